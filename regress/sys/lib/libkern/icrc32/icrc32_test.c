@@ -0,0 +1,293 @@
+/*	$OpenBSD$	*/
+
+/*
+ * Known answer and cross-check tests for the CRC32C implementations in
+ * sys/lib/libkern/icrc32.c, plus a throughput benchmark (-b).
+ *
+ * The source is included directly so that every implementation can be
+ * called, not only the one crc32c_setup() selects.  Each is checked
+ * against fixed vectors (RFC 3720 B.4 among them) and against a bitwise
+ * reference over every length up to a few stream blocks, at every
+ * misalignment of the start and with chained calls.
+ */
+
+#include <sys/types.h>
+#include <sys/time.h>
+
+#include <err.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "icrc32.c"
+
+#define BUFSIZE		(1024 * 1024 + 64)
+#define MAXMISALIGN	16
+
+struct impl {
+	const char	*name;
+	uint32_t	(*func)(uint32_t, const void *, size_t);
+};
+
+struct kat {
+	const char	*data;		/* NULL: use pattern */
+	size_t		off;		/* pattern offset */
+	size_t		len;
+	uint32_t	crc;
+};
+
+static const struct kat kats[] = {
+	{ "", 0, 0, 0x00000000 },
+	{ "a", 0, 1, 0xC1D04330 },
+	{ "abc", 0, 3, 0x364B3FB7 },
+	{ "123456789", 0, 9, CRC32C_CHECK },
+	{ "message digest", 0, 14, 0x02BD79D0 },
+	{ "The quick brown fox jumps over the lazy dog", 0, 43, 0x22620404 },
+	/* pattern[i] = (i * 31 + (i >> 8)) & 0xff */
+	{ NULL, 0, 767, 0x574E3879 },
+	{ NULL, 0, 768, 0xAB60C946 },
+	{ NULL, 1, 769, 0x4A647601 },
+	{ NULL, 0, 24575, 0x9A7553D1 },
+	{ NULL, 0, 24576, 0x32245916 },
+	{ NULL, 5, 24577, 0x155D43F1 },
+	{ NULL, 3, 65536, 0xE257CEA9 },
+	{ NULL, 0, 100000, 0x13720567 },
+};
+
+/*
+ * Lengths around the three-stream block boundaries of the hw code.
+ */
+static const size_t edges[] = {
+	CRC32C_SHORT * 3 - 1, CRC32C_SHORT * 3, CRC32C_SHORT * 3 + 1,
+	CRC32C_SHORT * 6 + 7, CRC32C_LONG * 3 - 1, CRC32C_LONG * 3,
+	CRC32C_LONG * 3 + 1, CRC32C_LONG * 3 + CRC32C_SHORT * 3 + 5,
+	CRC32C_LONG * 6 + 3, 65536, 1024 * 1024
+};
+
+static struct impl impls[4];
+static int nimpls;
+static uint8_t *pattern;
+static uint8_t *buf;
+static int failed;
+
+/*
+ * Bitwise reference, sharing no tables with the code under test.
+ */
+static uint32_t
+crc32c_ref(uint32_t crc, const void *data, size_t size)
+{
+	const uint8_t *p = data;
+	int k;
+
+	crc = ~crc;
+	while (size--) {
+		crc ^= *p++;
+		for (k = 0; k < 8; ++k)
+			crc = (crc >> 1) ^ (CRC32C_POLY & -(crc & 1));
+	}
+	return (~crc);
+}
+
+static void
+check(const char *what, const struct impl *im, size_t off, size_t len,
+    uint32_t got, uint32_t want)
+{
+	if (got == want)
+		return;
+	printf("FAIL %s %s off %zu len %zu: got %08x want %08x\n",
+	    what, im->name, off, len, got, want);
+	++failed;
+}
+
+static void
+test_kat(void)
+{
+	const struct kat *k;
+	const struct impl *im;
+	size_t i;
+	size_t m;
+	int n;
+
+	for (i = 0; i < sizeof(kats) / sizeof(kats[0]); ++i) {
+		k = &kats[i];
+		check("ref", &(struct impl){ "ref", NULL }, k->off, k->len,
+		    crc32c_ref(0, k->data ? (const void *)k->data :
+		    pattern + k->off, k->len), k->crc);
+		for (m = 0; m < MAXMISALIGN; ++m) {
+			/* copy to every misalignment of the start */
+			memcpy(buf + m, k->data ? (const void *)k->data :
+			    pattern + k->off, k->len);
+			for (n = 0; n < nimpls; ++n) {
+				im = &impls[n];
+				check("kat", im, m, k->len,
+				    im->func(0, buf + m, k->len), k->crc);
+			}
+		}
+	}
+}
+
+static void
+test_cross(void)
+{
+	const struct impl *im;
+	uint32_t want;
+	uint32_t part;
+	size_t len;
+	size_t off;
+	size_t i;
+	size_t m;
+	int n;
+
+	/* every length up to past the first short three-stream block */
+	for (len = 0; len <= CRC32C_SHORT * 4; ++len) {
+		for (m = 0; m < MAXMISALIGN; ++m) {
+			want = crc32c_ref(0, pattern + m, len);
+			for (n = 0; n < nimpls; ++n) {
+				im = &impls[n];
+				check("cross", im, m, len,
+				    im->func(0, pattern + m, len), want);
+			}
+		}
+	}
+
+	for (i = 0; i < sizeof(edges) / sizeof(edges[0]); ++i) {
+		len = edges[i];
+		for (m = 0; m < MAXMISALIGN; m += 3) {
+			want = crc32c_ref(0, pattern + m, len);
+			for (n = 0; n < nimpls; ++n) {
+				im = &impls[n];
+				check("edge", im, m, len,
+				    im->func(0, pattern + m, len), want);
+
+				/* chained over a misaligned split */
+				off = len / 3 + m;
+				if (off > len)
+					off = len;
+				part = im->func(0, pattern + m, off);
+				part = im->func(part, pattern + m + off,
+				    len - off);
+				check("chain", im, m, len, part, want);
+			}
+		}
+	}
+
+	/* the selected implementation, through the public entry points */
+	for (m = 0; m < MAXMISALIGN; ++m) {
+		len = CRC32C_LONG * 3 + 11;
+		want = crc32c_ref(0, pattern + m, len);
+		check("public", &(struct impl){ "iscsi_crc32", NULL }, m,
+		    len, iscsi_crc32(pattern + m, len), want);
+		part = iscsi_crc32(pattern + m, 100);
+		check("public", &(struct impl){ "iscsi_crc32_ext", NULL }, m,
+		    len, iscsi_crc32_ext(pattern + m + 100, len - 100, part),
+		    want);
+	}
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+/*
+ * Report MB/s of every implementation for a range of buffer sizes, at
+ * an aligned and a misaligned start.
+ */
+static void
+bench(void)
+{
+	static const size_t sizes[] = {
+		64, 512, 4096, 16384, 65536, 1024 * 1024
+	};
+	const struct impl *im;
+	volatile uint32_t sink = 0;
+	double t;
+	size_t total;
+	size_t i;
+	size_t m;
+	long iters;
+	long j;
+	int n;
+
+	printf("%-8s %8s %4s %10s\n", "impl", "size", "off", "MB/s");
+	for (n = 0; n < nimpls; ++n) {
+		im = &impls[n];
+		for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+			for (m = 0; m < 2; ++m) {
+				total = 256 * 1024 * 1024;
+				if (im->func == crc32c_byte)
+					total /= 8;
+				iters = total / sizes[i];
+				t = now();
+				for (j = 0; j < iters; ++j)
+					sink ^= im->func(0, buf + m * 3,
+					    sizes[i]);
+				t = now() - t;
+				printf("%-8s %8zu %4zu %10.1f\n", im->name,
+				    sizes[i], m * 3,
+				    (double)iters * sizes[i] / t / 1e6);
+			}
+		}
+	}
+	(void)sink;
+}
+
+int
+main(int argc, char **argv)
+{
+	size_t i;
+	int dobench = 0;
+	int ch;
+
+	while ((ch = getopt(argc, argv, "b")) != -1) {
+		switch (ch) {
+		case 'b':
+			dobench = 1;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-b]\n", getprogname());
+			exit(1);
+		}
+	}
+
+	if ((pattern = malloc(BUFSIZE)) == NULL ||
+	    (buf = malloc(BUFSIZE)) == NULL)
+		err(1, "malloc");
+	for (i = 0; i < BUFSIZE; ++i)
+		pattern[i] = (i * 31 + (i >> 8)) & 0xff;
+	memcpy(buf, pattern, BUFSIZE);
+
+	crc32c_setup();
+	impls[nimpls++] = (struct impl){ "byte", crc32c_byte };
+#if BYTE_ORDER == LITTLE_ENDIAN
+	impls[nimpls++] = (struct impl){ "slice8", crc32c_sw };
+#endif
+#if defined(__amd64__)
+	if (crc32c_hw_present())
+		impls[nimpls++] = (struct impl){ "sse42", crc32c_hw };
+	else
+		printf("no SSE4.2, hardware path not tested\n");
+#endif
+
+	if (dobench) {
+		bench();
+		return (0);
+	}
+
+	test_kat();
+	test_cross();
+	if (failed) {
+		printf("%d failures\n", failed);
+		return (1);
+	}
+	for (i = 0; i < (size_t)nimpls; ++i)
+		printf("%s: ok\n", impls[i].name);
+	return (0);
+}
@@ -0,0 +1,295 @@
+/*	$OpenBSD$	*/
+
+/*
+ * Known answer and cross-check tests for the CRC64 implementations in
+ * sys/lib/libkern/icrc64.c, plus a throughput benchmark (-b).
+ *
+ * The source is included directly so that both the table code and the
+ * PCLMULQDQ folding code can be called, not only the one crc64_setup()
+ * selects.  Each is checked against fixed vectors (the xz check value
+ * among them) and against a bitwise reference over every length up to
+ * past the folding threshold, at every misalignment of the start and
+ * with chained calls.
+ */
+
+#include <sys/types.h>
+#include <sys/time.h>
+
+#include <err.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "icrc64.c"
+
+#define BUFSIZE		(1024 * 1024 + 64)
+#define MAXMISALIGN	16
+
+struct impl {
+	const char	*name;
+	uint64_t	(*func)(uint64_t, const void *, size_t);
+};
+
+struct kat {
+	const char	*data;		/* NULL: use pattern */
+	size_t		off;		/* pattern offset */
+	size_t		len;
+	uint64_t	crc;
+};
+
+static const struct kat kats[] = {
+	{ "", 0, 0, 0x0000000000000000ULL },
+	{ "a", 0, 1, 0x330284772E652B05ULL },
+	{ "abc", 0, 3, 0x2CD8094A1A277627ULL },
+	{ "123456789", 0, 9, CRC64_CHECK },
+	{ "message digest", 0, 14, 0x5DBCC956318A9B6FULL },
+	{ "The quick brown fox jumps over the lazy dog", 0, 43,
+	    0x5B5EB8C2E54AA1C4ULL },
+	/* pattern[i] = (i * 31 + (i >> 8)) & 0xff */
+	{ NULL, 0, 255, 0x24B74A5414A755B9ULL },
+	{ NULL, 0, 256, 0xF1051BC2759DC582ULL },
+	{ NULL, 1, 257, 0x85401963395D5695ULL },
+	{ NULL, 0, 320, 0x36B0197E840325D0ULL },
+	{ NULL, 7, 1000, 0x5C19BD7828C985D5ULL },
+	{ NULL, 3, 4096, 0xD34BA6C92D24F33BULL },
+	{ NULL, 0, 65536, 0xF3EE42AC27576F1CULL },
+	{ NULL, 5, 100000, 0x2F09252024BC8647ULL },
+};
+
+/*
+ * Lengths around the 64 and 16 byte folding steps of the clmul code.
+ */
+static const size_t edges[] = {
+	CRC64_CLMUL_MIN + 15, CRC64_CLMUL_MIN + 16, CRC64_CLMUL_MIN + 63,
+	CRC64_CLMUL_MIN + 64, CRC64_CLMUL_MIN + 65, 1023, 1024, 1025,
+	4096 + 48, 4096 + 63, 65536, 1024 * 1024
+};
+
+static struct impl impls[2];
+static int nimpls;
+static uint8_t *pattern;
+static uint8_t *buf;
+static int failed;
+
+/*
+ * Bitwise reference, sharing no tables with the code under test.
+ */
+static uint64_t
+crc64_ref(uint64_t crc, const void *data, size_t size)
+{
+	const uint8_t *p = data;
+	int k;
+
+	crc = ~crc;
+	while (size--) {
+		crc ^= *p++;
+		for (k = 0; k < 8; ++k)
+			crc = (crc >> 1) ^ (CRC64_RPOLY & -(crc & 1));
+	}
+	return (~crc);
+}
+
+static void
+check(const char *what, const struct impl *im, size_t off, size_t len,
+    uint64_t got, uint64_t want)
+{
+	if (got == want)
+		return;
+	printf("FAIL %s %s off %zu len %zu: got %016llx want %016llx\n",
+	    what, im->name, off, len, (unsigned long long)got,
+	    (unsigned long long)want);
+	++failed;
+}
+
+static void
+test_kat(void)
+{
+	const struct kat *k;
+	const struct impl *im;
+	size_t i;
+	size_t m;
+	int n;
+
+	for (i = 0; i < sizeof(kats) / sizeof(kats[0]); ++i) {
+		k = &kats[i];
+		check("ref", &(struct impl){ "ref", NULL }, k->off, k->len,
+		    crc64_ref(0, k->data ? (const void *)k->data :
+		    pattern + k->off, k->len), k->crc);
+		for (m = 0; m < MAXMISALIGN; ++m) {
+			/* copy to every misalignment of the start */
+			memcpy(buf + m, k->data ? (const void *)k->data :
+			    pattern + k->off, k->len);
+			for (n = 0; n < nimpls; ++n) {
+				im = &impls[n];
+				check("kat", im, m, k->len,
+				    im->func(0, buf + m, k->len), k->crc);
+			}
+		}
+	}
+}
+
+static void
+test_cross(void)
+{
+	const struct impl *im;
+	uint64_t want;
+	uint64_t part;
+	size_t len;
+	size_t off;
+	size_t i;
+	size_t m;
+	int n;
+
+	/* every length up to well past the folding threshold */
+	for (len = 0; len <= CRC64_CLMUL_MIN * 3; ++len) {
+		for (m = 0; m < MAXMISALIGN; ++m) {
+			want = crc64_ref(0, pattern + m, len);
+			for (n = 0; n < nimpls; ++n) {
+				im = &impls[n];
+				check("cross", im, m, len,
+				    im->func(0, pattern + m, len), want);
+			}
+		}
+	}
+
+	for (i = 0; i < sizeof(edges) / sizeof(edges[0]); ++i) {
+		len = edges[i];
+		for (m = 0; m < MAXMISALIGN; m += 3) {
+			want = crc64_ref(0, pattern + m, len);
+			for (n = 0; n < nimpls; ++n) {
+				im = &impls[n];
+				check("edge", im, m, len,
+				    im->func(0, pattern + m, len), want);
+
+				/* chained over a misaligned split */
+				off = len / 3 + m;
+				if (off > len)
+					off = len;
+				part = im->func(0, pattern + m, off);
+				part = im->func(part, pattern + m + off,
+				    len - off);
+				check("chain", im, m, len, part, want);
+			}
+		}
+	}
+
+	/* the selected implementation, through the public entry points */
+	for (m = 0; m < MAXMISALIGN; ++m) {
+		len = CRC64_CLMUL_MIN * 4 + 11;
+		want = crc64_ref(0, pattern + m, len);
+		check("public", &(struct impl){ "crc64_ecma", NULL }, m,
+		    len, crc64_ecma(pattern + m, len), want);
+		part = crc64_ecma(pattern + m, 100);
+		check("public", &(struct impl){ "crc64_ecma_ext", NULL }, m,
+		    len, crc64_ecma_ext(pattern + m + 100, len - 100, part),
+		    want);
+	}
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+/*
+ * Report MB/s of every implementation for a range of buffer sizes, at
+ * an aligned and a misaligned start.
+ */
+static void
+bench(void)
+{
+	static const size_t sizes[] = {
+		64, 512, 4096, 16384, 65536, 1024 * 1024
+	};
+	const struct impl *im;
+	volatile uint64_t sink = 0;
+	double t;
+	size_t total;
+	size_t i;
+	size_t m;
+	long iters;
+	long j;
+	int n;
+
+	printf("%-8s %8s %4s %10s\n", "impl", "size", "off", "MB/s");
+	for (n = 0; n < nimpls; ++n) {
+		im = &impls[n];
+		for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+			for (m = 0; m < 2; ++m) {
+				total = 256 * 1024 * 1024;
+				iters = total / sizes[i];
+				t = now();
+				for (j = 0; j < iters; ++j)
+					sink ^= im->func(0, buf + m * 3,
+					    sizes[i]);
+				t = now() - t;
+				printf("%-8s %8zu %4zu %10.1f\n", im->name,
+				    sizes[i], m * 3,
+				    (double)iters * sizes[i] / t / 1e6);
+			}
+		}
+	}
+	(void)sink;
+}
+
+int
+main(int argc, char **argv)
+{
+	size_t i;
+	int dobench = 0;
+	int ch;
+
+	while ((ch = getopt(argc, argv, "b")) != -1) {
+		switch (ch) {
+		case 'b':
+			dobench = 1;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-b]\n", getprogname());
+			exit(1);
+		}
+	}
+
+	if ((pattern = malloc(BUFSIZE)) == NULL ||
+	    (buf = malloc(BUFSIZE)) == NULL)
+		err(1, "malloc");
+	for (i = 0; i < BUFSIZE; ++i)
+		pattern[i] = (i * 31 + (i >> 8)) & 0xff;
+	memcpy(buf, pattern, BUFSIZE);
+
+	/* builds the tables and the folding constants */
+	crc64_setup();
+#if BYTE_ORDER == LITTLE_ENDIAN
+	impls[nimpls++] = (struct impl){ "slice8", crc64_sw };
+#else
+	impls[nimpls++] = (struct impl){ "byte", crc64_sw };
+#endif
+#if defined(__amd64__)
+	if (crc64_clmul_present())
+		impls[nimpls++] = (struct impl){ "clmul", crc64_clmul };
+	else
+		printf("no PCLMULQDQ, folding path not tested\n");
+#endif
+
+	if (dobench) {
+		bench();
+		return (0);
+	}
+
+	test_kat();
+	test_cross();
+	if (failed) {
+		printf("%d failures\n", failed);
+		return (1);
+	}
+	for (i = 0; i < (size_t)nimpls; ++i)
+		printf("%s: ok\n", impls[i].name);
+	return (0);
+}
@@ -0,0 +1,56 @@
+/*
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include "hammer2.h"
+
+/*
+ * Run a bulk free pass on the mount containing path and report what it
+ * did.  A non-zero size overrides the kernel's scan bitmap budget, flags
+ * may request a full (non-incremental) scan.  Must be run as root.
+ */
+int
+cmd_bulkfree(const char *path, uint64_t size, int flags)
+{
+	hammer2_ioc_bulkfree_t bfi;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) < 0) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return 1;
+	}
+	bzero(&bfi, sizeof(bfi));
+	bfi.size = size;
+	bfi.flags = flags;
+	if (ioctl(fd, HAMMER2IOC_BULKFREE_SCAN, &bfi) < 0) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		close(fd);
+		return 1;
+	}
+	close(fd);
+
+	printf("scan               %s\n",
+	       (bfi.flags & HAMMER2_BULKFREE_INCR) ? "incremental" : "full");
+	printf("blockrefs scanned  %ju\n", (uintmax_t)bfi.count_scanned);
+	printf("subtrees unchanged %ju\n", (uintmax_t)bfi.count_pruned);
+	printf("windows            %ju\n", (uintmax_t)bfi.count_windows);
+	printf("blocks staged      %ju\n", (uintmax_t)bfi.count_staged);
+	printf("blocks freed       %ju\n", (uintmax_t)bfi.count_freed);
+	printf("blocks restored    %ju\n", (uintmax_t)bfi.count_restored);
+	printf("blocks fixed       %ju\n", (uintmax_t)bfi.count_fixed);
+	printf("bytes freed        %s\n", sizetostr(bfi.bytes_freed));
+	return 0;
+}
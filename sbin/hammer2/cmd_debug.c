@@ -419,6 +419,8 @@ show_bref(int fd, int tab, int bi, hammer2_blockref_t *bref, int dofreemap)
 	const char *type_str;
 	char *str = NULL;
 	uint32_t cv;
+	uint64_t cv64;
+	uint64_t xv[2];
 
 	switch(bref->type) {
 	case HAMMER2_BREF_TYPE_EMPTY:
@@ -519,11 +521,33 @@ show_bref(int fd, int tab, int bi, hammer2_blockref_t *bref, int dofreemap)
 			}
 			break;
 		case HAMMER2_CHECK_CRC64:
-			printf("(meth %02x) ", bref->methods);
+			cv64 = hammer2_icrc64(&media, bytes);
+			if (bref->check.crc64.value != cv64) {
+				printf("(crc64 %02x:%016jx/%016jx) ",
+				       bref->methods,
+				       (uintmax_t)bref->check.crc64.value,
+				       (uintmax_t)cv64);
+			} else {
+				printf("(meth %02x) ", bref->methods);
+			}
 			break;
 		case HAMMER2_CHECK_SHA192:
 			printf("(meth %02x) ", bref->methods);
 			break;
+		case HAMMER2_CHECK_XXH3:
+			hammer2_xxh3_128(&media, bytes, xv);
+			if (bref->check.xxh3.value[0] != xv[0] ||
+			    bref->check.xxh3.value[1] != xv[1]) {
+				printf("(xxh3 %02x:%016jx%016jx/%016jx%016jx) ",
+				       bref->methods,
+				       (uintmax_t)bref->check.xxh3.value[1],
+				       (uintmax_t)bref->check.xxh3.value[0],
+				       (uintmax_t)xv[1],
+				       (uintmax_t)xv[0]);
+			} else {
+				printf("(meth %02x) ", bref->methods);
+			}
+			break;
 		case HAMMER2_CHECK_FREEMAP:
 			cv = hammer2_icrc32(&media, bytes);
 			if (bref->check.freemap.icrc32 != cv) {
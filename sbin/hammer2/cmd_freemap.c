@@ -0,0 +1,352 @@
+/*
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "hammer2.h"
+
+/*
+ * Fragmentation report.  Every 2MB segment of the freemap leaves (the
+ * level-1 bitmaps) is classified by its 16KB block fill into one of
+ * FM_NBUCKETS buckets, per allocation class and per 2GB zone.  Free
+ * space inside partially filled segments is usable only by its own
+ * class, the fragmentation percentage is the share of free space which
+ * is stuck in such segments.
+ */
+#define FM_NBUCKETS	8
+#define FM_NBLOCKS	(HAMMER2_SEGSIZE / HAMMER2_FREEMAP_BLOCK_SIZE)
+#define FM_NTYPES	8		/* HAMMER2_FREEMAP_HEUR_TYPES */
+#define FM_NCLASSES	(FM_NTYPES * 2)
+
+struct fm_hist {
+	uint64_t	segs;		/* segments in use */
+	uint64_t	used;		/* 16KB blocks in use */
+	uint64_t	free;		/* 16KB blocks free in used segs */
+	uint64_t	bucket[FM_NBUCKETS];
+};
+
+struct fm_stats {
+	struct fm_hist	class[FM_NCLASSES];
+	struct fm_hist	zone;		/* current zone */
+	struct fm_hist	total;
+	uint64_t	zone_freesegs;
+	uint64_t	freesegs;
+	uint64_t	reserved;
+	int		zones;
+};
+
+static const char *fm_type_str[FM_NTYPES] = {
+	"empty", "inode", "indblk", "data", "volume", "freemap",
+	"fmapnode", "fbitmap"
+};
+
+static int fm_read(int fd, hammer2_blockref_t *bref,
+			hammer2_media_data_t *media);
+static void fm_scan(int fd, hammer2_blockref_t *bref,
+			struct fm_stats *st);
+static void fm_leaf(hammer2_blockref_t *bref, hammer2_media_data_t *media,
+			struct fm_stats *st);
+static void fm_print(const char *label, struct fm_hist *hist,
+			uint64_t freesegs);
+
+int
+cmd_freemap_stats(const char *devpath)
+{
+	hammer2_volume_data_t voldata;
+	hammer2_blockref_t *bref;
+	struct fm_stats *st;
+	hammer2_off_t best_tid;
+	char label[32];
+	int fd;
+	int i;
+
+	fd = open(devpath, O_RDONLY);
+	if (fd < 0) {
+		perror("open");
+		return 1;
+	}
+
+	/*
+	 * Use the most recent volume header.
+	 */
+	best_tid = 0;
+	for (i = 0; i < HAMMER2_NUM_VOLHDRS; ++i) {
+		hammer2_volume_data_t tmp;
+
+		if (pread(fd, &tmp, sizeof(tmp),
+			  i * HAMMER2_ZONE_BYTES64) != sizeof(tmp)) {
+			continue;
+		}
+		if (tmp.magic != HAMMER2_VOLUME_ID_HBO)
+			continue;
+		if (best_tid == 0 || tmp.mirror_tid > best_tid) {
+			best_tid = tmp.mirror_tid;
+			voldata = tmp;
+		}
+	}
+	if (best_tid == 0) {
+		fprintf(stderr, "%s: no valid volume header\n", devpath);
+		close(fd);
+		return 1;
+	}
+
+	st = calloc(1, sizeof(*st));
+	printf("zone  %-8s %7s %7s %7s %5s  fill histogram (%d buckets)\n",
+	       "", "segs", "freesgs", "freeMB", "frag%", FM_NBUCKETS);
+	for (i = 0; i < HAMMER2_SET_COUNT; ++i) {
+		bref = &voldata.freemap_blockset.blockref[i];
+		if (bref->type != HAMMER2_BREF_TYPE_EMPTY)
+			fm_scan(fd, bref, st);
+	}
+	close(fd);
+
+	printf("\nclass           %7s %7s %7s %5s  fill histogram\n",
+	       "segs", "", "freeMB", "");
+	for (i = 0; i < FM_NCLASSES; ++i) {
+		if (st->class[i].segs == 0)
+			continue;
+		snprintf(label, sizeof(label), "%-8s %3dK",
+			 fm_type_str[i >> 1],
+			 (i & 1) ? HAMMER2_PBUFSIZE / 1024 :
+				   HAMMER2_MINIOSIZE / 1024);
+		fm_print(label, &st->class[i], (uint64_t)-1);
+	}
+	printf("\n");
+	fm_print("total        ", &st->total, st->freesegs);
+	printf("%d zones, %ju reserved segments\n",
+	       st->zones, (uintmax_t)st->reserved);
+	free(st);
+
+	return 0;
+}
+
+/*
+ * Read the media block for a freemap blockref.
+ */
+static
+int
+fm_read(int fd, hammer2_blockref_t *bref, hammer2_media_data_t *media)
+{
+	hammer2_off_t io_off;
+	size_t bytes;
+
+	bytes = (size_t)1 << (bref->data_off & HAMMER2_OFF_MASK_RADIX);
+	io_off = bref->data_off & ~HAMMER2_OFF_MASK_RADIX;
+	if (bytes > sizeof(*media))
+		return -1;
+	if (pread(fd, media, bytes, io_off) != (ssize_t)bytes)
+		return -1;
+	return 0;
+}
+
+static
+void
+fm_scan(int fd, hammer2_blockref_t *bref, struct fm_stats *st)
+{
+	hammer2_media_data_t *media;
+	size_t bytes;
+	int count;
+	int i;
+
+	media = malloc(sizeof(*media));
+	if (fm_read(fd, bref, media) < 0) {
+		fprintf(stderr, "freemap: read failed at %016jx\n",
+			(uintmax_t)bref->data_off);
+		free(media);
+		return;
+	}
+	bytes = (size_t)1 << (bref->data_off & HAMMER2_OFF_MASK_RADIX);
+
+	switch(bref->type) {
+	case HAMMER2_BREF_TYPE_FREEMAP_NODE:
+		count = bytes / sizeof(hammer2_blockref_t);
+		for (i = 0; i < count; ++i) {
+			if (media->npdata[i].type != HAMMER2_BREF_TYPE_EMPTY)
+				fm_scan(fd, &media->npdata[i], st);
+		}
+		break;
+	case HAMMER2_BREF_TYPE_FREEMAP_LEAF:
+		fm_leaf(bref, media, st);
+		break;
+	default:
+		break;
+	}
+	free(media);
+}
+
+/*
+ * Account for one 2GB zone.
+ */
+static
+void
+fm_leaf(hammer2_blockref_t *bref, hammer2_media_data_t *media,
+	struct fm_stats *st)
+{
+	hammer2_bmap_data_t *bmap;
+	struct fm_hist *hist;
+	char label[32];
+	int used;
+	int ci;
+	int n;
+	int i;
+	int j;
+
+	bzero(&st->zone, sizeof(st->zone));
+	st->zone_freesegs = 0;
+
+	for (n = 0; n < HAMMER2_FREEMAP_COUNT; ++n) {
+		bmap = &media->bmdata[n];
+		used = 0;
+		for (i = 0; i < 8; ++i) {
+			for (j = 0; j < 32; j += 2) {
+				if ((bmap->bitmap[i] >> j) & 3)
+					++used;
+			}
+		}
+		if (bmap->class == 0) {
+			if (used == 0)
+				++st->zone_freesegs;
+			else
+				++st->reserved;
+			continue;
+		}
+		ci = ((bmap->class >> 8) & (FM_NTYPES - 1)) *
+		     2 + ((bmap->class & 0xFF) > HAMMER2_MINIORADIX);
+		for (i = 0; i < 3; ++i) {
+			hist = (i == 0) ? &st->class[ci] :
+			       (i == 1) ? &st->zone : &st->total;
+			++hist->segs;
+			hist->used += used;
+			hist->free += FM_NBLOCKS - used;
+			if (used == FM_NBLOCKS)
+				++hist->bucket[FM_NBUCKETS - 1];
+			else
+				++hist->bucket[used * FM_NBUCKETS /
+					       FM_NBLOCKS];
+		}
+	}
+	st->freesegs += st->zone_freesegs;
+
+	snprintf(label, sizeof(label), "%-4ju %-8s",
+		 (uintmax_t)(bref->key >> HAMMER2_FREEMAP_LEVEL1_RADIX), "");
+	fm_print(label, &st->zone, st->zone_freesegs);
+	++st->zones;
+}
+
+/*
+ * Print one histogram line.  freesegs is the number of wholly free
+ * segments available to any class, or -1 if not applicable.
+ */
+static
+void
+fm_print(const char *label, struct fm_hist *hist, uint64_t freesegs)
+{
+	uint64_t freemb;
+	uint64_t allfree;
+	int i;
+
+	freemb = hist->free * HAMMER2_FREEMAP_BLOCK_SIZE / (1024 * 1024);
+	if (freesegs == (uint64_t)-1) {
+		printf("%s %7ju %7s %7ju %5s ", label,
+		       (uintmax_t)hist->segs, "",
+		       (uintmax_t)freemb, "");
+	} else {
+		allfree = hist->free + freesegs * FM_NBLOCKS;
+		printf("%s %7ju %7ju %7ju %5.1f ", label,
+		       (uintmax_t)hist->segs, (uintmax_t)freesegs,
+		       (uintmax_t)freemb,
+		       allfree ? (double)hist->free * 100.0 / allfree : 0.0);
+	}
+	for (i = 0; i < FM_NBUCKETS; ++i)
+		printf(" %5ju", (uintmax_t)hist->bucket[i]);
+	printf("\n");
+}
+
+/*
+ * Relocate the blocks of the PFS mounted at path out of sparsely filled
+ * segments.  pct and max select the segments, 0 selects the kernel
+ * defaults.  Must be run as root.
+ */
+int
+cmd_defrag(const char *path, int pct, int max)
+{
+	hammer2_ioc_defrag_t dfi;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) < 0) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return 1;
+	}
+	bzero(&dfi, sizeof(dfi));
+	dfi.fill_pct = pct;
+	dfi.max_segs = max;
+	if (ioctl(fd, HAMMER2IOC_DEFRAG, &dfi) < 0) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		close(fd);
+		return 1;
+	}
+	close(fd);
+
+	printf("segments selected  %ju\n", (uintmax_t)dfi.count_segs);
+	printf("chains scanned     %ju\n", (uintmax_t)dfi.count_scanned);
+	printf("chains relocated   %ju\n", (uintmax_t)dfi.count_moved);
+	printf("chains skipped     %ju\n", (uintmax_t)dfi.count_skipped);
+	printf("bytes relocated    %s\n", sizetostr(dfi.bytes_moved));
+	if (dfi.count_moved) {
+		printf("The old blocks are freed by the next two bulkfree "
+		       "passes.\n");
+	}
+	return 0;
+}
+
+/*
+ * Report the discard queue of the mount containing path.  flags may
+ * switch the kernel to the recording stub (HAMMER2_DISCARD_RECORD) or
+ * back to device discards, or clear the recorded extents after printing
+ * them.  Must be run as root.
+ */
+int
+cmd_discard(const char *path, int flags)
+{
+	hammer2_ioc_discard_t dis;
+	int fd;
+	int i;
+
+	if ((fd = open(path, O_RDONLY)) < 0) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return 1;
+	}
+	bzero(&dis, sizeof(dis));
+	dis.flags = flags;
+	if (ioctl(fd, HAMMER2IOC_DISCARD, &dis) < 0) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		close(fd);
+		return 1;
+	}
+	close(fd);
+
+	printf("discard thread     %s\n",
+	       (dis.flags & HAMMER2_DISCARD_ACTIVE) ? "running" : "stopped");
+	printf("issue to           %s\n",
+	       (dis.flags & HAMMER2_DISCARD_RECORDING) ? "recording stub" :
+							 "device");
+	printf("extents queued     %ju\n", (uintmax_t)dis.count_queued);
+	printf("extents recorded   %ju\n", (uintmax_t)dis.count_recorded);
+	for (i = 0; i < dis.nrec; ++i) {
+		printf("    %016jx-%016jx %s\n",
+		       (uintmax_t)dis.rec[i].beg, (uintmax_t)dis.rec[i].end,
+		       sizetostr(dis.rec[i].end - dis.rec[i].beg));
+	}
+	return 0;
+}
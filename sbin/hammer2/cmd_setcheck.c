@@ -53,8 +53,10 @@ cmd_setcheck(const char *check_str, char **paths)
 	} else {
 		check_algo = HAMMER2_CHECK_STRINGS_COUNT;
 		while (--check_algo >= 0) {
-			if (strcasecmp(check_str, checks[check_algo]) == 0)
+			if (checks[check_algo][0] &&
+			    strcasecmp(check_str, checks[check_algo]) == 0) {
 				break;
+			}
 		}
 		if (check_algo < 0 && strcasecmp(check_str, "default") == 0) {
 			check_algo = HAMMER2_CHECK_ISCSI32;
@@ -99,6 +99,14 @@ cmd_setcomp(const char *comp_str, char **paths)
 				ecode = 3;
 			}
 			break;
+		case HAMMER2_COMP_ZSTD:
+			if (comp_level < 1 || comp_level > 15) {
+				fprintf(stderr,
+					"Unsupported comp_level %d for %s\n",
+					comp_level, s1);
+				ecode = 3;
+			}
+			break;
 		default:
 			fprintf(stderr,
 				"Unsupported comp_level %d for %s\n",
@@ -216,6 +224,9 @@ cmd_setcomp_recursive(char* option_string, char* comp_string, char* file_string)
 	} else if (strcmp(comp_string, "3") == 0) {
 		printf("Will set ZLIB (slowest) compression on directory/file %s.\n", file_string);
 		comp_method = HAMMER2_COMP_ZLIB;
+	} else if (strcmp(comp_string, "4") == 0) {
+		printf("Will set ZSTD compression on directory/file %s.\n", file_string);
+		comp_method = HAMMER2_COMP_ZSTD;
 	}
 	else {
 		printf("Unknown compression method.\n");
@@ -144,3 +144,69 @@ checkmodestr(uint8_t check_algo)
 	}
 	return (buf);
 }
+
+/*
+ * Report global compression statistics via any file or directory on a
+ * mounted hammer2 filesystem.
+ */
+int
+cmd_compstats(const char *path)
+{
+	hammer2_ioc_compstats_t stats;
+	uint64_t tried;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) < 0) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return 1;
+	}
+	if (ioctl(fd, HAMMER2IOC_COMP_STATS, &stats) < 0) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		close(fd);
+		return 1;
+	}
+	close(fd);
+
+	tried = stats.attempted + stats.skip_entropy + stats.skip_heuristic;
+	printf("blocks considered  %ju\n", (uintmax_t)tried);
+	printf("  attempted        %ju\n", (uintmax_t)stats.attempted);
+	printf("  compressed       %ju\n", (uintmax_t)stats.compressed);
+	printf("  skip (entropy)   %ju\n", (uintmax_t)stats.skip_entropy);
+	printf("  skip (history)   %ju\n", (uintmax_t)stats.skip_heuristic);
+	printf("bytes in           %s\n", sizetostr(stats.bytes_in));
+	printf("bytes out          %s\n", sizetostr(stats.bytes_out));
+	if (stats.bytes_in) {
+		printf("ratio              %ju%%\n",
+		       (uintmax_t)(stats.bytes_out * 100 / stats.bytes_in));
+	}
+	return 0;
+}
+
+/*
+ * Report global parallel flush statistics and the flush workers of the
+ * PFS containing path.
+ */
+int
+cmd_flushstats(const char *path)
+{
+	hammer2_ioc_flushstats_t stats;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) < 0) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return 1;
+	}
+	if (ioctl(fd, HAMMER2IOC_FLUSH_STATS, &stats) < 0) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		close(fd);
+		return 1;
+	}
+	close(fd);
+
+	printf("flush workers      %u\n", stats.workers);
+	printf("jobs queued        %ju\n", (uintmax_t)stats.jobs);
+	printf("  run by workers   %ju\n", (uintmax_t)stats.jobs_worker);
+	printf("subtrees split     %ju\n", (uintmax_t)stats.subtrees);
+	printf("  run by workers   %ju\n", (uintmax_t)stats.subtrees_worker);
+	return 0;
+}
@@ -150,11 +150,17 @@ int cmd_pfs_snapshot(const char *sel_path, const char *name, const char *label);
 int cmd_service(void);
 int cmd_hash(int ac, const char **av);
 int cmd_stat(int ac, const char **av);
+int cmd_compstats(const char *path);
+int cmd_flushstats(const char *path);
+int cmd_bulkfree(const char *path, uint64_t size, int flags);
 int cmd_leaf(const char *sel_path);
 int cmd_shell(const char *hostname);
 int cmd_debugspan(const char *hostname);
 int cmd_chaindump(const char *path);
 int cmd_show(const char *devpath, int dofreemap);
+int cmd_freemap_stats(const char *devpath);
+int cmd_defrag(const char *path, int pct, int max);
+int cmd_discard(const char *path, int flags);
 int cmd_rsainit(const char *dir_path);
 int cmd_rsaenc(const char **keys, int nkeys);
 int cmd_rsadec(const char **keys, int nkeys);
@@ -172,8 +178,14 @@ const char *sizetostr(hammer2_off_t size);
 const char *counttostr(hammer2_off_t size);
 hammer2_key_t dirhash(const unsigned char *name, size_t len);
 
-uint32_t hammer2_icrc32(const void *buf, size_t size);
-uint32_t hammer2_icrc32c(const void *buf, size_t size, uint32_t crc);
+uint32_t iscsi_crc32(const void *buf, size_t size);
+uint32_t iscsi_crc32_ext(const void *buf, size_t size, uint32_t ocrc);
+#define hammer2_icrc32(buf, size)	iscsi_crc32((buf), (size))
+#define hammer2_icrc32c(buf, size, crc)	iscsi_crc32_ext((buf), (size), (crc))
+uint64_t crc64_ecma(const void *buf, size_t size);
+uint64_t crc64_ecma_ext(const void *buf, size_t size, uint64_t ocrc);
+#define hammer2_icrc64(buf, size)	crc64_ecma((buf), (size))
+void hammer2_xxh3_128(const void *buf, size_t size, uint64_t *out);
 
 void hammer2_shell_parse(dmsg_msg_t *msg, int unmanaged);
 void print_inode(char* inode_string);
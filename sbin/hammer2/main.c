@@ -148,6 +148,53 @@ main(int ac, char **av)
 			usage(1);
 		}
 		ecode = cmd_remote_connect(sel_path, av[1]);
+	} else if (strcmp(av[0], "compstats") == 0) {
+		if (ac < 2)
+			ecode = cmd_compstats(".");
+		else
+			ecode = cmd_compstats(av[1]);
+	} else if (strcmp(av[0], "flushstats") == 0) {
+		if (ac < 2)
+			ecode = cmd_flushstats(".");
+		else
+			ecode = cmd_flushstats(av[1]);
+	} else if (strcmp(av[0], "bulkfree") == 0) {
+		if (ac < 2)
+			ecode = cmd_bulkfree(".", 0, 0);
+		else
+			ecode = cmd_bulkfree(av[1], 0, 0);
+	} else if (strcmp(av[0], "bulkfree-full") == 0) {
+		if (ac < 2)
+			ecode = cmd_bulkfree(".", 0, HAMMER2_BULKFREE_FULL);
+		else
+			ecode = cmd_bulkfree(av[1], 0, HAMMER2_BULKFREE_FULL);
+	} else if (strcmp(av[0], "defrag") == 0) {
+		/*
+		 * Relocate blocks out of sparsely filled segments.
+		 */
+		ecode = cmd_defrag((ac < 2) ? "." : av[1],
+				   (ac < 3) ? 0 : strtol(av[2], NULL, 0), 0);
+	} else if (strcmp(av[0], "discard") == 0) {
+		/*
+		 * Report the discard queue, optionally switching between
+		 * device discards and the recording stub.
+		 */
+		int flags = 0;
+
+		if (ac >= 2 && strcmp(av[1], "record") == 0) {
+			flags = HAMMER2_DISCARD_RECORD;
+			--ac;
+			++av;
+		} else if (ac >= 2 && strcmp(av[1], "device") == 0) {
+			flags = HAMMER2_DISCARD_DEVICE;
+			--ac;
+			++av;
+		} else if (ac >= 2 && strcmp(av[1], "clear") == 0) {
+			flags = HAMMER2_DISCARD_CLEAR;
+			--ac;
+			++av;
+		}
+		ecode = cmd_discard((ac < 2) ? "." : av[1], flags);
 	} else if (strcmp(av[0], "chaindump") == 0) {
 		if (ac < 2)
 			ecode = cmd_chaindump(".");
@@ -347,7 +394,9 @@ main(int ac, char **av)
 		 * Raw dump of freemap.  Use -v to check all crc's, and
 		 * -vv to dump bulk file data.
 		 */
-		if (ac != 2) {
+		if (ac == 3 && strcmp(av[1], "--stats") == 0) {
+			ecode = cmd_freemap_stats(av[2]);
+		} else if (ac != 2) {
 			fprintf(stderr, "freemap: requires device path\n");
 			usage(1);
 		} else {
@@ -393,6 +442,8 @@ main(int ac, char **av)
 		ecode = cmd_setcheck("crc64", &av[1]);
 	} else if (strcmp(av[0], "setsha192") == 0) {
 		ecode = cmd_setcheck("sha192", &av[1]);
+	} else if (strcmp(av[0], "setxxh3") == 0) {
+		ecode = cmd_setcheck("xxh3", &av[1]);
 	} else if (strcmp(av[0], "printinode") == 0) {
 		if (ac != 2) {
 			fprintf(stderr,
@@ -453,6 +504,18 @@ usage(int code)
 			"Start service daemon\n"
 		"    stat [<path>]	          "
 			"Return inode quota & config\n"
+		"    compstats [<path>]           "
+			"Report compression statistics\n"
+		"    flushstats [<path>]          "
+			"Report parallel flush statistics\n"
+		"    bulkfree [<path>]            "
+			"Run a bulk free pass\n"
+		"    bulkfree-full [<path>]       "
+			"Run a full (non-incremental) pass\n"
+		"    defrag [<path>] [<fill%>]    "
+			"Relocate sparsely filled segments\n"
+		"    discard [record|device|clear] [<path>] "
+			"Report or configure discards\n"
 		"    leaf                         "
 			"Start pfs leaf daemon\n"
 		"    shell [<host>]               "
@@ -465,16 +528,21 @@ usage(int code)
 			"Raw hammer2 media dump\n"
 		"    freemap devpath              "
 			"Raw hammer2 media dump\n"
+		"    freemap --stats devpath      "
+			"Report freemap fragmentation\n"
 		"    setcomp comp[:level] path... "
-			"Set comp algo {none, autozero, lz4, zlib} & level\n"
+			"Set comp algo {none, autozero, lz4, zlib, zstd} "
+			"& level\n"
 		"    setcheck check path...       "
-			"Set check algo {none, crc32, crc64, sha192}\n"
+			"Set check algo {none, crc32, crc64, sha192, xxh3}\n"
 		"    setcrc32 path...             "
 			"Set check algo to crc32\n"
 		"    setcrc64 path...             "
 			"Set check algo to crc64\n"
 		"    setsha192 path...            "
 			"Set check algo to sha192\n"
+		"    setxxh3 path...              "
+			"Set check algo to xxh3\n"
 	);
 	exit(code);
 }
@@ -41,14 +41,18 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <strings.h>
 #include <unistd.h>
 #include <dmsg.h>
 
 static int cluster_connect(const char *volume);
+static void parse_options(char *opts, int *hflagsp);
 
 /*
- * Usage: mount_hammer2 [volume] [mtpt]
+ * Usage: mount_hammer2 [-o options] [volume] [mtpt]
+ *
+ * Options:	discard		discard (TRIM) space freed by the bulk free scan
  */
 int
 main(int argc, char *argv[])
@@ -58,11 +62,26 @@ main(int argc, char *argv[])
 	char *mountpt;
 	int error;
 	int mount_flags;
+	int hflags;
+	int ch;
 
 	bzero(&info, sizeof(info));
 	mount_flags = 0;
+	hflags = 0;
+
+	while ((ch = getopt(argc, argv, "o:")) != -1) {
+		switch(ch) {
+		case 'o':
+			parse_options(optarg, &hflags);
+			break;
+		default:
+			exit(1);
+		}
+	}
+	argc -= optind;
+	argv += optind;
 
-	if (argc < 3)
+	if (argc < 2)
 		exit(1);
 
 	/* error = getvfsbyname("hammer2", &vfc);
@@ -80,20 +99,20 @@ main(int argc, char *argv[])
 	 * the mount program will fork, detach, print a message, and exit(0)
 	 * the originator while retrying in the background.
 	 */
-	info.cluster_fd = cluster_connect(argv[1]);
+	info.cluster_fd = cluster_connect(argv[0]);
 	if (info.cluster_fd < 0) {
 		fprintf(stderr,
 			"hammer2_mount: cluster_connect(%s) failed\n",
-			argv[1]);
+			argv[0]);
 		//exit(1);
 	}
 
 	/*
 	 * Try to mount it
 	 */
-	info.volume = argv[1];
-	info.hflags = 0;
-	mountpt = argv[2];
+	info.volume = argv[0];
+	info.hflags = hflags;
+	mountpt = argv[1];
 
 
 	//error = mount(vfc.vfc_name, mountpt, mount_flags, &info);
@@ -119,6 +138,24 @@ main(int argc, char *argv[])
 	return (0);
 }
 
+/*
+ * Parse a comma separated -o option list.  Options which are not hammer2
+ * specific are ignored.
+ */
+static
+void
+parse_options(char *opts, int *hflagsp)
+{
+	char *opt;
+
+	while ((opt = strsep(&opts, ",")) != NULL) {
+		if (strcmp(opt, "discard") == 0)
+			*hflagsp |= HMNT2_DISCARD;
+		else if (strcmp(opt, "nodiscard") == 0)
+			*hflagsp &= ~HMNT2_DISCARD;
+	}
+}
+
 /*
  * Connect to the cluster controller.  We can connect to a local or remote
  * cluster controller, depending.  For a multi-node cluster we always want
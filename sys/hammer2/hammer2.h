@@ -72,6 +72,7 @@
 #include <sys/tree.h>
 #include <sys/mount.h>
 #include <sys/malloc.h>
+#include <sys/pool.h>
 #include <sys/file.h>
 #include <sys/stdint.h>
 #include <sys/lockf.h>
@@ -96,6 +97,7 @@
 #include <dev/pci/drm/drm_atomic.h>
 
 #include <sys/dmsg.h>
+#include <lib/libz/zlib.h>
 
 #include "hammer2_disk.h"
 #include "hammer2_mount.h"
@@ -781,36 +783,150 @@ struct hammer2_io {
 	off_t		arg_o;			/* INPROG I/O only */
 	int		refs;
 	int		act;			/* activity */
+	u_long		crc_good_mask;		/* verified sub-ranges */
 };
 
 typedef struct hammer2_io hammer2_io_t;
 
+/*
+ * Each bit in crc_good_mask covers one (1 << HAMMER2_IO_CRCRADIX) byte
+ * granule of the physical buffer and indicates that the chain occupying
+ * that range has passed its check code test since the buffer was loaded.
+ * Chains smaller than a granule are always re-tested.
+ */
+#define HAMMER2_IO_CRCBITS	(sizeof(u_long) * NBBY)
+#ifdef __LP64__
+#define HAMMER2_IO_CRCRADIX	(HAMMER2_PBUFRADIX - 6)
+#else
+#define HAMMER2_IO_CRCRADIX	(HAMMER2_PBUFRADIX - 5)
+#endif
+
+/*
+ * The DIO index is split into hashed shards, each with its own spinlock,
+ * so concurrent chain resolves against unrelated device offsets do not
+ * serialize on a single per-mount lock.
+ *
+ * hint[] is a small direct-mapped cache of recently acquired dios.  It is
+ * probed without the shard spinlock to bump the ref count of a dio which
+ * is already referenced.  Entries are only installed and cleared with the
+ * spinlock held, and a dio cleared from hint[] is not freed until the
+ * shard's lockless readers have drained.
+ */
+#define HAMMER2_IOHASH_SIZE	32		/* must be power of 2 */
+#define HAMMER2_IOHASH_MASK	(HAMMER2_IOHASH_SIZE - 1)
+#define HAMMER2_IOHINT_SIZE	16		/* must be power of 2 */
+#define HAMMER2_IOHINT_MASK	(HAMMER2_IOHINT_SIZE - 1)
+#define HAMMER2_IOTRIM_SCAN	16		/* dios per CLOCK step */
+
+struct hammer2_io_hash {
+	struct _atomic_lock *spin;		/* tree and hint[] access */
+	struct hammer2_io_tree tree;
+	hammer2_io_t	*hint[HAMMER2_IOHINT_SIZE];
+	int		lockers;		/* contention detection */
+	int		readers;		/* lockless hint[] probes */
+	int		count;			/* dios indexed by shard */
+	off_t		hand;			/* CLOCK eviction position */
+};
+
+typedef struct hammer2_io_hash hammer2_io_hash_t;
+
+/*
+ * Segment write aggregation.  hammer2_io_putblk() records each device
+ * buffer it leaves delayed-write in the wseg of its 2MB freemap segment.
+ * A segment only holds blocks of one allocation class and thus of one
+ * device buffer size, so the flush can gather the recorded buffers and
+ * write each contiguous run as a single I/O (hammer2_io_wagg_flush()).
+ * A buffer whose record is lost is simply written by the syncer.
+ */
+#define HAMMER2_WSEG_UNITS	(HAMMER2_SEGSIZE / HAMMER2_LBUFSIZE)
+
+RB_HEAD(hammer2_wseg_tree, hammer2_wseg);
+
+struct hammer2_wseg {
+	RB_ENTRY(hammer2_wseg) rbnode;	/* indexed by segment base */
+	off_t		sbase;
+	int		psize;		/* device buffer size */
+	uint32_t	mask[HAMMER2_WSEG_UNITS / 32]; /* dirty buffer starts */
+};
+
+typedef struct hammer2_wseg hammer2_wseg_t;
+
+/*
+ * Compression scratch used by the compressed write path and the
+ * decompression callbacks.  Each object carries a HAMMER2_PBUFSIZE bounce
+ * buffer plus zlib streams which are initialized on first use and then
+ * only reset, so a block never pays for deflateInit()/inflateInit().
+ * The zstd workspaces are likewise allocated on first use.
+ *
+ * Objects are kept on per-cpu free lists (see hammer2_comp.c) and are
+ * preallocated at vfs init, so the hot path does not malloc.
+ */
+struct hammer2_comp_scratch {
+	SLIST_ENTRY(hammer2_comp_scratch) entry;
+	char		*buf;			/* HAMMER2_PBUFSIZE bytes */
+	z_stream	zdef;
+	z_stream	zinf;
+	int		zdef_level;		/* 0 until zdef initialized */
+	int		zinf_init;
+	void		*zstd_cwrk;		/* NULL until first zstd write */
+	void		*zstd_dwrk;		/* NULL until first zstd read */
+};
+
+typedef struct hammer2_comp_scratch hammer2_comp_scratch_t;
+
+#define HAMMER2_COMP_PERCPU	4		/* objects preallocated per cpu */
+#define HAMMER2_COMP_PERCPU_MAX	16		/* free list cap per cpu */
+
+/*
+ * Incompressibility prediction.  The entropy estimator histograms
+ * HAMMER2_COMP_SAMPLES windows of HAMMER2_COMP_SAMPLE_LEN bytes spread
+ * over the logical buffer.  ip->comp_heuristic is a per-inode penalty,
+ * raised by failed attempts and entropy rejections and halved by each
+ * successful compression.
+ */
+#define HAMMER2_COMP_SAMPLES		16
+#define HAMMER2_COMP_SAMPLE_LEN		32
+#define HAMMER2_COMP_HEUR_FREE		16	/* below this always try */
+#define HAMMER2_COMP_HEUR_FAIL		8	/* failed compression */
+#define HAMMER2_COMP_HEUR_ENTROPY	4	/* rejected by estimator */
+#define HAMMER2_COMP_HEUR_MAX		128
+
+#define HAMMER2_COMPRES_SKIPPED		0	/* heuristic said no */
+#define HAMMER2_COMPRES_ENTROPY		1	/* estimator said no */
+#define HAMMER2_COMPRES_FAILED		2	/* did not fit */
+#define HAMMER2_COMPRES_COMPRESSED	3
+
 /*
  * Primary chain structure keeps track of the topology in-memory.
  */
 struct hammer2_chain {
 	hammer2_chain_core_t	core;
 	RB_ENTRY(hammer2_chain) rbnode;		/* live chain(s) */
-	hammer2_blockref_t	bref;
+	u_int		flags;
+	u_int		refs;
+	u_int		lockcnt;
+	u_int		bytes;			/* physical data size */
 	struct hammer2_chain	*parent;
-	struct hammer2_state	*state;		/* if active cache msg */
+	hammer2_media_data_t *data;		/* data pointer shortcut */
+	hammer2_io_t	*dio;			/* physical data buffer */
 	struct hammer2_mount	*hmp;
 	struct hammer2_pfsmount	*pmp;		/* (pfs-cluster pmp or spmp) */
+	hammer2_blockref_t	bref;
 
+	/*
+	 * Cold fields, only touched by modify/flush and LRU management.
+	 */
 	hammer2_xid_t	flush_xid;		/* flush sequencing */
 	hammer2_key_t   data_count;		/* delta's to apply */
 	hammer2_key_t   inode_count;		/* delta's to apply */
 	hammer2_key_t   data_count_up;		/* delta's to apply */
 	hammer2_key_t   inode_count_up;		/* delta's to apply */
-	hammer2_io_t	*dio;			/* physical data buffer */
-	u_int		bytes;			/* physical data size */
-	u_int		flags;
-	u_int		refs;
-	u_int		lockcnt;
-	hammer2_media_data_t *data;		/* data pointer shortcut */
 	TAILQ_ENTRY(hammer2_chain) flush_node;	/* flush list */
+	TAILQ_ENTRY(hammer2_chain) lru_node;	/* hmp->chain_lru */
 };
 
+TAILQ_HEAD(hammer2_chain_lru, hammer2_chain);
+
 typedef struct hammer2_chain hammer2_chain_t;
 
 int hammer2_chain_cmp(hammer2_chain_t *chain1, hammer2_chain_t *chain2);
@@ -830,6 +946,12 @@ RB_PROTOTYPE(hammer2_chain_tree, hammer2_chain, rbnode, hammer2_chain_cmp);
  * BMAPPED - Indicates that the chain is present in the parent blockmap.
  * BMAPUPD - Indicates that the chain is present but needs to be updated
  *	     in the parent blockmap.
+ *
+ * ONLRU   - The chain is on its mount's LRU of clean chains retained with
+ *	     zero refs on the parent's rbtree (see hammer2_chain_lastdrop()).
+ *
+ * TESTEDGOOD - The chain's check code has been verified against its
+ *	     current media data, cleared by hammer2_chain_modify().
  */
 #define HAMMER2_CHAIN_MODIFIED		0x00000001	/* dirty chain data */
 #define HAMMER2_CHAIN_ALLOCATED		0x00000002	/* kmalloc'd chain */
@@ -843,7 +965,7 @@ RB_PROTOTYPE(hammer2_chain_tree, hammer2_chain, rbnode, hammer2_chain_cmp);
 #define HAMMER2_CHAIN_ONFLUSH		0x00000200	/* on a flush list */
 #define HAMMER2_CHAIN_UNUSED00000400	0x00000400
 #define HAMMER2_CHAIN_VOLUMESYNC	0x00000800	/* needs volume sync */
-#define HAMMER2_CHAIN_UNUSED00001000	0x00001000
+#define HAMMER2_CHAIN_ONLRU		0x00001000	/* on hmp->chain_lru */
 #define HAMMER2_CHAIN_MOUNTED		0x00002000	/* PFS is mounted */
 #define HAMMER2_CHAIN_ONRBTREE		0x00004000	/* on parent RB tree */
 #define HAMMER2_CHAIN_SNAPSHOT		0x00008000	/* snapshot special */
@@ -851,7 +973,7 @@ RB_PROTOTYPE(hammer2_chain_tree, hammer2_chain, rbnode, hammer2_chain_cmp);
 #define HAMMER2_CHAIN_RELEASE		0x00020000	/* don't keep around */
 #define HAMMER2_CHAIN_BMAPPED		0x00040000	/* present in blkmap */
 #define HAMMER2_CHAIN_BMAPUPD		0x00080000	/* +needs updating */
-#define HAMMER2_CHAIN_UNUSED00100000	0x00100000
+#define HAMMER2_CHAIN_TESTEDGOOD	0x00100000	/* check code verified */
 #define HAMMER2_CHAIN_UNUSED00200000	0x00200000
 #define HAMMER2_CHAIN_PFSBOUNDARY	0x00400000	/* super->pfs inode */
 
@@ -952,6 +1074,11 @@ RB_PROTOTYPE(hammer2_chain_tree, hammer2_chain, rbnode, hammer2_chain_cmp);
  * If an insufficient number of chains remain in a working copy, the operation
  * may have to be downgraded, retried, or stall until the requisit number
  * of chains are available.
+ *
+ * Temporary clusters size array[] and cache_index[] to their chain count
+ * (nslots), see hammer2_cluster_new().  The inode's embedded cluster points
+ * them at HAMMER2_MAXCLUSTER entries in the inode because the super-root
+ * cluster can grow as devices are mounted.
  */
 #define HAMMER2_MAXCLUSTER	8
 
@@ -961,10 +1088,10 @@ struct hammer2_cluster {
 	struct hammer2_pfsmount	*pmp;
 	uint32_t		flags;
 	int			nchains;
+	int			nslots;		/* capacity of the arrays */
 	hammer2_chain_t		*focus;		/* current focus (or mod) */
-	hammer2_chain_t		*array[HAMMER2_MAXCLUSTER];
-	char			missed[HAMMER2_MAXCLUSTER];
-	int			cache_index[HAMMER2_MAXCLUSTER];
+	hammer2_chain_t		**array;	/* [nslots] */
+	int			*cache_index;	/* [nslots] */
 };
 
 typedef struct hammer2_cluster hammer2_cluster_t;
@@ -972,6 +1099,10 @@ typedef struct hammer2_cluster hammer2_cluster_t;
 #define HAMMER2_CLUSTER_INODE	0x00000001	/* embedded in inode */
 #define HAMMER2_CLUSTER_NOSYNC	0x00000002	/* not in sync (cumulative) */
 
+#define HAMMER2_CLUSTER_BYTES(nslots)					\
+	(sizeof(hammer2_cluster_t) +					\
+	 (nslots) * (sizeof(hammer2_chain_t *) + sizeof(int)))
+
 
 RB_HEAD(hammer2_inode_tree, hammer2_inode);
 
@@ -988,13 +1119,18 @@ struct hammer2_inode {
 	struct hammer2_inode	*pip;		/* parent inode */
 	struct vnode		*vp;
 	hammer2_cluster_t	cluster;
+	hammer2_chain_t		*cluster_array[HAMMER2_MAXCLUSTER];
+	int			cluster_cache[HAMMER2_MAXCLUSTER];
 	struct lockf		advlock;
 	hammer2_tid_t		inum;
 	u_int			flags;
 	u_int			refs;		/* +vpref, +flushref */
-	uint8_t			comp_heuristic;
+	uint8_t			comp_heuristic;	/* see hammer2_comp.c */
+	uint8_t			comp_tick;
 	hammer2_off_t		size;
 	uint64_t		mtime;
+	hammer2_off_t		data_cursor;	/* placement hint (freemap) */
+	hammer2_off_t		inode_cursor;	/* placement hint (freemap) */
 };
 
 typedef struct hammer2_inode hammer2_inode_t;
@@ -1081,6 +1217,7 @@ struct hammer2_trans {
 	int			blocked;
 	uint8_t			inodes_created;
 	uint8_t			dummy[7];
+	struct hammer2_inode	*tmp_ip;	/* placement hint (freemap) */
 };
 
 typedef struct hammer2_trans hammer2_trans_t;
@@ -1097,6 +1234,76 @@ typedef struct hammer2_trans hammer2_trans_t;
 #define HAMMER2_FREEMAP_HEUR		(HAMMER2_FREEMAP_HEUR_NRADIX * \
 					 HAMMER2_FREEMAP_HEUR_TYPES)
 
+/*
+ * Per-cpu freemap reservations.  Each cpu holds one reservation per
+ * heur_freemap[] index.  A reservation is a run of fully-free 256KB
+ * bitmap words within a single 2MB bmap which hammer2_freemap_alloc()
+ * marks allocated in one go and then carves allocations of the same
+ * class out of without touching the freemap chains.  The unused tail
+ * of each reservation is returned to the bitmap by the next sync.
+ */
+#define HAMMER2_FREEMAP_RESV_WORDS	8	/* max 256KB words (2MB) */
+
+struct hammer2_freemap_resv {
+	hammer2_off_t	beg;		/* base of reservation */
+	hammer2_off_t	cur;		/* next free byte */
+	hammer2_off_t	end;		/* end of reservation */
+	uint16_t	class;
+};
+
+typedef struct hammer2_freemap_resv hammer2_freemap_resv_t;
+
+struct hammer2_freemap_pcpu {
+	struct mutex	mtx;
+	hammer2_freemap_resv_t resv[HAMMER2_FREEMAP_HEUR];
+} __aligned(64);
+
+/*
+ * RAM-resident freemap summary, one entry per 2GB freemap leaf plus a
+ * bitset with one bit per 2MB segment which is free for any class
+ * (class 0 with space available).  radixmask has one bit per
+ * (bref type, allocation radix) pair which might be satisfied by a
+ * partially filled segment of the matching class in the zone.
+ *
+ * A zone's summary is built the first time the allocator looks at its
+ * leaf and is maintained under the fchain lock from then on.  Bits are
+ * set whenever space might have become available and only cleared when
+ * a full scan of the leaf fails, so a valid summary never hides space.
+ * The allocator uses it to skip full zones without touching their
+ * leaves and to jump straight to a free segment within a zone.
+ */
+struct hammer2_freemap_zsum {
+	uint64_t	radixmask;	/* (type, radix) might fit */
+	uint16_t	nfree;		/* free segments in zone */
+	uint16_t	flags;
+};
+
+typedef struct hammer2_freemap_zsum hammer2_freemap_zsum_t;
+
+#define HAMMER2_FREEMAP_ZSUM_VALID	0x0001
+
+#define HAMMER2_FREEMAP_ZSUM_BIT(type, radix)				\
+	((uint64_t)1 << ((((type) & 7) << 3) + (radix) - HAMMER2_RADIX_MIN))
+
+/*
+ * Pending discard extent, see hammer2_discard.c.  Extents are queued by
+ * the bulk free code in ascending order and coalesced when adjacent.
+ */
+struct hammer2_discard {
+	TAILQ_ENTRY(hammer2_discard) entry;
+	hammer2_off_t	beg;
+	hammer2_off_t	end;
+};
+
+TAILQ_HEAD(hammer2_discard_list, hammer2_discard);
+
+/*
+ * Discard issue hook, the device path or the recording stub selected with
+ * HAMMER2IOC_DISCARD, see hammer2_discard.c.
+ */
+typedef int (*hammer2_discard_issue_t)(struct hammer2_mount *hmp,
+			hammer2_off_t off, hammer2_off_t bytes);
+
 #define HAMMER2_CLUSTER_COPY_NOCHAINS	0x0001	/* do not copy or ref chains */
 #define HAMMER2_CLUSTER_COPY_NOREF	0x0002	/* do not ref chains or cl */
 
@@ -1128,8 +1335,12 @@ struct hammer2_mount {
 	int		nipstacks;
 	int		maxipstacks;
 	kdmsg_iocom_t	iocom;		/* volume-level dmsg interface */
-	struct _atomic_lock *io_spin;	/* iotree access */
-	struct hammer2_io_tree iotree;
+	hammer2_io_hash_t iohash[HAMMER2_IOHASH_SIZE];	/* dio index */
+	struct mutex	wagg_mtx;	/* wagg_tree interlock */
+	struct mutex	chain_lru_mtx;	/* chain_lru interlock */
+	struct hammer2_chain_lru chain_lru; /* retained clean chains */
+	int		chain_lru_count;
+	struct hammer2_wseg_tree wagg_tree; /* segments with dirty buffers */
 	int		iofree_count;
 	hammer2_chain_t vchain;		/* anchor chain (topology) */
 	hammer2_chain_t fchain;		/* anchor chain (freemap) */
@@ -1138,6 +1349,40 @@ struct hammer2_mount {
 	struct hammer2_pfsmount *spmp;	/* super-root pmp for transactions */
 	struct lock	vollk;		/* lockmgr lock */
 	hammer2_off_t	heur_freemap[HAMMER2_FREEMAP_HEUR];
+	struct hammer2_freemap_pcpu *freemap_pcpu; /* per-cpu reservations */
+	int		freemap_ncpus;
+	hammer2_freemap_zsum_t *freemap_zsum;	/* per-zone summary */
+	uint32_t	*freemap_segfree;	/* free segment bitset */
+	int		freemap_nzones;
+	int		volsync_seq;	/* completed volume flushes */
+	struct mutex	bulkfree_mtx;	/* bulkfree thread interlock */
+	int		bulkfree_run;	/* bulkfree thread running */
+	int		bulkfree_stop;	/* termination request */
+	int		bulkfree_req;	/* requested passes */
+	int		bulkfree_done;	/* completed passes */
+	int		bulkfree_stage_seq; /* volsync_seq at last staging */
+	int		bulkfree_staged; /* staged (10) blocks not yet freed */
+	uint64_t	bulkfree_size;	/* scan bitmap limit for request */
+	hammer2_ioc_bulkfree_t bulkfree_stats;	/* last completed pass */
+	int		bulkfree_flags;	/* flags for request */
+	int		bulkfree_incr;	/* incremental passes since full */
+	uint8_t		*bulkfree_refs;	/* per-16KB reference counts */
+	size_t		bulkfree_nrefs;
+	hammer2_blockset_t bulkfree_sroot; /* topology counted in refs */
+	int		hflags;		/* HMNT2_* mount flags */
+	struct mutex	discard_mtx;	/* discard queue interlock */
+	struct hammer2_discard_list discard_list; /* pending extents */
+	int		discard_count;	/* extents on discard_list */
+	int		discard_run;	/* discard thread running */
+	int		discard_stop;	/* termination request */
+	int		discard_busy;	/* extent being issued */
+	hammer2_off_t	discard_beg;	/* extent being issued */
+	hammer2_off_t	discard_end;
+	hammer2_discard_issue_t discard_issue; /* issue hook */
+	uint64_t	discard_nrec;	/* extents recorded by the stub */
+	struct hammer2_ioc_discard_rec discard_rec[HAMMER2_DISCARD_NREC];
+	uint32_t	*defrag_segs;	/* segments excluded from alloc */
+	size_t		defrag_nsegs;
 	int		volhdrno;	/* last volhdrno written */
 	hammer2_volume_data_t voldata;
 	hammer2_volume_data_t volsync;	/* synchronized voldata */
@@ -1145,6 +1390,68 @@ struct hammer2_mount {
 
 typedef struct hammer2_mount hammer2_mount_t;
 
+/*
+ * Logical buffer write handed from the write thread to the compression
+ * workers.  A worker performs the zero test, compression and check code
+ * calculation into a scratch object, all of which only depend on the
+ * buffer contents.  The write thread then commits the jobs (physical
+ * assignment, chain updates and device I/O) strictly in submission
+ * order, so per-inode ordering is unchanged.
+ */
+struct hammer2_wjob {
+	TAILQ_ENTRY(hammer2_wjob) entry;	/* pmp->wjob_queue */
+	struct bio		*bio;
+	struct buf		*bp;
+	hammer2_inode_t		*ip;
+	hammer2_key_t		lbase;
+	int			pblksize;
+	int			comp_algo;
+	int			check_algo;
+	int			flags;
+	int			comp_size;	/* 0 if not compressed */
+	int			comp_block_size;
+	int			comp_result;	/* HAMMER2_COMPRES_* */
+	hammer2_comp_scratch_t	*scr;		/* compressed data */
+	hammer2_blockref_t	bref;		/* methods and check code */
+};
+
+TAILQ_HEAD(hammer2_wjob_list, hammer2_wjob);
+
+typedef struct hammer2_wjob hammer2_wjob_t;
+
+#define HAMMER2_WJOB_QUEUED	0x0001		/* handed to the workers */
+#define HAMMER2_WJOB_DONE	0x0002		/* compression finished */
+#define HAMMER2_WJOB_ZERO	0x0004		/* buffer is all zeros */
+
+#define HAMMER2_WJOB_BATCH	32		/* bios per write thread pass */
+#define HAMMER2_WWORKERS_MAX	32		/* compression workers per PFS */
+
+/*
+ * Flush job, a cluster element or an independent dirty subtree handed to
+ * the PFS flush workers by hammer2_flush_cluster().  The submitter joins
+ * on batch->pending, helping to run queued jobs while it waits.
+ */
+struct hammer2_fjob_batch {
+	struct hammer2_pfsmount	*pmp;
+	int			pending;	/* queued or running jobs */
+};
+
+struct hammer2_fjob {
+	TAILQ_ENTRY(hammer2_fjob) entry;	/* pmp->fjob_queue */
+	struct hammer2_fjob_batch *batch;
+	hammer2_trans_t		*trans;
+	hammer2_chain_t		*chain;		/* referenced */
+	int			flags;
+};
+
+TAILQ_HEAD(hammer2_fjob_list, hammer2_fjob);
+
+typedef struct hammer2_fjob hammer2_fjob_t;
+
+#define HAMMER2_FJOB_SPLIT	0x0001		/* also split its subtrees */
+
+#define HAMMER2_FWORKERS_MAX	32		/* flush workers per PFS */
+
 /*
  * HAMMER2 PFS mount point structure (aka vp->v_mount->mnt_data).
  * This has a 1:1 correspondence to struct mount (note that the
@@ -1185,10 +1492,18 @@ struct hammer2_pfsmount {
 	int			count_lwinprog;	/* logical write in prog */
 	struct i_atomic_lock *list_spin;
 	struct h2_unlk_list	unlinkq;	/* last-close unlink */
-	thread_t		wthread_td;	/* write thread td */
+	struct proc		*wthread_td;	/* write thread */
 	struct bio_queue_head	wthread_bioq;	/* logical buffer bioq */
-	struct mutex		*wthread_mtx;	/* interlock */
+	struct mutex		wthread_mtx;	/* interlock */
 	int			wthread_destroy;/* termination sequencing */
+	struct hammer2_wjob_list wjob_queue;	/* awaiting compression */
+	int			wjob_pending;	/* queued or running jobs */
+	int			wworkers;	/* running compression workers */
+	int			wworkers_stop;
+	struct mutex		fjob_mtx;	/* flush job interlock */
+	struct hammer2_fjob_list fjob_queue;	/* awaiting flush */
+	int			fworkers;	/* running flush workers */
+	int			fworkers_stop;
 };
 
 typedef struct hammer2_pfsmount hammer2_pfsmount_t;
@@ -1222,6 +1537,22 @@ hammer2_devblkradix(int radix)
 	}
 }
 
+/*
+ * Mark the 16KB freemap block containing off as referenced (11) in a
+ * bulk free scan bitmap whose first bmap covers base.
+ */
+static __inline
+void
+hammer2_bmap_markref(hammer2_bmap_data_t *scan, hammer2_off_t base,
+		     hammer2_off_t off)
+{
+	hammer2_bmap_data_t *bmap;
+
+	bmap = &scan[(off - base) >> HAMMER2_SEGRADIX];
+	bmap->bitmap[(int)(off >> (HAMMER2_SEGRADIX - 3)) & 7] |=
+		3U << (((int)(off >> HAMMER2_FREEMAP_BLOCK_RADIX) & 15) * 2);
+}
+
 static __inline
 size_t
 hammer2_devblksize(size_t bytes)
@@ -1256,6 +1587,49 @@ extern int hammer2_flush_pipe;
 extern int hammer2_synchronous_flush;
 extern int hammer2_dio_count;
 extern long hammer2_limit_dirty_chains;
+extern long hammer2_dio_contention;
+extern long hammer2_dio_lockless;
+extern long hammer2_dio_evicted;
+extern long hammer2_dio_pristine;
+extern long hammer2_check_verified;
+extern long hammer2_check_skipped;
+extern int hammer2_dio_limit;
+extern long hammer2_wagg_maxio;
+extern struct pool hammer2_chain_pool;
+extern struct pool hammer2_cluster_pool;
+extern int hammer2_chain_lru_max;
+extern int hammer2_flush_parallel;
+extern int hammer2_flush_workers;
+extern long hammer2_flush_jobs;
+extern long hammer2_flush_jobs_worker;
+extern long hammer2_flush_subtrees;
+extern long hammer2_flush_subtrees_worker;
+extern long hammer2_chain_lru_hits;
+extern long hammer2_chain_lru_misses;
+extern long hammer2_chain_lru_evicted;
+extern long hammer2_wagg_ios;
+extern long hammer2_wagg_bufs;
+extern long hammer2_comp_scratch_allocs;
+extern long hammer2_comp_attempted;
+extern long hammer2_comp_compressed;
+extern long hammer2_comp_skip_entropy;
+extern long hammer2_comp_skip_heuristic;
+extern long hammer2_comp_bytes_in;
+extern long hammer2_comp_bytes_out;
+extern int hammer2_comp_entropy_bits;
+extern int hammer2_write_workers;
+extern long hammer2_bulkfree_mem;
+extern int hammer2_bulkfree_interval;
+extern int hammer2_bulkfree_rate;
+extern int hammer2_bulkfree_incr;
+extern long hammer2_discard_rate;
+extern long hammer2_discard_maxio;
+extern long hammer2_discard_align;
+extern int hammer2_discard_maxq;
+extern long hammer2_discard_count;
+extern long hammer2_discard_bytes;
+extern int hammer2_defrag_fill;
+extern int hammer2_defrag_batch;
 extern long hammer2_iod_file_read;
 extern long hammer2_iod_meta_read;
 extern long hammer2_iod_indr_read;
@@ -1277,8 +1651,6 @@ extern long hammer2_ioa_indr_write;
 extern long hammer2_ioa_fmap_write;
 extern long hammer2_ioa_volu_write;
 
-extern struct vnode *cache_buffer_read;
-extern struct objcache *cache_buffer_write;
 
 extern int destroy;
 extern int write_thread_wakeup;
@@ -1288,6 +1660,8 @@ extern int write_thread_wakeup;
  */
 #define hammer2_icrc32(buf, size)	iscsi_crc32((buf), (size))
 #define hammer2_icrc32c(buf, size, crc)	iscsi_crc32_ext((buf), (size), (crc))
+#define hammer2_icrc64(buf, size)	crc64_ecma((buf), (size))
+void hammer2_xxh3_128(const void *buf, size_t size, uint64_t *out);
 
 hammer2_cluster_t *hammer2_inode_lock_ex(hammer2_inode_t *ip);
 hammer2_cluster_t *hammer2_inode_lock_sh(hammer2_inode_t *ip);
@@ -1383,6 +1757,7 @@ hammer2_chain_t *hammer2_chain_alloc(hammer2_mount_t *hmp,
 void hammer2_chain_core_alloc(hammer2_trans_t *trans, hammer2_chain_t *chain);
 void hammer2_chain_ref(hammer2_chain_t *chain);
 void hammer2_chain_drop(hammer2_chain_t *chain);
+void hammer2_chain_lru_trim(hammer2_mount_t *hmp, int limit);
 int hammer2_chain_lock(hammer2_chain_t *chain, int how);
 void hammer2_chain_load_async(hammer2_cluster_t *cluster,
 				void (*func)(hammer2_io_t *dio,
@@ -1431,12 +1806,16 @@ void hammer2_chain_delete(hammer2_trans_t *trans, hammer2_chain_t *parent,
 void hammer2_chain_delete_duplicate(hammer2_trans_t *trans,
 				hammer2_chain_t **chainp, int flags);
 void hammer2_flush(hammer2_trans_t *trans, hammer2_chain_t *chain);
+void hammer2_flush_cluster(hammer2_trans_t *trans, hammer2_cluster_t *cluster);
+void hammer2_flush_workers_start(hammer2_pfsmount_t *pmp);
+void hammer2_flush_workers_stop(hammer2_pfsmount_t *pmp);
 void hammer2_chain_commit(hammer2_trans_t *trans, hammer2_chain_t *chain);
 void hammer2_chain_setflush(hammer2_trans_t *trans, hammer2_chain_t *chain);
 void hammer2_chain_countbrefs(hammer2_chain_t *chain,
 				hammer2_blockref_t *base, int count);
 
 void hammer2_chain_setcheck(hammer2_chain_t *chain, void *bdata);
+void hammer2_bref_setcheck(hammer2_blockref_t *bref, void *bdata, int bytes);
 int hammer2_chain_testcheck(hammer2_chain_t *chain, void *bdata);
 
 
@@ -1493,14 +1872,19 @@ void vfs_bio_clrbuf(struct buf *bp);
 hammer2_io_t *hammer2_io_getblk(hammer2_mount_t *hmp, off_t lbase,
 				int lsize, int *ownerp);
 void hammer2_io_putblk(hammer2_io_t **diop);
+void hammer2_io_init(hammer2_mount_t *hmp);
 void hammer2_io_cleanup(hammer2_mount_t *hmp, struct hammer2_io_tree *tree);
+void hammer2_io_cleanup_all(hammer2_mount_t *hmp);
+int hammer2_io_trim_shard(hammer2_mount_t *hmp, hammer2_io_hash_t *hash,
+				int scan);
+void hammer2_io_trim(hammer2_mount_t *hmp);
+void hammer2_io_wagg_flush(hammer2_mount_t *hmp);
 char *hammer2_io_data(hammer2_io_t *dio, off_t lbase);
 int hammer2_io_new(hammer2_mount_t *hmp, off_t lbase, int lsize,
 				hammer2_io_t **diop);
 int hammer2_io_newnz(hammer2_mount_t *hmp, off_t lbase, int lsize,
 				hammer2_io_t **diop);
-int hammer2_io_newq(hammer2_mount_t *hmp, off_t lbase, int lsize,
-				hammer2_io_t **diop);
+void hammer2_io_pristine(hammer2_mount_t *hmp, off_t lbase, int lsize);
 int hammer2_io_bread(hammer2_mount_t *hmp, off_t lbase, int lsize,
 				hammer2_io_t **diop);
 void hammer2_io_breadcb(hammer2_mount_t *hmp, off_t lbase, int lsize,
@@ -1519,6 +1903,10 @@ void hammer2_io_setdirty(hammer2_io_t *dio);
 void hammer2_io_setinval(hammer2_io_t *dio, u_int bytes);
 void hammer2_io_brelse(hammer2_io_t **diop);
 void hammer2_io_bqrelse(hammer2_io_t **diop);
+u_long hammer2_io_crc_mask(hammer2_io_t *dio, off_t lbase, int lsize);
+int hammer2_io_crc_good(hammer2_chain_t *chain, u_long *maskp);
+void hammer2_io_crc_setmask(hammer2_io_t *dio, u_long mask);
+void hammer2_io_crc_clrmask(hammer2_io_t *dio, off_t lbase, int lsize);
 
 static __inline int
 cluster_read(struct vnode *vp, off_t filesize, off_t loffset,
@@ -1554,6 +1942,21 @@ void hammer2_lwinprog_wait(hammer2_pfsmount_t *pmp);
 struct mtx;
 int mtxsleep(void *, struct mutex *, int, const char *, int);
 
+/*
+ * hammer2_comp.c
+ */
+void hammer2_comp_init(void);
+void hammer2_comp_uninit(void);
+hammer2_comp_scratch_t *hammer2_comp_get(void);
+void hammer2_comp_put(hammer2_comp_scratch_t *scr);
+z_stream *hammer2_comp_deflate(hammer2_comp_scratch_t *scr, int level);
+z_stream *hammer2_comp_inflate(hammer2_comp_scratch_t *scr);
+void *hammer2_comp_zstd_cwrk(hammer2_comp_scratch_t *scr);
+void *hammer2_comp_zstd_dwrk(hammer2_comp_scratch_t *scr);
+int hammer2_comp_entropy_high(const void *data, int bytes);
+int hammer2_comp_heur_try(hammer2_inode_t *ip);
+void hammer2_comp_heur_update(hammer2_inode_t *ip, int result);
+
 /*
  * hammer2_freemap.c
  */
@@ -1561,6 +1964,45 @@ int hammer2_freemap_alloc(hammer2_trans_t *trans, hammer2_chain_t *chain,
 				size_t bytes);
 void hammer2_freemap_adjust(hammer2_trans_t *trans, hammer2_mount_t *hmp,
 				hammer2_blockref_t *bref, int how);
+void hammer2_freemap_resv_init(hammer2_mount_t *hmp);
+void hammer2_freemap_resv_release(hammer2_trans_t *trans,
+				hammer2_mount_t *hmp);
+void hammer2_freemap_resv_destroy(hammer2_mount_t *hmp);
+void hammer2_freemap_sum_init(hammer2_mount_t *hmp);
+void hammer2_freemap_sum_destroy(hammer2_mount_t *hmp);
+int hammer2_freemap_defrag_begin(hammer2_trans_t *trans,
+				hammer2_mount_t *hmp, int pct, int max);
+void hammer2_freemap_defrag_end(hammer2_mount_t *hmp);
+int hammer2_freemap_defrag_target(hammer2_mount_t *hmp, hammer2_off_t off);
+void hammer2_freemap_bulkfree_merge(hammer2_trans_t *trans,
+				hammer2_mount_t *hmp, hammer2_off_t sbase,
+				hammer2_off_t sstop, hammer2_bmap_data_t *scan,
+				int dostage, int dofree,
+				hammer2_ioc_bulkfree_t *stats);
+
+/*
+ * hammer2_bulkfree.c
+ */
+void hammer2_bulkfree_start(hammer2_mount_t *hmp);
+void hammer2_bulkfree_stop(hammer2_mount_t *hmp);
+int hammer2_bulkfree_request(hammer2_mount_t *hmp,
+				hammer2_ioc_bulkfree_t *bfi);
+
+/*
+ * hammer2_discard.c
+ */
+void hammer2_discard_start(hammer2_mount_t *hmp);
+void hammer2_discard_stop(hammer2_mount_t *hmp);
+void hammer2_discard_queue(hammer2_mount_t *hmp, hammer2_off_t beg,
+				hammer2_off_t end);
+void hammer2_discard_cancel(hammer2_mount_t *hmp, hammer2_off_t beg,
+				hammer2_off_t end);
+int hammer2_discard_ioctl(hammer2_mount_t *hmp, hammer2_ioc_discard_t *dis);
+
+/*
+ * hammer2_defrag.c
+ */
+int hammer2_defrag(hammer2_pfsmount_t *pmp, hammer2_ioc_defrag_t *dfi);
 
 /*
  * hammer2_cluster.c
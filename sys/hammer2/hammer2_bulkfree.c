@@ -0,0 +1,793 @@
+/*
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include <sys/param.h>
+#include <sys/systm.h>
+#include <sys/kernel.h>
+#include <sys/kthread.h>
+#include <sys/mount.h>
+#include <sys/vnode.h>
+
+#include "hammer2.h"
+
+/*
+ * Bulk free scan.
+ *
+ * The live filesystem never frees blocks when chains are deleted or
+ * replaced, it just leaves them marked allocated (11) in the freemap.
+ * The bulk free scan walks the topology, builds a RAM bitmap of every
+ * 16KB block still referenced, and merges it into the freemap (see
+ * hammer2_freemap_bulkfree_merge()).  Unreferenced blocks go through two
+ * passes, 11 -> 10 and then 10 -> 00, so a block is only reused once
+ * every volume header which might still reference it has been rewritten.
+ *
+ * The scan reads the on-media topology of the last completed flush
+ * (hmp->volsync) instead of the in-memory chains.  Those blocks are
+ * immutable until freed, so no chain locks are held and the scan cannot
+ * race renames or deletions.  Blocks allocated since that flush are at
+ * worst staged (10), and the next pass sees them and restores them.
+ *
+ * When a reference count for every 16KB block of the volume fits in the
+ * RAM budget (hammer2_bulkfree_mem, or the ioctl's size) the counts are
+ * kept between passes along with the super-root blockset they describe.
+ * The next pass is then incremental: it diffs the new topology against
+ * the old one, pairing blockrefs by key, and only descends where a
+ * blockref's mirror_tid or data_off differs.  Old-only subtrees are
+ * subtracted and new-only subtrees added, so the counts again describe
+ * the new topology at a cost proportional to what changed.  The old
+ * topology is still readable because nothing it references has been
+ * freed yet.  Counts saturate at 255 and stay there, every
+ * hammer2_bulkfree_incr'th pass is a full rescan which resets them.
+ *
+ * Otherwise the pass uses the freemap's own hammer2_bmap_data layout as
+ * the scan bitmap, 64 bytes per 2MB of media, broken up into windows of
+ * whole 2GB zones with the topology rescanned once per window, and no
+ * state is carried forward.
+ *
+ * Each mount runs one bulk free thread.  It runs a pass every
+ * hammer2_bulkfree_interval seconds, throttled to hammer2_bulkfree_rate
+ * blockrefs per second, and unthrottled passes on demand via
+ * HAMMER2IOC_BULKFREE_SCAN.
+ */
+struct hammer2_bulkfree_elm {
+	TAILQ_ENTRY(hammer2_bulkfree_elm) entry;
+	hammer2_blockref_t	obref;		/* old side (diff only) */
+	hammer2_blockref_t	bref;
+	int			op;
+};
+
+#define HAMMER2_BULKFREE_OP_ADD		1
+#define HAMMER2_BULKFREE_OP_SUB		2
+#define HAMMER2_BULKFREE_OP_DIFF	3
+
+TAILQ_HEAD(hammer2_bulkfree_list, hammer2_bulkfree_elm);
+
+struct hammer2_bulkfree_info {
+	hammer2_mount_t		*hmp;
+	hammer2_off_t		sbase;		/* window */
+	hammer2_off_t		sstop;
+	hammer2_bmap_data_t	*bmap;		/* scan bitmap for window */
+	uint8_t			*refs;		/* or reference counts */
+	size_t			nrefs;
+	hammer2_ioc_bulkfree_t	*stats;
+	struct hammer2_bulkfree_list list;	/* deferred subtrees */
+	int			depth;
+	int			throttle;
+	int			count;		/* throttle interval count */
+};
+
+#define HAMMER2_BULKFREE_MAXDEPTH	10
+#define HAMMER2_BULKFREE_REFMAX		255
+
+static void hammer2_bulkfree_thread(void *arg);
+static int hammer2_bulkfree_pass(hammer2_mount_t *hmp,
+			hammer2_ioc_bulkfree_t *bfi, int throttle);
+static int hammer2_bulkfree_scan(struct hammer2_bulkfree_info *info,
+			hammer2_blockref_t *bref, int op);
+static int hammer2_bulkfree_diff(struct hammer2_bulkfree_info *info,
+			hammer2_blockref_t *obref, hammer2_blockref_t *bref);
+
+/*
+ * Account for the blocks covered by bref.  In bitmap mode mark them
+ * referenced if they lie in the current window, in count mode add or
+ * subtract one reference.
+ */
+static
+void
+hammer2_bulkfree_mark(struct hammer2_bulkfree_info *info,
+		      hammer2_blockref_t *bref, int op)
+{
+	hammer2_off_t off;
+	hammer2_off_t end;
+	size_t i;
+	int radix;
+
+	radix = (int)(bref->data_off & HAMMER2_OFF_MASK_RADIX);
+	if (radix == 0)
+		return;
+	off = bref->data_off & ~HAMMER2_OFF_MASK_RADIX;
+	end = off + ((hammer2_off_t)1 << radix);
+	off &= ~(hammer2_off_t)HAMMER2_FREEMAP_BLOCK_MASK;
+
+	if (info->refs) {
+		for (; off < end; off += HAMMER2_FREEMAP_BLOCK_SIZE) {
+			i = (size_t)(off >> HAMMER2_FREEMAP_BLOCK_RADIX);
+			if (i >= info->nrefs ||
+			    info->refs[i] == HAMMER2_BULKFREE_REFMAX) {
+				continue;
+			}
+			if (op == HAMMER2_BULKFREE_OP_ADD)
+				++info->refs[i];
+			else if (info->refs[i])
+				--info->refs[i];
+		}
+		return;
+	}
+
+	if (end <= info->sbase || off >= info->sstop)
+		return;
+	if (off < info->sbase)
+		off = info->sbase;
+	for (; off < end && off < info->sstop;
+	     off += HAMMER2_FREEMAP_BLOCK_SIZE) {
+		hammer2_bmap_markref(info->bmap, info->sbase, off);
+	}
+}
+
+/*
+ * Check for termination and apply the rate limit, once per blockref.
+ */
+static
+int
+hammer2_bulkfree_tick(struct hammer2_bulkfree_info *info)
+{
+	if (info->hmp->bulkfree_stop)
+		return (EINTR);
+	++info->stats->count_scanned;
+	if (info->throttle && hammer2_bulkfree_rate > 0 &&
+	    ++info->count >= hammer2_bulkfree_rate / 10 + 1) {
+		info->count = 0;
+		tsleep(&info->count, 0, "h2bfrt", hz / 10 + 1);
+	}
+	return (0);
+}
+
+/*
+ * Queue a subtree for later processing once the recursion gets too deep,
+ * bounding kernel stack use.
+ */
+static
+void
+hammer2_bulkfree_defer(struct hammer2_bulkfree_info *info,
+		       hammer2_blockref_t *obref, hammer2_blockref_t *bref,
+		       int op)
+{
+	struct hammer2_bulkfree_elm *elm;
+
+	elm = malloc(sizeof(*elm), M_HAMMER2, M_ZERO | M_WAITOK);
+	if (obref)
+		elm->obref = *obref;
+	elm->bref = *bref;
+	elm->op = op;
+	TAILQ_INSERT_TAIL(&info->list, elm, entry);
+}
+
+/*
+ * Read the media block for an inode or indirect bref and return its
+ * blockref array.  *countp is 0 for DIRECTDATA inodes.  Inodes and
+ * indirect blocks are never compressed.
+ */
+static
+int
+hammer2_bulkfree_read(struct hammer2_bulkfree_info *info,
+		      hammer2_blockref_t *bref, hammer2_io_t **diop,
+		      hammer2_blockref_t **basep, int *countp)
+{
+	hammer2_inode_data_t *ipdata;
+	char *bdata;
+	int bytes;
+	int error;
+
+	*diop = NULL;
+	*basep = NULL;
+	*countp = 0;
+
+	if ((bref->data_off & HAMMER2_OFF_MASK_RADIX) == 0)
+		return (EDOM);
+	bytes = 1 << (int)(bref->data_off & HAMMER2_OFF_MASK_RADIX);
+	error = hammer2_io_bread(info->hmp, bref->data_off, bytes, diop);
+	if (error) {
+		hammer2_io_bqrelse(diop);
+		return (error);
+	}
+	bdata = hammer2_io_data(*diop, bref->data_off);
+
+	if (bref->type == HAMMER2_BREF_TYPE_INODE) {
+		ipdata = (hammer2_inode_data_t *)bdata;
+		if ((ipdata->op_flags & HAMMER2_OPFLAG_DIRECTDATA) == 0) {
+			*basep = ipdata->u.blockset.blockref;
+			*countp = HAMMER2_SET_COUNT;
+		}
+	} else {
+		*basep = (hammer2_blockref_t *)bdata;
+		*countp = bytes / sizeof(hammer2_blockref_t);
+	}
+	return (0);
+}
+
+/*
+ * Scan the brefs in base[0..count-1].
+ */
+static
+int
+hammer2_bulkfree_scan_base(struct hammer2_bulkfree_info *info,
+			   hammer2_blockref_t *base, int count, int op)
+{
+	int error = 0;
+	int i;
+
+	++info->depth;
+	for (i = 0; i < count && error == 0; ++i) {
+		if (base[i].type == HAMMER2_BREF_TYPE_EMPTY)
+			continue;
+		error = hammer2_bulkfree_scan(info, &base[i], op);
+	}
+	--info->depth;
+
+	return (error);
+}
+
+/*
+ * Recursively scan the on-media topology under bref, modeled on the
+ * mount-time recovery scan, adding (or subtracting) every block it
+ * references.
+ */
+static
+int
+hammer2_bulkfree_scan(struct hammer2_bulkfree_info *info,
+		      hammer2_blockref_t *bref, int op)
+{
+	hammer2_blockref_t *base;
+	hammer2_io_t *dio;
+	int count;
+	int error;
+
+	if ((error = hammer2_bulkfree_tick(info)) != 0)
+		return (error);
+
+	hammer2_bulkfree_mark(info, bref, op);
+
+	switch(bref->type) {
+	case HAMMER2_BREF_TYPE_INODE:
+	case HAMMER2_BREF_TYPE_INDIRECT:
+		break;
+	case HAMMER2_BREF_TYPE_DATA:
+		return (0);
+	default:
+		return (EDOM);
+	}
+
+	if (info->depth >= HAMMER2_BULKFREE_MAXDEPTH) {
+		hammer2_bulkfree_defer(info, NULL, bref, op);
+		return (0);
+	}
+
+	error = hammer2_bulkfree_read(info, bref, &dio, &base, &count);
+	if (error == 0) {
+		error = hammer2_bulkfree_scan_base(info, base, count, op);
+		hammer2_io_bqrelse(&dio);
+	}
+	return (error);
+}
+
+/*
+ * Diff two sorted blockref arrays, pairing elements by key.  Unpaired
+ * old elements are subtracted and unpaired new elements added.
+ */
+static
+int
+hammer2_bulkfree_diff_base(struct hammer2_bulkfree_info *info,
+			   hammer2_blockref_t *obase, int ocount,
+			   hammer2_blockref_t *base, int count)
+{
+	hammer2_blockref_t *obref;
+	hammer2_blockref_t *bref;
+	int error = 0;
+	int i = 0;
+	int j = 0;
+
+	++info->depth;
+	while (error == 0) {
+		while (i < ocount && obase[i].type == HAMMER2_BREF_TYPE_EMPTY)
+			++i;
+		while (j < count && base[j].type == HAMMER2_BREF_TYPE_EMPTY)
+			++j;
+		obref = (i < ocount) ? &obase[i] : NULL;
+		bref = (j < count) ? &base[j] : NULL;
+		if (obref == NULL && bref == NULL)
+			break;
+
+		if (obref && bref && obref->key == bref->key &&
+		    obref->keybits == bref->keybits) {
+			error = hammer2_bulkfree_diff(info, obref, bref);
+			++i;
+			++j;
+		} else if (bref == NULL ||
+			   (obref && obref->key < bref->key)) {
+			error = hammer2_bulkfree_scan(info, obref,
+						      HAMMER2_BULKFREE_OP_SUB);
+			++i;
+		} else if (obref == NULL || bref->key < obref->key) {
+			error = hammer2_bulkfree_scan(info, bref,
+						      HAMMER2_BULKFREE_OP_ADD);
+			++j;
+		} else {
+			/* same key, different keybits */
+			error = hammer2_bulkfree_scan(info, obref,
+						      HAMMER2_BULKFREE_OP_SUB);
+			if (error == 0) {
+				error = hammer2_bulkfree_scan(info, bref,
+						      HAMMER2_BULKFREE_OP_ADD);
+			}
+			++i;
+			++j;
+		}
+	}
+	--info->depth;
+
+	return (error);
+}
+
+/*
+ * Diff the subtree at obref (previous pass) against the subtree at bref
+ * (this pass), which occupy the same key range.  A blockref with the
+ * same mirror_tid and data_off is the same immutable block, so the whole
+ * subtree is unchanged and its counts carry forward.
+ *
+ * mirror_tid is compared against the paired old blockref rather than a
+ * single volume-wide tid because each PFS has its own tid space.
+ */
+static
+int
+hammer2_bulkfree_diff(struct hammer2_bulkfree_info *info,
+		      hammer2_blockref_t *obref, hammer2_blockref_t *bref)
+{
+	hammer2_blockref_t *obase;
+	hammer2_blockref_t *base;
+	hammer2_io_t *odio;
+	hammer2_io_t *dio;
+	int ocount;
+	int count;
+	int error;
+
+	if (bref->mirror_tid == obref->mirror_tid &&
+	    bref->data_off == obref->data_off &&
+	    bref->type == obref->type) {
+		++info->stats->count_pruned;
+		return (0);
+	}
+
+	/*
+	 * Only matching inode/indirect pairs can be diffed, anything else
+	 * is a plain replacement.
+	 */
+	if (bref->type != obref->type ||
+	    (bref->type != HAMMER2_BREF_TYPE_INODE &&
+	     bref->type != HAMMER2_BREF_TYPE_INDIRECT)) {
+		error = hammer2_bulkfree_scan(info, obref,
+					      HAMMER2_BULKFREE_OP_SUB);
+		if (error == 0) {
+			error = hammer2_bulkfree_scan(info, bref,
+						      HAMMER2_BULKFREE_OP_ADD);
+		}
+		return (error);
+	}
+
+	if ((error = hammer2_bulkfree_tick(info)) != 0)
+		return (error);
+	hammer2_bulkfree_mark(info, obref, HAMMER2_BULKFREE_OP_SUB);
+	hammer2_bulkfree_mark(info, bref, HAMMER2_BULKFREE_OP_ADD);
+
+	if (info->depth >= HAMMER2_BULKFREE_MAXDEPTH) {
+		hammer2_bulkfree_defer(info, obref, bref,
+				       HAMMER2_BULKFREE_OP_DIFF);
+		return (0);
+	}
+
+	error = hammer2_bulkfree_read(info, obref, &odio, &obase, &ocount);
+	if (error)
+		return (error);
+	error = hammer2_bulkfree_read(info, bref, &dio, &base, &count);
+	if (error == 0) {
+		error = hammer2_bulkfree_diff_base(info, obase, ocount,
+						   base, count);
+		hammer2_io_bqrelse(&dio);
+	}
+	hammer2_io_bqrelse(&odio);
+
+	return (error);
+}
+
+/*
+ * Run the deferred list until it is empty, discarding it on error.
+ */
+static
+int
+hammer2_bulkfree_drain(struct hammer2_bulkfree_info *info, int error)
+{
+	struct hammer2_bulkfree_elm *elm;
+	hammer2_blockref_t *obase;
+	hammer2_blockref_t *base;
+	hammer2_io_t *odio;
+	hammer2_io_t *dio;
+	int ocount;
+	int count;
+
+	while ((elm = TAILQ_FIRST(&info->list)) != NULL) {
+		TAILQ_REMOVE(&info->list, elm, entry);
+		if (error) {
+			free(elm, M_HAMMER2, 0);
+			continue;
+		}
+
+		/*
+		 * The deferred blockrefs themselves were already accounted
+		 * for, only their children remain.
+		 */
+		error = hammer2_bulkfree_read(info, &elm->bref, &dio,
+					      &base, &count);
+		if (error == 0 && elm->op == HAMMER2_BULKFREE_OP_DIFF) {
+			error = hammer2_bulkfree_read(info, &elm->obref,
+						      &odio, &obase, &ocount);
+			if (error == 0) {
+				error = hammer2_bulkfree_diff_base(info,
+						obase, ocount, base, count);
+				hammer2_io_bqrelse(&odio);
+			}
+			hammer2_io_bqrelse(&dio);
+		} else if (error == 0) {
+			error = hammer2_bulkfree_scan_base(info, base, count,
+							   elm->op);
+			hammer2_io_bqrelse(&dio);
+		}
+		free(elm, M_HAMMER2, 0);
+	}
+	return (error);
+}
+
+/*
+ * Build the scan bitmap for the window from the reference counts.
+ */
+static
+void
+hammer2_bulkfree_refs_to_bmap(struct hammer2_bulkfree_info *info)
+{
+	hammer2_off_t off;
+	size_t i;
+
+	for (off = info->sbase; off < info->sstop;
+	     off += HAMMER2_FREEMAP_BLOCK_SIZE) {
+		i = (size_t)(off >> HAMMER2_FREEMAP_BLOCK_RADIX);
+		if (i >= info->nrefs)
+			break;
+		if (info->refs[i])
+			hammer2_bmap_markref(info->bmap, info->sbase, off);
+	}
+}
+
+/*
+ * Discard the reference counts carried between passes.
+ */
+static
+void
+hammer2_bulkfree_refs_destroy(hammer2_mount_t *hmp)
+{
+	if (hmp->bulkfree_refs) {
+		free(hmp->bulkfree_refs, M_HAMMER2, 0);
+		hmp->bulkfree_refs = NULL;
+	}
+	hmp->bulkfree_nrefs = 0;
+	hmp->bulkfree_incr = 0;
+}
+
+/*
+ * Run one bulk free pass over the whole volume.
+ */
+static
+int
+hammer2_bulkfree_pass(hammer2_mount_t *hmp, hammer2_ioc_bulkfree_t *bfi,
+		      int throttle)
+{
+	struct hammer2_bulkfree_info info;
+	hammer2_trans_t trans;
+	hammer2_blockset_t sroot;
+	hammer2_tid_t tid;
+	hammer2_off_t sbase;
+	size_t nbmaps;
+	size_t nrefs;
+	size_t size;
+	int incremental;
+	uint64_t staged;
+	int dostage;
+	int dofree;
+	int error = 0;
+
+	/*
+	 * Size the scan bitmap in whole 2GB zones, no larger than needed
+	 * to cover the volume in one window.
+	 */
+	size = bfi->size ? bfi->size : hammer2_bulkfree_mem;
+	nbmaps = size / sizeof(hammer2_bmap_data_t);
+	nbmaps &= ~(size_t)(HAMMER2_FREEMAP_COUNT - 1);
+	if (nbmaps == 0)
+		nbmaps = HAMMER2_FREEMAP_COUNT;
+	nrefs = (hmp->voldata.volu_size +
+		 ((hammer2_off_t)1 << HAMMER2_FREEMAP_LEVEL1_RADIX) - 1) >>
+		HAMMER2_FREEMAP_LEVEL1_RADIX;
+	if (nbmaps > nrefs * HAMMER2_FREEMAP_COUNT)
+		nbmaps = nrefs * HAMMER2_FREEMAP_COUNT;
+	nrefs = hmp->voldata.volu_size >> HAMMER2_FREEMAP_BLOCK_RADIX;
+
+	bzero(&info, sizeof(info));
+	info.hmp = hmp;
+	info.stats = bfi;
+	info.throttle = throttle;
+	info.bmap = malloc(nbmaps * sizeof(hammer2_bmap_data_t), M_HAMMER2,
+			   M_WAITOK);
+	TAILQ_INIT(&info.list);
+
+	/*
+	 * Blocks staged (10) by an earlier pass may only be freed once
+	 * every volume header has been rewritten since, otherwise a backup
+	 * volume header could still reference them.  Waiting for one more
+	 * flush than there are headers guarantees the oldest one started
+	 * after the staging.
+	 *
+	 * Staged blocks cannot be told apart by age, so nothing new is
+	 * staged while an earlier staging is still waiting for its flushes.
+	 * Otherwise every pass would restart the wait and a volume which
+	 * flushes less than once per volume header between passes (an idle
+	 * volume, back-to-back passes) would never free anything.
+	 */
+	hammer2_voldata_lock(hmp);
+	dofree = (hmp->volsync_seq - hmp->bulkfree_stage_seq >
+		  HAMMER2_NUM_VOLHDRS);
+	dostage = (dofree || hmp->bulkfree_staged == 0);
+	sroot = hmp->volsync.sroot_blockset;
+	tid = hmp->volsync.mirror_tid;
+	hammer2_voldata_unlock(hmp);
+
+	/*
+	 * Count mode if the counts fit in the budget, incremental if the
+	 * previous pass left valid counts behind.
+	 */
+	if (hammer2_bulkfree_incr > 0 && nrefs <= size) {
+		incremental = (hmp->bulkfree_refs != NULL &&
+			       hmp->bulkfree_nrefs == nrefs &&
+			       hmp->bulkfree_incr < hammer2_bulkfree_incr &&
+			       (bfi->flags & HAMMER2_BULKFREE_FULL) == 0);
+		if (incremental == 0) {
+			hammer2_bulkfree_refs_destroy(hmp);
+			hmp->bulkfree_refs = malloc(nrefs, M_HAMMER2,
+						    M_WAITOK | M_ZERO);
+			hmp->bulkfree_nrefs = nrefs;
+		}
+		info.refs = hmp->bulkfree_refs;
+		info.nrefs = nrefs;
+
+		if (incremental) {
+			error = hammer2_bulkfree_diff_base(&info,
+					hmp->bulkfree_sroot.blockref,
+					HAMMER2_SET_COUNT,
+					sroot.blockref, HAMMER2_SET_COUNT);
+		} else {
+			error = hammer2_bulkfree_scan_base(&info,
+					sroot.blockref, HAMMER2_SET_COUNT,
+					HAMMER2_BULKFREE_OP_ADD);
+		}
+		error = hammer2_bulkfree_drain(&info, error);
+
+		/*
+		 * Partially updated counts are useless.
+		 */
+		if (error) {
+			hammer2_bulkfree_refs_destroy(hmp);
+			goto done;
+		}
+		hmp->bulkfree_sroot = sroot;
+		if (incremental) {
+			++hmp->bulkfree_incr;
+			bfi->flags |= HAMMER2_BULKFREE_INCR;
+		} else {
+			hmp->bulkfree_incr = 0;
+		}
+	} else {
+		hammer2_bulkfree_refs_destroy(hmp);
+	}
+	bfi->flags &= ~HAMMER2_BULKFREE_FULL;
+	staged = bfi->count_staged;
+
+	for (sbase = 0; sbase < hmp->voldata.volu_size;
+	     sbase = info.sstop) {
+		info.sbase = sbase;
+		info.sstop = sbase + (hammer2_off_t)nbmaps * HAMMER2_SEGSIZE;
+		bzero(info.bmap, nbmaps * sizeof(hammer2_bmap_data_t));
+
+		if (info.refs) {
+			hammer2_bulkfree_refs_to_bmap(&info);
+		} else {
+			error = hammer2_bulkfree_scan_base(&info,
+					sroot.blockref, HAMMER2_SET_COUNT,
+					HAMMER2_BULKFREE_OP_ADD);
+			error = hammer2_bulkfree_drain(&info, error);
+			if (error)
+				break;
+		}
+		++bfi->count_windows;
+
+		hammer2_trans_init(&trans, hmp->spmp, 0);
+		hammer2_freemap_bulkfree_merge(&trans, hmp, info.sbase,
+					       info.sstop, info.bmap, dostage,
+					       dofree, bfi);
+		if (info.sstop >= hmp->voldata.volu_size) {
+			hammer2_voldata_lock(hmp);
+			hammer2_voldata_modify(hmp);
+			hmp->voldata.bulkfree_tid = tid;
+			hammer2_voldata_unlock(hmp);
+		}
+		hammer2_trans_done(&trans);
+	}
+
+	/*
+	 * Restart the wait only if this pass staged new blocks.  A freeing
+	 * pass which covered the whole volume and staged nothing leaves no
+	 * staged blocks behind.
+	 */
+	if (bfi->count_staged != staged) {
+		hmp->bulkfree_stage_seq = hmp->volsync_seq;
+		hmp->bulkfree_staged = 1;
+	} else if (dofree && error == 0) {
+		hmp->bulkfree_staged = 0;
+	}
+done:
+	free(info.bmap, M_HAMMER2, 0);
+
+	return (error);
+}
+
+static
+void
+hammer2_bulkfree_thread(void *arg)
+{
+	hammer2_mount_t *hmp = arg;
+	hammer2_ioc_bulkfree_t bfi;
+	int throttle;
+	int error;
+	int req;
+
+	mtx_enter(&hmp->bulkfree_mtx);
+	while (hmp->bulkfree_stop == 0) {
+		/*
+		 * Wait for a request or for the interval to expire, timed
+		 * passes are throttled.
+		 */
+		throttle = 0;
+		if (hmp->bulkfree_req == hmp->bulkfree_done) {
+			error = mtxsleep(&hmp->bulkfree_req,
+					 &hmp->bulkfree_mtx, 0, "h2bulk",
+					 hammer2_bulkfree_interval * hz);
+			if (hmp->bulkfree_stop)
+				break;
+			if (hmp->bulkfree_req == hmp->bulkfree_done) {
+				if (error != EWOULDBLOCK ||
+				    hammer2_bulkfree_interval <= 0) {
+					continue;
+				}
+				throttle = 1;
+			}
+		}
+		req = hmp->bulkfree_req;
+		bzero(&bfi, sizeof(bfi));
+		bfi.size = throttle ? 0 : hmp->bulkfree_size;
+		bfi.flags = throttle ? 0 : hmp->bulkfree_flags;
+		mtx_leave(&hmp->bulkfree_mtx);
+
+		bfi.error = hammer2_bulkfree_pass(hmp, &bfi, throttle);
+
+		mtx_enter(&hmp->bulkfree_mtx);
+		hmp->bulkfree_stats = bfi;
+		hmp->bulkfree_done = req;
+		wakeup(&hmp->bulkfree_done);
+	}
+	hmp->bulkfree_run = 0;
+	wakeup(&hmp->bulkfree_run);
+	wakeup(&hmp->bulkfree_done);
+	mtx_leave(&hmp->bulkfree_mtx);
+
+	kthread_exit(0);
+}
+
+/*
+ * Called at mount time for read-write mounts, after recovery.
+ */
+void
+hammer2_bulkfree_start(hammer2_mount_t *hmp)
+{
+	mtx_init(&hmp->bulkfree_mtx, IPL_NONE);
+	hmp->bulkfree_stop = 0;
+	hmp->bulkfree_run = 1;
+	if (kthread_create(hammer2_bulkfree_thread, hmp, NULL, "h2bulk")) {
+		printf("hammer2: unable to start bulkfree thread\n");
+		hmp->bulkfree_run = 0;
+	}
+}
+
+/*
+ * Called at unmount time, aborts any pass in progress.
+ */
+void
+hammer2_bulkfree_stop(hammer2_mount_t *hmp)
+{
+	if (hmp->bulkfree_run == 0)
+		return;
+	mtx_enter(&hmp->bulkfree_mtx);
+	hmp->bulkfree_stop = 1;
+	wakeup(&hmp->bulkfree_req);
+	while (hmp->bulkfree_run) {
+		mtxsleep(&hmp->bulkfree_run, &hmp->bulkfree_mtx, 0,
+			 "h2bfstp", 0);
+	}
+	mtx_leave(&hmp->bulkfree_mtx);
+	hammer2_bulkfree_refs_destroy(hmp);
+}
+
+/*
+ * HAMMER2IOC_BULKFREE_SCAN.  Queue a pass to the bulk free thread and
+ * wait for it, returning its statistics.
+ */
+int
+hammer2_bulkfree_request(hammer2_mount_t *hmp, hammer2_ioc_bulkfree_t *bfi)
+{
+	int error = 0;
+	int req;
+
+	if (hmp->ronly)
+		return (EROFS);
+	if (hmp->bulkfree_run == 0)
+		return (EOPNOTSUPP);
+
+	mtx_enter(&hmp->bulkfree_mtx);
+	hmp->bulkfree_size = bfi->size;
+	hmp->bulkfree_flags = bfi->flags;
+	req = ++hmp->bulkfree_req;
+	wakeup(&hmp->bulkfree_req);
+	while (hmp->bulkfree_done - req < 0) {
+		if (hmp->bulkfree_run == 0) {
+			error = EINTR;
+			break;
+		}
+		error = mtxsleep(&hmp->bulkfree_done, &hmp->bulkfree_mtx,
+				 PCATCH, "h2bfwt", 0);
+		if (error)
+			break;
+	}
+	if (error == 0) {
+		*bfi = hmp->bulkfree_stats;
+		error = bfi->error;
+	}
+	mtx_leave(&hmp->bulkfree_mtx);
+
+	return (error);
+}
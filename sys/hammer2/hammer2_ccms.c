@@ -38,11 +38,13 @@
 #include <sys/param.h>
 #include <sys/systm.h>
 #include <sys/kernel.h>
+#include <sys/proc.h>
 #include <sys/malloc.h>
 #include <sys/objcache.h>
 #include <sys/sysctl.h>
 #include <sys/uio.h>
 #include <machine/limits.h>
+#include <machine/lock.h>
 #include <machine/mplock.h>
 
 #include "hammer2.h"
@@ -52,35 +54,9 @@
 int ccms_debug = 0;
 
 struct thread *curthread;
-struct thread *curthread2;
 
-int ssleep(const volatile void *, struct lock *, int, const char *, int);
 int lksleep(const volatile void *, struct lock *, int, const char *, int);
 
-/*
- * Interlocked spinlock sleep.  An exclusively held spinlock must
- * be passed to ssleep().  The function will atomically release the
- * spinlock and tsleep on the ident, then reacquire the spinlock and
- * return.
- *
- * This routine is fairly important along the critical path, so optimize it
- * heavily.
- */
-int
-ssleep(const volatile void *ident, struct lock *spin, int flags,
-       const char *wmesg, int timo)
-{
-        //globaldata_t gd = mycpu;
-        int error;
-
-        //tsleep_interlock(gd, ident, flags, 10);
-        //spin_unlock_quick(gd, spin);
-        error = tsleep(ident, flags , wmesg, timo);
-        //___mp_lock_quick(gd, spin, wmesg);
-
-        return (error);
-}
-
 int
 lksleep(const volatile void *ident, struct lock *lock, int flags,
         const char *wmesg, int timo)
@@ -126,7 +102,7 @@ ccms_cst_init(ccms_cst_t *cst, void *handle)
 void
 ccms_cst_uninit(ccms_cst_t *cst)
 {
-	KKASSERT(cst->count == 0);
+	KKASSERT(cst->lock == 0);
 	if (cst->state != CCMS_STATE_INVALID) {
 		/* XXX */
 	}
@@ -223,50 +199,158 @@ ccms_lock_put(ccms_lock_t *lock)
  *			    CST SUPPORT FUNCTIONS			*
  ************************************************************************/
 
+/*
+ * Threads sleeping on a cst interlock with one of a small set of hashed
+ * mutexes rather than a per-cst lock, keeping the cst small.  Only the
+ * slow paths touch them.
+ */
+#define CCMS_SLEEP_HSIZE	64		/* must be power of 2 */
+
+static struct mutex ccms_sleep_mtx[CCMS_SLEEP_HSIZE];
+
+int ccms_spin_max = 1000;	/* adaptive spin iterations before sleeping */
+
+void
+ccms_init(void)
+{
+	int i;
+
+	for (i = 0; i < CCMS_SLEEP_HSIZE; ++i)
+		mtx_init(&ccms_sleep_mtx[i], IPL_NONE);
+}
+
+static __inline struct mutex *
+ccms_sleep_mtx_get(ccms_cst_t *cst)
+{
+	return(&ccms_sleep_mtx[((uintptr_t)cst >> 6) &
+			       (CCMS_SLEEP_HSIZE - 1)]);
+}
+
+/*
+ * Called when lock state lv failed the caller's acquisition test.  While
+ * the exclusive owner is running on a cpu (or only shared holders are
+ * present) spin for a bounded number of iterations, otherwise set WAITING
+ * interlocked with the sleep mutex and sleep until a release wakes us.
+ * The caller retests the lock state on return.
+ */
+static
+void
+ccms_thread_wait(ccms_cst_t *cst, uint32_t lv, int *spinsp,
+		 const char *wmesg)
+{
+	struct mutex *mtx;
+	struct proc *td;
+
+	if (*spinsp < ccms_spin_max) {
+		td = cst->td;
+		if ((lv & CCMS_LK_EXCL) == 0 ||
+		    (td != NULL && td->p_stat == SONPROC)) {
+			++*spinsp;
+			SPINLOCK_SPIN_HOOK;
+			return;
+		}
+	}
+	mtx = ccms_sleep_mtx_get(cst);
+	mtx_enter(mtx);
+	if (atomic_cmpset_int(&cst->lock, lv, lv | CCMS_LK_WAITING))
+		msleep(cst, mtx, PNORELOCK, wmesg, 0);
+	else
+		mtx_leave(mtx);
+}
+
+/*
+ * Wake up all threads sleeping on the cst.  Called by a releasing thread
+ * which cleared CCMS_LK_WAITING.
+ */
+static
+void
+ccms_thread_wakeup(ccms_cst_t *cst)
+{
+	struct mutex *mtx;
+
+	mtx = ccms_sleep_mtx_get(cst);
+	mtx_enter(mtx);
+	wakeup(cst);
+	mtx_leave(mtx);
+}
+
+/*
+ * Release the exclusive lock state, also dropping an upgrade if upgraded.
+ * The owner fields must already have been cleared.
+ */
+static
+void
+ccms_thread_release_excl(ccms_cst_t *cst, uint32_t upg)
+{
+	uint32_t lv;
+
+	for (;;) {
+		lv = cst->lock;
+		KKASSERT((lv & CCMS_LK_EXCL) && (lv & CCMS_LK_UPGMASK) >= upg);
+		if (atomic_cmpset_int(&cst->lock, lv,
+				      (lv & ~(CCMS_LK_EXCL | CCMS_LK_WAITING)) -
+				      upg)) {
+			break;
+		}
+	}
+	if (lv & CCMS_LK_WAITING)
+		ccms_thread_wakeup(cst);
+}
+
 /*
  * Acquire local cache state & lock.  If the current thread already holds
  * the lock exclusively we bump the exclusive count, even if the thread is
  * trying to get a shared lock.
+ *
+ * Uncontended acquisitions are a single compare-and-set on cst->lock.
  */
 void
 ccms_thread_lock(ccms_cst_t *cst, ccms_state_t state)
 {
+	uint32_t lv;
+	int spins;
 
 	/*
 	 * Regardless of the type of lock requested if the current thread
 	 * already holds an exclusive lock we bump the exclusive count and
-	 * return.  This requires no spinlock.
+	 * return.  This requires no atomic op.
 	 */
 	LOCKENTER;
-	if (cst->count < 0 && cst->td == (struct proc *)curthread2) {
-		--cst->count;
+	if ((cst->lock & CCMS_LK_EXCL) && cst->td == curproc) {
+		++cst->count;
 		return;
 	}
 
-	/*
-	 * Otherwise use the spinlock to interlock the operation and sleep
-	 * as necessary.
-	 */
-	__mp_lock((struct __mp_lock *)&cst->spin); 
+	spins = 0;
 	if (state == CCMS_STATE_SHARED) {
-		while (cst->count < 0 || cst->upgrade) {
-			cst->blocked = 1;
-			ssleep(cst, NULL /* &cst->spin XX */, 0, "ccmslck", hz);
+		for (;;) {
+			lv = cst->lock;
+			if ((lv & (CCMS_LK_EXCL | CCMS_LK_UPGMASK)) == 0) {
+				KKASSERT((lv & CCMS_LK_SHMASK) !=
+					 CCMS_LK_SHMASK);
+				if (atomic_cmpset_int(&cst->lock, lv, lv + 1))
+					break;
+				continue;
+			}
+			ccms_thread_wait(cst, lv, &spins, "ccmslck");
 		}
-		++cst->count;
-		KKASSERT(cst->td == NULL);
 	} else if (state == CCMS_STATE_EXCLUSIVE) {
-		while (cst->count != 0 || cst->upgrade) {
-			cst->blocked = 1;
-			ssleep(cst, NULL /* &cst->spin */, 0, "ccmslck", hz);
+		for (;;) {
+			lv = cst->lock;
+			if ((lv & ~CCMS_LK_WAITING) == 0) {
+				if (atomic_cmpset_int(&cst->lock, lv,
+						      lv | CCMS_LK_EXCL)) {
+					break;
+				}
+				continue;
+			}
+			ccms_thread_wait(cst, lv, &spins, "ccmslck");
 		}
-		cst->count = -1;
-		/* proc ex lock */ /* XX cst->td = curthread2; */
+		cst->td = curproc;
+		cst->count = 1;
 	} else {
-		__mp_unlock((struct __mp_lock *)&cst->spin);
 		panic("ccms_thread_lock: bad state %d\n", state);
 	}
-	__mp_unlock((struct __mp_lock *)&cst->spin);
 }
 
 /*
@@ -276,32 +360,32 @@ ccms_thread_lock(ccms_cst_t *cst, ccms_state_t state)
 int
 ccms_thread_lock_nonblock(ccms_cst_t *cst, ccms_state_t state)
 {
-	if (cst->count < 0 /* XX && cst->td == curthread2 */) {
-		--cst->count;
+	uint32_t lv;
+
+	if ((cst->lock & CCMS_LK_EXCL) && cst->td == curproc) {
+		++cst->count;
 		LOCKENTER;
 		return(0);
 	}
 
-	__mp_lock((struct __mp_lock *)&cst->spin);
 	if (state == CCMS_STATE_SHARED) {
-		if (cst->count < 0 || cst->upgrade) {
-			__mp_unlock((struct __mp_lock *)&cst->spin);
-			return (EBUSY);
-		}
-		++cst->count;
-		KKASSERT(cst->td == NULL);
+		do {
+			lv = cst->lock;
+			if (lv & (CCMS_LK_EXCL | CCMS_LK_UPGMASK))
+				return (EBUSY);
+		} while (atomic_cmpset_int(&cst->lock, lv, lv + 1) == 0);
 	} else if (state == CCMS_STATE_EXCLUSIVE) {
-		if (cst->count != 0 || cst->upgrade) {
-			__mp_unlock((struct __mp_lock *)&cst->spin);
-			return (EBUSY);
-		}
-		cst->count = -1;
-		// XX cst->td = curthread;
+		do {
+			lv = cst->lock;
+			if (lv & ~CCMS_LK_WAITING)
+				return (EBUSY);
+		} while (atomic_cmpset_int(&cst->lock, lv,
+					   lv | CCMS_LK_EXCL) == 0);
+		cst->td = curproc;
+		cst->count = 1;
 	} else {
-		__mp_unlock((struct __mp_lock *)&cst->spin);
 		panic("ccms_thread_lock_nonblock: bad state %d\n", state);
 	}
-	__mp_unlock((struct __mp_lock *)&cst->spin);
 	LOCKENTER;
 	return(0);
 }
@@ -309,11 +393,11 @@ ccms_thread_lock_nonblock(ccms_cst_t *cst, ccms_state_t state)
 ccms_state_t
 ccms_thread_lock_temp_release(ccms_cst_t *cst)
 {
-	if (cst->count < 0) {
+	if (cst->lock & CCMS_LK_EXCL) {
 		ccms_thread_unlock(cst);
 		return(CCMS_STATE_EXCLUSIVE);
 	}
-	if (cst->count > 0) {
+	if (cst->lock & CCMS_LK_SHMASK) {
 		ccms_thread_unlock(cst);
 		return(CCMS_STATE_SHARED);
 	}
@@ -329,57 +413,81 @@ ccms_thread_lock_temp_restore(ccms_cst_t *cst, ccms_state_t ostate)
 /*
  * Temporarily upgrade a thread lock for making local structural changes.
  * No new shared or exclusive locks can be acquired by others while we are
- * upgrading, but other upgraders are allowed.
+ * upgrading, but other upgraders are allowed.  They obtain the exclusive
+ * lock one after the other.
  */
 ccms_state_t
 ccms_thread_lock_upgrade(ccms_cst_t *cst)
 {
+	uint32_t lv;
+	uint32_t nv;
+	int spins;
+
 	/*
 	 * Nothing to do if already exclusive
 	 */
-	if (cst->count < 0) {
-		// XXKKASSERT(cst->td == curthread);
+	if (cst->lock & CCMS_LK_EXCL) {
+		KKASSERT(cst->td == curproc);
 		return(CCMS_STATE_EXCLUSIVE);
 	}
 
 	/*
-	 * Convert a shared lock to exclusive.
+	 * Convert a shared lock to exclusive.  Our shared count becomes a
+	 * pending upgrade, which may let another upgrader proceed.
 	 */
-	if (cst->count > 0) {
-		__mp_lock((struct __mp_lock *)&cst->spin);
-		++cst->upgrade;
-		--cst->count;
-		while (cst->count) {
-			cst->blocked = 1;
-			ssleep(cst, NULL /* &cst->spin*/, 0, "ccmsupg", hz);
+	if ((cst->lock & CCMS_LK_SHMASK) == 0)
+		panic("ccms_thread_lock_upgrade: not locked");
+	for (;;) {
+		lv = cst->lock;
+		KKASSERT(lv & CCMS_LK_SHMASK);
+		nv = lv - 1 + CCMS_LK_UPGINC;
+		if ((nv & CCMS_LK_SHMASK) == 0)
+			nv &= ~CCMS_LK_WAITING;
+		if (atomic_cmpset_int(&cst->lock, lv, nv))
+			break;
+	}
+	if ((lv ^ nv) & CCMS_LK_WAITING)
+		ccms_thread_wakeup(cst);
+
+	spins = 0;
+	for (;;) {
+		lv = cst->lock;
+		if ((lv & (CCMS_LK_EXCL | CCMS_LK_SHMASK)) == 0) {
+			if (atomic_cmpset_int(&cst->lock, lv,
+					      lv | CCMS_LK_EXCL)) {
+				break;
+			}
+			continue;
 		}
-		cst->count = -1;
-		// XX cst->td = curthread;
-		__mp_unlock((struct __mp_lock *)&cst->spin);
-		return(CCMS_STATE_SHARED);
+		ccms_thread_wait(cst, lv, &spins, "ccmsupg");
 	}
-	panic("ccms_thread_lock_upgrade: not locked");
-	/* NOT REACHED */
-	return(0);
+	cst->td = curproc;
+	cst->count = 1;
+	return(CCMS_STATE_SHARED);
 }
 
 void
 ccms_thread_lock_downgrade(ccms_cst_t *cst, ccms_state_t ostate)
 {
+	uint32_t lv;
+
 	if (ostate == CCMS_STATE_SHARED) {
-		//KKASSERT(cst->td == curthread);
-		KKASSERT(cst->count == -1);
-		__mp_lock((struct __mp_lock *)&cst->spin);
-		--cst->upgrade;
-		cst->count = 1;
+		KKASSERT(cst->td == curproc && cst->count == 1);
 		cst->td = NULL;
-		if (cst->blocked) {
-			cst->blocked = 0;
-			__mp_unlock((struct __mp_lock *)&cst->spin);
-			wakeup(cst);
-		} else {
-			__mp_unlock((struct __mp_lock *)&cst->spin);
+		cst->count = 0;
+		for (;;) {
+			lv = cst->lock;
+			KKASSERT((lv & CCMS_LK_EXCL) &&
+				 (lv & CCMS_LK_UPGMASK));
+			if (atomic_cmpset_int(&cst->lock, lv,
+					      (lv & ~(CCMS_LK_EXCL |
+						      CCMS_LK_WAITING)) -
+					      CCMS_LK_UPGINC + 1)) {
+				break;
+			}
 		}
+		if (lv & CCMS_LK_WAITING)
+			ccms_thread_wakeup(cst);
 	}
 	/* else nothing to do if excl->excl */
 }
@@ -390,39 +498,39 @@ ccms_thread_lock_downgrade(ccms_cst_t *cst, ccms_state_t ostate)
 void
 ccms_thread_unlock(ccms_cst_t *cst)
 {
+	uint32_t lv;
+	uint32_t nv;
+
 	LOCKEXIT;
-	if (cst->count < 0) {
+	if (cst->lock & CCMS_LK_EXCL) {
 		/*
 		 * Exclusive
 		 */
-		//KKASSERT(cst->td == curthread);
-		if (cst->count < -1) {
-			++cst->count;
+		KKASSERT(cst->td == curproc);
+		if (cst->count > 1) {
+			--cst->count;
 			return;
 		}
-		__mp_lock((struct __mp_lock *)&cst->spin);
-		KKASSERT(cst->count == -1);
+		KKASSERT(cst->count == 1);
 		cst->count = 0;
 		cst->td = NULL;
-		if (cst->blocked) {
-			cst->blocked = 0;
-			__mp_unlock((struct __mp_lock *)&cst->spin);
-			wakeup(cst);
-			return;
-		}
-		__mp_unlock((struct __mp_lock *)&cst->spin);
-	} else if (cst->count > 0) {
+		ccms_thread_release_excl(cst, 0);
+	} else if (cst->lock & CCMS_LK_SHMASK) {
 		/*
-		 * Shared
+		 * Shared, waiters can only make progress once the last
+		 * shared holder is gone.
 		 */
-		__mp_lock((struct __mp_lock *)&cst->spin);
-		if (--cst->count == 0 && cst->blocked) {
-			cst->blocked = 0;
-			__mp_unlock((struct __mp_lock *)&cst->spin);
-			wakeup(cst);
-			return;
+		for (;;) {
+			lv = cst->lock;
+			KKASSERT(lv & CCMS_LK_SHMASK);
+			nv = lv - 1;
+			if ((nv & CCMS_LK_SHMASK) == 0)
+				nv &= ~CCMS_LK_WAITING;
+			if (atomic_cmpset_int(&cst->lock, lv, nv))
+				break;
 		}
-		__mp_unlock((struct __mp_lock *)&cst->spin);
+		if ((lv ^ nv) & CCMS_LK_WAITING)
+			ccms_thread_wakeup(cst);
 	} else {
 		panic("ccms_thread_unlock: bad zero count\n");
 	}
@@ -431,8 +539,8 @@ ccms_thread_unlock(ccms_cst_t *cst)
 void
 ccms_thread_lock_setown(ccms_cst_t *cst)
 {
-	KKASSERT(cst->count < 0);
-	// XX cst->td = curthread;
+	KKASSERT(cst->lock & CCMS_LK_EXCL);
+	cst->td = curproc;
 }
 
 /*
@@ -443,107 +551,21 @@ ccms_thread_unlock_upgraded(ccms_cst_t *cst, ccms_state_t ostate)
 {
 	if (ostate == CCMS_STATE_SHARED) {
 		LOCKEXIT;
-		// XX KKASSERT(cst->td == curthread);
-		KKASSERT(cst->count == -1);
-		__mp_lock((struct __mp_lock *)&cst->spin);
-		--cst->upgrade;
+		KKASSERT(cst->td == curproc && cst->count == 1);
 		cst->count = 0;
 		cst->td = NULL;
-		if (cst->blocked) {
-			cst->blocked = 0;
-			__mp_unlock((struct __mp_lock *)&cst->spin);
-			wakeup(cst);
-		} else {
-			__mp_unlock((struct __mp_lock *)&cst->spin);
-		}
+		ccms_thread_release_excl(cst, CCMS_LK_UPGINC);
 	} else {
 		ccms_thread_unlock(cst);
 	}
 }
 
-#if 0
-/*
- * Release a local thread lock with special handling of the last lock
- * reference.
- *
- * If no upgrades are in progress then the last reference to the lock will
- * upgrade the lock to exclusive (if it was shared) and return 0 without
- * unlocking it.
- *
- * If more than one reference remains, or upgrades are in progress,
- * we drop the reference and return non-zero to indicate that more
- * locks are present or pending.
- */
-int
-ccms_thread_unlock_zero(ccms_cst_t *cst)
-{
-	if (cst->count < 0) {
-		/*
-		 * Exclusive owned by us, no races possible as long as it
-		 * remains negative.  Return 0 and leave us locked on the
-		 * last lock.
-		 */
-		KKASSERT(cst->td == curthread);
-		if (cst->count == -1) {
-			__mp_lock(&cst->spin);
-			if (cst->upgrade) {
-				cst->count = 0;
-				if (cst->blocked) {
-					cst->blocked = 0;
-					__mp_unlock((struct __mp_lock *)&cst->spin);
-					wakeup(cst);
-				} else {
-					__mp_unlock((struct __mp_lock *)&cst->spin);
-				}
-				return(1);
-			}
-			__mp_unlock((struct __mp_lock *)&cst->spin);
-			return(0);
-		}
-		++cst->count;
-	} else {
-		/*
-		 * Convert the last shared lock to an exclusive lock
-		 * and return 0.
-		 *
-		 * If there are upgrades pending the cst is unlocked and
-		 * the upgrade waiters are woken up.  The upgrade count
-		 * prevents new exclusive holders for the duration.
-		 */
-		__mp_lock((struct __mp_lock *)&cst->spin);
-		KKASSERT(cst->count > 0);
-		if (cst->count == 1) {
-			if (cst->upgrade) {
-				cst->count = 0;
-				if (cst->blocked) {
-					cst->blocked = 0;
-					__mp_unlock((struct __mp_lock *)&cst->spin);
-					wakeup(cst);
-				} else {
-					__mp_unlock((struct __mp_lock *)&cst->spin);
-				}
-				return(1);
-			} else {
-				cst->count = -1;
-				cst->td = curthread;
-				__mp_unlock((struct __mp_lock *)&cst->spin);
-				return(0);
-			}
-		}
-		--cst->count;
-		__mp_unlock((struct __mp_lock *)&cst->spin);
-	}
-	return(1);
-}
-#endif
-
 int
 ccms_thread_lock_owned(ccms_cst_t *cst)
 {
-	return(cst->count < 0 /* && cst->td == curthread  XX */);
+	return((cst->lock & CCMS_LK_EXCL) && cst->td == curproc);
 }
 
-
 #if 0
 /*
  * Acquire remote grant state.  This routine can be used to upgrade or
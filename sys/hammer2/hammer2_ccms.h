@@ -187,8 +187,10 @@ struct ccms_lock {
  *
  * High level CST locks must be obtained top-down.
  *
- * count - Negative value indicates active exclusive lock, positive value
- *	   indicates active shared lock.
+ * lock  - Thread lock state word, see CCMS_LK_*.  Uncontended shared and
+ *	   exclusive acquisitions are a single atomic op on this word.
+ *
+ * count - Exclusive recursion depth, only modified by the owner (td).
  *
  * spin  - Structural spinlock, typically just one is held at a time.
  *	   However, to complement the top-down nature of the higher level
@@ -202,19 +204,30 @@ struct ccms_cst {
 	ccms_type_t	type;		/* CST type and flags */
 	uint8_t		unused02;
 	uint8_t		unused03;
-
-	ccms_tid_t	path_id;	/* rendezvous inode id */
-	ccms_tid_t	tid;		/* [meta]data versioning id */
-	ccms_key_t	key_beg;	/* key range (inclusive) */
-	ccms_key_t	key_end;	/* key range (inclusive) */
-
-	int32_t		upgrade;	/* upgrades pending */
-	int32_t		count;		/* active shared/exclusive count */
-	int32_t		blocked;	/* wakeup blocked on release */
-	struct proc *td;
-	/* XX FIX thread_t	td; */		/* if excl lock (count < 0) */
+	volatile uint32_t lock;		/* CCMS_LK_* */
+	int32_t		count;		/* exclusive recursion depth */
+	struct proc	*td;		/* exclusive owner */
 };
 
+/*
+ * CST thread lock state.  The shared count and the number of pending
+ * upgrades share the word with the exclusive and waiting flags so all
+ * state transitions are single compare-and-set operations.
+ *
+ * EXCL     - Held exclusively (including by a completed upgrade).
+ *
+ * WAITING  - Threads sleep on the cst.  The releasing thread clears the
+ *	      flag and issues the wakeup, see ccms_thread_wakeup().
+ *
+ * UPGRADE  - Shared holders converting to exclusive, blocks new shared
+ *	      and exclusive acquisitions but not other upgrades.
+ */
+#define CCMS_LK_EXCL		0x80000000U
+#define CCMS_LK_WAITING		0x40000000U
+#define CCMS_LK_UPGMASK		0x3FF00000U
+#define CCMS_LK_UPGINC		0x00100000U
+#define CCMS_LK_SHMASK		0x000FFFFFU
+
 /*
  * Domain management, contains a pseudo-root for the CCMS topology.
  */
@@ -232,6 +245,7 @@ typedef struct ccms_domain	ccms_domain_t;
  */
 #ifdef _KERNEL
 
+void ccms_init(void);
 void ccms_domain_init(ccms_domain_t *dom);
 void ccms_domain_uninit(ccms_domain_t *dom);
 void ccms_cst_init(ccms_cst_t *cst, void *handle);
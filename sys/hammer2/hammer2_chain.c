@@ -212,7 +212,7 @@ hammer2_chain_alloc(hammer2_mount_t *hmp, hammer2_pfsmount_t *pmp,
 		 * maintain a pmp association for per-mount memory tracking
 		 * purposes.  The pmp can be NULL.
 		 */
-		chain = malloc(sizeof(*chain), M_TEMP /* hmp->mchain */, M_WAITOK | M_ZERO);
+		chain = pool_get(&hammer2_chain_pool, PR_WAITOK | PR_ZERO);
 		break;
 	case HAMMER2_BREF_TYPE_VOLUME:
 	case HAMMER2_BREF_TYPE_FREEMAP:
@@ -342,12 +342,20 @@ static hammer2_chain_t *hammer2_chain_lastdrop(hammer2_chain_t *chain);
 void
 hammer2_chain_drop(hammer2_chain_t *chain)
 {
+	hammer2_mount_t *hmp = chain->hmp;
 	u_int refs;
 	u_int need = 0;
+	int trim;
 
 	if (hammer2_debug & 0x200000)
 		printf("drop");
 
+	/*
+	 * Evictions from hammer2_chain_lru_trim() are flagged RELEASE and
+	 * must not recurse back into the trim.
+	 */
+	trim = (chain->flags & HAMMER2_CHAIN_RELEASE) == 0;
+
 	if (chain->flags & HAMMER2_CHAIN_UPDATE)
 		++need;
 	if (chain->flags & HAMMER2_CHAIN_MODIFIED)
@@ -367,6 +375,133 @@ hammer2_chain_drop(hammer2_chain_t *chain)
 			/* retry the same chain */
 		}
 	}
+
+	/*
+	 * Keep the LRU of retained clean chains bounded.
+	 */
+	if (trim && hmp && hmp->chain_lru_count > hammer2_chain_lru_max)
+		hammer2_chain_lru_trim(hmp, hammer2_chain_lru_max);
+}
+
+/*
+ * Clean, unreferenced inode and indirect block chains are retained on
+ * their parent's rbtree and queued on a per-mount LRU instead of being
+ * destroyed, so a subsequent lookup finds the existing chain (including
+ * its TESTEDGOOD state) rather than allocating a new one.
+ *
+ * Chains which are modified, deleted, flushing, still holding a dio, or
+ * hinted with HAMMER2_CHAIN_RELEASE are never retained.
+ */
+static __inline
+int
+hammer2_chain_lru_ok(hammer2_chain_t *chain)
+{
+	if (hammer2_chain_lru_max <= 0 || chain->parent == NULL)
+		return 0;
+	if (chain->bref.type != HAMMER2_BREF_TYPE_INODE &&
+	    chain->bref.type != HAMMER2_BREF_TYPE_INDIRECT) {
+		return 0;
+	}
+	if ((chain->flags & (HAMMER2_CHAIN_ONRBTREE |
+			     HAMMER2_CHAIN_ALLOCATED)) !=
+	    (HAMMER2_CHAIN_ONRBTREE | HAMMER2_CHAIN_ALLOCATED)) {
+		return 0;
+	}
+	if (chain->flags & (HAMMER2_CHAIN_DELETED |
+			    HAMMER2_CHAIN_MODIFIED |
+			    HAMMER2_CHAIN_UPDATE |
+			    HAMMER2_CHAIN_INITIAL |
+			    HAMMER2_CHAIN_RELEASE |
+			    HAMMER2_CHAIN_DESTROY |
+			    HAMMER2_CHAIN_PFSBOUNDARY |
+			    HAMMER2_CHAIN_ONFLUSH)) {
+		return 0;
+	}
+	if (chain->dio)
+		return 0;
+	return 1;
+}
+
+/*
+ * Queue (or requeue) chain at the tail of the LRU and make the 1->0
+ * transition.  The caller holds the last ref.  Both steps are done
+ * under the LRU mutex so hammer2_chain_lru_trim() never sees a queued
+ * chain in the middle of its last drop.
+ *
+ * Returns 0 on success.  On failure the chain has been re-referenced
+ * and is left queued, it will be requeued again on its next last drop.
+ */
+static int
+hammer2_chain_lru_put(hammer2_mount_t *hmp, hammer2_chain_t *chain)
+{
+	int error;
+
+	mtx_enter(&hmp->chain_lru_mtx);
+	if (chain->flags & HAMMER2_CHAIN_ONLRU) {
+		TAILQ_REMOVE(&hmp->chain_lru, chain, lru_node);
+		++hammer2_chain_lru_hits;
+	} else {
+		atomic_set_int(&chain->flags, HAMMER2_CHAIN_ONLRU);
+		++hmp->chain_lru_count;
+	}
+	TAILQ_INSERT_TAIL(&hmp->chain_lru, chain, lru_node);
+	error = atomic_cmpset_int(&chain->refs, 1, 0) ? 0 : EAGAIN;
+	mtx_leave(&hmp->chain_lru_mtx);
+
+	return (error);
+}
+
+/*
+ * Remove chain from the LRU, if queued, prior to destroying it.
+ */
+static void
+hammer2_chain_lru_remove(hammer2_mount_t *hmp, hammer2_chain_t *chain)
+{
+	mtx_enter(&hmp->chain_lru_mtx);
+	if (chain->flags & HAMMER2_CHAIN_ONLRU) {
+		TAILQ_REMOVE(&hmp->chain_lru, chain, lru_node);
+		atomic_clear_int(&chain->flags, HAMMER2_CHAIN_ONLRU);
+		--hmp->chain_lru_count;
+	}
+	mtx_leave(&hmp->chain_lru_mtx);
+}
+
+/*
+ * Release LRU chains, oldest first, until no more than (limit) remain.
+ * A limit of 0 purges the LRU (unmount).
+ *
+ * The 0->1 transition is made while the chain is still queued and the
+ * LRU mutex is held, which interlocks against hammer2_chain_lastdrop()
+ * destroying the chain underneath us.  Chains which are currently
+ * referenced are rotated to the tail and stay queued, so a chain can
+ * never end up with 0 refs on its parent's rbtree without being on the
+ * LRU.  Each chain is examined at most once per call.
+ */
+void
+hammer2_chain_lru_trim(hammer2_mount_t *hmp, int limit)
+{
+	hammer2_chain_t *chain;
+	int scan;
+
+	mtx_enter(&hmp->chain_lru_mtx);
+	scan = hmp->chain_lru_count;
+	while (hmp->chain_lru_count > limit && scan-- > 0) {
+		chain = TAILQ_FIRST(&hmp->chain_lru);
+		KKASSERT(chain != NULL);
+		TAILQ_REMOVE(&hmp->chain_lru, chain, lru_node);
+		if (atomic_cmpset_int(&chain->refs, 0, 1) == 0) {
+			TAILQ_INSERT_TAIL(&hmp->chain_lru, chain, lru_node);
+			continue;
+		}
+		atomic_clear_int(&chain->flags, HAMMER2_CHAIN_ONLRU);
+		--hmp->chain_lru_count;
+		mtx_leave(&hmp->chain_lru_mtx);
+		atomic_set_int(&chain->flags, HAMMER2_CHAIN_RELEASE);
+		++hammer2_chain_lru_evicted;
+		hammer2_chain_drop(chain);
+		mtx_enter(&hmp->chain_lru_mtx);
+	}
+	mtx_leave(&hmp->chain_lru_mtx);
 }
 
 /*
@@ -434,6 +569,23 @@ hammer2_chain_lastdrop(hammer2_chain_t *chain)
 	pmp = chain->pmp;	/* can be NULL */
 	rdrop = NULL;
 
+	/*
+	 * Clean chains may be retained on the parent's rbtree with 0 refs
+	 * and queued on the LRU.  The chain is queued and the 1->0
+	 * transition made under the LRU mutex so hammer2_chain_lru_trim()
+	 * can always find it.
+	 *
+	 * NOTE: We return (chain) on failure to retry, leaving it queued.
+	 */
+	if (hammer2_chain_lru_ok(chain)) {
+		__mp_unlock((struct __mp_lock *)&chain->core.cst.spin);
+		if (hammer2_chain_lru_put(hmp, chain) == 0)
+			chain = NULL;	/* success */
+		return(chain);
+	}
+	if (chain->flags & HAMMER2_CHAIN_ONLRU)
+		hammer2_chain_lru_remove(hmp, chain);
+
 	/*
 	 * Spinlock the parent and try to drop the last ref on chain.
 	 * On success remove chain from its parent, otherwise return NULL.
@@ -486,8 +638,7 @@ hammer2_chain_lastdrop(hammer2_chain_t *chain)
 	__mp_unlock((struct __mp_lock *)&chain->core.cst.spin);
 	KKASSERT(RB_EMPTY(&chain->core.rbtree) &&
 		 chain->core.chain_count == 0);
-	KKASSERT(chain->core.cst.count == 0);
-	KKASSERT(chain->core.cst.upgrade == 0);
+	KKASSERT(chain->core.cst.lock == 0);
 
 	/*
 	 * All spin locks are gone, finish freeing stuff.
@@ -507,7 +658,7 @@ hammer2_chain_lastdrop(hammer2_chain_t *chain)
 	if (chain->flags & HAMMER2_CHAIN_ALLOCATED) {
 		chain->flags &= ~HAMMER2_CHAIN_ALLOCATED;
 		chain->hmp = NULL;
-		free(chain, M_TEMP /* hmp->mchain*/, 0);
+		pool_put(&hammer2_chain_pool, chain);
 	}
 
 	/*
@@ -587,6 +738,7 @@ hammer2_chain_lock(hammer2_chain_t *chain, int how)
 	hammer2_blockref_t *bref;
 	ccms_state_t ostate;
 	char *bdata;
+	u_long mask;
 	int error;
 
 	/*
@@ -710,7 +862,19 @@ hammer2_chain_lock(hammer2_chain_t *chain, int how)
 		 * cache, which might not be true (need biodep on flush
 		 * to calculate crc?  or simple crc?).
 		 */
+	} else if (chain->flags & HAMMER2_CHAIN_TESTEDGOOD) {
+		/*
+		 * Already tested while the chain was retained.
+		 */
+		++hammer2_check_skipped;
+	} else if (hammer2_io_crc_good(chain, &mask)) {
+		/*
+		 * Already tested since the buffer was loaded.
+		 */
+		++hammer2_check_skipped;
+		atomic_set_int(&chain->flags, HAMMER2_CHAIN_TESTEDGOOD);
 	} else {
+		++hammer2_check_verified;
 		if (hammer2_chain_testcheck(chain, bdata) == 0) {
 			printf("chain %016x.%02x meth=%02x CHECK FAIL %08x (flags=%08x)\n",
 				(unsigned int)chain->bref.data_off,
@@ -718,6 +882,10 @@ hammer2_chain_lock(hammer2_chain_t *chain, int how)
 				chain->bref.methods,
 				hammer2_icrc32(bdata, chain->bytes),
 				(unsigned int)chain->flags);
+		} else {
+			hammer2_io_crc_setmask(chain->dio, mask);
+			atomic_set_int(&chain->flags,
+				       HAMMER2_CHAIN_TESTEDGOOD);
 		}
 	}
 
@@ -1145,6 +1313,7 @@ hammer2_chain_modify(hammer2_trans_t *trans, hammer2_chain_t *chain, int flags)
 	char *bdata;
 
 	hmp = chain->hmp;
+	atomic_clear_int(&chain->flags, HAMMER2_CHAIN_TESTEDGOOD);
 
 	/*
 	 * data is not optional for freemap chains (we must always be sure
@@ -1526,6 +1695,11 @@ hammer2_chain_get(hammer2_chain_t *parent, int generation,
 	hammer2_chain_core_alloc(NULL, chain);
 	/* ref'd chain returned */
 
+	if (bref->type == HAMMER2_BREF_TYPE_INODE ||
+	    bref->type == HAMMER2_BREF_TYPE_INDIRECT) {
+		++hammer2_chain_lru_misses;
+	}
+
 	/*
 	 * Flag that the chain is in the parent's blockmap so delete/flush
 	 * knows what to do with it.
@@ -1790,12 +1964,16 @@ again:
 				      key_beg, key_end,
 				      &bref);
 	generation = parent->core.generation;
+	if (chain)
+		hammer2_chain_ref(chain);
+	else if (bref)
+		bcopy = *bref;
+	__mp_unlock((struct __mp_lock *)&parent->core.cst.spin);
 
 	/*
 	 * Exhausted parent chain, iterate.
 	 */
 	if (bref == NULL) {
-		__mp_unlock((struct __mp_lock *)&parent->core.cst.spin);
 		if (key_beg == key_end)	/* short cut single-key case */
 			return (NULL);
 
@@ -1820,11 +1998,9 @@ again:
 	}
 
 	/*
-	 * Selected from blockref or in-memory chain.
+	 * Selected from blockref or in-memory chain (already referenced).
 	 */
 	if (chain == NULL) {
-		bcopy = *bref;
-		__mp_unlock((struct __mp_lock *)&parent->core.cst.spin);
 		chain = hammer2_chain_get(parent, generation,
 					  &bcopy);
 		if (chain == NULL) {
@@ -1836,9 +2012,6 @@ again:
 			hammer2_chain_drop(chain);
 			goto again;
 		}
-	} else {
-		hammer2_chain_ref(chain);
-		__mp_unlock((struct __mp_lock *)&parent->core.cst.spin);
 	}
 
 	/*
@@ -3407,6 +3580,24 @@ hammer2_chain_delete(hammer2_trans_t *trans, hammer2_chain_t *parent,
 	}
 }
 
+/*
+ * Number of elements the sequential scan in hammer2_base_find() may skip
+ * from *cache_indexp before a binary search is used instead.
+ */
+#define HAMMER2_BASE_SEQSCAN	8
+
+/*
+ * Returns non-zero if the (non-empty) blockref ends before key_beg.
+ */
+static __inline int
+hammer2_base_before(hammer2_blockref_t *scan, hammer2_key_t key_beg)
+{
+	hammer2_key_t scan_end;
+
+	scan_end = scan->key + ((hammer2_key_t)1 << scan->keybits) - 1;
+	return (scan->key <= key_beg && scan_end < key_beg);
+}
+
 /*
  * Returns the index of the nearest element in the blockref array >= elm.
  * Returns (count) if no element could be found.
@@ -3419,6 +3610,12 @@ hammer2_chain_delete(hammer2_trans_t *trans, hammer2_chain_t *parent,
  * (*cache_indexp) is a heuristic and can be any value without effecting
  * the result.
  *
+ * The live elements are sorted and do not overlap but may be interleaved
+ * with empty elements.  Unless the sequential case applies the starting
+ * point is located with a binary search over the live portion, an empty
+ * probe is resolved with the next non-empty element, whose ordering the
+ * empty elements in between share.
+ *
  * WARNING!  Must be called with parent's spinlock held.  Spinlock remains
  *	     held through the operation.
  */
@@ -3431,6 +3628,9 @@ hammer2_base_find(hammer2_chain_t *parent,
 	hammer2_blockref_t *scan;
 	hammer2_key_t scan_end;
 	int i;
+	int j;
+	int lo;
+	int hi;
 	int limit;
 
 	/*
@@ -3447,7 +3647,9 @@ hammer2_base_find(hammer2_chain_t *parent,
 
 	/*
 	 * Sequential optimization using *cache_indexp.  This is the most
-	 * likely scenario.
+	 * likely scenario.  If the cached element does not start beyond
+	 * key_beg no earlier element can match, and if the match is not
+	 * too far ahead we scan forwards from there.
 	 *
 	 * We can avoid trailing empty entries on live chains, otherwise
 	 * we might have to check the whole block array.
@@ -3461,15 +3663,37 @@ hammer2_base_find(hammer2_chain_t *parent,
 		i = 0;
 	KKASSERT(i < count);
 
+	lo = 0;
+	hi = limit;
+	scan = &base[i];
+	if (scan->type != 0 && scan->key <= key_beg) {
+		lo = i;
+		j = i + HAMMER2_BASE_SEQSCAN;
+		if (j >= limit || base[j].type == 0 ||
+		    hammer2_base_before(&base[j], key_beg) == 0) {
+			hi = i;
+		} else {
+			lo = j + 1;
+		}
+	} else if (scan->type != 0) {
+		hi = i;
+	}
+
 	/*
-	 * Search backwards
+	 * Binary search [lo, hi) for the first element which does not end
+	 * before key_beg.
 	 */
-	scan = &base[i];
-	while (i > 0 && (scan->type == 0 || scan->key > key_beg)) {
-		--scan;
-		--i;
+	while (lo < hi) {
+		i = lo + (hi - lo) / 2;
+		for (j = i; j < hi && base[j].type == 0; ++j)
+			;
+		if (j < hi && hammer2_base_before(&base[j], key_beg))
+			lo = j + 1;
+		else
+			hi = i;
 	}
-	*cache_indexp = i;
+	i = lo;
+	scan = &base[i];
 
 	/*
 	 * Search forwards, stop when we find a scan element which
@@ -3881,18 +4105,39 @@ hammer2_chain_setcheck(hammer2_chain_t *chain, void *bdata)
 {
 	chain->bref.flags &= ~HAMMER2_BREF_FLAG_ZERO;
 
-	switch(HAMMER2_DEC_CHECK(chain->bref.methods)) {
+	/*
+	 * The data is changing under a new check code, any prior test
+	 * result for this range no longer applies.
+	 */
+	if (chain->dio) {
+		hammer2_io_crc_clrmask(chain->dio, chain->bref.data_off,
+				       chain->bytes);
+	}
+	hammer2_bref_setcheck(&chain->bref, bdata, chain->bytes);
+}
+
+/*
+ * Calculate the check code for bytes of bdata into bref->check according
+ * to the check method in bref->methods.  Does not require a chain, which
+ * allows the compression workers to precompute file data check codes.
+ */
+void
+hammer2_bref_setcheck(hammer2_blockref_t *bref, void *bdata, int bytes)
+{
+	switch(HAMMER2_DEC_CHECK(bref->methods)) {
 	case HAMMER2_CHECK_NONE:
 		break;
 	case HAMMER2_CHECK_DISABLED:
 		break;
 	case HAMMER2_CHECK_ISCSI32:
-		chain->bref.check.iscsi32.value =
-			hammer2_icrc32(bdata, chain->bytes);
+		bref->check.iscsi32.value = hammer2_icrc32(bdata, bytes);
 		break;
 	case HAMMER2_CHECK_CRC64:
-		chain->bref.check.crc64.value = 0;
-		/* XXX */
+		bref->check.crc64.value = hammer2_icrc64(bdata, bytes);
+		break;
+	case HAMMER2_CHECK_XXH3:
+		hammer2_xxh3_128(bdata, bytes, bref->check.xxh3.value);
+		bref->check.xxh3.unused = 0;
 		break;
 	case HAMMER2_CHECK_SHA192:
 		{
@@ -3903,21 +4148,20 @@ hammer2_chain_setcheck(hammer2_chain_t *chain, void *bdata)
 			} u;
 
 			HMAC_SHA256_Init(&hash_ctx, "\x0b\x0b\x0b\x0b\x0b\x0b\x0b\x0b\x0b\x0b\x0b\x0b\x0b\x0b\x0b\x0b", 16);
-			HMAC_SHA256_Update(&hash_ctx, bdata, chain->bytes);
+			HMAC_SHA256_Update(&hash_ctx, bdata, bytes);
 			HMAC_SHA256_Final(u.digest, &hash_ctx);
 			u.digest64[2] ^= u.digest64[3];
 			bcopy(u.digest,
-			      chain->bref.check.sha192.data,
-			      sizeof(chain->bref.check.sha192.data));
+			      bref->check.sha192.data,
+			      sizeof(bref->check.sha192.data));
 		}
 		break;
 	case HAMMER2_CHECK_FREEMAP:
-		chain->bref.check.freemap.icrc32 =
-			hammer2_icrc32(bdata, chain->bytes);
+		bref->check.freemap.icrc32 = hammer2_icrc32(bdata, bytes);
 		break;
 	default:
-		printf("hammer2_chain_setcheck: unknown check type %02x\n",
-			chain->bref.methods);
+		printf("hammer2_bref_setcheck: unknown check type %02x\n",
+			bref->methods);
 		break;
 	}
 }
@@ -3942,8 +4186,17 @@ hammer2_chain_testcheck(hammer2_chain_t *chain, void *bdata)
 		     hammer2_icrc32(bdata, chain->bytes));
 		break;
 	case HAMMER2_CHECK_CRC64:
-		r = (chain->bref.check.crc64.value == 0);
-		/* XXX */
+		r = (chain->bref.check.crc64.value ==
+		     hammer2_icrc64(bdata, chain->bytes));
+		break;
+	case HAMMER2_CHECK_XXH3:
+		{
+			uint64_t xv[2];
+
+			hammer2_xxh3_128(bdata, chain->bytes, xv);
+			r = (chain->bref.check.xxh3.value[0] == xv[0] &&
+			     chain->bref.check.xxh3.value[1] == xv[1]);
+		}
 		break;
 	case HAMMER2_CHECK_SHA192:
 		{
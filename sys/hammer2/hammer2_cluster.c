@@ -57,6 +57,45 @@
 
 struct uuid *kern_uuidgen(struct uuid *store, size_t count);
 
+/*
+ * Allocate a zero'd temporary cluster with room for (nslots) chains.  The
+ * array[] and cache_index[] storage trails the structure.  Single-node
+ * clusters, the common case, come from hammer2_cluster_pool.
+ */
+static hammer2_cluster_t *
+hammer2_cluster_new(hammer2_pfsmount_t *pmp, int nslots)
+{
+	hammer2_cluster_t *cluster;
+
+	if (nslots < 1)
+		nslots = 1;
+	KKASSERT(nslots <= HAMMER2_MAXCLUSTER);
+	if (nslots == 1) {
+		cluster = pool_get(&hammer2_cluster_pool,
+				   PR_WAITOK | PR_ZERO);
+	} else {
+		cluster = malloc(HAMMER2_CLUSTER_BYTES(nslots), M_HAMMER2,
+				 M_WAITOK | M_ZERO);
+	}
+	cluster->nslots = nslots;
+	cluster->array = (hammer2_chain_t **)(cluster + 1);
+	cluster->cache_index = (int *)(cluster->array + nslots);
+	cluster->pmp = pmp;			/* can be NULL */
+
+	return (cluster);
+}
+
+static void
+hammer2_cluster_free(hammer2_cluster_t *cluster)
+{
+	KKASSERT((cluster->flags & HAMMER2_CLUSTER_INODE) == 0);
+	cluster->focus = NULL;
+	if (cluster->nslots == 1)
+		pool_put(&hammer2_cluster_pool, cluster);
+	else
+		free(cluster, M_HAMMER2, 0);
+}
+
 /*
  * Returns TRUE if any chain in the cluster needs to be resized.
  */
@@ -171,11 +210,10 @@ hammer2_cluster_from_chain(hammer2_chain_t *chain)
 {
 	hammer2_cluster_t *cluster;
 
-	cluster = malloc(sizeof(*cluster), M_HAMMER2, M_WAITOK | M_ZERO);
+	cluster = hammer2_cluster_new(chain->pmp, 1);
 	cluster->array[0] = chain;
 	cluster->nchains = 1;
 	cluster->focus = chain;
-	cluster->pmp = chain->pmp;
 	cluster->refs = 1;
 
 	return cluster;
@@ -225,10 +263,10 @@ hammer2_cluster_alloc(hammer2_pfsmount_t *pmp,
 		      bref->type);
 	}
 
-	cluster = malloc(sizeof(*cluster), M_HAMMER2, M_WAITOK | M_ZERO);
+	rcluster = &pmp->iroot->cluster;
+	cluster = hammer2_cluster_new(pmp, rcluster->nchains);
 	cluster->refs = 1;
 
-	rcluster = &pmp->iroot->cluster;
 	for (i = 0; i < rcluster->nchains; ++i) {
 		chain = hammer2_chain_alloc(rcluster->array[i]->hmp,
 					    pmp, trans, bref);
@@ -248,7 +286,6 @@ hammer2_cluster_alloc(hammer2_pfsmount_t *pmp,
 		cluster->array[i] = chain;
 	}
 	cluster->nchains = i;
-	cluster->pmp = pmp;
 	cluster->focus = cluster->array[0];
 
 	return (cluster);
@@ -294,8 +331,7 @@ hammer2_cluster_drop(hammer2_cluster_t *cluster)
 		}
 	}
 	if (atomic_fetchadd_int(&cluster->refs, -1) == 1) {
-		cluster->focus = NULL;
-		free(cluster, M_HAMMER2, 0);
+		hammer2_cluster_free(cluster);
 		/* cluster = NULL; safety */
 	}
 }
@@ -349,6 +385,7 @@ hammer2_cluster_replace(hammer2_cluster_t *dst, hammer2_cluster_t *src)
 	int i;
 
 	KKASSERT(dst->refs == 1);
+	KKASSERT(src->nchains <= dst->nslots);
 	dst->focus = NULL;
 
 	for (i = 0; i < src->nchains; ++i) {
@@ -388,6 +425,7 @@ hammer2_cluster_replace_locked(hammer2_cluster_t *dst, hammer2_cluster_t *src)
 	int i;
 
 	KKASSERT(dst->refs == 1);
+	KKASSERT(src->nchains <= dst->nslots);
 
 	dst->focus = NULL;
 	for (i = 0; i < src->nchains; ++i) {
@@ -437,8 +475,7 @@ hammer2_cluster_copy(hammer2_cluster_t *ocluster, int copy_flags)
 	hammer2_chain_t *chain;
 	int i;
 
-	ncluster = malloc(sizeof(*ncluster), M_HAMMER2, M_WAITOK | M_ZERO);
-	ncluster->pmp = pmp;
+	ncluster = hammer2_cluster_new(pmp, ocluster->nchains);
 	ncluster->nchains = ocluster->nchains;
 	ncluster->refs = (copy_flags & HAMMER2_CLUSTER_COPY_NOREF) ? 0 : 1;
 	if ((copy_flags & HAMMER2_CLUSTER_COPY_NOCHAINS) == 0) {
@@ -475,8 +512,7 @@ hammer2_cluster_unlock(hammer2_cluster_t *cluster)
 		}
 	}
 	if (atomic_fetchadd_int(&cluster->refs, -1) == 1) {
-		cluster->focus = NULL;
-		free(cluster, M_HAMMER2, 0);
+		hammer2_cluster_free(cluster);
 		/* cluster = NULL; safety */
 	}
 }
@@ -616,8 +652,7 @@ hammer2_cluster_lookup_init(hammer2_cluster_t *cparent, int flags)
 	hammer2_cluster_t *cluster;
 	int i;
 
-	cluster = malloc(sizeof(*cluster), M_HAMMER2, M_WAITOK | M_ZERO);
-	cluster->pmp = cparent->pmp;			/* can be NULL */
+	cluster = hammer2_cluster_new(cparent->pmp, cparent->nchains);
 	/* cluster->focus = NULL; already null */
 
 	for (i = 0; i < cparent->nchains; ++i) {
@@ -675,8 +710,7 @@ hammer2_cluster_lookup(hammer2_cluster_t *cparent, hammer2_key_t *key_nextp,
 	bref_keybits = 0;
 	bytes = 0;
 
-	cluster = malloc(sizeof(*cluster), M_HAMMER2, M_WAITOK | M_ZERO);
-	cluster->pmp = pmp;				/* can be NULL */
+	cluster = hammer2_cluster_new(pmp, cparent->nchains);
 	cluster->refs = 1;
 	/* cluster->focus = NULL; already null */
 	cparent->focus = NULL;
@@ -855,9 +889,7 @@ hammer2_cluster_create(hammer2_trans_t *trans, hammer2_cluster_t *cparent,
 	pmp = trans->pmp;				/* can be NULL */
 
 	if ((cluster = *clusterp) == NULL) {
-		cluster = malloc(sizeof(*cluster), M_HAMMER2,
-				  M_WAITOK | M_ZERO);
-		cluster->pmp = pmp;			/* can be NULL */
+		cluster = hammer2_cluster_new(pmp, cparent->nchains);
 		cluster->refs = 1;
 	}
 	cluster->focus = NULL;
@@ -0,0 +1,374 @@
+/*
+ * Copyright (c) 2013-2014 The DragonFly Project.  All rights reserved.
+ *
+ * This code is derived from software contributed to The DragonFly Project
+ * by Matthew Dillon <dillon@dragonflybsd.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ * 3. Neither the name of The DragonFly Project nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific, prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "hammer2.h"
+#include "hammer2_zstd.h"
+
+/*
+ * Per-cpu pools of compression scratch objects.
+ *
+ * Each cpu has its own free list protected by its own mutex, so
+ * concurrent compressors and decompression callbacks on different cpus
+ * do not contend.  A get which finds its own list empty steals from the
+ * other cpus before falling back to malloc, and a put which would push a
+ * cpu's list over HAMMER2_COMP_PERCPU_MAX frees the object instead.
+ *
+ * The objects themselves are not bound to a cpu, the caller owns the
+ * scratch (and its zlib streams) until it is put back and may block
+ * while holding it.
+ */
+struct hammer2_comp_pcpu {
+	struct mutex	mtx;
+	SLIST_HEAD(, hammer2_comp_scratch) list;
+	int		count;
+} __aligned(64);
+
+static struct hammer2_comp_pcpu *hammer2_comp_pcpu;
+static int hammer2_comp_ncpus;
+
+static hammer2_comp_scratch_t *
+hammer2_comp_alloc(void)
+{
+	hammer2_comp_scratch_t *scr;
+
+	scr = malloc(sizeof(*scr), M_HAMMER2, M_WAITOK | M_ZERO);
+	scr->buf = malloc(HAMMER2_PBUFSIZE, M_HAMMER2, M_WAITOK);
+
+	return (scr);
+}
+
+static void
+hammer2_comp_free(hammer2_comp_scratch_t *scr)
+{
+	if (scr->zdef_level)
+		deflateEnd(&scr->zdef);
+	if (scr->zinf_init)
+		inflateEnd(&scr->zinf);
+	if (scr->zstd_cwrk)
+		free(scr->zstd_cwrk, M_HAMMER2, 0);
+	if (scr->zstd_dwrk)
+		free(scr->zstd_dwrk, M_HAMMER2, 0);
+	free(scr->buf, M_HAMMER2, 0);
+	free(scr, M_HAMMER2, 0);
+}
+
+static __inline struct hammer2_comp_pcpu *
+hammer2_comp_mycpu(void)
+{
+	return (&hammer2_comp_pcpu[cpu_number() % hammer2_comp_ncpus]);
+}
+
+/*
+ * Called from hammer2_vfs_init().  Preload every cpu's free list so
+ * the compressed I/O paths never allocate in steady state.
+ */
+void
+hammer2_comp_init(void)
+{
+	struct hammer2_comp_pcpu *pc;
+	hammer2_comp_scratch_t *scr;
+	int i;
+	int j;
+
+	hammer2_comp_ncpus = ncpus;
+	hammer2_comp_pcpu = malloc(sizeof(*pc) * hammer2_comp_ncpus,
+				   M_HAMMER2, M_WAITOK | M_ZERO);
+	for (i = 0; i < hammer2_comp_ncpus; ++i) {
+		pc = &hammer2_comp_pcpu[i];
+		mtx_init(&pc->mtx, IPL_NONE);
+		SLIST_INIT(&pc->list);
+		for (j = 0; j < HAMMER2_COMP_PERCPU; ++j) {
+			scr = hammer2_comp_alloc();
+			SLIST_INSERT_HEAD(&pc->list, scr, entry);
+			++pc->count;
+		}
+	}
+}
+
+void
+hammer2_comp_uninit(void)
+{
+	struct hammer2_comp_pcpu *pc;
+	hammer2_comp_scratch_t *scr;
+	int i;
+
+	if (hammer2_comp_pcpu == NULL)
+		return;
+	for (i = 0; i < hammer2_comp_ncpus; ++i) {
+		pc = &hammer2_comp_pcpu[i];
+		while ((scr = SLIST_FIRST(&pc->list)) != NULL) {
+			SLIST_REMOVE_HEAD(&pc->list, entry);
+			--pc->count;
+			hammer2_comp_free(scr);
+		}
+		KKASSERT(pc->count == 0);
+	}
+	free(hammer2_comp_pcpu, M_HAMMER2, 0);
+	hammer2_comp_pcpu = NULL;
+}
+
+/*
+ * Obtain a scratch object, preferring the current cpu's free list.
+ */
+hammer2_comp_scratch_t *
+hammer2_comp_get(void)
+{
+	struct hammer2_comp_pcpu *pc;
+	hammer2_comp_scratch_t *scr;
+	int cpu;
+	int i;
+
+	cpu = cpu_number() % hammer2_comp_ncpus;
+	for (i = 0; i < hammer2_comp_ncpus; ++i) {
+		pc = &hammer2_comp_pcpu[(cpu + i) % hammer2_comp_ncpus];
+		if (SLIST_EMPTY(&pc->list))
+			continue;
+		mtx_enter(&pc->mtx);
+		scr = SLIST_FIRST(&pc->list);
+		if (scr) {
+			SLIST_REMOVE_HEAD(&pc->list, entry);
+			--pc->count;
+			mtx_leave(&pc->mtx);
+			return (scr);
+		}
+		mtx_leave(&pc->mtx);
+	}
+	atomic_add_long(&hammer2_comp_scratch_allocs, 1);
+
+	return (hammer2_comp_alloc());
+}
+
+/*
+ * Return a scratch object to the current cpu's free list.  The zlib
+ * streams are left initialized for the next user.
+ */
+void
+hammer2_comp_put(hammer2_comp_scratch_t *scr)
+{
+	struct hammer2_comp_pcpu *pc;
+
+	pc = hammer2_comp_mycpu();
+	mtx_enter(&pc->mtx);
+	if (pc->count < HAMMER2_COMP_PERCPU_MAX) {
+		SLIST_INSERT_HEAD(&pc->list, scr, entry);
+		++pc->count;
+		scr = NULL;
+	}
+	mtx_leave(&pc->mtx);
+	if (scr)
+		hammer2_comp_free(scr);
+}
+
+/*
+ * Return the scratch's deflate stream ready to compress a new block at
+ * the requested level.  The stream is initialized the first time it is
+ * used and reset afterwards.  Returns NULL if zlib could not allocate
+ * its state, the caller should then write the block uncompressed.
+ */
+z_stream *
+hammer2_comp_deflate(hammer2_comp_scratch_t *scr, int level)
+{
+	z_stream *strm = &scr->zdef;
+
+	if (scr->zdef_level == 0) {
+		bzero(strm, sizeof(*strm));
+		if (deflateInit(strm, level) != Z_OK)
+			return (NULL);
+		scr->zdef_level = level;
+		return (strm);
+	}
+	if (deflateReset(strm) != Z_OK)
+		return (NULL);
+	if (scr->zdef_level != level) {
+		if (deflateParams(strm, level, Z_DEFAULT_STRATEGY) != Z_OK)
+			return (NULL);
+		scr->zdef_level = level;
+	}
+	return (strm);
+}
+
+/*
+ * Return the scratch's inflate stream ready to decompress a new block.
+ */
+z_stream *
+hammer2_comp_inflate(hammer2_comp_scratch_t *scr)
+{
+	z_stream *strm = &scr->zinf;
+
+	if (scr->zinf_init == 0) {
+		bzero(strm, sizeof(*strm));
+		if (inflateInit(strm) != Z_OK)
+			return (NULL);
+		scr->zinf_init = 1;
+		return (strm);
+	}
+	if (inflateReset(strm) != Z_OK)
+		return (NULL);
+	return (strm);
+}
+
+/*
+ * Return the scratch's zstd compression workspace (~370KB), allocated
+ * the first time the scratch compresses a zstd block.  Mounts which
+ * never use zstd do not pay for it.
+ */
+void *
+hammer2_comp_zstd_cwrk(hammer2_comp_scratch_t *scr)
+{
+	if (scr->zstd_cwrk == NULL)
+		scr->zstd_cwrk = malloc(hammer2_zstd_cwrksize(), M_HAMMER2,
+					M_WAITOK);
+	return (scr->zstd_cwrk);
+}
+
+/*
+ * Return the scratch's zstd decompression workspace.
+ */
+void *
+hammer2_comp_zstd_dwrk(hammer2_comp_scratch_t *scr)
+{
+	if (scr->zstd_dwrk == NULL)
+		scr->zstd_dwrk = malloc(hammer2_zstd_dwrksize(), M_HAMMER2,
+					M_WAITOK);
+	return (scr->zstd_dwrk);
+}
+
+/*
+ * Estimate whether a logical buffer is worth compressing.
+ *
+ * A byte histogram is built over HAMMER2_COMP_SAMPLES evenly spaced
+ * windows and the order-2 (collision) entropy -log2(sum(p^2)) of the
+ * sample is compared against hammer2_comp_entropy_bits.  Already
+ * compressed or encrypted data samples at ~7.3 bits per byte, text and
+ * executables at 4-6.  Four interleaved histograms avoid serializing on
+ * repeated bytes and the final reduction is a plain sum of squares, so
+ * the loops vectorize.
+ *
+ * Returns non-zero if the buffer looks incompressible.
+ */
+int
+hammer2_comp_entropy_high(const void *data, int bytes)
+{
+	const uint8_t *base = data;
+	const uint8_t *p;
+	uint8_t hist[4][256];
+	uint64_t sumsq;
+	uint64_t n;
+	int stride;
+	int count;
+	int w;
+	int i;
+	int c;
+
+	if (hammer2_comp_entropy_bits >= 8)
+		return 0;
+	if (bytes < HAMMER2_COMP_SAMPLES * HAMMER2_COMP_SAMPLE_LEN)
+		return 0;
+
+	/*
+	 * Each histogram sees at most 1/4 of the 512 sampled bytes so the
+	 * counts fit in 8 bits.
+	 */
+	bzero(hist, sizeof(hist));
+	stride = (bytes - HAMMER2_COMP_SAMPLE_LEN) / (HAMMER2_COMP_SAMPLES - 1);
+	for (w = 0; w < HAMMER2_COMP_SAMPLES; ++w) {
+		p = base + w * stride;
+		for (i = 0; i < HAMMER2_COMP_SAMPLE_LEN; i += 4) {
+			++hist[0][p[i + 0]];
+			++hist[1][p[i + 1]];
+			++hist[2][p[i + 2]];
+			++hist[3][p[i + 3]];
+		}
+	}
+
+	sumsq = 0;
+	for (i = 0; i < 256; ++i) {
+		c = hist[0][i] + hist[1][i] + hist[2][i] + hist[3][i];
+		sumsq += c * c;
+	}
+	count = HAMMER2_COMP_SAMPLES * HAMMER2_COMP_SAMPLE_LEN;
+	n = (uint64_t)count * count;
+
+	/* -log2(sumsq / n) > bits  <=>  (sumsq << bits) < n */
+	return ((sumsq << hammer2_comp_entropy_bits) < n);
+}
+
+/*
+ * Decide whether to attempt compression of the next block of an inode.
+ * Below HAMMER2_COMP_HEUR_FREE every block is tried, above it only
+ * every (comp_heuristic / 8)'th block is probed, up to 1 in 16.
+ *
+ * Called unlocked from the compression workers, a lost comp_tick update
+ * only shifts which block gets probed.
+ */
+int
+hammer2_comp_heur_try(hammer2_inode_t *ip)
+{
+	int heur = ip->comp_heuristic;
+
+	if (heur < HAMMER2_COMP_HEUR_FREE)
+		return 1;
+	return ((++ip->comp_tick % (heur >> 3)) == 0);
+}
+
+/*
+ * Feed the outcome of a block back into the inode's penalty.  Success
+ * halves the penalty instead of clearing it, so a file of mostly
+ * incompressible data with the odd compressible block stays throttled,
+ * while a file that turns compressible recovers in a few blocks.
+ *
+ * Called from the ordered commit path with the inode locked.
+ */
+void
+hammer2_comp_heur_update(hammer2_inode_t *ip, int result)
+{
+	int heur = ip->comp_heuristic;
+
+	switch(result) {
+	case HAMMER2_COMPRES_COMPRESSED:
+		heur >>= 1;
+		break;
+	case HAMMER2_COMPRES_FAILED:
+		heur += HAMMER2_COMP_HEUR_FAIL;
+		break;
+	case HAMMER2_COMPRES_ENTROPY:
+		heur += HAMMER2_COMP_HEUR_ENTROPY;
+		break;
+	default:
+		break;
+	}
+	if (heur > HAMMER2_COMP_HEUR_MAX)
+		heur = HAMMER2_COMP_HEUR_MAX;
+	ip->comp_heuristic = heur;
+}
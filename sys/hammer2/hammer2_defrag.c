@@ -0,0 +1,356 @@
+/*
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include <sys/param.h>
+#include <sys/systm.h>
+#include <sys/kernel.h>
+#include <sys/mount.h>
+#include <sys/vnode.h>
+
+#include "hammer2.h"
+
+/*
+ * Online segment defragmentation.
+ *
+ * Partial allocations and the linear packing of small blocks leave 2MB
+ * segments which are only sparsely used but cannot be reused for another
+ * class until every block in them is freed.  HAMMER2IOC_DEFRAG selects
+ * the segments whose fill is at most fill_pct percent (see
+ * hammer2_freemap_defrag_begin()), excludes them from allocation, and
+ * walks the topology of the PFS the ioctl was issued on, under that
+ * PFS's own transactions, modifying every chain whose block lies in a
+ * selected segment.  Other PFSs are relocated by running the ioctl on
+ * their own mounts.  The modification is a normal copy-on-write which
+ * moves the chain to a new block elsewhere, the old block is then freed
+ * by the bulk free scan like any other replaced block and the segment
+ * eventually becomes wholly free.
+ *
+ * The walk is done in transactions of hammer2_defrag_batch chains.  The
+ * path of parent chains is kept referenced between transactions and
+ * locked again top-down, the scan of each level resumes after the last
+ * child visited.  A parent deleted in the meantime ends the scan of its
+ * subtree.  Chains already modified since the last flush have a new
+ * block, the ones which still sit in a selected segment are left alone
+ * and counted as skipped, as are subtrees deeper than
+ * HAMMER2_DEFRAG_MAXDEPTH.
+ *
+ * Snapshots share blocks with the PFS they were taken from.  Copying a
+ * shared block only moves one of its references, the old segment would
+ * never empty and space use would grow.  Snapshot PFSs are therefore
+ * never defragmented, and in other PFSs chains whose blockref predates
+ * the PFS's newest snapshot (see hammer2_defrag_horizon()) are left
+ * alone and counted as skipped.
+ */
+#define HAMMER2_DEFRAG_MAXDEPTH	64
+
+struct hammer2_defrag_level {
+	hammer2_chain_t		*parent;	/* ref'd, locked in trans */
+	hammer2_chain_t		*last;		/* ref'd, last child scanned */
+};
+
+/*
+ * Snapshots and PFS roots seen under the super-root by
+ * hammer2_defrag_horizon().
+ */
+struct hammer2_defrag_pfs {
+	uuid_t			clid;
+	hammer2_tid_t		mirror_tid;	/* snapshots only */
+	int			snapshot;
+};
+
+/*
+ * Return the highest mirror_tid found in the root blocksets of the
+ * snapshots of pmp, or 0 if there are none.  A snapshot's root blockset
+ * is a copy of its origin's, so every block of the origin still shared
+ * with a snapshot has a mirror_tid at or below this horizon, while
+ * blocks rewritten since the newest snapshot are above it.
+ *
+ * mirror_tids are allocated per PFS, so only snapshots of pmp may be
+ * compared.  A snapshot of a PFS root keeps its origin's pfs_clid.  A
+ * snapshot of a subdirectory gets a fresh pfs_clid which does not say
+ * where it came from, those matching no PFS root are counted as well.
+ */
+static
+hammer2_tid_t
+hammer2_defrag_horizon(hammer2_pfsmount_t *pmp)
+{
+	hammer2_mount_t *hmp = pmp->iroot->cluster.focus->hmp;	/* XXX */
+	const hammer2_inode_data_t *ipdata;
+	const hammer2_blockref_t *bref;
+	struct hammer2_defrag_pfs *ary;
+	struct hammer2_defrag_pfs *tmp;
+	hammer2_cluster_t *cparent;
+	hammer2_cluster_t *cluster;
+	hammer2_key_t key_next;
+	hammer2_tid_t horizon;
+	int count;
+	int max;
+	int ddflag;
+	int i;
+	int j;
+
+	count = 0;
+	max = 16;
+	ary = malloc(sizeof(*ary) * max, M_HAMMER2, M_WAITOK | M_ZERO);
+
+	cparent = hammer2_inode_lock_sh(hmp->spmp->iroot);
+	cluster = hammer2_cluster_lookup(cparent, &key_next,
+					 0, (hammer2_key_t)-1,
+					 HAMMER2_LOOKUP_SHARED, &ddflag);
+	while (cluster) {
+		if (hammer2_cluster_type(cluster) != HAMMER2_BREF_TYPE_INODE)
+			goto next;
+		ipdata = &hammer2_cluster_data(cluster)->ipdata;
+		if (count == max) {
+			tmp = malloc(sizeof(*ary) * max * 2, M_HAMMER2,
+				     M_WAITOK | M_ZERO);
+			bcopy(ary, tmp, sizeof(*ary) * max);
+			free(ary, M_HAMMER2, 0);
+			ary = tmp;
+			max *= 2;
+		}
+		ary[count].clid = ipdata->pfs_clid;
+		if (ipdata->pfs_type == HAMMER2_PFSTYPE_SNAPSHOT) {
+			ary[count].snapshot = 1;
+			if ((ipdata->op_flags &
+			     HAMMER2_OPFLAG_DIRECTDATA) == 0) {
+				for (i = 0; i < HAMMER2_SET_COUNT; ++i) {
+					bref = &ipdata->u.blockset.blockref[i];
+					if (bref->type != 0 &&
+					    ary[count].mirror_tid <
+					    bref->mirror_tid) {
+						ary[count].mirror_tid =
+							bref->mirror_tid;
+					}
+				}
+			}
+		}
+		++count;
+next:
+		cluster = hammer2_cluster_next(cparent, cluster, &key_next,
+					       key_next, (hammer2_key_t)-1,
+					       HAMMER2_LOOKUP_SHARED);
+	}
+	hammer2_inode_unlock_sh(hmp->spmp->iroot, cparent);
+
+	horizon = 0;
+	for (i = 0; i < count; ++i) {
+		if (ary[i].snapshot == 0 || horizon >= ary[i].mirror_tid)
+			continue;
+		if (bcmp(&ary[i].clid, &pmp->pfs_clid,
+			 sizeof(pmp->pfs_clid)) != 0) {
+			/*
+			 * Skip snapshots of other PFS roots.
+			 */
+			for (j = 0; j < count; ++j) {
+				if (ary[j].snapshot == 0 &&
+				    bcmp(&ary[i].clid, &ary[j].clid,
+					 sizeof(ary[j].clid)) == 0) {
+					break;
+				}
+			}
+			if (j < count)
+				continue;
+		}
+		horizon = ary[i].mirror_tid;
+	}
+	free(ary, M_HAMMER2, 0);
+
+	return (horizon);
+}
+
+static
+void
+hammer2_defrag_chain(hammer2_trans_t *trans, hammer2_mount_t *hmp,
+		     hammer2_chain_t *chain, hammer2_tid_t horizon,
+		     hammer2_ioc_defrag_t *dfi)
+{
+	switch(chain->bref.type) {
+	case HAMMER2_BREF_TYPE_INODE:
+	case HAMMER2_BREF_TYPE_INDIRECT:
+	case HAMMER2_BREF_TYPE_DATA:
+		break;
+	default:
+		return;
+	}
+	if ((chain->bref.data_off & ~HAMMER2_OFF_MASK_RADIX) == 0 ||
+	    hammer2_freemap_defrag_target(hmp, chain->bref.data_off) == 0) {
+		return;
+	}
+	if (chain->flags & HAMMER2_CHAIN_MODIFIED) {
+		++dfi->count_skipped;
+		return;
+	}
+	if (chain->bref.mirror_tid <= horizon) {
+		++dfi->count_skipped;	/* possibly shared with a snapshot */
+		return;
+	}
+	hammer2_chain_modify(trans, chain, 0);
+	++dfi->count_moved;
+	dfi->bytes_moved += chain->bytes;
+}
+
+int
+hammer2_defrag(hammer2_pfsmount_t *pmp, hammer2_ioc_defrag_t *dfi)
+{
+	struct hammer2_defrag_level *stack;
+	struct hammer2_defrag_level *lev;
+	const hammer2_inode_data_t *ipdata;
+	hammer2_cluster_t *cluster;
+	hammer2_mount_t *hmp;
+	hammer2_trans_t trans;
+	hammer2_chain_t *chain;
+	hammer2_tid_t horizon;
+	int cache_index;
+	int pfs_type;
+	int depth;
+	int count;
+	int pct;
+	int i;
+
+	hmp = pmp->iroot->cluster.focus->hmp;	/* XXX */
+	if (hmp->ronly)
+		return (EROFS);
+
+	pct = dfi->fill_pct ? (int)dfi->fill_pct : hammer2_defrag_fill;
+	if (pct <= 0 || pct >= 100)
+		return (EINVAL);
+
+	/*
+	 * Every block of a snapshot may be shared with its origin.
+	 */
+	cluster = hammer2_inode_lock_sh(pmp->iroot);
+	ipdata = &hammer2_cluster_data(cluster)->ipdata;
+	pfs_type = ipdata->pfs_type;
+	hammer2_inode_unlock_sh(pmp->iroot, cluster);
+	if (pfs_type == HAMMER2_PFSTYPE_SNAPSHOT)
+		return (EOPNOTSUPP);
+	horizon = hammer2_defrag_horizon(pmp);
+
+	hammer2_trans_init(&trans, hmp->spmp, 0);
+	i = hammer2_freemap_defrag_begin(&trans, hmp, pct, dfi->max_segs);
+	hammer2_trans_done(&trans);
+	if (i < 0)
+		return (EBUSY);
+	dfi->count_segs = i;
+	if (i == 0) {
+		hammer2_freemap_defrag_end(hmp);
+		return (0);
+	}
+
+	stack = malloc(sizeof(*stack) * HAMMER2_DEFRAG_MAXDEPTH, M_HAMMER2,
+		       M_WAITOK | M_ZERO);
+	chain = pmp->iroot->cluster.focus;	/* XXX */
+	hammer2_chain_ref(chain);
+	stack[0].parent = chain;
+	depth = 0;
+
+	while (depth >= 0) {
+		/*
+		 * Lock the path top-down.  Stop at the first deleted parent
+		 * and throw away its level and everything below it.
+		 */
+		hammer2_trans_init(&trans, pmp, 0);
+		for (i = 0; i <= depth; ++i) {
+			lev = &stack[i];
+			hammer2_chain_lock(lev->parent, HAMMER2_RESOLVE_MAYBE);
+			if (lev->parent->flags & HAMMER2_CHAIN_DELETED)
+				break;
+		}
+		if (i <= depth) {
+			hammer2_chain_unlock(stack[i].parent);
+			while (depth >= i) {
+				lev = &stack[depth--];
+				hammer2_chain_drop(lev->parent);
+				if (lev->last)
+					hammer2_chain_drop(lev->last);
+				lev->parent = NULL;
+				lev->last = NULL;
+			}
+		}
+
+		cache_index = -1;
+		count = 0;
+		while (depth >= 0 && count < hammer2_defrag_batch) {
+			lev = &stack[depth];
+
+			/*
+			 * hammer2_chain_scan() consumes a lock on the last
+			 * child, our own reference is dropped separately.
+			 */
+			if (lev->last)
+				hammer2_chain_lock(lev->last,
+						   HAMMER2_RESOLVE_NEVER);
+			chain = hammer2_chain_scan(lev->parent, lev->last,
+						   &cache_index, 0);
+			if (lev->last) {
+				hammer2_chain_drop(lev->last);
+				lev->last = NULL;
+			}
+
+			/*
+			 * End of this level, pop back to the parent level
+			 * which resumes after the chain we just finished.
+			 */
+			if (chain == NULL) {
+				hammer2_chain_unlock(lev->parent);
+				hammer2_chain_drop(lev->parent);
+				lev->parent = NULL;
+				--depth;
+				continue;
+			}
+
+			++count;
+			++dfi->count_scanned;
+			hammer2_defrag_chain(&trans, hmp, chain, horizon, dfi);
+
+			hammer2_chain_ref(chain);
+			lev->last = chain;
+			if (chain->bref.type != HAMMER2_BREF_TYPE_INODE &&
+			    chain->bref.type != HAMMER2_BREF_TYPE_INDIRECT) {
+				hammer2_chain_unlock(chain);
+			} else if (chain->flags & HAMMER2_CHAIN_PFSBOUNDARY) {
+				/* never leave the PFS */
+				hammer2_chain_unlock(chain);
+			} else if (depth + 1 == HAMMER2_DEFRAG_MAXDEPTH) {
+				++dfi->count_skipped;
+				hammer2_chain_unlock(chain);
+			} else {
+				/*
+				 * Descend, the chain's lock from the scan
+				 * becomes the new level's parent lock.
+				 */
+				hammer2_chain_ref(chain);
+				lev = &stack[++depth];
+				lev->parent = chain;
+				lev->last = NULL;
+			}
+		}
+
+		/*
+		 * Unlock the path bottom-up and let flushes and other
+		 * transactions run.
+		 */
+		for (i = depth; i >= 0; --i)
+			hammer2_chain_unlock(stack[i].parent);
+		hammer2_trans_done(&trans);
+		if (depth >= 0)
+			tsleep(&hmp->defrag_segs, 0, "h2dfrg", 1);
+	}
+	free(stack, M_HAMMER2, 0);
+	hammer2_freemap_defrag_end(hmp);
+
+	return (0);
+}
@@ -0,0 +1,386 @@
+/*
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include <sys/param.h>
+#include <sys/systm.h>
+#include <sys/kernel.h>
+#include <sys/kthread.h>
+#include <sys/mount.h>
+#include <sys/vnode.h>
+#include <sys/fcntl.h>
+#include <sys/dkio.h>
+
+#include "hammer2.h"
+
+/*
+ * Discard (TRIM) of freed space, enabled per device with the
+ * HMNT2_DISCARD mount flag.
+ *
+ * Blocks only become free when the bulk free scan moves them from staged
+ * (10) to free (00).  hammer2_freemap_bulkfree_merge() collects runs of
+ * freed 16KB blocks, which hammer2_discard_queue() trims to
+ * hammer2_discard_align boundaries and appends to the device's discard
+ * list, coalescing with the previous extent when adjacent.  A per-device
+ * thread issues the extents in pieces of at most hammer2_discard_maxio
+ * bytes, throttled to hammer2_discard_rate bytes per second.  Discards
+ * are advisory, extents which do not fit the queue limit are dropped.
+ *
+ * A queued block is free in the freemap and may be allocated again before
+ * its discard is issued.  The allocator calls hammer2_discard_cancel() for
+ * every range it takes out of the freemap, which trims the range out of
+ * the queue and waits for an overlapping discard in progress to complete.
+ * Extents are queued while fchain is held, so this cannot race the merge.
+ *
+ * Extents are handed to hmp->discard_issue.  hammer2_discard_issue_dev()
+ * passes them to the device.  HAMMER2IOC_DISCARD can select
+ * hammer2_discard_issue_rec() instead, which only records them, so the
+ * coalescing and freeing paths can be checked on devices without
+ * discard support.
+ */
+static void hammer2_discard_thread(void *arg);
+static int hammer2_discard_issue_dev(hammer2_mount_t *hmp, hammer2_off_t off,
+			hammer2_off_t bytes);
+static int hammer2_discard_issue_rec(hammer2_mount_t *hmp, hammer2_off_t off,
+			hammer2_off_t bytes);
+
+/*
+ * Queue [beg, end) for discard.  Called by the bulk free code with fchain
+ * held.
+ */
+void
+hammer2_discard_queue(hammer2_mount_t *hmp, hammer2_off_t beg,
+		      hammer2_off_t end)
+{
+	struct hammer2_discard *dis;
+	hammer2_off_t align;
+
+	if (hmp->discard_run == 0)
+		return;
+	align = hammer2_discard_align;
+	if (align < HAMMER2_FREEMAP_BLOCK_SIZE || (align & (align - 1)))
+		align = HAMMER2_FREEMAP_BLOCK_SIZE;
+	beg = (beg + align - 1) & ~(align - 1);
+	end &= ~(align - 1);
+	if (beg >= end)
+		return;
+
+	mtx_enter(&hmp->discard_mtx);
+	dis = TAILQ_LAST(&hmp->discard_list, hammer2_discard_list);
+	if (dis && dis->end == beg) {
+		dis->end = end;
+		mtx_leave(&hmp->discard_mtx);
+		return;
+	}
+	if (hmp->discard_count >= hammer2_discard_maxq) {
+		mtx_leave(&hmp->discard_mtx);
+		return;
+	}
+	mtx_leave(&hmp->discard_mtx);
+
+	dis = malloc(sizeof(*dis), M_HAMMER2, M_WAITOK | M_ZERO);
+	dis->beg = beg;
+	dis->end = end;
+
+	mtx_enter(&hmp->discard_mtx);
+	if (hmp->discard_run) {
+		TAILQ_INSERT_TAIL(&hmp->discard_list, dis, entry);
+		++hmp->discard_count;
+		wakeup(&hmp->discard_list);
+		dis = NULL;
+	}
+	mtx_leave(&hmp->discard_mtx);
+	if (dis)
+		free(dis, M_HAMMER2, 0);
+}
+
+/*
+ * [beg, end) is being allocated, remove it from the discard queue and
+ * wait for any overlapping discard in progress.  Called by the allocator
+ * with fchain held.
+ */
+void
+hammer2_discard_cancel(hammer2_mount_t *hmp, hammer2_off_t beg,
+		       hammer2_off_t end)
+{
+	struct hammer2_discard *dis;
+	struct hammer2_discard *next;
+	struct hammer2_discard_list tmplist;
+
+	if (hmp->discard_run == 0)
+		return;
+
+	TAILQ_INIT(&tmplist);
+	mtx_enter(&hmp->discard_mtx);
+	while (hmp->discard_busy &&
+	       hmp->discard_beg < end && hmp->discard_end > beg) {
+		mtxsleep(&hmp->discard_busy, &hmp->discard_mtx, 0,
+			 "h2dscw", 0);
+	}
+	TAILQ_FOREACH_SAFE(dis, &hmp->discard_list, entry, next) {
+		if (dis->end <= beg || dis->beg >= end)
+			continue;
+
+		/*
+		 * Keep the larger remaining piece if the range splits the
+		 * extent, the other piece is simply not discarded.
+		 */
+		if (dis->beg < beg && dis->end > end) {
+			if (beg - dis->beg >= dis->end - end)
+				dis->end = beg;
+			else
+				dis->beg = end;
+		} else if (dis->beg < beg) {
+			dis->end = beg;
+		} else if (dis->end > end) {
+			dis->beg = end;
+		} else {
+			TAILQ_REMOVE(&hmp->discard_list, dis, entry);
+			TAILQ_INSERT_TAIL(&tmplist, dis, entry);
+			--hmp->discard_count;
+		}
+	}
+	mtx_leave(&hmp->discard_mtx);
+
+	while ((dis = TAILQ_FIRST(&tmplist)) != NULL) {
+		TAILQ_REMOVE(&tmplist, dis, entry);
+		free(dis, M_HAMMER2, 0);
+	}
+}
+
+static
+void
+hammer2_discard_thread(void *arg)
+{
+	hammer2_mount_t *hmp = arg;
+	struct hammer2_discard *dis;
+	struct hammer2_discard_list tmplist;
+	hammer2_discard_issue_t issue;
+	hammer2_off_t beg;
+	hammer2_off_t end;
+	int error;
+	int slp;
+
+	mtx_enter(&hmp->discard_mtx);
+	while (hmp->discard_stop == 0) {
+		dis = TAILQ_FIRST(&hmp->discard_list);
+		if (dis == NULL) {
+			mtxsleep(&hmp->discard_list, &hmp->discard_mtx, 0,
+				 "h2disc", 0);
+			continue;
+		}
+
+		/*
+		 * Take up to hammer2_discard_maxio bytes off the head of
+		 * the queue and mark them in progress.
+		 */
+		beg = dis->beg;
+		end = dis->end;
+		if (hammer2_discard_maxio > 0 &&
+		    end - beg > (hammer2_off_t)hammer2_discard_maxio) {
+			end = (beg + hammer2_discard_maxio) &
+			      ~(hammer2_off_t)HAMMER2_FREEMAP_BLOCK_MASK;
+		}
+		if (end == dis->end) {
+			TAILQ_REMOVE(&hmp->discard_list, dis, entry);
+			--hmp->discard_count;
+		} else {
+			dis->beg = end;
+			dis = NULL;
+		}
+		hmp->discard_beg = beg;
+		hmp->discard_end = end;
+		hmp->discard_busy = 1;
+		issue = hmp->discard_issue;
+		mtx_leave(&hmp->discard_mtx);
+
+		if (dis)
+			free(dis, M_HAMMER2, 0);
+		error = issue(hmp, beg, end - beg);
+
+		mtx_enter(&hmp->discard_mtx);
+		hmp->discard_busy = 0;
+		wakeup(&hmp->discard_busy);
+		if (error == 0) {
+			++hammer2_discard_count;
+			hammer2_discard_bytes += end - beg;
+		} else if (error == EOPNOTSUPP || error == ENOTTY) {
+			printf("hammer2: device does not support discard, "
+			       "disabled\n");
+			break;
+		}
+
+		if (hammer2_discard_rate > 0) {
+			slp = (int)((end - beg) * hz / hammer2_discard_rate);
+			if (slp > 0 && hmp->discard_stop == 0) {
+				mtxsleep(&hmp->discard_stop, &hmp->discard_mtx,
+					 0, "h2dsrt", slp);
+			}
+		}
+	}
+
+	/*
+	 * Throw away whatever is left.  discard_run is cleared under the
+	 * mutex so the queue and cancel functions stop touching the list.
+	 */
+	TAILQ_INIT(&tmplist);
+	TAILQ_CONCAT(&tmplist, &hmp->discard_list, entry);
+	hmp->discard_count = 0;
+	hmp->discard_run = 0;
+	wakeup(&hmp->discard_run);
+	mtx_leave(&hmp->discard_mtx);
+
+	while ((dis = TAILQ_FIRST(&tmplist)) != NULL) {
+		TAILQ_REMOVE(&tmplist, dis, entry);
+		free(dis, M_HAMMER2, 0);
+	}
+	kthread_exit(0);
+}
+
+/*
+ * Discard (bytes) at (off).  OpenBSD's buffer layer has no discard
+ * command and none of its disk drivers accept one, so the request is
+ * passed to the device as an ioctl where the platform provides one.
+ */
+static
+int
+hammer2_discard_issue_dev(hammer2_mount_t *hmp, hammer2_off_t off,
+			  hammer2_off_t bytes)
+{
+#ifdef DIOCGDELETE
+	off_t args[2];
+
+	args[0] = (off_t)off;
+	args[1] = (off_t)bytes;
+	return (VOP_IOCTL(hmp->devvp, DIOCGDELETE, (caddr_t)args, FWRITE,
+			  FSCRED, curproc));
+#else
+	return (EOPNOTSUPP);
+#endif
+}
+
+/*
+ * Recording stub, keeps the last HAMMER2_DISCARD_NREC extents for
+ * HAMMER2IOC_DISCARD.
+ */
+static
+int
+hammer2_discard_issue_rec(hammer2_mount_t *hmp, hammer2_off_t off,
+			  hammer2_off_t bytes)
+{
+	struct hammer2_ioc_discard_rec *rec;
+
+	mtx_enter(&hmp->discard_mtx);
+	rec = &hmp->discard_rec[hmp->discard_nrec % HAMMER2_DISCARD_NREC];
+	rec->beg = off;
+	rec->end = off + bytes;
+	++hmp->discard_nrec;
+	mtx_leave(&hmp->discard_mtx);
+
+	return (0);
+}
+
+/*
+ * Called at mount time for read-write mounts with HMNT2_DISCARD set, and
+ * by HAMMER2IOC_DISCARD.  Does nothing if the thread is already running.
+ */
+void
+hammer2_discard_start(hammer2_mount_t *hmp)
+{
+	mtx_enter(&hmp->discard_mtx);
+	if (hmp->discard_run) {
+		mtx_leave(&hmp->discard_mtx);
+		return;
+	}
+	if (hmp->discard_issue == NULL)
+		hmp->discard_issue = hammer2_discard_issue_dev;
+	hmp->discard_count = 0;
+	hmp->discard_stop = 0;
+	hmp->discard_busy = 0;
+	hmp->discard_run = 1;
+	mtx_leave(&hmp->discard_mtx);
+
+	if (kthread_create(hammer2_discard_thread, hmp, NULL, "h2disc")) {
+		printf("hammer2: unable to start discard thread\n");
+		mtx_enter(&hmp->discard_mtx);
+		hmp->discard_run = 0;
+		mtx_leave(&hmp->discard_mtx);
+	}
+}
+
+/*
+ * Called at unmount time after the bulk free thread has been stopped,
+ * pending discards are dropped.
+ */
+void
+hammer2_discard_stop(hammer2_mount_t *hmp)
+{
+	if (hmp->discard_run == 0)
+		return;
+	mtx_enter(&hmp->discard_mtx);
+	hmp->discard_stop = 1;
+	wakeup(&hmp->discard_list);
+	wakeup(&hmp->discard_stop);
+	while (hmp->discard_run) {
+		mtxsleep(&hmp->discard_run, &hmp->discard_mtx, 0,
+			 "h2dsstp", 0);
+	}
+	mtx_leave(&hmp->discard_mtx);
+}
+
+/*
+ * HAMMER2IOC_DISCARD, select the issue hook and report the queue and the
+ * extents recorded by the stub.
+ */
+int
+hammer2_discard_ioctl(hammer2_mount_t *hmp, hammer2_ioc_discard_t *dis)
+{
+	uint64_t n;
+	int i;
+
+	if (dis->flags & (HAMMER2_DISCARD_RECORD | HAMMER2_DISCARD_DEVICE)) {
+		if (hmp->ronly)
+			return (EROFS);
+		mtx_enter(&hmp->discard_mtx);
+		if (dis->flags & HAMMER2_DISCARD_RECORD)
+			hmp->discard_issue = hammer2_discard_issue_rec;
+		else
+			hmp->discard_issue = hammer2_discard_issue_dev;
+		mtx_leave(&hmp->discard_mtx);
+		if (dis->flags & HAMMER2_DISCARD_RECORD)
+			hammer2_discard_start(hmp);
+	}
+
+	mtx_enter(&hmp->discard_mtx);
+	dis->flags &= ~(HAMMER2_DISCARD_ACTIVE | HAMMER2_DISCARD_RECORDING);
+	if (hmp->discard_run)
+		dis->flags |= HAMMER2_DISCARD_ACTIVE;
+	if (hmp->discard_issue == hammer2_discard_issue_rec)
+		dis->flags |= HAMMER2_DISCARD_RECORDING;
+	dis->count_queued = hmp->discard_count;
+	dis->count_recorded = hmp->discard_nrec;
+	n = hmp->discard_nrec;
+	if (n > HAMMER2_DISCARD_NREC)
+		n = HAMMER2_DISCARD_NREC;
+	for (i = 0; i < (int)n; ++i) {
+		dis->rec[i] = hmp->discard_rec[(hmp->discard_nrec - n + i) %
+					       HAMMER2_DISCARD_NREC];
+	}
+	dis->nrec = (int)n;
+	if (dis->flags & HAMMER2_DISCARD_CLEAR)
+		hmp->discard_nrec = 0;
+	mtx_leave(&hmp->discard_mtx);
+
+	return (0);
+}
@@ -530,6 +530,10 @@ struct hammer2_blockref {		/* MUST BE EXACTLY 64 BYTES */
 		struct {
 			char data[24];
 		} sha192;
+		struct {
+			uint64_t value[2];	/* low64, high64 */
+			uint64_t unused;
+		} xxh3;
 
 		/*
 		 * Freemap hints are embedded in addition to the icrc32.
@@ -586,11 +590,15 @@ typedef struct hammer2_blockref hammer2_blockref_t;
 #define HAMMER2_CHECK_CRC64		3
 #define HAMMER2_CHECK_SHA192		4
 #define HAMMER2_CHECK_FREEMAP		5
+#define HAMMER2_CHECK_XXH3		6
 
-/* user-specifiable check modes only */
+/*
+ * user-specifiable check modes only, the empty slot is the internal
+ * freemap check and cannot be selected by name.
+ */
 #define HAMMER2_CHECK_STRINGS		{ "none", "disabled", "crc32", \
-					  "crc64", "sha192" }
-#define HAMMER2_CHECK_STRINGS_COUNT	5
+					  "crc64", "sha192", "", "xxh3" }
+#define HAMMER2_CHECK_STRINGS_COUNT	7
 
 /*
  * Encode/decode check or compression algorithm request in
@@ -605,10 +613,12 @@ typedef struct hammer2_blockref hammer2_blockref_t;
 #define HAMMER2_COMP_AUTOZERO		1
 #define HAMMER2_COMP_LZ4		2
 #define HAMMER2_COMP_ZLIB		3
+#define HAMMER2_COMP_ZSTD		4
 
 #define HAMMER2_COMP_NEWFS_DEFAULT	HAMMER2_COMP_LZ4
-#define HAMMER2_COMP_STRINGS		{ "none", "autozero", "lz4", "zlib" }
-#define HAMMER2_COMP_STRINGS_COUNT	4
+#define HAMMER2_COMP_STRINGS		{ "none", "autozero", "lz4", "zlib", \
+					  "zstd" }
+#define HAMMER2_COMP_STRINGS_COUNT	5
 
 
 /*
@@ -54,6 +54,7 @@
 #include <sys/lock.h>
 #include <sys/uuid.h>
 #include <sys/kernel.h>
+#include <sys/kthread.h>
 
 #include "hammer2.h"
 
@@ -78,13 +79,25 @@ struct hammer2_flush_info {
 	struct h2_flush_list flushq;
 	hammer2_xid_t	sync_xid;	/* memory synchronization point */
 	hammer2_chain_t	*debug;
+	struct hammer2_fjob_batch *batch; /* split subtrees at depth 0 */
 };
 
 typedef struct hammer2_flush_info hammer2_flush_info_t;
 
+static void hammer2_flush_common(hammer2_trans_t *trans,
+				hammer2_chain_t *chain,
+				struct hammer2_fjob_batch *batch);
 static void hammer2_flush_core(hammer2_flush_info_t *info,
 				hammer2_chain_t *chain, int deleting);
+static void hammer2_flush_scan(hammer2_chain_t *parent,
+				hammer2_flush_info_t *info);
 static int hammer2_flush_recurse(hammer2_chain_t *child, void *data);
+static int hammer2_flush_job_queue(struct hammer2_fjob_batch *batch,
+				hammer2_trans_t *trans,
+				hammer2_chain_t *chain, int flags);
+static void hammer2_flush_job_run(hammer2_fjob_t *job, int worker);
+static void hammer2_flush_job_wait(struct hammer2_fjob_batch *batch);
+static void hammer2_flush_worker(void *arg);
 
 /*
  * For now use a global transaction manager.  What we ultimately want to do
@@ -365,6 +378,242 @@ hammer2_trans_done(hammer2_trans_t *trans)
  */
 void
 hammer2_flush(hammer2_trans_t *trans, hammer2_chain_t *chain)
+{
+	hammer2_flush_common(trans, chain, NULL);
+}
+
+/*
+ * Flush all elements of a cluster, as hammer2_vfs_sync() does before
+ * synchronizing the volume roots.  Each element is queued to the PFS
+ * flush workers and further splits its independent dirty subtrees
+ * across them.  Returns once every element has been fully flushed.
+ *
+ * Elements are flushed serially by the caller if hammer2_flush_parallel
+ * is 0.  If the PFS has no flush workers the caller runs the queued jobs
+ * itself from hammer2_flush_job_wait().
+ */
+void
+hammer2_flush_cluster(hammer2_trans_t *trans, hammer2_cluster_t *cluster)
+{
+	struct hammer2_fjob_batch batch;
+	hammer2_chain_t *chain;
+	int parallel;
+	int i;
+
+	batch.pmp = trans->pmp;
+	batch.pending = 0;
+	parallel = (hammer2_flush_parallel && batch.pmp);
+
+	for (i = 0; i < cluster->nchains; ++i) {
+		chain = cluster->array[i];
+		if (chain == NULL)
+			continue;
+		if (parallel == 0 ||
+		    hammer2_flush_job_queue(&batch, trans, chain,
+					    HAMMER2_FJOB_SPLIT)) {
+			hammer2_chain_lock(chain, HAMMER2_RESOLVE_ALWAYS);
+			hammer2_flush(trans, chain);
+			hammer2_chain_unlock(chain);
+		}
+	}
+	hammer2_flush_job_wait(&batch);
+}
+
+/*
+ * Queue a flush of (chain) to the batch's PFS flush workers, adding a ref
+ * for the job.  Can be called with a core spinlock held, returns ENOMEM
+ * if the job could not be allocated and the caller must flush inline.
+ */
+static int
+hammer2_flush_job_queue(struct hammer2_fjob_batch *batch,
+			hammer2_trans_t *trans, hammer2_chain_t *chain,
+			int flags)
+{
+	hammer2_pfsmount_t *pmp = batch->pmp;
+	hammer2_fjob_t *job;
+
+	job = malloc(sizeof(*job), M_HAMMER2, M_NOWAIT | M_ZERO);
+	if (job == NULL)
+		return (ENOMEM);
+	hammer2_chain_ref(chain);
+	job->batch = batch;
+	job->trans = trans;
+	job->chain = chain;
+	job->flags = flags;
+
+	mtx_enter(&pmp->fjob_mtx);
+	TAILQ_INSERT_TAIL(&pmp->fjob_queue, job, entry);
+	++batch->pending;
+	mtx_leave(&pmp->fjob_mtx);
+	if (pmp->fworkers)
+		wakeup_one(&pmp->fjob_queue);
+
+	atomic_add_long(&hammer2_flush_jobs, 1);
+	if ((flags & HAMMER2_FJOB_SPLIT) == 0)
+		atomic_add_long(&hammer2_flush_subtrees, 1);
+
+	return (0);
+}
+
+/*
+ * Run a flush job and complete it against its batch.  Called by the PFS
+ * flush workers (worker != 0) and by submitters helping out in
+ * hammer2_flush_job_wait().
+ */
+static void
+hammer2_flush_job_run(hammer2_fjob_t *job, int worker)
+{
+	struct hammer2_fjob_batch *batch = job->batch;
+	struct hammer2_fjob_batch sub;
+	hammer2_pfsmount_t *pmp = batch->pmp;
+	hammer2_chain_t *chain = job->chain;
+
+	if (worker) {
+		atomic_add_long(&hammer2_flush_jobs_worker, 1);
+		if ((job->flags & HAMMER2_FJOB_SPLIT) == 0)
+			atomic_add_long(&hammer2_flush_subtrees_worker, 1);
+	}
+	if (job->flags & HAMMER2_FJOB_SPLIT) {
+		sub.pmp = pmp;
+		sub.pending = 0;
+		hammer2_chain_lock(chain, HAMMER2_RESOLVE_ALWAYS);
+		hammer2_flush_common(job->trans, chain, &sub);
+	} else {
+		hammer2_chain_lock(chain, HAMMER2_RESOLVE_MAYBE);
+		hammer2_flush_common(job->trans, chain, NULL);
+	}
+	hammer2_chain_unlock(chain);
+	hammer2_chain_drop(chain);		/* ref from queue */
+	free(job, M_HAMMER2, 0);
+
+	mtx_enter(&pmp->fjob_mtx);
+	if (--batch->pending == 0)
+		wakeup(batch);
+	mtx_leave(&pmp->fjob_mtx);
+}
+
+/*
+ * Join a batch, running queued flush jobs (from any batch) while waiting
+ * rather than idling.  Jobs only ever wait on deeper jobs so helping
+ * cannot deadlock.  The caller must not hold the lock on any chain the
+ * batch's jobs need, in particular their parent.
+ *
+ * Without flush workers the queue is only drained here.  The caller
+ * sleeps only while another helper is running one of the batch's jobs,
+ * which cannot itself be waiting on this caller.
+ */
+static void
+hammer2_flush_job_wait(struct hammer2_fjob_batch *batch)
+{
+	hammer2_pfsmount_t *pmp = batch->pmp;
+	hammer2_fjob_t *job;
+
+	if (batch->pending == 0)
+		return;
+
+	mtx_enter(&pmp->fjob_mtx);
+	while (batch->pending) {
+		job = TAILQ_FIRST(&pmp->fjob_queue);
+		if (job == NULL) {
+			mtxsleep(batch, &pmp->fjob_mtx, 0, "h2fjob", 0);
+			continue;
+		}
+		TAILQ_REMOVE(&pmp->fjob_queue, job, entry);
+		mtx_leave(&pmp->fjob_mtx);
+		hammer2_flush_job_run(job, 0);
+		mtx_enter(&pmp->fjob_mtx);
+	}
+	mtx_leave(&pmp->fjob_mtx);
+}
+
+/*
+ * Start the flush workers for a PFS.  hammer2_flush_workers overrides
+ * the default of one worker per cpu.
+ */
+void
+hammer2_flush_workers_start(hammer2_pfsmount_t *pmp)
+{
+	int count;
+	int i;
+
+	count = hammer2_flush_workers;
+	if (count <= 0)
+		count = ncpus;
+	if (count > HAMMER2_FWORKERS_MAX)
+		count = HAMMER2_FWORKERS_MAX;
+
+	for (i = 0; i < count; ++i) {
+		mtx_enter(&pmp->fjob_mtx);
+		++pmp->fworkers;
+		mtx_leave(&pmp->fjob_mtx);
+		if (kthread_create(hammer2_flush_worker, pmp, NULL,
+				   "h2flush")) {
+			printf("hammer2: unable to start flush worker\n");
+			mtx_enter(&pmp->fjob_mtx);
+			--pmp->fworkers;
+			mtx_leave(&pmp->fjob_mtx);
+			break;
+		}
+	}
+}
+
+/*
+ * Stop the flush workers for a PFS and wait for them to exit.  The
+ * queue is empty by then since every flush joins its jobs.
+ */
+void
+hammer2_flush_workers_stop(hammer2_pfsmount_t *pmp)
+{
+	mtx_enter(&pmp->fjob_mtx);
+	pmp->fworkers_stop = 1;
+	wakeup(&pmp->fjob_queue);
+	while (pmp->fworkers) {
+		mtxsleep(&pmp->fworkers, &pmp->fjob_mtx, 0, "h2fstop", 0);
+	}
+	pmp->fworkers_stop = 0;
+	mtx_leave(&pmp->fjob_mtx);
+}
+
+/*
+ * Flush worker.  Runs queued cluster elements and subtrees until the
+ * PFS is unmounted.
+ */
+static
+void
+hammer2_flush_worker(void *arg)
+{
+	hammer2_pfsmount_t *pmp;
+	hammer2_fjob_t *job;
+
+	pmp = arg;
+
+	mtx_enter(&pmp->fjob_mtx);
+	while (pmp->fworkers_stop == 0) {
+		job = TAILQ_FIRST(&pmp->fjob_queue);
+		if (job == NULL) {
+			mtxsleep(&pmp->fjob_queue, &pmp->fjob_mtx,
+				 0, "h2fwrk", 0);
+			continue;
+		}
+		TAILQ_REMOVE(&pmp->fjob_queue, job, entry);
+		mtx_leave(&pmp->fjob_mtx);
+		hammer2_flush_job_run(job, 1);
+		mtx_enter(&pmp->fjob_mtx);
+	}
+	--pmp->fworkers;
+	wakeup(&pmp->fworkers);
+	mtx_leave(&pmp->fjob_mtx);
+
+	kthread_exit(0);
+}
+
+/*
+ * Body of hammer2_flush().  A non-NULL (batch) splits the independent
+ * dirty subtrees directly under (chain) across the PFS workers.
+ */
+static void
+hammer2_flush_common(hammer2_trans_t *trans, hammer2_chain_t *chain,
+		     struct hammer2_fjob_batch *batch)
 {
 	hammer2_chain_t *scan;
 	hammer2_flush_info_t info;
@@ -383,6 +632,7 @@ hammer2_flush(hammer2_trans_t *trans, hammer2_chain_t *chain)
 	info.trans = trans;
 	info.sync_xid = trans->sync_xid;
 	info.cache_index = -1;
+	info.batch = batch;
 
 	/*
 	 * Calculate parent (can be NULL), if not NULL the flush core
@@ -537,15 +787,22 @@ hammer2_flush_core(hammer2_flush_info_t *info, hammer2_chain_t *chain,
 		 * pre-clear ONFLUSH.  It can get set again due to races,
 		 * which we want so the scan finds us again in the next flush.
 		 */
-		hammer2_flush_recurse(chain, NULL); // XXX fix me
-
 		atomic_clear_int(&chain->flags, HAMMER2_CHAIN_ONFLUSH);
 		info->parent = chain;
 		__mp_lock((struct __mp_lock *)&chain->core.cst.spin);
-		RB_SCAN(hammer2_chain_tree, &chain->core.rbtree,
-			NULL, hammer2_flush_recurse, info);
+		hammer2_flush_scan(chain, info);
 		__mp_unlock((struct __mp_lock *)&chain->core.cst.spin);
 		info->parent = parent;
+
+		/*
+		 * Join subtrees handed to the workers before this chain's
+		 * own block table update.  They lock chain as their parent.
+		 */
+		if (info->batch && info->depth == 0 && info->batch->pending) {
+			hammer2_chain_unlock(chain);
+			hammer2_flush_job_wait(info->batch);
+			hammer2_chain_lock(chain, HAMMER2_RESOLVE_MAYBE);
+		}
 		if (info->diddeferral)
 			hammer2_chain_setflush(info->trans, chain);
 	}
@@ -701,6 +958,7 @@ again:
 					 HAMMER2_VOLUME_ICRCVH_OFF,
 					HAMMER2_VOLUME_ICRCVH_SIZE);
 			hmp->volsync = hmp->voldata;
+			++hmp->volsync_seq;
 			atomic_set_int(&chain->flags, HAMMER2_CHAIN_VOLUMESYNC);
 			hammer2_chain_unlock(&hmp->fchain);
 			hammer2_voldata_unlock(hmp);
@@ -935,6 +1193,50 @@ done:
 	}
 }
 
+/*
+ * Run hammer2_flush_recurse() on each child in parent's rbtree, standing
+ * in for the RB_SCAN() this port lacks.  The callback can drop the core
+ * spinlock so the current child stays referenced across it and the scan
+ * resumes from its successor, or from the next key if it was removed
+ * meanwhile.
+ *
+ * parent->core spinlock is held on entry and return.
+ */
+static void
+hammer2_flush_scan(hammer2_chain_t *parent, hammer2_flush_info_t *info)
+{
+	hammer2_chain_t *child;
+	hammer2_chain_t *next;
+
+	child = RB_MIN(hammer2_chain_tree, &parent->core.rbtree);
+	if (child)
+		hammer2_chain_ref(child);
+	while (child) {
+		if ((child->flags & HAMMER2_CHAIN_ONRBTREE) &&
+		    child->parent == parent) {
+			hammer2_flush_recurse(child, info);
+		}
+		if ((child->flags & HAMMER2_CHAIN_ONRBTREE) &&
+		    child->parent == parent) {
+			next = RB_NEXT(hammer2_chain_tree,
+				       &parent->core.rbtree, child);
+		} else {
+			next = RB_NFIND(hammer2_chain_tree,
+					&parent->core.rbtree, child);
+		}
+		if (next)
+			hammer2_chain_ref(next);
+
+		/*
+		 * The last drop takes the core spinlock.
+		 */
+		__mp_unlock((struct __mp_lock *)&parent->core.cst.spin);
+		hammer2_chain_drop(child);
+		__mp_lock((struct __mp_lock *)&parent->core.cst.spin);
+		child = next;
+	}
+}
+
 /*
  * Flush recursion helper, called from flush_core, calls flush_core.
  *
@@ -954,6 +1256,10 @@ done:
  *
  * WARNING! Flushes do not cross PFS boundaries.  Specifically, a flush must
  *	    not cross a pfs-root boundary.
+ *
+ * At the top of a split flush (info->batch, depth 0) dirty children are
+ * independent subtrees and are queued to the PFS workers instead, to be
+ * joined by hammer2_flush_core().
  */
 static int
 hammer2_flush_recurse(hammer2_chain_t *child, void *data)
@@ -962,6 +1268,14 @@ hammer2_flush_recurse(hammer2_chain_t *child, void *data)
 	/*hammer2_trans_t *trans = info->trans;*/
 	hammer2_chain_t *parent = info->parent;
 
+	if (info->batch && info->depth == 0 &&
+	    (child->flags & HAMMER2_CHAIN_FLUSH_MASK) &&
+	    ((child->flags & HAMMER2_CHAIN_PFSBOUNDARY) == 0 ||
+	     child->pmp == NULL) &&
+	    hammer2_flush_job_queue(info->batch, info->trans, child, 0) == 0) {
+		return (0);
+	}
+
 	/*
 	 * (child can never be fchain or vchain so a special check isn't
 	 *  needed).
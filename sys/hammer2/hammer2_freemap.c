@@ -49,7 +49,9 @@
 struct hammer2_fiterate {
 	hammer2_off_t	bpref;
 	hammer2_off_t	bnext;
+	hammer2_off_t	resv_end;	/* end of new reservation or 0 */
 	int		loops;
+	int		resv;		/* try to reserve a run of words */
 };
 
 typedef struct hammer2_fiterate hammer2_fiterate_t;
@@ -61,7 +63,33 @@ static void hammer2_freemap_init(hammer2_trans_t *trans, hammer2_mount_t *hmp,
 			hammer2_key_t key, hammer2_chain_t *chain);
 static int hammer2_bmap_alloc(hammer2_trans_t *trans, hammer2_mount_t *hmp,
 			hammer2_bmap_data_t *bmap, uint16_t class,
-			int n, int radix, hammer2_key_t *basep);
+			int n, int radix, hammer2_off_t bpref,
+			hammer2_key_t *basep);
+static int hammer2_bmap_reserve(hammer2_trans_t *trans, hammer2_mount_t *hmp,
+			hammer2_bmap_data_t *bmap, uint16_t class,
+			hammer2_off_t bpref, hammer2_key_t *basep,
+			hammer2_off_t *endp);
+static hammer2_off_t hammer2_freemap_bpref(hammer2_trans_t *trans,
+			hammer2_chain_t *chain);
+static void hammer2_freemap_bpref_update(hammer2_trans_t *trans,
+			hammer2_chain_t *chain, int hadoff);
+static int hammer2_freemap_defrag_skip(hammer2_mount_t *hmp,
+			hammer2_off_t off, int *skippedp);
+static int hammer2_freemap_resv_carve(hammer2_freemap_resv_t *resv,
+			uint16_t class, int radix, hammer2_off_t *offp);
+static void hammer2_freemap_resv_pristine(hammer2_mount_t *hmp,
+			hammer2_off_t off, int radix);
+static void hammer2_freemap_resv_free(hammer2_trans_t *trans,
+			hammer2_mount_t *hmp, hammer2_chain_t **parentp,
+			hammer2_off_t beg, hammer2_off_t end);
+static hammer2_freemap_zsum_t *hammer2_freemap_sum_zone(hammer2_mount_t *hmp,
+			hammer2_off_t data_off);
+static void hammer2_freemap_sum_leaf(hammer2_mount_t *hmp,
+			hammer2_chain_t *chain);
+static void hammer2_freemap_sum_update(hammer2_mount_t *hmp,
+			hammer2_off_t data_off, hammer2_bmap_data_t *bmap);
+static int hammer2_freemap_sum_start(hammer2_mount_t *hmp, hammer2_key_t key,
+			uint64_t bit, int start);
 static int hammer2_freemap_iterate(hammer2_trans_t *trans,
 			hammer2_chain_t **parentp, hammer2_chain_t **chainp,
 			hammer2_fiterate_t *iter);
@@ -206,8 +234,9 @@ hammer2_freemap_reserve(hammer2_trans_t *trans, hammer2_chain_t *chain,
  * allocations using the iterator as allocated, instantiating new 2GB zones,
  * and dealing with the end-of-media edge case).
  *
- * ip and bpref are only used as a heuristic to determine locality of
- * reference.  bref->key may also be used heuristically.
+ * trans->tmp_ip and the chain's previous data_off are only used as a
+ * heuristic to determine locality of reference, see
+ * hammer2_freemap_bpref().
  */
 int
 hammer2_freemap_alloc(hammer2_trans_t *trans, hammer2_chain_t *chain,
@@ -216,8 +245,15 @@ hammer2_freemap_alloc(hammer2_trans_t *trans, hammer2_chain_t *chain,
 	hammer2_mount_t *hmp = chain->hmp;
 	hammer2_blockref_t *bref = &chain->bref;
 	hammer2_chain_t *parent;
+	struct hammer2_freemap_pcpu *fp;
+	hammer2_freemap_resv_t nresv;
+	hammer2_freemap_resv_t oresv;
+	hammer2_off_t off;
+	hammer2_off_t bpref;
+	uint16_t class;
 	int radix;
 	int error;
+	int hadoff;
 	unsigned int hindex;
 	hammer2_fiterate_t iter;
 
@@ -241,9 +277,7 @@ hammer2_freemap_alloc(hammer2_trans_t *trans, hammer2_chain_t *chain,
 	}
 
 	KKASSERT(bytes >= HAMMER2_ALLOC_MIN && bytes <= HAMMER2_ALLOC_MAX);
-
-	if (trans->flags & (HAMMER2_TRANS_ISFLUSH | HAMMER2_TRANS_PREFLUSH))
-		++trans->sync_xid;
+	class = (bref->type << 8) | hammer2_devblkradix(radix);
 
 	/*
 	 * Calculate the starting point for our allocation search.
@@ -258,16 +292,15 @@ hammer2_freemap_alloc(hammer2_trans_t *trans, hammer2_chain_t *chain,
 	 * The single most important aspect of this is the inode grouping
 	 * because that is what allows 'find' and 'ls' and other filesystem
 	 * topology operations to run fast.
+	 *
+	 * Within a class we prefer space near the block's previous copy,
+	 * the file's last data block, or the parent directory's inodes.
+	 * Allocations without a locality hint fall back to the per-class
+	 * heuristic below.
 	 */
-#if 0
-	if (bref->data_off & ~HAMMER2_OFF_MASK_RADIX)
-		bpref = bref->data_off & ~HAMMER2_OFF_MASK_RADIX;
-	else if (trans->tmp_bpref)
-		bpref = trans->tmp_bpref;
-	else if (trans->tmp_ip)
-		bpref = trans->tmp_ip->chain->bref.data_off;
-	else
-#endif
+	bpref = hammer2_freemap_bpref(trans, chain);
+	hadoff = (bref->data_off & ~HAMMER2_OFF_MASK_RADIX) != 0;
+
 	/*
 	 * Heuristic tracking index.  We would like one for each distinct
 	 * bref type if possible.  heur_freemap[] has room for two classes
@@ -280,7 +313,47 @@ hammer2_freemap_alloc(hammer2_trans_t *trans, hammer2_chain_t *chain,
 	hindex &= HAMMER2_FREEMAP_HEUR_TYPES * HAMMER2_FREEMAP_HEUR_NRADIX - 1;
 	KKASSERT(hindex < HAMMER2_FREEMAP_HEUR);
 
-	iter.bpref = hmp->heur_freemap[hindex];
+	/*
+	 * Carve the allocation out of this cpu's reservation for the
+	 * heuristic index if possible.  The reservation is already marked
+	 * allocated in the freemap so neither fchain nor the leaf has to
+	 * be locked.  The batch freeing code always goes through the
+	 * freemap.
+	 *
+	 * A hinted allocation only uses the reservation if it lies in the
+	 * same 2MB segment as the hint, otherwise the hint is honored with
+	 * a plain allocation and the reservation is left intact for
+	 * unrelated allocations.  Only an allocation which was eligible
+	 * for the reservation and found it exhausted creates a new one.
+	 */
+	iter.resv = 0;
+	iter.resv_end = 0;
+	if (hmp->freemap_pcpu &&
+	    (trans->flags & HAMMER2_TRANS_FREEBATCH) == 0) {
+		fp = &hmp->freemap_pcpu[cpu_number() % hmp->freemap_ncpus];
+		mtx_enter(&fp->mtx);
+		if (bpref == 0 ||
+		    ((fp->resv[hindex].cur ^ bpref) &
+		     ~HAMMER2_SEGMASK64) == 0) {
+			error = hammer2_freemap_resv_carve(&fp->resv[hindex],
+							   class, radix, &off);
+			iter.resv = 1;
+		} else {
+			error = ENOSPC;
+		}
+		mtx_leave(&fp->mtx);
+		if (error == 0) {
+			hammer2_freemap_resv_pristine(hmp, off, radix);
+			bref->data_off = off | radix;
+			hammer2_freemap_bpref_update(trans, chain, hadoff);
+			return (0);
+		}
+	}
+
+	if (trans->flags & (HAMMER2_TRANS_ISFLUSH | HAMMER2_TRANS_PREFLUSH))
+		++trans->sync_xid;
+
+	iter.bpref = bpref ? bpref : hmp->heur_freemap[hindex];
 
 	/*
 	 * Make sure bpref is in-bounds.  It's ok if bpref covers a zone's
@@ -302,15 +375,134 @@ hammer2_freemap_alloc(hammer2_trans_t *trans, hammer2_chain_t *chain,
 		error = hammer2_freemap_try_alloc(trans, &parent, bref,
 						  radix, &iter);
 	}
-	hmp->heur_freemap[hindex] = iter.bnext;
+	if (bpref == 0)
+		hmp->heur_freemap[hindex] = iter.bnext;
+
+	/*
+	 * The space may have been freed by the bulk free code and still be
+	 * queued for discard, including the rest of a new reservation.
+	 */
+	if (error == 0) {
+		off = bref->data_off & ~HAMMER2_OFF_MASK_RADIX;
+		hammer2_discard_cancel(hmp, off,
+				       iter.resv_end ? iter.resv_end :
+						       off + bytes);
+	}
+
+	/*
+	 * If a new reservation was made our allocation sits at its base.
+	 * Install the remainder as this cpu's reservation and return the
+	 * unused tail of the one it replaces to the freemap.  We may have
+	 * migrated or raced another allocator on this cpu, it doesn't
+	 * matter which reservation gets displaced.
+	 */
+	if (error == 0 && iter.resv_end) {
+		off = bref->data_off & ~HAMMER2_OFF_MASK_RADIX;
+		nresv.beg = off;
+		nresv.cur = off;
+		nresv.end = iter.resv_end;
+		nresv.class = class;
+		error = hammer2_freemap_resv_carve(&nresv, class, radix, &off);
+		KKASSERT(error == 0 &&
+			 off == (bref->data_off & ~HAMMER2_OFF_MASK_RADIX));
+		hammer2_freemap_resv_pristine(hmp, off, radix);
+
+		fp = &hmp->freemap_pcpu[cpu_number() % hmp->freemap_ncpus];
+		mtx_enter(&fp->mtx);
+		oresv = fp->resv[hindex];
+		fp->resv[hindex] = nresv;
+		mtx_leave(&fp->mtx);
+		if (oresv.cur < oresv.end) {
+			hammer2_freemap_resv_free(trans, hmp, &parent,
+						  oresv.cur, oresv.end);
+		}
+	}
 	hammer2_chain_unlock(parent);
 
 	if (trans->flags & (HAMMER2_TRANS_ISFLUSH | HAMMER2_TRANS_PREFLUSH))
 		--trans->sync_xid;
+	if (error == 0)
+		hammer2_freemap_bpref_update(trans, chain, hadoff);
 
 	return (error);
 }
 
+/*
+ * Select the preferred starting point for an allocation, or 0 if there is
+ * no locality hint.
+ *
+ * A block being reallocated (copy-on-write or resize) is placed near its
+ * previous copy.  Otherwise trans->tmp_ip is the inode whose data is being
+ * written, or the directory a new inode is being created in.  New data and
+ * indirect blocks follow the file's data cursor and new inodes follow the
+ * directory's inode cursor, falling back to the location of the inode
+ * itself so a file's first blocks land near it.
+ *
+ * The hint only selects where the search starts.  The per-class segment
+ * grouping done by the freemap is unaffected.
+ */
+static
+hammer2_off_t
+hammer2_freemap_bpref(hammer2_trans_t *trans, hammer2_chain_t *chain)
+{
+	hammer2_inode_t *ip;
+	hammer2_chain_t *focus;
+	hammer2_off_t bpref;
+
+	bpref = chain->bref.data_off & ~HAMMER2_OFF_MASK_RADIX;
+	if (bpref)
+		return (bpref);
+	if ((ip = trans->tmp_ip) == NULL)
+		return (0);
+
+	switch(chain->bref.type) {
+	case HAMMER2_BREF_TYPE_INODE:
+		bpref = ip->inode_cursor;
+		break;
+	case HAMMER2_BREF_TYPE_INDIRECT:
+	case HAMMER2_BREF_TYPE_DATA:
+		bpref = ip->data_cursor;
+		break;
+	default:
+		return (0);
+	}
+	if (bpref == 0 && (focus = ip->cluster.focus) != NULL)
+		bpref = focus->bref.data_off & ~HAMMER2_OFF_MASK_RADIX;
+	return (bpref);
+}
+
+/*
+ * Advance the cursor of trans->tmp_ip past a successful allocation.  Only
+ * new blocks move the cursors, a copy-on-write stays near its old copy and
+ * does not pull the file's following blocks along with it.
+ *
+ * The cursors are hints and are updated without locking the inode.
+ */
+static
+void
+hammer2_freemap_bpref_update(hammer2_trans_t *trans, hammer2_chain_t *chain,
+			     int hadoff)
+{
+	hammer2_inode_t *ip;
+	hammer2_off_t off;
+
+	if ((ip = trans->tmp_ip) == NULL || hadoff)
+		return;
+	off = (chain->bref.data_off & ~HAMMER2_OFF_MASK_RADIX) +
+	      ((size_t)1 << (chain->bref.data_off & HAMMER2_OFF_MASK_RADIX));
+
+	switch(chain->bref.type) {
+	case HAMMER2_BREF_TYPE_INODE:
+		ip->inode_cursor = off;
+		break;
+	case HAMMER2_BREF_TYPE_DATA:
+		ip->data_cursor = off;
+		break;
+	default:
+		break;
+	}
+}
+
 static int
 hammer2_freemap_try_alloc(hammer2_trans_t *trans, hammer2_chain_t **parentp,
 			  hammer2_blockref_t *bref, int radix,
@@ -323,6 +515,8 @@ hammer2_freemap_try_alloc(hammer2_trans_t *trans, hammer2_chain_t **parentp,
 	hammer2_key_t key_dummy;
 	hammer2_chain_t *chain;
 	hammer2_off_t key;
+	hammer2_freemap_zsum_t *zsum;
+	uint64_t zbit;
 	size_t bytes;
 	uint16_t class;
 	int error = 0;
@@ -351,6 +545,17 @@ hammer2_freemap_try_alloc(hammer2_trans_t *trans, hammer2_chain_t **parentp,
 	l1size = H2FMSHIFT(HAMMER2_FREEMAP_LEVEL1_RADIX);
 	l1mask = l1size - 1;
 
+	/*
+	 * Skip zones the summary knows cannot satisfy the request without
+	 * looking up (and possibly reading) their leaf.
+	 */
+	zsum = hammer2_freemap_sum_zone(hmp, key);
+	zbit = HAMMER2_FREEMAP_ZSUM_BIT(bref->type, radix);
+	if (zsum && zsum->nfree == 0 && (zsum->radixmask & zbit) == 0) {
+		chain = NULL;
+		return (hammer2_freemap_iterate(trans, parentp, &chain, iter));
+	}
+
 	chain = hammer2_chain_lookup(parentp, &key_dummy, key, key + l1mask,
 				     &cache_index,
 				     HAMMER2_LOOKUP_ALWAYS |
@@ -381,6 +586,7 @@ hammer2_freemap_try_alloc(hammer2_trans_t *trans, hammer2_chain_t **parentp,
 			/* bref.methods should already be inherited */
 
 			hammer2_freemap_init(trans, hmp, key, chain);
+			hammer2_freemap_sum_leaf(hmp, chain);
 		}
 	} else if ((chain->bref.check.freemap.bigmask & (1 << radix)) == 0) {
 		/*
@@ -392,6 +598,8 @@ hammer2_freemap_try_alloc(hammer2_trans_t *trans, hammer2_chain_t **parentp,
 		 * Modify existing chain to setup for adjustment.
 		 */
 		hammer2_chain_modify(trans, chain, 0);
+		if (zsum == NULL)
+			hammer2_freemap_sum_leaf(hmp, chain);
 	}
 
 	/*
@@ -400,6 +608,7 @@ hammer2_freemap_try_alloc(hammer2_trans_t *trans, hammer2_chain_t **parentp,
 	if (error == 0) {
 		hammer2_bmap_data_t *bmap;
 		hammer2_key_t base_key;
+		int skipped = 0;
 		int count;
 		int start;
 		int n;
@@ -408,6 +617,7 @@ hammer2_freemap_try_alloc(hammer2_trans_t *trans, hammer2_chain_t **parentp,
 		start = (int)((iter->bnext - key) >>
 			      HAMMER2_FREEMAP_LEVEL0_RADIX);
 		KKASSERT(start >= 0 && start < HAMMER2_FREEMAP_COUNT);
+		start = hammer2_freemap_sum_start(hmp, key, zbit, start);
 		hammer2_chain_modify(trans, chain, 0);
 
 		error = ENOSPC;
@@ -419,11 +629,24 @@ hammer2_freemap_try_alloc(hammer2_trans_t *trans, hammer2_chain_t **parentp,
 			n = start + count;
 			bmap = &chain->data->bmdata[n];
 			if (n < HAMMER2_FREEMAP_COUNT && bmap->avail &&
-			    (bmap->class == 0 || bmap->class == class)) {
+			    (bmap->class == 0 || bmap->class == class) &&
+			    hammer2_freemap_defrag_skip(hmp, key + n * l0size,
+							&skipped) == 0) {
 				base_key = key + n * l0size;
-				error = hammer2_bmap_alloc(trans, hmp, bmap,
-							   class, n, radix,
-							   &base_key);
+				error = ENOSPC;
+				if (iter->resv) {
+					error = hammer2_bmap_reserve(trans,
+							hmp, bmap, class,
+							iter->bnext,
+							&base_key,
+							&iter->resv_end);
+				}
+				if (error == ENOSPC) {
+					error = hammer2_bmap_alloc(trans, hmp,
+							bmap, class, n, radix,
+							iter->bnext,
+							&base_key);
+				}
 				if (error != ENOSPC) {
 					key = base_key;
 					break;
@@ -432,19 +655,39 @@ hammer2_freemap_try_alloc(hammer2_trans_t *trans, hammer2_chain_t **parentp,
 			n = start - count;
 			bmap = &chain->data->bmdata[n];
 			if (n >= 0 && bmap->avail &&
-			    (bmap->class == 0 || bmap->class == class)) {
+			    (bmap->class == 0 || bmap->class == class) &&
+			    hammer2_freemap_defrag_skip(hmp, key + n * l0size,
+							&skipped) == 0) {
 				base_key = key + n * l0size;
-				error = hammer2_bmap_alloc(trans, hmp, bmap,
-							   class, n, radix,
-							   &base_key);
+				error = ENOSPC;
+				if (iter->resv) {
+					error = hammer2_bmap_reserve(trans,
+							hmp, bmap, class,
+							iter->bnext,
+							&base_key,
+							&iter->resv_end);
+				}
+				if (error == ENOSPC) {
+					error = hammer2_bmap_alloc(trans, hmp,
+							bmap, class, n, radix,
+							iter->bnext,
+							&base_key);
+				}
 				if (error != ENOSPC) {
 					key = base_key;
 					break;
 				}
 			}
 		}
-		if (error == ENOSPC)
+		/*
+		 * Segments being defragmented are not really full, do not
+		 * hide the leaf from later allocations.
+		 */
+		if (error == ENOSPC && skipped == 0) {
 			chain->bref.check.freemap.bigmask &= ~(1 << radix);
+			if ((zsum = hammer2_freemap_sum_zone(hmp, key)) != NULL)
+				zsum->radixmask &= ~zbit;
+		}
 		/* XXX also scan down from original count */
 	}
 
@@ -486,7 +729,8 @@ hammer2_freemap_try_alloc(hammer2_trans_t *trans, hammer2_chain_t **parentp,
  *
  * If the linear iterator is mid-block we use it directly (the bitmap should
  * already be marked allocated), otherwise we search for a block in the bitmap
- * that fits the allocation request.
+ * that fits the allocation request.  If bpref lies within this bmap the
+ * search starts at bpref and wraps.
  *
  * A partial bitmap allocation sets the minimum bitmap granularity (16KB)
  * to fully allocated and adjusts the linear allocator to allow the
@@ -496,15 +740,17 @@ static
 int
 hammer2_bmap_alloc(hammer2_trans_t *trans, hammer2_mount_t *hmp,
 		   hammer2_bmap_data_t *bmap,
-		   uint16_t class, int n, int radix, hammer2_key_t *basep)
+		   uint16_t class, int n, int radix, hammer2_off_t bpref,
+		   hammer2_key_t *basep)
 {
-	hammer2_io_t *dio;
 	size_t size;
 	size_t bsize;
 	int bmradix;
 	uint32_t bmmask;
 	int offset;
-	int error;
+	int nslots;
+	int slot;
+	int k;
 	int i;
 	int j;
 
@@ -558,14 +804,24 @@ hammer2_bmap_alloc(hammer2_trans_t *trans, hammer2_mount_t *hmp,
 		bmmask <<= j;
 		bmap->linear = offset + size;
 	} else {
-		for (i = 0; i < 8; ++i) {
+		/*
+		 * Scan the (bsize) slots, starting at the slot containing
+		 * bpref if it lies within this bmap.
+		 */
+		nslots = HAMMER2_SEGSIZE / bsize;
+		if (((*basep ^ bpref) & ~HAMMER2_SEGMASK64) == 0)
+			slot = (int)(bpref & HAMMER2_SEGMASK64) / bsize;
+		else
+			slot = 0;
+		for (k = 0; k < nslots; ++k, ++slot) {
+			if (slot == nslots)
+				slot = 0;
+			i = slot / (32 / bmradix);
+			j = (slot % (32 / bmradix)) * bmradix;
 			bmmask = (bmradix == 32) ?
-				 0xFFFFFFFFU : (1 << bmradix) - 1;
-			for (j = 0; j < 32; j += bmradix) {
-				if ((bmap->bitmap[i] & bmmask) == 0)
-					goto success;
-				bmmask <<= bmradix;
-			}
+				 0xFFFFFFFFU : ((1 << bmradix) - 1) << j;
+			if ((bmap->bitmap[i] & bmmask) == 0)
+				goto success;
 		}
 		/*fragments might remain*/
 		/*KKASSERT(bmap->avail == 0);*/
@@ -607,11 +863,10 @@ success:
 #endif
 
 		if ((bmap->bitmap[i] & pbmmask) == 0) {
-			error = hammer2_io_newq(hmp,
-						(*basep + (offset & ~pmask)) |
-						 pradix,
-						psize, &dio);
-			hammer2_io_bqrelse(&dio);
+			hammer2_io_pristine(hmp,
+					    (*basep + (offset & ~pmask)) |
+					     pradix,
+					    psize);
 		}
 	}
 
@@ -644,6 +899,66 @@ success:
 	bmap->class = class;
 	bmap->avail -= size;
 	*basep += offset;
+	hammer2_freemap_sum_update(hmp, *basep, bmap);
+
+	hammer2_voldata_lock(hmp);
+	hammer2_voldata_modify(hmp);
+	hmp->voldata.allocator_free -= size;  /* XXX */
+	hammer2_voldata_unlock(hmp);
+
+	return(0);
+}
+
+/*
+ * Reserve a run of up to HAMMER2_FREEMAP_RESV_WORDS fully-free bitmap
+ * words (256KB each) from the bmap whos base data offset is (*basep).
+ * The whole run is marked allocated and accounted for, *basep is
+ * adjusted to the start of the run and *endp is set to its end.
+ *
+ * The search starts at the word containing bpref if it lies within this
+ * bmap and wraps.
+ *
+ * Returns ENOSPC if the bmap has no fully-free word, the caller then
+ * falls back to a normal hammer2_bmap_alloc().
+ */
+static
+int
+hammer2_bmap_reserve(hammer2_trans_t *trans, hammer2_mount_t *hmp,
+		     hammer2_bmap_data_t *bmap, uint16_t class,
+		     hammer2_off_t bpref, hammer2_key_t *basep,
+		     hammer2_off_t *endp)
+{
+	size_t size;
+	int k;
+	int i;
+	int j;
+
+	if (((*basep ^ bpref) & ~HAMMER2_SEGMASK64) == 0)
+		i = (int)(bpref & HAMMER2_SEGMASK64) / (HAMMER2_SEGSIZE / 8);
+	else
+		i = 0;
+	for (k = 0; k < 8; ++k, i = (i + 1) & 7) {
+		if (bmap->bitmap[i] == 0)
+			break;
+	}
+	if (k == 8)
+		return (ENOSPC);
+	for (j = i + 1; j < 8 && j - i < HAMMER2_FREEMAP_RESV_WORDS; ++j) {
+		if (bmap->bitmap[j])
+			break;
+	}
+	size = (size_t)(j - i) * (HAMMER2_SEGSIZE / 8);
+	if (bmap->avail < size)
+		return (ENOSPC);
+
+	while (i < j) {
+		bmap->bitmap[--j] = 0xFFFFFFFFU;
+	}
+	bmap->class = class;
+	bmap->avail -= size;
+	*basep += i * (HAMMER2_SEGSIZE / 8);
+	*endp = *basep + size;
+	hammer2_freemap_sum_update(hmp, *basep, bmap);
 
 	hammer2_voldata_lock(hmp);
 	hammer2_voldata_modify(hmp);
@@ -848,6 +1163,7 @@ hammer2_freemap_adjust(hammer2_trans_t *trans, hammer2_mount_t *hmp,
 			/* bref.methods should already be inherited */
 
 			hammer2_freemap_init(trans, hmp, key, chain);
+			hammer2_freemap_sum_leaf(hmp, chain);
 		}
 		/* XXX handle error */
 	}
@@ -990,10 +1306,777 @@ again:
 	 * doesn't hurt and we might want to use the hint for other validation
 	 * operations later on.
 	 */
-	if (modified)
+	if (modified) {
 		chain->bref.check.freemap.bigmask |= 1 << radix;
+		hammer2_freemap_sum_update(hmp, data_off, bmap);
+	}
 
 	hammer2_chain_unlock(chain);
 done:
 	hammer2_chain_unlock(parent);
 }
+
+/*
+ * Per-cpu reservation support.
+ *
+ * Carve a (1<<radix) allocation out of a reservation, returning the data
+ * offset in *offp.  Allocations are naturally aligned and never cross a
+ * device block since all sizes are powers of 2.  Called with the per-cpu
+ * mutex held (or on a private copy), must not block.
+ */
+static
+int
+hammer2_freemap_resv_carve(hammer2_freemap_resv_t *resv, uint16_t class,
+			   int radix, hammer2_off_t *offp)
+{
+	hammer2_off_t size = (hammer2_off_t)1 << radix;
+	hammer2_off_t off;
+
+	if (resv->cur >= resv->end || resv->class != class)
+		return (ENOSPC);
+	off = (resv->cur + size - 1) & ~(size - 1);
+	if (off + size > resv->end)
+		return (ENOSPC);
+	resv->cur = off + size;
+	*offp = off;
+
+	return (0);
+}
+
+/*
+ * Reservations start out entirely free so the first allocation into
+ * each device block can skip the read-before-write, the same as
+ * hammer2_bmap_alloc() does for fresh bitmap blocks.
+ */
+static
+void
+hammer2_freemap_resv_pristine(hammer2_mount_t *hmp, hammer2_off_t off,
+			      int radix)
+{
+	size_t size = (size_t)1 << radix;
+	size_t psize = hammer2_devblksize(size);
+
+	if (psize != size && (off & (psize - 1)) == 0)
+		hammer2_io_pristine(hmp, off | hammer2_getradix(psize), psize);
+}
+
+/*
+ * Return the unused portion [beg, end) of a reservation to the freemap.
+ * Only whole 16KB freemap blocks can be returned, a partially carved
+ * block stays allocated (the same as a partially used linear block).
+ * The range always lies within a single 2MB bmap.
+ *
+ * Called with *parentp (fchain) locked.
+ */
+static
+void
+hammer2_freemap_resv_free(hammer2_trans_t *trans, hammer2_mount_t *hmp,
+			  hammer2_chain_t **parentp,
+			  hammer2_off_t beg, hammer2_off_t end)
+{
+	hammer2_chain_t *chain;
+	hammer2_bmap_data_t *bmap;
+	hammer2_key_t key;
+	hammer2_key_t key_dummy;
+	hammer2_off_t l1mask;
+	uint32_t *bitmap;
+	size_t freed;
+	int cache_index = -1;
+	int ddflag;
+	int i;
+
+	beg = (beg + HAMMER2_FREEMAP_BLOCK_MASK) &
+	      ~(hammer2_off_t)HAMMER2_FREEMAP_BLOCK_MASK;
+	if (beg >= end)
+		return;
+	KKASSERT((beg & ~HAMMER2_SEGMASK64) ==
+		 ((end - 1) & ~HAMMER2_SEGMASK64));
+
+	key = H2FMBASE(beg, HAMMER2_FREEMAP_LEVEL1_RADIX);
+	l1mask = H2FMSHIFT(HAMMER2_FREEMAP_LEVEL1_RADIX) - 1;
+	chain = hammer2_chain_lookup(parentp, &key_dummy, key, key + l1mask,
+				     &cache_index,
+				     HAMMER2_LOOKUP_ALWAYS |
+				     HAMMER2_LOOKUP_MATCHIND, &ddflag);
+	if (chain == NULL) {
+		printf("hammer2_freemap_resv_free: %016jx: no chain\n",
+			beg);
+		return;
+	}
+	hammer2_chain_modify(trans, chain, 0);
+
+	bmap = &chain->data->bmdata[(int)(beg >> HAMMER2_SEGRADIX) &
+				    (HAMMER2_FREEMAP_COUNT - 1)];
+	freed = 0;
+	while (beg < end) {
+		bitmap = &bmap->bitmap[(int)(beg >>
+					     (HAMMER2_SEGRADIX - 3)) & 7];
+		i = ((int)(beg >> HAMMER2_FREEMAP_BLOCK_RADIX) & 15) * 2;
+		KKASSERT(((*bitmap >> i) & 3) == 3);
+		*bitmap &= ~(3U << i);
+		freed += HAMMER2_FREEMAP_BLOCK_SIZE;
+		beg += HAMMER2_FREEMAP_BLOCK_SIZE;
+	}
+	bmap->avail += freed;
+	KKASSERT(bmap->avail <= HAMMER2_SEGSIZE);
+	if (bmap->avail == HAMMER2_SEGSIZE &&
+	    bmap->bitmap[0] == 0 &&
+	    bmap->bitmap[1] == 0 &&
+	    bmap->bitmap[2] == 0 &&
+	    bmap->bitmap[3] == 0 &&
+	    bmap->bitmap[4] == 0 &&
+	    bmap->bitmap[5] == 0 &&
+	    bmap->bitmap[6] == 0 &&
+	    bmap->bitmap[7] == 0) {
+		bmap->class = 0;
+	}
+
+	/*
+	 * Any allocation size might fit now, re-enable the hints.
+	 */
+	for (i = HAMMER2_RADIX_MIN; i <= HAMMER2_RADIX_MAX; ++i)
+		chain->bref.check.freemap.bigmask |= 1 << i;
+	hammer2_freemap_sum_update(hmp, end - 1, bmap);
+	hammer2_chain_unlock(chain);
+
+	hammer2_voldata_lock(hmp);
+	hammer2_voldata_modify(hmp);
+	hmp->voldata.allocator_free += freed;
+	hammer2_voldata_unlock(hmp);
+}
+
+/*
+ * Setup the per-cpu reservations at mount time.
+ */
+void
+hammer2_freemap_resv_init(hammer2_mount_t *hmp)
+{
+	struct hammer2_freemap_pcpu *fp;
+	int i;
+
+	hmp->freemap_ncpus = ncpus;
+	hmp->freemap_pcpu = malloc(sizeof(*fp) * hmp->freemap_ncpus,
+				   M_HAMMER2, M_WAITOK | M_ZERO);
+	for (i = 0; i < hmp->freemap_ncpus; ++i) {
+		fp = &hmp->freemap_pcpu[i];
+		mtx_init(&fp->mtx, IPL_NONE);
+	}
+}
+
+/*
+ * Called by hammer2_vfs_sync() prior to flushing fchain.  Return the
+ * unused portions of every cpu's reservations to the freemap so they
+ * are not committed to media as allocated.
+ */
+void
+hammer2_freemap_resv_release(hammer2_trans_t *trans, hammer2_mount_t *hmp)
+{
+	struct hammer2_freemap_pcpu *fp;
+	hammer2_freemap_resv_t resv;
+	hammer2_chain_t *parent;
+	int i;
+	int j;
+
+	if (hmp->freemap_pcpu == NULL)
+		return;
+
+	if (trans->flags & (HAMMER2_TRANS_ISFLUSH | HAMMER2_TRANS_PREFLUSH))
+		++trans->sync_xid;
+
+	parent = &hmp->fchain;
+	hammer2_chain_lock(parent, HAMMER2_RESOLVE_ALWAYS);
+	for (i = 0; i < hmp->freemap_ncpus; ++i) {
+		fp = &hmp->freemap_pcpu[i];
+		for (j = 0; j < HAMMER2_FREEMAP_HEUR; ++j) {
+			mtx_enter(&fp->mtx);
+			resv = fp->resv[j];
+			bzero(&fp->resv[j], sizeof(fp->resv[j]));
+			mtx_leave(&fp->mtx);
+			if (resv.cur < resv.end) {
+				hammer2_freemap_resv_free(trans, hmp, &parent,
+							  resv.cur, resv.end);
+			}
+		}
+	}
+	hammer2_chain_unlock(parent);
+
+	if (trans->flags & (HAMMER2_TRANS_ISFLUSH | HAMMER2_TRANS_PREFLUSH))
+		--trans->sync_xid;
+}
+
+/*
+ * Called at unmount after the final sync has released all reservations.
+ */
+void
+hammer2_freemap_resv_destroy(hammer2_mount_t *hmp)
+{
+	if (hmp->freemap_pcpu) {
+		free(hmp->freemap_pcpu, M_HAMMER2, 0);
+		hmp->freemap_pcpu = NULL;
+	}
+}
+
+/*
+ * Freemap summary support.  All of these are called with fchain locked.
+ *
+ * Return the summary for the zone containing data_off, or NULL if the
+ * zone has not been summarized yet (or lies beyond the volume size
+ * the summary was sized for).
+ */
+static
+hammer2_freemap_zsum_t *
+hammer2_freemap_sum_zone(hammer2_mount_t *hmp, hammer2_off_t data_off)
+{
+	hammer2_freemap_zsum_t *zsum;
+	hammer2_off_t zone;
+
+	zone = data_off >> HAMMER2_FREEMAP_LEVEL1_RADIX;
+	if (hmp->freemap_zsum == NULL || zone >= hmp->freemap_nzones)
+		return (NULL);
+	zsum = &hmp->freemap_zsum[zone];
+	if ((zsum->flags & HAMMER2_FREEMAP_ZSUM_VALID) == 0)
+		return (NULL);
+	return (zsum);
+}
+
+/*
+ * Return the (type, radix) bits a segment of the specified class can
+ * satisfy.  A class covers every radix mapping to its device block size.
+ */
+static __inline
+uint64_t
+hammer2_freemap_sum_classbits(uint16_t class)
+{
+	uint64_t bits = 0;
+	int type = class >> 8;
+	int radix = class & 0xFF;
+
+	do {
+		bits |= HAMMER2_FREEMAP_ZSUM_BIT(type, radix);
+	} while (--radix >= HAMMER2_RADIX_MIN &&
+		 hammer2_devblkradix(radix) == (class & 0xFF));
+	return (bits);
+}
+
+/*
+ * Recalculate the summary state of the segment containing data_off
+ * after its bmap has been modified.
+ */
+static
+void
+hammer2_freemap_sum_update(hammer2_mount_t *hmp, hammer2_off_t data_off,
+			   hammer2_bmap_data_t *bmap)
+{
+	hammer2_freemap_zsum_t *zsum;
+	uint32_t *segp;
+	uint32_t mask;
+	hammer2_off_t seg;
+
+	if ((zsum = hammer2_freemap_sum_zone(hmp, data_off)) == NULL)
+		return;
+	seg = data_off >> HAMMER2_SEGRADIX;
+	segp = &hmp->freemap_segfree[seg >> 5];
+	mask = 1U << (seg & 31);
+
+	if (bmap->class == 0 && bmap->avail) {
+		if ((*segp & mask) == 0) {
+			*segp |= mask;
+			++zsum->nfree;
+		}
+	} else {
+		if (*segp & mask) {
+			*segp &= ~mask;
+			--zsum->nfree;
+		}
+		if (bmap->avail)
+			zsum->radixmask |=
+				hammer2_freemap_sum_classbits(bmap->class);
+	}
+}
+
+/*
+ * Build the summary for a freemap leaf the first time it is seen.
+ */
+static
+void
+hammer2_freemap_sum_leaf(hammer2_mount_t *hmp, hammer2_chain_t *chain)
+{
+	hammer2_freemap_zsum_t *zsum;
+	hammer2_bmap_data_t *bmap;
+	hammer2_off_t zone;
+	hammer2_off_t key;
+	int n;
+
+	KKASSERT(chain->bref.type == HAMMER2_BREF_TYPE_FREEMAP_LEAF);
+	zone = chain->bref.key >> HAMMER2_FREEMAP_LEVEL1_RADIX;
+	if (hmp->freemap_zsum == NULL || zone >= hmp->freemap_nzones)
+		return;
+	zsum = &hmp->freemap_zsum[zone];
+	bzero(zsum, sizeof(*zsum));
+	bzero(&hmp->freemap_segfree[zone * (HAMMER2_FREEMAP_COUNT / 32)],
+	      HAMMER2_FREEMAP_COUNT / 8);
+	zsum->flags = HAMMER2_FREEMAP_ZSUM_VALID;
+
+	key = H2FMBASE(chain->bref.key, HAMMER2_FREEMAP_LEVEL1_RADIX);
+	bmap = &chain->data->bmdata[0];
+	for (n = 0; n < HAMMER2_FREEMAP_COUNT; ++n) {
+		hammer2_freemap_sum_update(hmp, key, bmap);
+		key += H2FMSHIFT(HAMMER2_FREEMAP_LEVEL0_RADIX);
+		++bmap;
+	}
+}
+
+/*
+ * Pick the bmap index to start scanning a leaf at.  If no partially
+ * filled segment of our class can satisfy the request, jump to the
+ * free segment nearest to start.
+ */
+static
+int
+hammer2_freemap_sum_start(hammer2_mount_t *hmp, hammer2_key_t key,
+			  uint64_t bit, int start)
+{
+	hammer2_freemap_zsum_t *zsum;
+	uint32_t *segfree;
+	int count;
+	int n;
+
+	zsum = hammer2_freemap_sum_zone(hmp, key);
+	if (zsum == NULL || (zsum->radixmask & bit) || zsum->nfree == 0)
+		return (start);
+	segfree = &hmp->freemap_segfree[(key >> HAMMER2_SEGRADIX) >> 5];
+
+	for (count = 0; count < HAMMER2_FREEMAP_COUNT; ++count) {
+		n = start + count;
+		if (n < HAMMER2_FREEMAP_COUNT &&
+		    (segfree[n >> 5] & (1U << (n & 31)))) {
+			return (n);
+		}
+		n = start - count;
+		if (n >= 0 && (segfree[n >> 5] & (1U << (n & 31))))
+			return (n);
+	}
+	return (start);
+}
+
+/*
+ * Size the summary for the volume at mount time, after the volume
+ * header has been loaded.  Zones are summarized lazily so mounting
+ * does not have to read every freemap leaf.
+ */
+void
+hammer2_freemap_sum_init(hammer2_mount_t *hmp)
+{
+	hammer2_off_t nzones;
+
+	nzones = (hmp->voldata.volu_size +
+		  H2FMSHIFT(HAMMER2_FREEMAP_LEVEL1_RADIX) - 1) >>
+		 HAMMER2_FREEMAP_LEVEL1_RADIX;
+	hmp->freemap_nzones = (int)nzones;
+	hmp->freemap_zsum = malloc(sizeof(*hmp->freemap_zsum) * nzones,
+				   M_HAMMER2, M_WAITOK | M_ZERO);
+	hmp->freemap_segfree = malloc(nzones * (HAMMER2_FREEMAP_COUNT / 8),
+				      M_HAMMER2, M_WAITOK | M_ZERO);
+}
+
+void
+hammer2_freemap_sum_destroy(hammer2_mount_t *hmp)
+{
+	if (hmp->freemap_zsum) {
+		free(hmp->freemap_zsum, M_HAMMER2, 0);
+		hmp->freemap_zsum = NULL;
+	}
+	if (hmp->freemap_segfree) {
+		free(hmp->freemap_segfree, M_HAMMER2, 0);
+		hmp->freemap_segfree = NULL;
+	}
+	hmp->freemap_nzones = 0;
+}
+
+/*
+ * Bulk free support.  Merge one segment's scan bitmap (sbmap) into its
+ * live bmap.  If stats is NULL nothing is modified and non-zero is
+ * returned if anything would change.
+ *
+ * Freed blocks are accumulated into the discard run [dbeg, dend), which
+ * is handed to hammer2_discard_queue() whenever a block does not extend
+ * it.  base is the data offset of the segment.
+ */
+static
+int
+hammer2_bmap_bulkfree(hammer2_mount_t *hmp, hammer2_bmap_data_t *bmap,
+		      hammer2_bmap_data_t *sbmap, int dostage, int dofree,
+		      hammer2_ioc_bulkfree_t *stats, hammer2_off_t base,
+		      hammer2_off_t *dbeg, hammer2_off_t *dend)
+{
+	hammer2_off_t off;
+	uint32_t live;
+	uint32_t ref;
+	uint32_t avail;
+	int changed = 0;
+	int recalc = 0;
+	int i;
+	int j;
+
+	for (i = 0; i < 8; ++i) {
+		if (bmap->bitmap[i] == sbmap->bitmap[i])
+			continue;
+		for (j = 0; j < 32; j += 2) {
+			live = (bmap->bitmap[i] >> j) & 3;
+			ref = (sbmap->bitmap[i] >> j) & 3;
+			if (live == ref)
+				continue;
+			if (ref == 0 && live == 3 && dostage == 0)
+				continue;
+			if (ref == 0 && live != 3 && dofree == 0)
+				continue;
+			changed = 1;
+			if (stats == NULL)
+				continue;
+			if (ref == 3) {
+				/* 10 -> 11 or 00 -> 11 */
+				if (live == 0)
+					++stats->count_fixed;
+				else
+					++stats->count_restored;
+				bmap->bitmap[i] |= 3U << j;
+				recalc = 1;
+			} else if (live == 3) {
+				/* 11 -> 10 */
+				++stats->count_staged;
+				bmap->bitmap[i] &= ~(1U << j);
+			} else {
+				/* 10 -> 00 */
+				++stats->count_freed;
+				stats->bytes_freed +=
+					HAMMER2_FREEMAP_BLOCK_SIZE;
+				bmap->bitmap[i] &= ~(3U << j);
+				recalc = 1;
+
+				off = base + i * (HAMMER2_SEGSIZE / 8) +
+				      j * (HAMMER2_FREEMAP_BLOCK_SIZE / 2);
+				if (off != *dend) {
+					if (*dbeg < *dend) {
+						hammer2_discard_queue(hmp,
+							*dbeg, *dend);
+					}
+					*dbeg = off;
+				}
+				*dend = off + HAMMER2_FREEMAP_BLOCK_SIZE;
+			}
+		}
+	}
+	if (stats == NULL || recalc == 0)
+		return (changed);
+
+	/*
+	 * Recalculate avail from the bitmap.  Partial block tracking is
+	 * lost anyway once blocks are freed underneath it, and the linear
+	 * iterator must not continue into a freed block.
+	 */
+	avail = 0;
+	for (i = 0; i < 8; ++i) {
+		for (j = 0; j < 32; j += 2) {
+			if (((bmap->bitmap[i] >> j) & 3) == 0)
+				avail += HAMMER2_FREEMAP_BLOCK_SIZE;
+		}
+	}
+
+	hammer2_voldata_lock(hmp);
+	hammer2_voldata_modify(hmp);
+	hmp->voldata.allocator_free += (int64_t)avail - bmap->avail;
+	hammer2_voldata_unlock(hmp);
+
+	bmap->avail = avail;
+	bmap->linear = 0;
+	if (avail == HAMMER2_SEGSIZE)
+		bmap->class = 0;
+
+	return (changed);
+}
+
+/*
+ * Merge the scan bitmap for [sbase, sstop) produced by the bulk free
+ * scan into the live freemap.  scan[] has one bmap per 2MB segment of
+ * the window with 11 set for every 16KB block referenced by the
+ * topology.
+ *
+ * Allocated but unreferenced blocks are staged 11 -> 10 if dostage is
+ * set.  Staged blocks still unreferenced are freed 10 -> 00 if dofree is
+ * set, which the caller only does once every volume header has been
+ * rewritten since the staging.  Staged blocks which are referenced are
+ * restored to 11, and referenced blocks marked free are fixed up like
+ * the mount-time recovery scan would.
+ *
+ * Freed blocks are queued for discard if the device has discards enabled.
+ *
+ * Segments covering the static newfs allocations, each zone's reserved
+ * area and the end of the volume are never touched.  Per-cpu freemap
+ * reservations are treated as referenced, they cannot be created or
+ * released while fchain is held.
+ */
+void
+hammer2_freemap_bulkfree_merge(hammer2_trans_t *trans, hammer2_mount_t *hmp,
+			       hammer2_off_t sbase, hammer2_off_t sstop,
+			       hammer2_bmap_data_t *scan, int dostage,
+			       int dofree, hammer2_ioc_bulkfree_t *stats)
+{
+	struct hammer2_freemap_pcpu *fp;
+	hammer2_freemap_resv_t resv;
+	hammer2_chain_t *parent;
+	hammer2_chain_t *chain;
+	hammer2_bmap_data_t *bmap;
+	hammer2_bmap_data_t *sbmap;
+	hammer2_key_t key;
+	hammer2_key_t key_dummy;
+	hammer2_off_t l0size;
+	hammer2_off_t l1size;
+	hammer2_off_t lokey;
+	hammer2_off_t hikey;
+	hammer2_off_t off;
+	hammer2_off_t dbeg;
+	hammer2_off_t dend;
+	int cache_index = -1;
+	int ddflag;
+	int modified;
+	int n;
+	int i;
+	int j;
+
+	l0size = H2FMSHIFT(HAMMER2_FREEMAP_LEVEL0_RADIX);
+	l1size = H2FMSHIFT(HAMMER2_FREEMAP_LEVEL1_RADIX);
+	lokey = (hmp->voldata.allocator_beg + HAMMER2_SEGMASK64) &
+		~HAMMER2_SEGMASK64;
+	hikey = hmp->voldata.volu_size & ~HAMMER2_SEGMASK64;
+	dbeg = dend = 0;
+
+	for (key = sbase; key < sstop; key += l1size) {
+		parent = &hmp->fchain;
+		hammer2_chain_lock(parent, HAMMER2_RESOLVE_ALWAYS);
+
+		for (i = 0; hmp->freemap_pcpu && i < hmp->freemap_ncpus; ++i) {
+			fp = &hmp->freemap_pcpu[i];
+			for (j = 0; j < HAMMER2_FREEMAP_HEUR; ++j) {
+				mtx_enter(&fp->mtx);
+				resv = fp->resv[j];
+				mtx_leave(&fp->mtx);
+				if (resv.beg >= resv.end || resv.end <= key ||
+				    resv.beg >= key + l1size) {
+					continue;
+				}
+				off = resv.beg & ~(hammer2_off_t)
+					HAMMER2_FREEMAP_BLOCK_MASK;
+				while (off < resv.end) {
+					hammer2_bmap_markref(scan, sbase, off);
+					off += HAMMER2_FREEMAP_BLOCK_SIZE;
+				}
+			}
+		}
+
+		chain = hammer2_chain_lookup(&parent, &key_dummy,
+					     key, key + l1size - 1,
+					     &cache_index,
+					     HAMMER2_LOOKUP_ALWAYS |
+					     HAMMER2_LOOKUP_MATCHIND, &ddflag);
+		if (chain == NULL) {
+			hammer2_chain_unlock(parent);
+			continue;
+		}
+
+		/*
+		 * Check first so untouched leaves are not modified.
+		 */
+		modified = 0;
+		bmap = &chain->data->bmdata[0];
+		sbmap = &scan[(key - sbase) >> HAMMER2_SEGRADIX];
+		for (n = 0, off = key; n < HAMMER2_FREEMAP_COUNT;
+		     ++n, off += l0size) {
+			if (off < lokey || off >= hikey ||
+			    (off & HAMMER2_ZONE_MASK64) < HAMMER2_ZONE_SEG) {
+				continue;
+			}
+			if (hammer2_bmap_bulkfree(hmp, &bmap[n], &sbmap[n],
+						  dostage, dofree, NULL, off,
+						  &dbeg, &dend)) {
+				modified = 1;
+				break;
+			}
+		}
+
+		if (modified) {
+			hammer2_chain_modify(trans, chain, 0);
+			bmap = &chain->data->bmdata[0];
+			for (n = 0, off = key; n < HAMMER2_FREEMAP_COUNT;
+			     ++n, off += l0size) {
+				if (off < lokey || off >= hikey ||
+				    (off & HAMMER2_ZONE_MASK64) <
+				     HAMMER2_ZONE_SEG) {
+					continue;
+				}
+				hammer2_bmap_bulkfree(hmp, &bmap[n], &sbmap[n],
+						      dostage, dofree,
+						      stats, off,
+						      &dbeg, &dend);
+				hammer2_freemap_sum_update(hmp, off, &bmap[n]);
+			}
+			for (i = HAMMER2_RADIX_MIN; i <= HAMMER2_RADIX_MAX; ++i)
+				chain->bref.check.freemap.bigmask |= 1 << i;
+		}
+		/*
+		 * Queue the remaining discard run before fchain is released
+		 * and the freed blocks become allocatable.
+		 */
+		if (dbeg < dend)
+			hammer2_discard_queue(hmp, dbeg, dend);
+		dbeg = dend = 0;
+		hammer2_chain_unlock(chain);
+		hammer2_chain_unlock(parent);
+	}
+}
+
+/*
+ * Online defragmentation support.  Select every in-use segment filled to
+ * at most pct percent, up to max segments (0 for no limit), and exclude
+ * the selected segments from allocation until hammer2_freemap_defrag_end()
+ * so chains relocated out of them cannot land back in them.  The per-cpu
+ * reservations are released afterwards in case one sits in a selected
+ * segment.
+ *
+ * Returns the number of segments selected, or -1 if a defragmentation is
+ * already in progress.
+ */
+int
+hammer2_freemap_defrag_begin(hammer2_trans_t *trans, hammer2_mount_t *hmp,
+			     int pct, int max)
+{
+	hammer2_chain_t *parent;
+	hammer2_chain_t *chain;
+	hammer2_bmap_data_t *bmap;
+	hammer2_key_t key;
+	hammer2_key_t key_dummy;
+	hammer2_off_t l0size;
+	hammer2_off_t l1size;
+	hammer2_off_t lokey;
+	hammer2_off_t hikey;
+	hammer2_off_t off;
+	uint32_t *segs;
+	size_t nsegs;
+	size_t limit;
+	size_t seg;
+	int cache_index = -1;
+	int ddflag;
+	int count;
+	int n;
+
+	l0size = H2FMSHIFT(HAMMER2_FREEMAP_LEVEL0_RADIX);
+	l1size = H2FMSHIFT(HAMMER2_FREEMAP_LEVEL1_RADIX);
+	lokey = (hmp->voldata.allocator_beg + HAMMER2_SEGMASK64) &
+		~HAMMER2_SEGMASK64;
+	hikey = hmp->voldata.volu_size & ~HAMMER2_SEGMASK64;
+	nsegs = (size_t)(hmp->voldata.volu_size >> HAMMER2_SEGRADIX);
+	limit = (size_t)HAMMER2_SEGSIZE * pct / 100;
+	segs = malloc(howmany(nsegs, 32) * sizeof(uint32_t), M_HAMMER2,
+		      M_WAITOK | M_ZERO);
+	count = 0;
+
+	parent = &hmp->fchain;
+	hammer2_chain_lock(parent, HAMMER2_RESOLVE_ALWAYS);
+	if (hmp->defrag_segs) {
+		hammer2_chain_unlock(parent);
+		free(segs, M_HAMMER2, 0);
+		return (-1);
+	}
+	hmp->defrag_segs = segs;
+	hmp->defrag_nsegs = nsegs;
+	hammer2_chain_unlock(parent);
+
+	for (key = 0; key < hikey && (max == 0 || count < max);
+	     key += l1size) {
+		parent = &hmp->fchain;
+		hammer2_chain_lock(parent, HAMMER2_RESOLVE_ALWAYS);
+		chain = hammer2_chain_lookup(&parent, &key_dummy,
+					     key, key + l1size - 1,
+					     &cache_index,
+					     HAMMER2_LOOKUP_ALWAYS |
+					     HAMMER2_LOOKUP_MATCHIND, &ddflag);
+		if (chain == NULL) {
+			hammer2_chain_unlock(parent);
+			continue;
+		}
+		bmap = &chain->data->bmdata[0];
+		for (n = 0, off = key; n < HAMMER2_FREEMAP_COUNT;
+		     ++n, off += l0size) {
+			if (off < lokey || off >= hikey ||
+			    (off & HAMMER2_ZONE_MASK64) < HAMMER2_ZONE_SEG) {
+				continue;
+			}
+			if (bmap[n].class == 0 || bmap[n].avail == 0 ||
+			    (size_t)(HAMMER2_SEGSIZE - bmap[n].avail) > limit) {
+				continue;
+			}
+			seg = (size_t)(off >> HAMMER2_SEGRADIX);
+			segs[seg >> 5] |= 1U << (seg & 31);
+			if (++count == max)
+				break;
+		}
+		hammer2_chain_unlock(chain);
+		hammer2_chain_unlock(parent);
+	}
+	hammer2_freemap_resv_release(trans, hmp);
+
+	return (count);
+}
+
+/*
+ * End the defragmentation, the selected segments may be allocated from
+ * again.
+ */
+void
+hammer2_freemap_defrag_end(hammer2_mount_t *hmp)
+{
+	hammer2_chain_t *parent;
+	uint32_t *segs;
+
+	parent = &hmp->fchain;
+	hammer2_chain_lock(parent, HAMMER2_RESOLVE_ALWAYS);
+	segs = hmp->defrag_segs;
+	hmp->defrag_segs = NULL;
+	hmp->defrag_nsegs = 0;
+	hammer2_chain_unlock(parent);
+	if (segs)
+		free(segs, M_HAMMER2, 0);
+}
+
+/*
+ * Returns non-zero if off lies in a segment selected for defragmentation.
+ * Callers hold fchain or accept a stale answer.
+ */
+int
+hammer2_freemap_defrag_target(hammer2_mount_t *hmp, hammer2_off_t off)
+{
+	uint32_t *segs = hmp->defrag_segs;
+	size_t seg;
+
+	if (segs == NULL)
+		return (0);
+	seg = (size_t)(off >> HAMMER2_SEGRADIX);
+	if (seg >= hmp->defrag_nsegs)
+		return (0);
+	return ((segs[seg >> 5] >> (seg & 31)) & 1);
+}
+
+/*
+ * Allocator helper, skip segments selected for defragmentation and flag
+ * that the scan did so.
+ */
+static
+int
+hammer2_freemap_defrag_skip(hammer2_mount_t *hmp, hammer2_off_t off,
+			    int *skippedp)
+{
+	if (hammer2_freemap_defrag_target(hmp, off)) {
+		*skippedp = 1;
+		return (1);
+	}
+	return (0);
+}
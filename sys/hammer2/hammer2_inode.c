@@ -312,7 +312,7 @@ hammer2_inode_drop(hammer2_inode_t *ip)
 			__mp_lock((struct __mp_lock *)&pmp->inum_spin);
 
 			if (atomic_cmpset_int(&ip->refs, 1, 0)) {
-				KKASSERT(ip->topo_cst.count == 0);
+				KKASSERT(ip->topo_cst.lock == 0);
 				if (ip->flags & HAMMER2_INODE_ONRBTREE) {
 					atomic_clear_int(&ip->flags,
 						     HAMMER2_INODE_ONRBTREE);
@@ -566,6 +566,9 @@ again:
 	nip->cluster.refs = 1;
 	nip->cluster.pmp = pmp;
 	nip->cluster.flags |= HAMMER2_CLUSTER_INODE;
+	nip->cluster.nslots = HAMMER2_MAXCLUSTER;
+	nip->cluster.array = nip->cluster_array;
+	nip->cluster.cache_index = nip->cluster_cache;
 	hammer2_cluster_replace(&nip->cluster, cluster);
 
 	nipdata = &hammer2_cluster_data(cluster)->ipdata;
@@ -682,11 +685,16 @@ retry:
 	}
 
 	if (error == 0) {
+		/*
+		 * Place the new inode near its siblings.
+		 */
+		trans->tmp_ip = dip;
 		error = hammer2_cluster_create(trans, cparent, &cluster,
 					     lhc, 0,
 					     HAMMER2_BREF_TYPE_INODE,
 					     HAMMER2_INODE_BYTES,
 					     0);
+		trans->tmp_ip = NULL;
 	}
 #if INODE_DEBUG
 	printf("CREATE INODE %*.*s chain=%p\n",
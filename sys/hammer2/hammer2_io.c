@@ -32,6 +32,8 @@
  * SUCH DAMAGE.
  */
 
+#include <sys/conf.h>
+
 #include "hammer2.h"
 
 /*
@@ -43,6 +45,8 @@
  */
 static void hammer2_io_callback(struct bio2 *bio);
 static int hammer2_io_cleanup_callback(hammer2_io_t *dio, void *arg);
+static void hammer2_io_wagg_note(hammer2_mount_t *hmp, off_t pbase,
+			int psize);
 
 static int
 hammer2_io_cmp(hammer2_io_t *io1, hammer2_io_t *io2)
@@ -57,8 +61,33 @@ hammer2_io_cmp(hammer2_io_t *io1, hammer2_io_t *io2)
 RB_PROTOTYPE2(hammer2_io_tree, hammer2_io, rbnode, hammer2_io_cmp, off_t);
 RB_GENERATE2(hammer2_io_tree, hammer2_io, rbnode, hammer2_io_cmp, off_t, pbase);
 
+static int
+hammer2_wseg_cmp(hammer2_wseg_t *wseg1, hammer2_wseg_t *wseg2)
+{
+	if (wseg1->sbase < wseg2->sbase)
+		return(-1);
+	if (wseg1->sbase > wseg2->sbase)
+		return(1);
+	return(0);
+}
+
+RB_PROTOTYPE2(hammer2_wseg_tree, hammer2_wseg, rbnode, hammer2_wseg_cmp,
+	      off_t);
+RB_GENERATE2(hammer2_wseg_tree, hammer2_wseg, rbnode, hammer2_wseg_cmp,
+	     off_t, sbase);
+
+/*
+ * One aggregated write.  The member buffers are busied delayed-write
+ * buffers of one segment, contiguous and in device order.
+ */
+struct hammer2_wagg_io {
+	int		count;
+	struct buf	*bufs[HAMMER2_WSEG_UNITS];
+};
+
 struct hammer2_cleanupcb_info {
 	struct hammer2_io_tree tmptree;
+	hammer2_io_hash_t *hash;
 	int	count;
 };
 
@@ -67,13 +96,120 @@ struct hammer2_cleanupcb_info {
 #define HAMMER2_DIO_GOOD	0x40000000
 #define HAMMER2_DIO_WAITING	0x20000000
 #define HAMMER2_DIO_DIRTY	0x10000000
+#define HAMMER2_DIO_PRISTINE	0x08000000	/* media never written */
 
-#define HAMMER2_DIO_MASK	0x0FFFFFFF
+#define HAMMER2_DIO_MASK	0x07FFFFFF
 
 void
 vfs_bio_clrbuf(struct buf *bp)
 {
-        brelse(bp);
+	clrbuf(bp);
+	bp->b_flags |= B_CACHE;
+}
+
+/*
+ * Select the DIO index shard for pbase.  Adjacent physical buffers land
+ * in different shards so sequential scans spread across the locks.
+ */
+static __inline hammer2_io_hash_t *
+hammer2_io_hash(hammer2_mount_t *hmp, off_t pbase)
+{
+	int hv;
+
+	hv = (int)(pbase >> HAMMER2_PBUFRADIX) ^
+	     (int)(pbase >> (HAMMER2_PBUFRADIX + 8));
+	return(&hmp->iohash[hv & HAMMER2_IOHASH_MASK]);
+}
+
+static __inline int
+hammer2_io_hintv(off_t pbase)
+{
+	int hv;
+
+	hv = (int)(pbase >> HAMMER2_LBUFRADIX) ^
+	     (int)(pbase >> (HAMMER2_PBUFRADIX + 5));
+	return(hv & HAMMER2_IOHINT_MASK);
+}
+
+/*
+ * Shard spinlock.  lockers is bumped before the spinlock is acquired so
+ * we can count acquisitions which found the shard already busy.
+ */
+static __inline void
+hammer2_io_hash_lock(hammer2_io_hash_t *hash)
+{
+	if (atomic_fetchadd_int(&hash->lockers, 1) != 0)
+		++hammer2_dio_contention;
+	__mp_lock((struct __mp_lock *)&hash->spin);
+}
+
+static __inline void
+hammer2_io_hash_unlock(hammer2_io_hash_t *hash)
+{
+	__mp_unlock((struct __mp_lock *)&hash->spin);
+	atomic_add_int(&hash->lockers, -1);
+}
+
+/*
+ * Wait for lockless hint[] probes on the shard to finish.  Called after
+ * dios have been removed from the shard and before they are freed.  The
+ * probe window is only a few instructions long.
+ */
+static void
+hammer2_io_hash_drain(hammer2_io_hash_t *hash)
+{
+	while (hash->readers)
+		cpu_ccfence();
+}
+
+void
+hammer2_io_init(hammer2_mount_t *hmp)
+{
+	hammer2_io_hash_t *hash;
+	int i;
+
+	for (i = 0; i < HAMMER2_IOHASH_SIZE; ++i) {
+		hash = &hmp->iohash[i];
+		RB_INIT(&hash->tree);
+		spin_init((struct __mp_lock *)&hash->spin, "hm2mount_io");
+	}
+	mtx_init(&hmp->wagg_mtx, IPL_BIO);
+	RB_INIT(&hmp->wagg_tree);
+}
+
+/*
+ * Lockless fast path.  We can only add a ref to a dio which already has
+ * refs, because cleanup (which holds the shard spinlock) may remove any
+ * dio whos ref count is 0.  Returns NULL if the caller must take the
+ * shard spinlock.
+ */
+static hammer2_io_t *
+hammer2_io_hint_lookup(hammer2_io_hash_t *hash, off_t pbase)
+{
+	hammer2_io_t *dio;
+	int refs;
+
+	atomic_add_int(&hash->readers, 1);
+	dio = hash->hint[hammer2_io_hintv(pbase)];
+	cpu_ccfence();
+	if (dio && dio->pbase == pbase) {
+		for (;;) {
+			refs = dio->refs;
+			cpu_ccfence();
+			if ((refs & HAMMER2_DIO_MASK) == 0) {
+				dio = NULL;
+				break;
+			}
+			if (atomic_cmpset_int(&dio->refs, refs, refs + 1))
+				break;
+			/* retry */
+		}
+	} else {
+		dio = NULL;
+	}
+	atomic_add_int(&hash->readers, -1);
+
+	return(dio);
 }
 
 /*
@@ -84,6 +220,7 @@ vfs_bio_clrbuf(struct buf *bp)
 hammer2_io_t *
 hammer2_io_getblk(hammer2_mount_t *hmp, off_t lbase, int lsize, int *ownerp)
 {
+	hammer2_io_hash_t *hash;
 	hammer2_io_t *dio;
 	hammer2_io_t *xio;
 	off_t pbase;
@@ -99,33 +236,49 @@ hammer2_io_getblk(hammer2_mount_t *hmp, off_t lbase, int lsize, int *ownerp)
 	KKASSERT(pbase != 0 && ((lbase + lsize - 1) & pmask) == pbase);
 
 	/*
-	 * Access/Allocate the DIO
+	 * Access/Allocate the DIO.  Try the lockless hint first, then
+	 * fall back to the shard.
 	 */
-	__mp_lock((struct __mp_lock *)&hmp->io_spin);
-	dio = RB_LOOKUP(hammer2_io_tree, &hmp->iotree, pbase);
+	hash = hammer2_io_hash(hmp, pbase);
+	dio = hammer2_io_hint_lookup(hash, pbase);
+	if (dio) {
+		++hammer2_dio_lockless;
+		goto found;
+	}
+
+	hammer2_io_hash_lock(hash);
+	dio = RB_LOOKUP(hammer2_io_tree, &hash->tree, pbase);
 	if (dio) {
 		if ((atomic_fetchadd_int(&dio->refs, 1) &
 		     HAMMER2_DIO_MASK) == 0) {
 			atomic_add_int(&dio->hmp->iofree_count, -1);
 		}
+		hash->hint[hammer2_io_hintv(pbase)] = dio;
+		hammer2_io_hash_unlock(hash);
 	} else {
+		hammer2_io_hash_unlock(hash);
 		dio = malloc(sizeof(*dio), M_HAMMER2, M_INTWAIT | M_ZERO);
 		dio->hmp = hmp;
 		dio->pbase = pbase;
 		dio->psize = psize;
 		dio->refs = 1;
-		__mp_lock((struct __mp_lock *)&hmp->io_spin);
-		xio = RB_INSERT(hammer2_io_tree, &hmp->iotree, dio);
+		hammer2_io_hash_lock(hash);
+		xio = RB_INSERT(hammer2_io_tree, &hash->tree, dio);
 		if (xio == NULL) {
+			++hash->count;
+			hash->hint[hammer2_io_hintv(pbase)] = dio;
+			hammer2_io_hash_unlock(hash);
 		} else {
 			if ((atomic_fetchadd_int(&xio->refs, 1) &
 			     HAMMER2_DIO_MASK) == 0) {
 				atomic_add_int(&xio->hmp->iofree_count, -1);
 			}
+			hammer2_io_hash_unlock(hash);
 			free(dio, M_HAMMER2, 0);
 			dio = xio;
 		}
 	}
+found:
 
 	/*
 	 * Obtain/Validate the buffer.
@@ -176,7 +329,8 @@ done:
  * If part of an asynchronous I/O the asynchronous I/O is biodone()'d.
  *
  * If the caller owned INPROG then the dio will be set GOOD or not
- * depending on whether the caller disposed of dio->bp or not.
+ * depending on whether the caller disposed of dio->bp or not.  Once a
+ * buffer has been instantiated the dio is no longer PRISTINE.
  */
 static
 void
@@ -191,7 +345,9 @@ hammer2_io_complete(hammer2_io_t *dio, int owner)
 		good = dio->bp ? HAMMER2_DIO_GOOD : 0;
 		if (atomic_cmpset_int(&dio->refs, refs,
 				      (refs & ~(HAMMER2_DIO_WAITING |
-					        HAMMER2_DIO_INPROG)) |
+					        HAMMER2_DIO_INPROG |
+						(good ? HAMMER2_DIO_PRISTINE :
+							0))) |
 				      good)) {
 			if (refs & HAMMER2_DIO_WAITING)
 				wakeup(dio);
@@ -255,6 +411,7 @@ hammer2_io_putblk(hammer2_io_t **diop)
 	hmp = dio->hmp;
 	bp = dio->bp;
 	dio->bp = NULL;
+	dio->crc_good_mask = 0;		/* buffer must be re-verified */
 	pbase = dio->pbase;
 	psize = dio->psize;
 	atomic_add_int(&hmp->iofree_count, 1);
@@ -264,7 +421,10 @@ hammer2_io_putblk(hammer2_io_t **diop)
 	if (refs & HAMMER2_DIO_GOOD) {
 		KKASSERT(bp != NULL);
 		if (refs & HAMMER2_DIO_DIRTY) {
-			if (hammer2_cluster_enable) {
+			if (hammer2_wagg_maxio > psize) {
+				bdwrite(bp);
+				hammer2_io_wagg_note(hmp, pbase, psize);
+			} else if (hammer2_cluster_enable) {
 				peof = (pbase + HAMMER2_SEGMASK64) &
 				       ~HAMMER2_SEGMASK64;
 				cluster_write(bp, (struct cluster_info *)peof, psize);
@@ -281,49 +441,125 @@ hammer2_io_putblk(hammer2_io_t **diop)
 
 	/*
 	 * We cache free buffers so re-use cases can use a shared lock, but
-	 * if too many build up we have to clean them out.
+	 * if too many build up we have to clean them out.  Only a bounded
+	 * step of the CLOCK is run here, against the released dio's shard.
+	 * hammer2_io_trim() does the rest from the syncer.
 	 */
-	if (hmp->iofree_count > 1000) {
-		struct hammer2_cleanupcb_info info;
-
-		RB_INIT(&info.tmptree);
-		__mp_lock((struct __mp_lock *)&hmp->io_spin);
-		if (hmp->iofree_count > 1000) {
-			info.count = hmp->iofree_count / 2;
-			RB_SCAN(hammer2_io_tree, &hmp->iotree, NULL,
-				hammer2_io_cleanup_callback, &info);
-		}
-		hammer2_io_cleanup(hmp, &info.tmptree);
-	}
+	if (hmp->iofree_count > hammer2_dio_limit)
+		hammer2_io_trim_shard(hmp, hammer2_io_hash(hmp, pbase),
+				      HAMMER2_IOTRIM_SCAN);
 }
 
 /*
  * Cleanup any dio's with no references which are not in-progress.
+ * Called with the shard spinlock held.
+ *
+ * dio->act is the CLOCK reference count.  It is bumped on each getblk
+ * and aged here, so a dio must go unreferenced for several sweeps of
+ * the hand before it is evicted.
  */
-
 static
 int
 hammer2_io_cleanup_callback(hammer2_io_t *dio, void *arg)
 {
 	struct hammer2_cleanupcb_info *info = arg;
+	hammer2_io_hash_t *hash;
 	hammer2_io_t *xio;
+	int hv;
 
 	if ((dio->refs & (HAMMER2_DIO_MASK | HAMMER2_DIO_INPROG)) == 0) {
 		if (dio->act > 0) {
 			--dio->act;
 			return 0;
 		}
+		if (info == NULL)
+			return 0;
 		KKASSERT(dio->bp == NULL);
-		RB_REMOVE(hammer2_io_tree, &dio->hmp->iotree, dio);
+		hash = info->hash;
+		hv = hammer2_io_hintv(dio->pbase);
+		if (hash->hint[hv] == dio)
+			hash->hint[hv] = NULL;
+		RB_REMOVE(hammer2_io_tree, &hash->tree, dio);
+		--hash->count;
 		xio = (hammer2_io_t *)RB_INSERT(hammer2_io_tree, &info->tmptree, dio);
 		KKASSERT(xio == NULL);
-		if (--info->count <= 0)	// limit scan 
-			return(-1);
+		++info->count;
 	}
 	return 0;
 }
 
+/*
+ * Advance the shard's CLOCK hand over up to scan dios, evicting those
+ * which are unreferenced and have aged out.  The spinlock is only held
+ * for the bounded scan, the evicted dios are freed after it is released.
+ * Returns the number of dios evicted.
+ */
+int
+hammer2_io_trim_shard(hammer2_mount_t *hmp, hammer2_io_hash_t *hash,
+		      int scan)
+{
+	struct hammer2_cleanupcb_info info;
+	struct hammer2_io dummy;
+	hammer2_io_t *dio;
+	hammer2_io_t *next;
+
+	RB_INIT(&info.tmptree);
+	info.hash = hash;
+	info.count = 0;
+
+	hammer2_io_hash_lock(hash);
+	if (scan > hash->count)
+		scan = hash->count;
+	dummy.pbase = hash->hand;
+	dio = RB_NFIND(hammer2_io_tree, &hash->tree, &dummy);
+	while (scan-- > 0) {
+		if (dio == NULL) {
+			dio = RB_MIN(hammer2_io_tree, &hash->tree);
+			if (dio == NULL)
+				break;
+		}
+		next = RB_NEXT(hammer2_io_tree, &hash->tree, dio);
+		hammer2_io_cleanup_callback(dio, &info);
+		dio = next;
+	}
+	hash->hand = dio ? dio->pbase : 0;	/* 0 wraps to RB_MIN */
+	hammer2_io_hash_unlock(hash);
 
+	if (info.count) {
+		hammer2_io_hash_drain(hash);
+		hammer2_io_cleanup(hmp, &info.tmptree);
+		hammer2_dio_evicted += info.count;
+	}
+	return(info.count);
+}
+
+/*
+ * Incrementally trim the cached dios back below hammer2_dio_limit,
+ * leaving some slop so the frontend does not immediately re-trigger.
+ * Each shard is only locked for one bounded CLOCK step at a time.
+ */
+void
+hammer2_io_trim(hammer2_mount_t *hmp)
+{
+	int target;
+	int loops;
+	int i;
+
+	target = hammer2_dio_limit - hammer2_dio_limit / 4;
+	for (loops = 0; loops < 8; ++loops) {
+		for (i = 0; i < HAMMER2_IOHASH_SIZE; ++i) {
+			if (hmp->iofree_count <= target)
+				return;
+			hammer2_io_trim_shard(hmp, &hmp->iohash[i],
+					      HAMMER2_IOTRIM_SCAN);
+		}
+	}
+}
+
+/*
+ * Free the dios collected in tree.  The dios must already have been
+ * removed from their shards and the shards drained of lockless readers.
+ */
 void
 hammer2_io_cleanup(hammer2_mount_t *hmp, struct hammer2_io_tree *tree)
 {
@@ -338,6 +574,259 @@ hammer2_io_cleanup(hammer2_mount_t *hmp, struct hammer2_io_tree *tree)
 	}
 }
 
+/*
+ * Record a device buffer which has been left delayed-write.  Called from
+ * hammer2_io_putblk() which may not block, if the segment record cannot
+ * be allocated the buffer is left to the syncer.
+ */
+static
+void
+hammer2_io_wagg_note(hammer2_mount_t *hmp, off_t pbase, int psize)
+{
+	hammer2_wseg_t *wseg;
+	hammer2_wseg_t *xseg;
+	off_t sbase;
+	int i;
+
+	sbase = pbase & ~HAMMER2_SEGMASK64;
+	i = (int)((pbase - sbase) / HAMMER2_LBUFSIZE);
+
+	mtx_enter(&hmp->wagg_mtx);
+	wseg = RB_LOOKUP(hammer2_wseg_tree, &hmp->wagg_tree, sbase);
+	mtx_leave(&hmp->wagg_mtx);
+	xseg = NULL;
+	if (wseg == NULL) {
+		xseg = malloc(sizeof(*xseg), M_HAMMER2, M_NOWAIT | M_ZERO);
+		if (xseg == NULL)
+			return;
+		xseg->sbase = sbase;
+		xseg->psize = psize;
+	}
+
+	mtx_enter(&hmp->wagg_mtx);
+	if (xseg) {
+		wseg = RB_INSERT(hammer2_wseg_tree, &hmp->wagg_tree, xseg);
+		if (wseg == NULL) {
+			wseg = xseg;
+			xseg = NULL;
+		}
+	} else {
+		wseg = RB_LOOKUP(hammer2_wseg_tree, &hmp->wagg_tree, sbase);
+	}
+	if (wseg && wseg->psize == psize)
+		wseg->mask[i >> 5] |= 1U << (i & 31);
+	mtx_leave(&hmp->wagg_mtx);
+
+	if (xseg)
+		free(xseg, M_HAMMER2, 0);
+}
+
+/*
+ * Busy a recorded buffer if it is still delayed-write and idle.  Buffers
+ * written or reused in the mean time are skipped.
+ */
+static
+struct buf *
+hammer2_io_wagg_acquire(hammer2_mount_t *hmp, off_t pbase, int psize)
+{
+	struct buf *bp;
+	int s;
+
+	s = splbio();
+	bp = incore(hmp->devvp, pbase);
+	if (bp == NULL || bp->b_bcount != psize ||
+	    (bp->b_flags & (B_BUSY | B_DELWRI | B_INVAL)) != B_DELWRI) {
+		splx(s);
+		return(NULL);
+	}
+	bufcache_take(bp);
+	buf_acquire(bp);
+	splx(s);
+
+	return(bp);
+}
+
+/*
+ * Completion of an aggregated write, called at splbio.  The member
+ * buffers are completed with the result, being async writes biodone()
+ * releases them.
+ */
+static
+void
+hammer2_io_wagg_done(struct buf *cbp)
+{
+	struct hammer2_wagg_io *wio = cbp->b_bio1.bio_caller_info1.ptr;
+	struct buf *bp;
+	int i;
+
+	for (i = 0; i < wio->count; ++i) {
+		bp = wio->bufs[i];
+		if (cbp->b_flags & B_ERROR) {
+			SET(bp->b_flags, B_ERROR);
+			bp->b_error = cbp->b_error;
+		}
+		bp->b_resid = 0;
+		biodone(bp);
+	}
+	SET(cbp->b_flags, B_INVAL);
+	brelse(cbp);
+	free(wio, M_HAMMER2, 0);
+}
+
+/*
+ * Issue the buffers gathered in wio as a single write.  The data is
+ * copied into one transfer buffer, the member buffers are accounted as
+ * in-progress writes on the device vnode so vwaitforio() covers them.
+ */
+static
+void
+hammer2_io_wagg_issue(hammer2_mount_t *hmp, struct hammer2_wagg_io *wio)
+{
+	struct buf *cbp;
+	struct buf *bp;
+	long bytes;
+	int i;
+	int s;
+
+	if (wio->count == 1) {
+		bawrite(wio->bufs[0]);
+		free(wio, M_HAMMER2, 0);
+		return;
+	}
+
+	bytes = 0;
+	for (i = 0; i < wio->count; ++i)
+		bytes += wio->bufs[i]->b_bcount;
+	KKASSERT(bytes <= MAXPHYS);
+	cbp = geteblk(bytes);
+	bytes = 0;
+	for (i = 0; i < wio->count; ++i) {
+		bp = wio->bufs[i];
+		bcopy(bp->b_data, cbp->b_data + bytes, bp->b_bcount);
+		bytes += bp->b_bcount;
+	}
+
+	s = splbio();
+	for (i = 0; i < wio->count; ++i) {
+		bp = wio->bufs[i];
+		CLR(bp->b_flags, B_READ | B_DONE | B_ERROR);
+		SET(bp->b_flags, B_ASYNC | B_WRITEINPROG);
+		buf_undirty(bp);
+		bp->b_vp->v_numoutput++;
+		bcstats.pendingwrites++;
+		bcstats.numwrites++;
+	}
+	bcstats.pendingwrites++;
+	splx(s);
+
+	bp = wio->bufs[0];
+	CLR(cbp->b_flags, B_READ | B_DONE | B_ERROR);
+	SET(cbp->b_flags, B_CALL);
+	cbp->b_iodone = hammer2_io_wagg_done;
+	cbp->b_bio1.bio_caller_info1.ptr = wio;
+	cbp->b_dev = hmp->devvp->v_rdev;
+	cbp->b_lblkno = bp->b_lblkno;
+	cbp->b_blkno = bp->b_blkno;
+	cbp->b_bcount = bytes;
+	cbp->b_resid = 0;
+
+	++hammer2_wagg_ios;
+	hammer2_wagg_bufs += wio->count;
+	(*bdevsw[major(cbp->b_dev)].d_strategy)(cbp);
+}
+
+/*
+ * Write out the delayed-write buffers recorded by hammer2_io_putblk(),
+ * segment by segment in device order.  Each run of contiguous buffers,
+ * up to hammer2_wagg_maxio bytes (at most MAXPHYS), is issued as one
+ * write.  Called by the flush before the volume header is synchronized,
+ * the caller waits for the writes with vwaitforio().
+ */
+void
+hammer2_io_wagg_flush(hammer2_mount_t *hmp)
+{
+	struct hammer2_wseg_tree tree;
+	struct hammer2_wagg_io *wio;
+	hammer2_wseg_t *wseg;
+	struct buf *bp;
+	long maxio;
+	int step;
+	int i;
+
+	mtx_enter(&hmp->wagg_mtx);
+	tree = hmp->wagg_tree;
+	RB_INIT(&hmp->wagg_tree);
+	mtx_leave(&hmp->wagg_mtx);
+
+	/*
+	 * The transfer buffer and the device strategy are both limited
+	 * to MAXPHYS, geteblk() cannot map more than that.
+	 */
+	maxio = hammer2_wagg_maxio;
+	if (maxio > MAXPHYS)
+		maxio = MAXPHYS;
+	wio = NULL;
+
+	while ((wseg = RB_MIN(hammer2_wseg_tree, &tree)) != NULL) {
+		RB_REMOVE(hammer2_wseg_tree, &tree, wseg);
+		step = wseg->psize / HAMMER2_LBUFSIZE;
+		for (i = 0; i < HAMMER2_WSEG_UNITS; i += step) {
+			bp = NULL;
+			if (wseg->mask[i >> 5] & (1U << (i & 31))) {
+				bp = hammer2_io_wagg_acquire(hmp,
+					wseg->sbase + i * HAMMER2_LBUFSIZE,
+					wseg->psize);
+			}
+			if (wio && (bp == NULL ||
+				    (wio->count + 1) * wseg->psize > maxio)) {
+				hammer2_io_wagg_issue(hmp, wio);
+				wio = NULL;
+			}
+			if (bp == NULL)
+				continue;
+			if (wio == NULL) {
+				wio = malloc(sizeof(*wio), M_HAMMER2,
+					     M_WAITOK | M_ZERO);
+			}
+			wio->bufs[wio->count++] = bp;
+		}
+		if (wio) {
+			hammer2_io_wagg_issue(hmp, wio);
+			wio = NULL;
+		}
+		free(wseg, M_HAMMER2, 0);
+	}
+}
+
+/*
+ * Free all cached dios on unmount.
+ */
+void
+hammer2_io_cleanup_all(hammer2_mount_t *hmp)
+{
+	hammer2_io_hash_t *hash;
+	hammer2_wseg_t *wseg;
+	int i;
+
+	for (i = 0; i < HAMMER2_IOHASH_SIZE; ++i) {
+		hash = &hmp->iohash[i];
+		hammer2_io_hash_lock(hash);
+		bzero(hash->hint, sizeof(hash->hint));
+		hash->count = 0;
+		hammer2_io_hash_unlock(hash);
+		hammer2_io_hash_drain(hash);
+		hammer2_io_cleanup(hmp, &hash->tree);
+	}
+
+	/*
+	 * Any buffers still recorded are left to the syncer.
+	 */
+	while ((wseg = RB_ROOT(&hmp->wagg_tree)) != NULL) {
+		RB_REMOVE(hammer2_wseg_tree, &hmp->wagg_tree, wseg);
+		free(wseg, M_HAMMER2, 0);
+	}
+}
+
 char *
 hammer2_io_data(hammer2_io_t *dio, off_t lbase)
 {
@@ -351,10 +840,15 @@ hammer2_io_data(hammer2_io_t *dio, off_t lbase)
 	return(bp->b_data + off);
 }
 
+/*
+ * Instantiate a buffer for a new allocation.  The read-before-write can
+ * be skipped if the allocation covers the whole device buffer or the
+ * allocator has marked the device buffer PRISTINE.
+ */
 static
 int
 _hammer2_io_new(hammer2_mount_t *hmp, off_t lbase, int lsize,
-	        hammer2_io_t **diop, int dozero, int quick)
+	        hammer2_io_t **diop, int dozero)
 {
 	hammer2_io_t *dio;
 	int owner;
@@ -362,22 +856,13 @@ _hammer2_io_new(hammer2_mount_t *hmp, off_t lbase, int lsize,
 
 	dio = *diop = hammer2_io_getblk(hmp, lbase, lsize, &owner);
 	if (owner) {
-		if (lsize == dio->psize) {
+		if (lsize == dio->psize ||
+		    (dio->refs & HAMMER2_DIO_PRISTINE)) {
 			dio->bp = getblk(hmp->devvp,
-					     dio->pbase, dio->psize,
-					     (quick ? GETBLK_NOWAIT : 0),
-					     0);
-			if (dio->bp) {
-				vfs_bio_clrbuf(dio->bp);
-				if (quick) {
-					dio->bp->b_flags |= B_CACHE;
-					brelse(dio->bp);
-					dio->bp = NULL;
-				}
-			}
-			error = 0;
-		} else if (quick) {
-			/* do nothing */
+					     dio->pbase, dio->psize, 0, 0);
+			vfs_bio_clrbuf(dio->bp);
+			if (lsize != dio->psize)
+				++hammer2_dio_pristine;
 			error = 0;
 		} else {
 			error = bread(hmp->devvp, dio->pbase,
@@ -396,6 +881,7 @@ _hammer2_io_new(hammer2_mount_t *hmp, off_t lbase, int lsize,
 			bzero(hammer2_io_data(dio, lbase), lsize);
 		atomic_set_int(&dio->refs, HAMMER2_DIO_DIRTY);
 	}
+	hammer2_io_crc_clrmask(dio, lbase, lsize);
 	return error;
 }
 
@@ -403,21 +889,37 @@ int
 hammer2_io_new(hammer2_mount_t *hmp, off_t lbase, int lsize,
 	       hammer2_io_t **diop)
 {
-	return(_hammer2_io_new(hmp, lbase, lsize, diop, 1, 0));
+	return(_hammer2_io_new(hmp, lbase, lsize, diop, 1));
 }
 
 int
 hammer2_io_newnz(hammer2_mount_t *hmp, off_t lbase, int lsize,
 	       hammer2_io_t **diop)
 {
-	return(_hammer2_io_new(hmp, lbase, lsize, diop, 0, 0));
+	return(_hammer2_io_new(hmp, lbase, lsize, diop, 0));
 }
 
-int
-hammer2_io_newq(hammer2_mount_t *hmp, off_t lbase, int lsize,
-	       hammer2_io_t **diop)
+/*
+ * Called by the allocator when it allocates out of a device buffer it
+ * knows is entirely free.  Its media content is garbage, so the first
+ * hammer2_io_new() into it may instantiate a zero-filled buffer instead
+ * of reading it.  lbase/lsize describe the whole device buffer.
+ *
+ * Nothing is done if the dio currently has a buffer, and the hint is
+ * simply lost if the dio is evicted before it is used.
+ */
+void
+hammer2_io_pristine(hammer2_mount_t *hmp, off_t lbase, int lsize)
 {
-	return(_hammer2_io_new(hmp, lbase, lsize, diop, 0, 1));
+	hammer2_io_t *dio;
+	int owner;
+
+	dio = hammer2_io_getblk(hmp, lbase, lsize, &owner);
+	if (owner) {
+		atomic_set_int(&dio->refs, HAMMER2_DIO_PRISTINE);
+		hammer2_io_complete(dio, owner);
+	}
+	hammer2_io_putblk(&dio);
 }
 
 int
@@ -536,8 +1038,10 @@ hammer2_io_setdirty(hammer2_io_t *dio)
 void
 hammer2_io_setinval(hammer2_io_t *dio, u_int bytes)
 {
-	if ((u_int)dio->psize == bytes)
+	if ((u_int)dio->psize == bytes) {
 		dio->bp->b_flags |= B_INVAL | B_RELBUF;
+		dio->crc_good_mask = 0;
+	}
 }
 
 void
@@ -557,3 +1061,89 @@ hammer2_io_isdirty(hammer2_io_t *dio)
 {
 	return((dio->refs & HAMMER2_DIO_DIRTY) != 0);
 }
+
+/*
+ * Calculate the crc_good_mask bits covering the logical range.  Returns
+ * 0 if the range is smaller than one granule and cannot be tracked.
+ */
+u_long
+hammer2_io_crc_mask(hammer2_io_t *dio, off_t lbase, int lsize)
+{
+	u_long mask;
+	int i;
+	int n;
+
+	n = lsize >> HAMMER2_IO_CRCRADIX;
+	if (n == 0)
+		return 0;
+	if (n >= (int)HAMMER2_IO_CRCBITS)
+		return(~0UL);
+	i = (int)((lbase & ~HAMMER2_OFF_MASK_RADIX) - dio->pbase) >>
+	    HAMMER2_IO_CRCRADIX;
+	mask = ((1UL << n) - 1) << i;
+
+	return(mask);
+}
+
+/*
+ * Returns non-zero if the chain's data range in its dio has already
+ * passed the check code test.  *maskp is set for a later
+ * hammer2_io_crc_setmask() when it has not.
+ */
+int
+hammer2_io_crc_good(hammer2_chain_t *chain, u_long *maskp)
+{
+	hammer2_io_t *dio;
+	u_long mask;
+
+	dio = chain->dio;
+	if (dio == NULL) {
+		*maskp = 0;
+		return 0;
+	}
+	mask = hammer2_io_crc_mask(dio, chain->bref.data_off, chain->bytes);
+	*maskp = mask;
+	if (mask && (dio->crc_good_mask & mask) == mask)
+		return 1;
+	return 0;
+}
+
+void
+hammer2_io_crc_setmask(hammer2_io_t *dio, u_long mask)
+{
+	u_long omask;
+
+	if (mask == 0)
+		return;
+	for (;;) {
+		omask = dio->crc_good_mask;
+		cpu_ccfence();
+		if (atomic_cas_ulong(&dio->crc_good_mask, omask,
+				     omask | mask) == omask) {
+			break;
+		}
+		/* retry */
+	}
+}
+
+void
+hammer2_io_crc_clrmask(hammer2_io_t *dio, off_t lbase, int lsize)
+{
+	u_long omask;
+	u_long mask;
+
+	mask = hammer2_io_crc_mask(dio, lbase, lsize);
+	if (mask == 0)
+		return;
+	for (;;) {
+		omask = dio->crc_good_mask;
+		cpu_ccfence();
+		if ((omask & mask) == 0)
+			break;
+		if (atomic_cas_ulong(&dio->crc_good_mask, omask,
+				     omask & ~mask) == omask) {
+			break;
+		}
+		/* retry */
+	}
+}
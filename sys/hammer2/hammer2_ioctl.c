@@ -61,6 +61,11 @@ static int hammer2_ioctl_pfs_delete(hammer2_inode_t *ip, void *data);
 static int hammer2_ioctl_inode_get(hammer2_inode_t *ip, void *data);
 static int hammer2_ioctl_inode_set(hammer2_inode_t *ip, void *data);
 static int hammer2_ioctl_debug_dump(hammer2_inode_t *ip);
+static int hammer2_ioctl_comp_stats(hammer2_inode_t *ip, void *data);
+static int hammer2_ioctl_flush_stats(hammer2_inode_t *ip, void *data);
+static int hammer2_ioctl_bulkfree_scan(hammer2_inode_t *ip, void *data);
+static int hammer2_ioctl_defrag(hammer2_inode_t *ip, void *data);
+static int hammer2_ioctl_discard(hammer2_inode_t *ip, void *data);
 //static int hammer2_ioctl_inode_comp_set(hammer2_inode_t *ip, void *data);
 //static int hammer2_ioctl_inode_comp_rec_set(hammer2_inode_t *ip, void *data);
 //static int hammer2_ioctl_inode_comp_rec_set2(hammer2_inode_t *ip, void *data);
@@ -182,6 +187,24 @@ hammer2_ioctl(hammer2_inode_t *ip, u_long com, void *data, int fflag,
 	case HAMMER2IOC_DEBUG_DUMP:
 		error = hammer2_ioctl_debug_dump(ip);
 		break;
+	case HAMMER2IOC_COMP_STATS:
+		error = hammer2_ioctl_comp_stats(ip, data);
+		break;
+	case HAMMER2IOC_FLUSH_STATS:
+		error = hammer2_ioctl_flush_stats(ip, data);
+		break;
+	case HAMMER2IOC_BULKFREE_SCAN:
+		if (error == 0)
+			error = hammer2_ioctl_bulkfree_scan(ip, data);
+		break;
+	case HAMMER2IOC_DEFRAG:
+		if (error == 0)
+			error = hammer2_ioctl_defrag(ip, data);
+		break;
+	case HAMMER2IOC_DISCARD:
+		if (error == 0)
+			error = hammer2_ioctl_discard(ip, data);
+		break;
 	default:
 		error = EOPNOTSUPP;
 		break;
@@ -763,3 +786,72 @@ hammer2_ioctl_debug_dump(hammer2_inode_t *ip)
 	}
 	return 0;
 }
+
+/*
+ * Report the global compression statistics.  Does not require root.
+ */
+static int
+hammer2_ioctl_comp_stats(hammer2_inode_t *ip, void *data)
+{
+	hammer2_ioc_compstats_t *stats = data;
+
+	bzero(stats, sizeof(*stats));
+	stats->attempted = hammer2_comp_attempted;
+	stats->compressed = hammer2_comp_compressed;
+	stats->skip_entropy = hammer2_comp_skip_entropy;
+	stats->skip_heuristic = hammer2_comp_skip_heuristic;
+	stats->bytes_in = hammer2_comp_bytes_in;
+	stats->bytes_out = hammer2_comp_bytes_out;
+	return 0;
+}
+
+/*
+ * Report the global parallel flush statistics and the number of flush
+ * workers on the PFS.  Does not require root.
+ */
+static int
+hammer2_ioctl_flush_stats(hammer2_inode_t *ip, void *data)
+{
+	hammer2_ioc_flushstats_t *stats = data;
+
+	bzero(stats, sizeof(*stats));
+	stats->jobs = hammer2_flush_jobs;
+	stats->jobs_worker = hammer2_flush_jobs_worker;
+	stats->subtrees = hammer2_flush_subtrees;
+	stats->subtrees_worker = hammer2_flush_subtrees_worker;
+	stats->workers = ip->pmp->fworkers;
+	return 0;
+}
+
+/*
+ * Run a bulk free pass on the underlying mount and wait for it.
+ */
+static int
+hammer2_ioctl_bulkfree_scan(hammer2_inode_t *ip, void *data)
+{
+	hammer2_mount_t *hmp = ip->pmp->iroot->cluster.focus->hmp;
+
+	return (hammer2_bulkfree_request(hmp, data));
+}
+
+/*
+ * Relocate chains of the PFS out of sparsely used segments, see
+ * hammer2_defrag.c.
+ */
+static int
+hammer2_ioctl_defrag(hammer2_inode_t *ip, void *data)
+{
+	return (hammer2_defrag(ip->pmp, data));
+}
+
+/*
+ * Inspect or configure the discard queue of the underlying mount, see
+ * hammer2_discard.c.
+ */
+static int
+hammer2_ioctl_discard(hammer2_inode_t *ip, void *data)
+{
+	hammer2_mount_t *hmp = ip->pmp->iroot->cluster.focus->hmp;
+
+	return (hammer2_discard_ioctl(hmp, data));
+}
@@ -117,6 +117,118 @@ typedef struct hammer2_ioc_inode hammer2_ioc_inode_t;
 #define HAMMER2IOC_INODE_FLAG_DQUOTA	0x00000002
 #define HAMMER2IOC_INODE_FLAG_COPIES	0x00000004
 
+/*
+ * Global compression statistics
+ */
+struct hammer2_ioc_compstats {
+	uint64_t		attempted;	/* LZ4/zlib passes run */
+	uint64_t		compressed;	/* passes that fit */
+	uint64_t		skip_entropy;	/* rejected by the estimator */
+	uint64_t		skip_heuristic;	/* rejected by inode history */
+	uint64_t		bytes_in;	/* logical bytes compressed */
+	uint64_t		bytes_out;	/* resulting compressed bytes */
+	uint64_t		reserved[10];
+};
+
+typedef struct hammer2_ioc_compstats hammer2_ioc_compstats_t;
+
+/*
+ * Global parallel flush statistics
+ */
+struct hammer2_ioc_flushstats {
+	uint64_t		jobs;		/* flush jobs queued */
+	uint64_t		jobs_worker;	/* run by a flush worker */
+	uint64_t		subtrees;	/* subtrees split off a flush */
+	uint64_t		subtrees_worker; /* run by a flush worker */
+	uint32_t		workers;	/* flush workers on this PFS */
+	uint32_t		reserved01;
+	uint64_t		reserved[11];
+};
+
+typedef struct hammer2_ioc_flushstats hammer2_ioc_flushstats_t;
+
+/*
+ * Run a bulk free pass on the volume backing the ioctl target and
+ * return its statistics.  size limits the RAM used for the scan bitmap
+ * (0 selects the default), larger volumes are scanned in windows.
+ * Passes are incremental when the kernel still holds the reference
+ * counts from the previous pass unless HAMMER2_BULKFREE_FULL is set.
+ */
+struct hammer2_ioc_bulkfree {
+	uint64_t		size;		/* scan bitmap RAM limit */
+	uint64_t		count_scanned;	/* blockrefs scanned */
+	uint64_t		count_windows;	/* topology passes */
+	uint64_t		count_staged;	/* 11 -> 10 */
+	uint64_t		count_freed;	/* 10 -> 00 */
+	uint64_t		count_restored;	/* 10 -> 11 */
+	uint64_t		count_fixed;	/* 00 -> 11 */
+	uint64_t		bytes_freed;
+	int			error;
+	int			flags;
+	uint64_t		count_pruned;	/* unchanged subtrees skipped */
+	uint64_t		reserved[7];
+};
+
+#define HAMMER2_BULKFREE_FULL		0x0001	/* in: force a full scan */
+#define HAMMER2_BULKFREE_INCR		0x0002	/* out: pass was incremental */
+
+typedef struct hammer2_ioc_bulkfree hammer2_ioc_bulkfree_t;
+
+/*
+ * Relocate the blocks of sparsely filled 2MB segments so the segments can
+ * be freed by later bulk free passes.  Segments in use whose fill is at
+ * most fill_pct percent (0 selects the default) are selected, up to
+ * max_segs (0 for no limit).  Only the PFS the ioctl is issued on is
+ * relocated, blocks possibly shared with a snapshot are left in place
+ * and snapshots themselves fail with EOPNOTSUPP.
+ */
+struct hammer2_ioc_defrag {
+	uint32_t		fill_pct;	/* max segment fill (percent) */
+	uint32_t		max_segs;	/* max segments selected */
+	uint64_t		count_segs;	/* segments selected */
+	uint64_t		count_scanned;	/* chains scanned */
+	uint64_t		count_moved;	/* chains relocated */
+	uint64_t		count_skipped;	/* chains not relocated */
+	uint64_t		bytes_moved;
+	int			error;
+	int			flags;
+	uint64_t		reserved[8];
+};
+
+typedef struct hammer2_ioc_defrag hammer2_ioc_defrag_t;
+
+/*
+ * Inspect and configure the discard queue of the underlying device.
+ * HAMMER2_DISCARD_RECORD replaces device discards with a recording stub,
+ * starting the discard thread if necessary, so the queue can be
+ * exercised on devices without discard support.  The stub keeps the
+ * last HAMMER2_DISCARD_NREC extents it was handed, returned in rec[]
+ * oldest first.  HAMMER2_DISCARD_DEVICE goes back to device discards.
+ */
+struct hammer2_ioc_discard_rec {
+	uint64_t		beg;
+	uint64_t		end;
+};
+
+#define HAMMER2_DISCARD_NREC		64
+
+struct hammer2_ioc_discard {
+	int			flags;
+	int			nrec;		/* valid entries in rec[] */
+	uint64_t		count_queued;	/* extents waiting */
+	uint64_t		count_recorded;	/* extents recorded */
+	uint64_t		reserved[6];
+	struct hammer2_ioc_discard_rec rec[HAMMER2_DISCARD_NREC];
+};
+
+#define HAMMER2_DISCARD_RECORD		0x0001	/* in: record, don't issue */
+#define HAMMER2_DISCARD_DEVICE		0x0002	/* in: issue to the device */
+#define HAMMER2_DISCARD_CLEAR		0x0004	/* in: clear after copyout */
+#define HAMMER2_DISCARD_ACTIVE		0x0100	/* out: thread running */
+#define HAMMER2_DISCARD_RECORDING	0x0200	/* out: recording stub */
+
+typedef struct hammer2_ioc_discard hammer2_ioc_discard_t;
+
 /*
  * Ioctl list
  */
@@ -146,5 +258,10 @@ typedef struct hammer2_ioc_inode hammer2_ioc_inode_t;
 #define HAMMER2IOC_INODE_COMP_REC_SET2	_IOWR('h', 90, struct hammer2_ioc_inode)*/
 
 #define HAMMER2IOC_DEBUG_DUMP	_IOWR('h', 91, int)
+#define HAMMER2IOC_COMP_STATS	_IOWR('h', 92, struct hammer2_ioc_compstats)
+#define HAMMER2IOC_BULKFREE_SCAN _IOWR('h', 93, struct hammer2_ioc_bulkfree)
+#define HAMMER2IOC_DEFRAG	_IOWR('h', 94, struct hammer2_ioc_defrag)
+#define HAMMER2IOC_DISCARD	_IOWR('h', 95, struct hammer2_ioc_discard)
+#define HAMMER2IOC_FLUSH_STATS	_IOWR('h', 96, struct hammer2_ioc_flushstats)
 
 #endif /* !_VFS_HAMMER2_IOCTL_H_ */
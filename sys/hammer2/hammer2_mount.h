@@ -50,7 +50,8 @@ struct hammer2_mount_info {
 };
 
 #define HMNT2_NOAUTOSNAP	0x00000001
+#define HMNT2_DISCARD		0x00000002	/* discard freed space */
 
-#define HMNT2_USERFLAGS		(HMNT2_NOAUTOSNAP)
+#define HMNT2_USERFLAGS		(HMNT2_NOAUTOSNAP | HMNT2_DISCARD)
 
 #endif
@@ -48,6 +48,7 @@
 #include <sys/objcache.h>
 
 #include <sys/proc.h>
+#include <sys/kthread.h>
 #include <sys/namei.h>
 #include <sys/dirent.h>
 #include <sys/uio.h>
@@ -55,10 +56,12 @@
 #include <sys/dmsg.h>
 
 #include <machine/mplock.h>
+#include <uvm/uvm_extern.h>
 #include <lib/libz/zlib.h>
 
 #include "hammer2.h"
 #include "hammer2_lz4.h"
+#include "hammer2_zstd.h"
 
 #define REPORT_REFS_ERRORS 1	/* XXX remove me */
 #define VOP_FSYNC(vp, waitfor, flags)                   \
@@ -87,7 +90,50 @@ int hammer2_hardlink_enable = 1;
 int hammer2_flush_pipe = 100;
 int hammer2_synchronous_flush = 1;
 int hammer2_dio_count;
+int hammer2_dio_limit = 1000;
+long hammer2_wagg_maxio = MAXPHYS;	/* aggregated write, 0 = off */
+long hammer2_wagg_ios;			/* aggregated writes issued */
+long hammer2_wagg_bufs;			/* buffers written by them */
+struct pool hammer2_chain_pool;
+struct pool hammer2_cluster_pool;	/* single-node clusters */
+int hammer2_chain_lru_max = 4096;	/* retained clean chains per mount */
+int hammer2_flush_parallel = 1;		/* flush on the PFS workers */
+int hammer2_flush_workers;		/* 0 = ncpus */
+long hammer2_flush_jobs;		/* flush jobs queued */
+long hammer2_flush_jobs_worker;		/* run by a flush worker */
+long hammer2_flush_subtrees;		/* subtrees split off a flush */
+long hammer2_flush_subtrees_worker;	/* run by a flush worker */
+long hammer2_chain_lru_hits;		/* retained chains reused */
+long hammer2_chain_lru_misses;		/* inode/indirect chains allocated */
+long hammer2_chain_lru_evicted;		/* retained chains released */
 long hammer2_limit_dirty_chains;
+long hammer2_dio_contention;
+long hammer2_dio_lockless;
+long hammer2_dio_evicted;
+long hammer2_dio_pristine;		/* read-before-writes avoided */
+long hammer2_comp_scratch_allocs;
+long hammer2_comp_attempted;
+long hammer2_comp_compressed;
+long hammer2_comp_skip_entropy;
+long hammer2_comp_skip_heuristic;
+long hammer2_comp_bytes_in;
+long hammer2_comp_bytes_out;
+int hammer2_comp_entropy_bits = 7;	/* 8 disables the estimator */
+int hammer2_write_workers;		/* 0 = ncpus - 1 */
+long hammer2_bulkfree_mem = 16 * 1024 * 1024; /* scan bitmap budget */
+int hammer2_bulkfree_interval = 3600;	/* seconds, 0 = on demand only */
+int hammer2_bulkfree_rate = 50000;	/* blockrefs/sec, 0 = unlimited */
+int hammer2_bulkfree_incr = 24;		/* incremental passes per full */
+long hammer2_discard_rate = 256 * 1024 * 1024; /* bytes/sec, 0 = unlimited */
+long hammer2_discard_maxio = 32 * 1024 * 1024;	/* max bytes per request */
+long hammer2_discard_align = 1024 * 1024; /* extent alignment, pwr of 2 */
+int hammer2_discard_maxq = 4096;	/* max queued extents */
+long hammer2_discard_count;
+long hammer2_discard_bytes;
+int hammer2_defrag_fill = 25;		/* default max segment fill, percent */
+int hammer2_defrag_batch = 256;		/* chains per transaction */
+long hammer2_check_verified;
+long hammer2_check_skipped;
 long hammer2_iod_file_read;
 long hammer2_iod_meta_read;
 long hammer2_iod_indr_read;
@@ -109,9 +155,6 @@ long hammer2_ioa_meta_write;
 long hammer2_ioa_indr_write;
 long hammer2_ioa_volu_write;
 
-#define C_BUFFER "compbuffer Buffer used for compression"
-#define D_BUFFER "decompbuffer Buffer used for decompression."
-
 int hammer2_vfs_init(struct vfsconf *);
 int hammer2_vfs_uninit(struct vfsconf *);
 int hammer2_vfs_mount(struct mount *mp, char *path, caddr_t data,
@@ -136,6 +179,8 @@ static int hammer2_install_volume_header(hammer2_mount_t *hmp);
 static int hammer2_sync_scan2(struct mount *, struct vnode *, void *);
 
 static void hammer2_write_thread(void *arg);
+static void hammer2_write_workers_start(hammer2_pfsmount_t *pmp);
+static void hammer2_write_worker(void *arg);
 
 static void hammer2_vfs_unmount_hmp1(struct mount *mp, hammer2_mount_t *hmp);
 static void hammer2_vfs_unmount_hmp2(struct mount *mp, hammer2_mount_t *hmp);
@@ -151,6 +196,12 @@ static void hammer2_write_file_core(struct buf *bp, hammer2_trans_t *trans,
 				hammer2_key_t lbase, int ioflag, int pblksize,
 				int *errorp);
 
+static void hammer2_compress_buffer(hammer2_wjob_t *job);
+static void hammer2_compress_commit(hammer2_wjob_t *job,
+				hammer2_trans_t *trans,
+				hammer2_inode_data_t *ipdata,
+				hammer2_cluster_t *cparent,
+				int ioflag, int *errorp);
 static void hammer2_compress_and_write(struct buf *bp, hammer2_trans_t *,
 				hammer2_inode_t *, hammer2_inode_data_t *,
 				hammer2_cluster_t *,
@@ -513,9 +564,6 @@ mtxsleep(void *ident, struct mutex *mtx, int flags,
 int
 hammer2_vfs_init(struct vfsconf *conf)
 {
-	static struct objcache_malloc_args margs_read;
-	static struct objcache_malloc_args margs_write;
-
 	int error;
 
 	error = 0;
@@ -529,20 +577,20 @@ hammer2_vfs_init(struct vfsconf *conf)
 
 	if (error)
 		printf("HAMMER2 structure size mismatch; cannot continue.\n");
-	
-	margs_read.objsize = 65536;
-	margs_read.mtype = (malloc_type_t)D_BUFFER;
-	
-	margs_write.objsize = 32768;
-	margs_write.mtype = (malloc_type_t)C_BUFFER;
-	
-/* XX fix	cache_buffer_read = cache_enter(margs_read.mtype->ks_shortdesc,
-				objcache_malloc_alloc,
-				&margs_read);
-	cache_buffer_write = cache_enter(margs_write.mtype->ks_shortdesc,
-				0, 1, NULL, NULL, NULL, objcache_malloc_alloc,
-				objcache_malloc_free, &margs_write);
-*/
+
+	hammer2_comp_init();
+	ccms_init();
+
+	pool_init(&hammer2_chain_pool, sizeof(hammer2_chain_t), 0, 0, 0,
+	    "h2chain", &pool_allocator_nointr);
+	pool_init(&hammer2_cluster_pool, HAMMER2_CLUSTER_BYTES(1), 0, 0, 0,
+	    "h2clust", &pool_allocator_nointr);
+	if (bootverbose) {
+		printf("hammer2: %zu bytes per cached chain, "
+		       "%zu per single-node cluster\n",
+		       sizeof(hammer2_chain_t),
+		       (size_t)HAMMER2_CLUSTER_BYTES(1));
+	}
 
 	lockinit(&hammer2_mntlk, 0, "mntlk", 0, 0);
 	TAILQ_INIT(&hammer2_mntlist);
@@ -558,8 +606,9 @@ hammer2_vfs_init(struct vfsconf *conf)
 int
 hammer2_vfs_uninit(struct vfsconf *vfsp __unused)
 {
-	cache_purge((struct vnode*)cache_buffer_read);
-	cache_purge((struct vnode*)cache_buffer_write);
+	hammer2_comp_uninit();
+	pool_destroy(&hammer2_cluster_pool);
+	pool_destroy(&hammer2_chain_pool);
 	return 0;
 }
 
@@ -587,8 +636,11 @@ hammer2_pfsalloc(const hammer2_inode_data_t *ipdata, hammer2_tid_t alloc_tid)
 		pmp->inode_tid = ipdata->pfs_inum + 1;
 		pmp->pfs_clid = ipdata->pfs_clid;
 	}
-	mtx_enter(pmp->wthread_mtx);
+	mtx_init(&pmp->wthread_mtx, IPL_BIO);
 	bioq_init(&pmp->wthread_bioq);
+	TAILQ_INIT(&pmp->wjob_queue);
+	mtx_init(&pmp->fjob_mtx, IPL_NONE);
+	TAILQ_INIT(&pmp->fjob_queue);
 
 	return pmp;
 }
@@ -766,14 +818,19 @@ hammer2_vfs_mount(struct mount *mp, char *path, caddr_t data,
 		hmp = malloc(sizeof(*hmp), M_HAMMER2, M_WAITOK | M_ZERO);
 		hmp->ronly = ronly;
 		hmp->devvp = devvp;
+		hmp->hflags = info.hflags & HMNT2_USERFLAGS;
 		malloc(sizeof(&hmp->mchain), (long long)"HAMMER2-chains", M_WAITOK | M_ZERO);
 		TAILQ_INSERT_TAIL(&hammer2_mntlist, hmp, mntentry);
-		RB_INIT(&hmp->iotree);
-		spin_init((struct __mp_lock *)&hmp->io_spin, "hm2mount_io");
+		hammer2_io_init(hmp);
 		spin_init((struct __mp_lock *)&hmp->list_spin, "hm2mount_list");
 		TAILQ_INIT(&hmp->flushq);
+		mtx_init(&hmp->chain_lru_mtx, IPL_NONE);
+		TAILQ_INIT(&hmp->chain_lru);
+		mtx_init(&hmp->discard_mtx, IPL_NONE);
+		TAILQ_INIT(&hmp->discard_list);
 
 		lockinit(&hmp->vollk, 0,  "h2vol", 0, 0);
+		hammer2_freemap_resv_init(hmp);
 
 		/*
 		 * vchain setup. vchain.data is embedded.
@@ -827,6 +884,7 @@ hammer2_vfs_mount(struct mount *mp, char *path, caddr_t data,
 			hammer2_vfs_unmount(mp, MNT_FORCE);
 			return error;
 		}
+		hammer2_freemap_sum_init(hmp);
 
 		/*
 		 * Really important to get these right or flush will get
@@ -888,6 +946,9 @@ hammer2_vfs_mount(struct mount *mp, char *path, caddr_t data,
 		if ((mp->mnt_flag & MNT_RDONLY) == 0) {
 			error = hammer2_recovery(hmp);
 			/* XXX do something with error */
+			hammer2_bulkfree_start(hmp);
+			if (hmp->hflags & HMNT2_DISCARD)
+				hammer2_discard_start(hmp);
 		}
 		++hmp->pmp_count;
 
@@ -1093,11 +1154,18 @@ hammer2_vfs_mount(struct mount *mp, char *path, caddr_t data,
 	 * (only applicable to pfs mounts, not applicable to spmp)
 	 */
 	pmp->wthread_destroy = 0;
-	// toss
-	free(hammer2_write_thread, 0, 0);
-	/* XXX fix me !!! lwkt_create(hammer2_write_thread, pmp,
-		    &pmp->wthread_td, NULL, 0, -1, "hwrite-%s", label);
-	*/
+	if (kthread_create(hammer2_write_thread, pmp, &pmp->wthread_td,
+			   "h2write")) {
+		printf("hammer2: unable to start write thread\n");
+		pmp->wthread_td = NULL;
+	}
+
+	/*
+	 * Flush workers run the cluster elements and dirty subtrees
+	 * hammer2_vfs_sync() splits off.  They are independent of the
+	 * write thread.
+	 */
+	hammer2_flush_workers_start(pmp);
 
 	/*
 	 * With the cluster operational install ihidden.
@@ -1130,102 +1198,301 @@ hammer2_vfs_mount(struct mount *mp, char *path, caddr_t data,
 
 /*
  * Handle bioq for strategy write
+ *
+ * Logical buffers are taken off the bioq in batches of up to
+ * HAMMER2_WJOB_BATCH.  Each buffer which is to be compressed is queued
+ * to the compression workers, which compress and checksum the batch in
+ * parallel while this thread helps out.  The batch is then committed
+ * in bioq order, which keeps physical assignment and chain updates
+ * ordered per inode.
  */
 static
 void
 hammer2_write_thread(void *arg)
 {
 	hammer2_pfsmount_t *pmp;
+	hammer2_wjob_t *jobs;
+	hammer2_wjob_t *job;
 	struct bio *bio;
 	struct buf *bp;
 	hammer2_trans_t trans;
 	struct vnode *vp;
 	hammer2_inode_t *ip;
 	hammer2_cluster_t *cparent;
+	const hammer2_inode_data_t *ripdata;
 	hammer2_inode_data_t *wipdata;
 	hammer2_key_t lbase;
-	// XX int lblksize;
 	int pblksize;
 	int error;
+	int count;
+	int i;
 	
 	pmp = arg;
+	jobs = malloc(sizeof(*jobs) * HAMMER2_WJOB_BATCH, M_HAMMER2,
+		      M_WAITOK | M_ZERO);
+	hammer2_write_workers_start(pmp);
 	
-	mtx_enter((struct mutex *)&pmp->wthread_mtx);
+	mtx_enter(&pmp->wthread_mtx);
 	while (pmp->wthread_destroy == 0) {
 		if (bioq_first(&pmp->wthread_bioq) == NULL) {
-			mtxsleep(&pmp->wthread_bioq, (struct mutex *)&pmp->wthread_mtx,
+			mtxsleep(&pmp->wthread_bioq, &pmp->wthread_mtx,
 				 0, "h2bioqw", 0);
 		}
 		cparent = NULL;
 
 		hammer2_trans_init(&trans, pmp, HAMMER2_TRANS_BUFCACHE);
 
-		while ((bio = bioq_takefirst(&pmp->wthread_bioq)) != NULL) {
+		while (bioq_first(&pmp->wthread_bioq) != NULL) {
 			/*
-			 * dummy bio for synchronization.  The transaction
-			 * must be reinitialized.
+			 * Collect a batch.
 			 */
-			/* XXX if (bio->bio_buf == NULL) {
-				bio->bio_flags |= BIO_DONE;
-				wakeup(bio);
-				hammer2_trans_done(&trans);
-				hammer2_trans_init(&trans, pmp,
-						   HAMMER2_TRANS_BUFCACHE);
-				continue;
-			} */
+			count = 0;
+			while (count < HAMMER2_WJOB_BATCH &&
+			       (bio = bioq_takefirst(&pmp->wthread_bioq)) != NULL) {
+				/*
+				 * dummy bio for synchronization.  The transaction
+				 * must be reinitialized.
+				 */
+				/* XXX if (bio->bio_buf == NULL) {
+					bio->bio_flags |= BIO_DONE;
+					wakeup(bio);
+					hammer2_trans_done(&trans);
+					hammer2_trans_init(&trans, pmp,
+							   HAMMER2_TRANS_BUFCACHE);
+					continue;
+				} */
+				job = &jobs[count++];
+				bzero(job, sizeof(*job));
+				job->bio = bio;
+				job->bp = ((struct bioh2 *)bio)->bio_buf;
+			}
+			mtx_leave(&pmp->wthread_mtx);
 
 			/*
-			 * else normal bio processing
+			 * Snapshot the compression parameters and hand
+			 * compressible buffers to the workers.  Nothing is
+			 * modified here so a shared inode lock suffices.
 			 */
-			mtx_leave((struct mutex *)&pmp->wthread_mtx);
-
-			hammer2_lwinprog_drop(pmp);
-			
-			error = 0;
-			/* XX bp = bio->bio_buf; */
-			vp = bp->b_vp;
-			ip = VTOI(vp);
+			for (i = 0; i < count; ++i) {
+				job = &jobs[i];
+				hammer2_lwinprog_drop(pmp);
+
+				bp = job->bp;
+				vp = bp->b_vp;
+				ip = VTOI(vp);
+				job->ip = ip;
+
+				cparent = hammer2_inode_lock_sh(ip);
+				ripdata = &hammer2_cluster_data(cparent)->ipdata;
+				hammer2_calc_logical(ip, bp->b_loffset,
+						     &job->lbase, NULL);
+				job->pblksize = hammer2_calc_physical(ip,
+							ripdata, job->lbase);
+				job->comp_algo = ripdata->comp_algo;
+				job->check_algo = ripdata->check_algo;
+				hammer2_inode_unlock_sh(ip, cparent);
+
+				switch(HAMMER2_DEC_ALGO(job->comp_algo)) {
+				case HAMMER2_COMP_NONE:
+				case HAMMER2_COMP_AUTOZERO:
+					break;
+				default:
+					job->flags |= HAMMER2_WJOB_QUEUED;
+					mtx_enter(&pmp->wthread_mtx);
+					TAILQ_INSERT_TAIL(&pmp->wjob_queue,
+							  job, entry);
+					++pmp->wjob_pending;
+					mtx_leave(&pmp->wthread_mtx);
+					wakeup_one(&pmp->wjob_queue);
+					break;
+				}
+			}
 
 			/*
-			 * Inode is modified, flush size and mtime changes
-			 * to ensure that the file size remains consistent
-			 * with the buffers being flushed.
-			 *
-			 * NOTE: The inode_fsync() call only flushes the
-			 *	 inode's meta-data state, it doesn't try
-			 *	 to flush underlying buffers or chains.
+			 * Help compress until the queue drains, then wait
+			 * for the workers to finish their last jobs.
 			 */
-			cparent = hammer2_inode_lock_ex(ip);
-			if (ip->flags & (HAMMER2_INODE_RESIZED |
-					 HAMMER2_INODE_MTIME)) {
-				hammer2_inode_fsync(&trans, ip, cparent);
+			mtx_enter(&pmp->wthread_mtx);
+			while (pmp->wjob_pending) {
+				job = TAILQ_FIRST(&pmp->wjob_queue);
+				if (job == NULL) {
+					mtxsleep(&pmp->wjob_pending,
+						 &pmp->wthread_mtx,
+						 0, "h2wjob", 0);
+					continue;
+				}
+				TAILQ_REMOVE(&pmp->wjob_queue, job, entry);
+				mtx_leave(&pmp->wthread_mtx);
+				hammer2_compress_buffer(job);
+				mtx_enter(&pmp->wthread_mtx);
+				job->flags |= HAMMER2_WJOB_DONE;
+				--pmp->wjob_pending;
 			}
-			wipdata = hammer2_cluster_modify_ip(&trans, ip,
-							 cparent, 0);
-			/* XXX fix me pointer deref lblksize = hammer2_calc_logical(ip, bio->bio_offset,
-							&lbase, NULL);
-			*/
-			pblksize = hammer2_calc_physical(ip, wipdata, lbase);
-			hammer2_write_file_core(bp, &trans, ip, wipdata,
-						cparent,
-						lbase, IO_ASYNC,
-						pblksize, &error);
-			hammer2_cluster_modsync(cparent);
-			hammer2_inode_unlock_ex(ip, cparent);
-			if (error) {
-				printf("hammer2: error in buffer write\n");
-				bp->b_flags |= B_ERROR;
-				bp->b_error = EIO;
+			mtx_leave(&pmp->wthread_mtx);
+
+			/*
+			 * Commit the batch in order.
+			 */
+			for (i = 0; i < count; ++i) {
+				job = &jobs[i];
+				bp = job->bp;
+				ip = job->ip;
+				error = 0;
+
+				/*
+				 * Inode is modified, flush size and mtime
+				 * changes to ensure that the file size
+				 * remains consistent with the buffers being
+				 * flushed.
+				 *
+				 * NOTE: The inode_fsync() call only flushes
+				 *	 the inode's meta-data state, it doesn't
+				 *	 try to flush underlying buffers or
+				 *	 chains.
+				 */
+				cparent = hammer2_inode_lock_ex(ip);
+				if (ip->flags & (HAMMER2_INODE_RESIZED |
+						 HAMMER2_INODE_MTIME)) {
+					hammer2_inode_fsync(&trans, ip, cparent);
+				}
+				wipdata = hammer2_cluster_modify_ip(&trans, ip,
+								 cparent, 0);
+				lbase = job->lbase;
+				pblksize = hammer2_calc_physical(ip, wipdata,
+								 lbase);
+
+				/*
+				 * Blocks allocated for the buffer are placed
+				 * near the file's previous blocks.
+				 */
+				trans.tmp_ip = ip;
+
+				/*
+				 * The precomputed result is only usable if
+				 * the inode's parameters did not change while
+				 * the job was in flight.
+				 */
+				if ((job->flags & HAMMER2_WJOB_DONE) &&
+				    pblksize == job->pblksize &&
+				    wipdata->comp_algo == job->comp_algo &&
+				    wipdata->check_algo == job->check_algo) {
+					hammer2_compress_commit(job, &trans,
+							wipdata, cparent,
+							IO_ASYNC, &error);
+				} else {
+					if (job->scr) {
+						hammer2_comp_put(job->scr);
+						job->scr = NULL;
+					}
+					hammer2_write_file_core(bp, &trans, ip,
+							wipdata, cparent,
+							lbase, IO_ASYNC,
+							pblksize, &error);
+				}
+				trans.tmp_ip = NULL;
+				hammer2_cluster_modsync(cparent);
+				hammer2_inode_unlock_ex(ip, cparent);
+				if (error) {
+					printf("hammer2: error in buffer write\n");
+					bp->b_flags |= B_ERROR;
+					bp->b_error = EIO;
+				}
+				biodone((struct buf *)job->bio);
 			}
-			biodone((struct buf *)bio);
-			mtx_enter((struct mutex *)&pmp->wthread_mtx);
+			mtx_enter(&pmp->wthread_mtx);
 		}
 		hammer2_trans_done(&trans);
 	}
+
+	/*
+	 * Stop the compression workers before acknowledging termination.
+	 */
+	pmp->wworkers_stop = 1;
+	wakeup(&pmp->wjob_queue);
+	while (pmp->wworkers) {
+		mtxsleep(&pmp->wworkers, &pmp->wthread_mtx,
+			 0, "h2wstop", 0);
+	}
 	pmp->wthread_destroy = -1;
 	wakeup(&pmp->wthread_destroy);
 	
-	mtx_leave((struct mutex *)&pmp->wthread_mtx);
+	mtx_leave(&pmp->wthread_mtx);
+	free(jobs, M_HAMMER2, 0);
+
+	kthread_exit(0);
+}
+
+/*
+ * Start the compression workers for a PFS.  hammer2_write_workers
+ * overrides the default of one worker per additional cpu, the write
+ * thread itself also compresses.
+ */
+static
+void
+hammer2_write_workers_start(hammer2_pfsmount_t *pmp)
+{
+	int count;
+	int i;
+
+	count = hammer2_write_workers;
+	if (count <= 0)
+		count = ncpus - 1;
+	if (count > HAMMER2_WWORKERS_MAX)
+		count = HAMMER2_WWORKERS_MAX;
+
+	for (i = 0; i < count; ++i) {
+		mtx_enter(&pmp->wthread_mtx);
+		++pmp->wworkers;
+		mtx_leave(&pmp->wthread_mtx);
+		if (kthread_create(hammer2_write_worker, pmp, NULL, "h2wrk")) {
+			printf("hammer2: unable to start compression "
+			       "worker\n");
+			mtx_enter(&pmp->wthread_mtx);
+			--pmp->wworkers;
+			mtx_leave(&pmp->wthread_mtx);
+			break;
+		}
+	}
+}
+
+/*
+ * Compression worker.  Compresses and checksums queued logical buffers,
+ * completion order does not matter since the write thread commits the
+ * jobs in submission order.
+ */
+static
+void
+hammer2_write_worker(void *arg)
+{
+	hammer2_pfsmount_t *pmp;
+	hammer2_wjob_t *job;
+
+	pmp = arg;
+
+	mtx_enter(&pmp->wthread_mtx);
+	while (pmp->wworkers_stop == 0) {
+		job = TAILQ_FIRST(&pmp->wjob_queue);
+		if (job == NULL) {
+			mtxsleep(&pmp->wjob_queue,
+				 &pmp->wthread_mtx,
+				 0, "h2wwrk", 0);
+			continue;
+		}
+		TAILQ_REMOVE(&pmp->wjob_queue, job, entry);
+		mtx_leave(&pmp->wthread_mtx);
+
+		hammer2_compress_buffer(job);
+
+		mtx_enter(&pmp->wthread_mtx);
+		job->flags |= HAMMER2_WJOB_DONE;
+		if (--pmp->wjob_pending == 0)
+			wakeup(&pmp->wjob_pending);
+	}
+	--pmp->wworkers;
+	wakeup(&pmp->wworkers);
+	mtx_leave(&pmp->wthread_mtx);
+
+	kthread_exit(0);
 }
 
 void
@@ -1234,14 +1501,14 @@ hammer2_bioq_sync(hammer2_pfsmount_t *pmp)
 	struct bio *sync_bio;
 
 	bzero(&sync_bio, sizeof(sync_bio));	/* dummy with no bio_buf */
-	mtx_enter((struct mutex *)&pmp->wthread_mtx);
+	mtx_enter(&pmp->wthread_mtx);
 	if (pmp->wthread_destroy == 0 &&
 	    TAILQ_FIRST(&pmp->wthread_bioq.queue)) {
 		bioq_insert_tail(&pmp->wthread_bioq, sync_bio);
 		while ((/* XXX Fix sync_bio->bio_flags & */ BIO_DONE) == 0)
-			mtxsleep(&sync_bio, (struct mutex *)&pmp->wthread_mtx, 0, "h2bioq", 0);
+			mtxsleep(&sync_bio, &pmp->wthread_mtx, 0, "h2bioq", 0);
 	}
-	mtx_leave((struct mutex *)&pmp->wthread_mtx);
+	mtx_leave(&pmp->wthread_mtx);
 }
 
 /* 
@@ -1386,6 +1653,7 @@ hammer2_write_file_core(struct buf *bp, hammer2_trans_t *trans,
 		break;
 	case HAMMER2_COMP_LZ4:
 	case HAMMER2_COMP_ZLIB:
+	case HAMMER2_COMP_ZSTD:
 	default:
 		/*
 		 * Check for zero-fill and attempt compression.
@@ -1413,33 +1681,73 @@ hammer2_compress_and_write(struct buf *bp, hammer2_trans_t *trans,
 	hammer2_key_t lbase, int ioflag, int pblksize,
 	int *errorp, int comp_algo, int check_algo)
 {
-	hammer2_cluster_t *cluster;
-	hammer2_chain_t *chain;
+	hammer2_wjob_t job;
+
+	bzero(&job, sizeof(job));
+	job.bp = bp;
+	job.ip = ip;
+	job.lbase = lbase;
+	job.pblksize = pblksize;
+	job.comp_algo = comp_algo;
+	job.check_algo = check_algo;
+
+	hammer2_compress_buffer(&job);
+	hammer2_compress_commit(&job, trans, ipdata, cparent, ioflag, errorp);
+}
+
+/*
+ * First half of the compression write path.  Tests the logical buffer
+ * for zeros, compresses it into a scratch buffer and calculates the
+ * check code of the data which will be written.  Only the buffer
+ * contents and the job parameters are accessed so this may run in a
+ * compression worker without any locks held.
+ */
+static
+void
+hammer2_compress_buffer(hammer2_wjob_t *job)
+{
+	struct buf *bp = job->bp;
+	hammer2_inode_t *ip = job->ip;
+	hammer2_comp_scratch_t *scr;
+	int pblksize = job->pblksize;
+	int comp_algo = job->comp_algo;
 	int comp_size;
 	int comp_block_size;
-	int i;
 	char *comp_buffer;
 
 	if (test_block_zeros(bp->b_data, pblksize)) {
-		zero_write(bp, trans, ip, ipdata, cparent, lbase, errorp);
+		job->flags |= HAMMER2_WJOB_ZERO;
 		return;
 	}
 
 	comp_size = 0;
 	comp_buffer = NULL;
+	scr = NULL;
 
 	KKASSERT(pblksize / 2 <= 32768);
-		
-	if (ip->comp_heuristic < 8 || (ip->comp_heuristic & 7) == 0) {
-		z_stream strm_compress;
+
+	/*
+	 * Consult the per-inode history first, then sample the buffer.
+	 * Both are far cheaper than a failed LZ4 or zlib pass.
+	 */
+	if (hammer2_comp_heur_try(ip) == 0) {
+		atomic_add_long(&hammer2_comp_skip_heuristic, 1);
+		job->comp_result = HAMMER2_COMPRES_SKIPPED;
+	} else if (hammer2_comp_entropy_high(bp->b_data, pblksize)) {
+		atomic_add_long(&hammer2_comp_skip_entropy, 1);
+		job->comp_result = HAMMER2_COMPRES_ENTROPY;
+	} else {
+		z_stream *strm_compress;
 		int comp_level;
 		int ret;
 
+		atomic_add_long(&hammer2_comp_attempted, 1);
+		job->comp_result = HAMMER2_COMPRES_FAILED;
+
 		switch(HAMMER2_DEC_ALGO(comp_algo)) {
 		case HAMMER2_COMP_LZ4:
-			/* XXX comp_buffer = objcache_get(cache_buffer_write,
-						   M_INTWAIT);
-			*/
+			scr = hammer2_comp_get();
+			comp_buffer = scr->buf;
 			comp_size = LZ4_compress_limitedOutput(
 					bp->b_data,
 					&comp_buffer[sizeof(int)],
@@ -1462,27 +1770,41 @@ hammer2_compress_and_write(struct buf *bp, hammer2_trans_t *trans,
 				comp_level = 6;
 			else if (comp_level > 9)
 				comp_level = 9;
-			ret = deflateInit(&strm_compress, comp_level);
-			if (ret != Z_OK) {
+			scr = hammer2_comp_get();
+			comp_buffer = scr->buf;
+			strm_compress = hammer2_comp_deflate(scr, comp_level);
+			if (strm_compress == NULL) {
 				printf("HAMMER2 ZLIB: fatal error "
 					"on deflateInit.\n");
+				break;
 			}
-
-			/* XXX comp_buffer = objcache_get(cache_buffer_write,
-						   M_INTWAIT);
-			*/
-			strm_compress.next_in = bp->b_data;
-			strm_compress.avail_in = pblksize;
-			strm_compress.next_out = comp_buffer;
-			strm_compress.avail_out = pblksize / 2;
-			ret = deflate(&strm_compress, Z_FINISH);
+			strm_compress->next_in = bp->b_data;
+			strm_compress->avail_in = pblksize;
+			strm_compress->next_out = comp_buffer;
+			strm_compress->avail_out = pblksize / 2;
+			ret = deflate(strm_compress, Z_FINISH);
 			if (ret == Z_STREAM_END) {
 				comp_size = pblksize / 2 -
-					    strm_compress.avail_out;
+					    strm_compress->avail_out;
 			} else {
 				comp_size = 0;
 			}
-			ret = deflateEnd(&strm_compress);
+			break;
+		case HAMMER2_COMP_ZSTD:
+			comp_level = HAMMER2_DEC_LEVEL(comp_algo);
+			if (comp_level == 0)
+				comp_level = HAMMER2_ZSTD_LEVEL_DEF;
+			else if (comp_level > HAMMER2_ZSTD_LEVEL_MAX)
+				comp_level = HAMMER2_ZSTD_LEVEL_MAX;
+			scr = hammer2_comp_get();
+			comp_buffer = scr->buf;
+			/*
+			 * The zstd frame records its own content size,
+			 * no prefix is needed.
+			 */
+			comp_size = hammer2_zstd_compress(bp->b_data, pblksize,
+					comp_buffer, pblksize / 2, comp_level,
+					hammer2_comp_zstd_cwrk(scr));
 			break;
 		default:
 			printf("Error: Unknown compression method.\n");
@@ -1496,13 +1818,21 @@ hammer2_compress_and_write(struct buf *bp, hammer2_trans_t *trans,
 		 * compression failed or turned off
 		 */
 		comp_block_size = pblksize;	/* safety */
-		if (++ip->comp_heuristic > 128)
-			ip->comp_heuristic = 8;
+		if (scr) {
+			hammer2_comp_put(scr);
+			scr = NULL;
+		}
+		job->bref.methods = HAMMER2_ENC_COMP(HAMMER2_COMP_NONE) +
+				    HAMMER2_ENC_CHECK(job->check_algo);
+		hammer2_bref_setcheck(&job->bref, bp->b_data, pblksize);
 	} else {
 		/*
 		 * compression succeeded
 		 */
-		ip->comp_heuristic = 0;
+		job->comp_result = HAMMER2_COMPRES_COMPRESSED;
+		atomic_add_long(&hammer2_comp_compressed, 1);
+		atomic_add_long(&hammer2_comp_bytes_in, pblksize);
+		atomic_add_long(&hammer2_comp_bytes_out, comp_size);
 		if (comp_size <= 1024) {
 			comp_block_size = 1024;
 		} else if (comp_size <= 2048) {
@@ -1521,10 +1851,54 @@ hammer2_compress_and_write(struct buf *bp, hammer2_trans_t *trans,
 			/* NOT REACHED */
 			comp_block_size = pblksize;
 		}
+
+		/*
+		 * Make sure we don't leave garbage after the compressed
+		 * data, the check code covers the whole physical block.
+		 */
+		if (comp_size != comp_block_size) {
+			bzero(comp_buffer + comp_size,
+			      comp_block_size - comp_size);
+		}
+		job->bref.methods = HAMMER2_ENC_COMP(comp_algo) +
+				    HAMMER2_ENC_CHECK(job->check_algo);
+		hammer2_bref_setcheck(&job->bref, comp_buffer,
+				      comp_block_size);
 	}
+	job->scr = scr;
+	job->comp_size = comp_size;
+	job->comp_block_size = comp_block_size;
+}
+
+/*
+ * Second half of the compression write path.  Assigns physical storage
+ * for the result of hammer2_compress_buffer() and copies it and its
+ * precomputed check code into the chain.  Must be called with the
+ * inode locked exclusively, in the order the logical buffers were
+ * queued.
+ */
+static
+void
+hammer2_compress_commit(hammer2_wjob_t *job, hammer2_trans_t *trans,
+	hammer2_inode_data_t *ipdata, hammer2_cluster_t *cparent,
+	int ioflag, int *errorp)
+{
+	hammer2_cluster_t *cluster;
+	hammer2_chain_t *chain;
+	struct buf *bp = job->bp;
+	hammer2_inode_t *ip = job->ip;
+	int comp_block_size = job->comp_block_size;
+	int i;
+
+	if (job->flags & HAMMER2_WJOB_ZERO) {
+		zero_write(bp, trans, ip, ipdata, cparent, job->lbase, errorp);
+		return;
+	}
+
+	hammer2_comp_heur_update(ip, job->comp_result);
 
 	cluster = hammer2_assign_physical(trans, ip, cparent,
-					  lbase, comp_block_size,
+					  job->lbase, comp_block_size,
 					  errorp);
 	ipdata = &hammer2_cluster_data(cparent)->ipdata;
 
@@ -1551,6 +1925,8 @@ hammer2_compress_and_write(struct buf *bp, hammer2_trans_t *trans,
 			      HAMMER2_EMBEDDED_BYTES);
 			break;
 		case HAMMER2_BREF_TYPE_DATA:
+			KKASSERT(chain->bytes == comp_block_size);
+
 			/*
 			 * Optimize out the read-before-write
 			 * if possible.
@@ -1567,33 +1943,22 @@ hammer2_compress_and_write(struct buf *bp, hammer2_trans_t *trans,
 			}
 			bdata = hammer2_io_data(dio, chain->bref.data_off);
 
-			/*
-			 * When loading the block make sure we don't
-			 * leave garbage after the compressed data.
-			 */
-			if (comp_size) {
-				chain->bref.methods =
-					HAMMER2_ENC_COMP(comp_algo) +
-					HAMMER2_ENC_CHECK(check_algo);
-				bcopy(comp_buffer, bdata, comp_size);
-				if (comp_size != comp_block_size) {
-					bzero(bdata + comp_size,
-					      comp_block_size - comp_size);
-				}
-			} else {
-				chain->bref.methods =
-					HAMMER2_ENC_COMP(
-						HAMMER2_COMP_NONE) +
-					HAMMER2_ENC_CHECK(check_algo);
-				bcopy(bp->b_data, bdata, pblksize);
-			}
+			if (job->comp_size)
+				bcopy(job->scr->buf, bdata, comp_block_size);
+			else
+				bcopy(bp->b_data, bdata, comp_block_size);
 
 			/*
 			 * The flush code doesn't calculate check codes for
 			 * file data (doing so can result in excessive I/O),
-			 * so we do it here.
+			 * it was precomputed by hammer2_compress_buffer().
 			 */
-			hammer2_chain_setcheck(chain, bdata);
+			chain->bref.methods = job->bref.methods;
+			chain->bref.flags &= ~HAMMER2_BREF_FLAG_ZERO;
+			bcopy(&job->bref.check, &chain->bref.check,
+			      sizeof(chain->bref.check));
+			hammer2_io_crc_clrmask(dio, chain->bref.data_off,
+					       chain->bytes);
 
 			/*
 			 * Device buffer is now valid, chain is no longer in
@@ -1630,8 +1995,10 @@ hammer2_compress_and_write(struct buf *bp, hammer2_trans_t *trans,
 done:
 	if (cluster)
 		hammer2_cluster_unlock(cluster);
-	// XX if (comp_buffer)
-		// XX objcache_put(cache_buffer_write, comp_buffer);
+	if (job->scr) {
+		hammer2_comp_put(job->scr);
+		job->scr = NULL;
+	}
 }
 
 /*
@@ -1813,6 +2180,10 @@ hammer2_remount(hammer2_mount_t *hmp, struct mount *mp, char *path,
 
 	if (hmp->ronly && (mp->mnt_kern_flag & MNTK_WANTRDWR)) {
 		error = hammer2_recovery(hmp);
+		if (hmp->bulkfree_run == 0)
+			hammer2_bulkfree_start(hmp);
+		if ((hmp->hflags & HMNT2_DISCARD) && hmp->discard_run == 0)
+			hammer2_discard_start(hmp);
 	} else {
 		error = 0;
 	}
@@ -1855,18 +2226,23 @@ hammer2_vfs_unmount(struct mount *mp, int mntflags)
 
 	ccms_domain_uninit(&pmp->ccms_dom);
 
+	/*
+	 * Stop the write thread.  It joins its compression workers before
+	 * acknowledging, the flush workers are stopped after it.
+	 */
 	if (pmp->wthread_td) {
-		mtx_enter((struct mutex *)&pmp->wthread_mtx);
+		mtx_enter(&pmp->wthread_mtx);
 		pmp->wthread_destroy = 1;
 		wakeup(&pmp->wthread_bioq);
 		while (pmp->wthread_destroy != -1) {
 			mtxsleep(&pmp->wthread_destroy,
-				(struct mutex *)&pmp->wthread_mtx, 0,
+				&pmp->wthread_mtx, 0,
 				"umount-sleep",	0);
 		}
-		mtx_leave((struct mutex *)&pmp->wthread_mtx);
+		mtx_leave(&pmp->wthread_mtx);
 		pmp->wthread_td = NULL;
 	}
+	hammer2_flush_workers_stop(pmp);
 
 	/*
 	 * Cleanup our reference on ihidden.
@@ -1934,6 +2310,15 @@ static
 void
 hammer2_vfs_unmount_hmp1(struct mount *mp, hammer2_mount_t *hmp)
 {
+	/*
+	 * Stop the bulk free thread before the final syncs, it runs its
+	 * own transactions.  The discard thread is fed by it.
+	 */
+	if (hmp->pmp_count == 1) {
+		hammer2_bulkfree_stop(hmp);
+		hammer2_discard_stop(hmp);
+	}
+
 	hammer2_mount_exlock(hmp);
 	--hmp->pmp_count;
 
@@ -1959,6 +2344,11 @@ hammer2_vfs_unmount_hmp1(struct mount *mp, hammer2_mount_t *hmp)
 		hammer2_vfs_sync(mp, MNT_WAIT);
 	}
 
+	/*
+	 * Retained chains may still point at the PFS being unmounted.
+	 */
+	hammer2_chain_lru_trim(hmp, 0);
+
 	if (hmp->pmp_count == 0) {
 		if ((hmp->vchain.flags | hmp->fchain.flags) &
 		    HAMMER2_CHAIN_FLUSH_MASK) {
@@ -1996,6 +2386,7 @@ hammer2_vfs_unmount_hmp2(struct mount *mp, hammer2_mount_t *hmp)
 				hammer2_inode_drop(spmp->iroot);
 				spmp->iroot = NULL;
 			}
+			hammer2_chain_lru_trim(hmp, 0);
 			hmp->spmp = NULL;
 			free(&spmp->mmsg, M_TEMP, 0);
 			free(&spmp->minode, M_TEMP, 0);
@@ -2064,13 +2455,15 @@ hammer2_vfs_unmount_hmp2(struct mount *mp, hammer2_mount_t *hmp)
 		hammer2_mount_unlock(hmp);
 		hammer2_chain_drop(&hmp->vchain);
 
-		hammer2_io_cleanup(hmp, &hmp->iotree);
+		hammer2_io_cleanup_all(hmp);
 		if (hmp->iofree_count) {
 			printf("io_cleanup: %d I/O's left hanging\n",
 				hmp->iofree_count);
 		}
 
 		TAILQ_REMOVE(&hammer2_mntlist, hmp, mntentry);
+		hammer2_freemap_resv_destroy(hmp);
+		hammer2_freemap_sum_destroy(hmp);
 		free(&hmp->mchain, M_HAMMER2, 0);
 		free(hmp, M_HAMMER2, 0);
 	} else {
@@ -2370,6 +2763,7 @@ hammer2_vfs_sync(struct mount *mp, int waitfor)
 	int force_fchain;
 	int i;
 	int j;
+	int s;
 
 	pmp = MPTOPMP(mp);
 	iroot = pmp->iroot;
@@ -2439,16 +2833,12 @@ hammer2_vfs_sync(struct mount *mp, int waitfor)
 	 * super-root flush will not be able to update its block table
 	 * properly.
 	 *
-	 * XXX currently done serially instead of concurrently
+	 * The elements, and the dirty subtrees directly under each, are
+	 * flushed concurrently on the PFS workers and joined before the
+	 * volume roots are synchronized below.
 	 */
-	for (i = 0; iroot && i < iroot->cluster.nchains; ++i) {
-		chain = iroot->cluster.array[i];
-		if (chain) {
-			hammer2_chain_lock(chain, HAMMER2_RESOLVE_ALWAYS);
-			hammer2_flush(&info.trans, chain);
-			hammer2_chain_unlock(chain);
-		}
-	}
+	if (iroot)
+		hammer2_flush_cluster(&info.trans, &iroot->cluster);
 #if 0
 	hammer2_trans_done(&info.trans);
 #endif
@@ -2491,6 +2881,13 @@ hammer2_vfs_sync(struct mount *mp, int waitfor)
 		KKASSERT(chain->pmp != parent->pmp);
 		hammer2_chain_setflush(&info.trans, parent);
 
+		/*
+		 * Return unused per-cpu freemap reservations to the bitmap
+		 * so the fchain flush below does not commit them as
+		 * allocated.
+		 */
+		hammer2_freemap_resv_release(&info.trans, hmp);
+
 		/*
 		 * Media mounts have two 'roots', vchain for the topology
 		 * and fchain for the free block table.  Flush both.
@@ -2538,14 +2935,29 @@ hammer2_vfs_sync(struct mount *mp, int waitfor)
 		hammer2_chain_unlock(&hmp->fchain);
 #endif
 
+		/*
+		 * Age and trim cached dios from the syncer so frontend
+		 * putblk's rarely have to, and shrink the retained chain
+		 * LRU when the page daemon is short on memory.
+		 */
+		hammer2_io_trim(hmp);
+		if (uvmexp.free < uvmexp.freetarg)
+			hammer2_chain_lru_trim(hmp, hammer2_chain_lru_max / 4);
+
 		error = 0;
 
 		/*
 		 * We can't safely flush the volume header until we have
-		 * flushed any device buffers which have built up.
+		 * flushed any device buffers which have built up.  The
+		 * buffers left dirty by this flush go out first as
+		 * per-segment aggregated writes.
 		 *
 		 * XXX this isn't being incremental
 		 */
+		hammer2_io_wagg_flush(hmp);
+		s = splbio();
+		vwaitforio(hmp->devvp, 0, "h2wagg", 0);
+		splx(s);
 		vn_lock(hmp->devvp, LK_EXCLUSIVE | LK_RETRY, NULL);
 		// XXX fix me error = VOP_FSYNC(hmp->devvp, MNT_WAIT, 0);
 		vn_close(hmp->devvp, 0, NULL, NULL);
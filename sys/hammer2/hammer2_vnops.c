@@ -70,6 +70,7 @@
 
 #include "hammer2.h"
 #include "hammer2_lz4.h"
+#include "hammer2_zstd.h"
 
 #define ZFOFFSET	(-2LL)
 #define FILTEROP_ISFD   0x0001          /* if ident == filedescriptor */
@@ -101,10 +102,6 @@ int vop_stdmountctl(struct vop_mountctl_args *ap);
 void cache_setvp(struct nchandle *nch, struct vnode *vp);
 //static void _cache_setvp(struct mount *mp, struct namecache *ncp, struct vnode *vp);
 
-//struct objcache *cache_buffer_read;
-
-struct vnode *cache_buffer_read;
-struct objcache *cache_buffer_write;
 struct lwp;
 
 #define B_HEAVY         0x00100000      /* Heavy-weight buffer */
@@ -702,6 +699,7 @@ void
 hammer2_decompress_LZ4_callback(const char *data, u_int bytes, struct bioh2 *bio)
 {
 	struct buf *bp;
+	hammer2_comp_scratch_t *scr;
 	char *compressed_buffer;
 	int compressed_size;
 	int result;
@@ -718,7 +716,8 @@ hammer2_decompress_LZ4_callback(const char *data, u_int bytes, struct bioh2 *bio
 	compressed_size = *(const int *)data;
 	KKASSERT(compressed_size <= bytes - sizeof(int));
 
-	// compressed_buffer = cache_lookup((struct vnode*)cache_buffer_read, NULL, NULL);  XX fix me
+	scr = hammer2_comp_get();
+	compressed_buffer = scr->buf;
 	result = LZ4_decompress_safe(__DECONST(char *, &data[sizeof(int)]),
 				     compressed_buffer,
 				     compressed_size,
@@ -734,7 +733,7 @@ hammer2_decompress_LZ4_callback(const char *data, u_int bytes, struct bioh2 *bio
 	bcopy(compressed_buffer, bp->b_data, bp->b_bufsize);
 	if (result < bp->b_bufsize)
 		bzero(bp->b_data + result, bp->b_bufsize - result);
-	// XXX objcache_put(cache_buffer_read, compressed_buffer);
+	hammer2_comp_put(scr);
 	bp->b_resid = 0;
 	bp->b_flags |= B_AGE;
 }
@@ -749,41 +748,85 @@ void
 hammer2_decompress_ZLIB_callback(const char *data, u_int bytes, struct bioh2 *bio)
 {
 	struct buf *bp;
+	hammer2_comp_scratch_t *scr;
 	char *compressed_buffer;
-	z_stream strm_decompress;
+	z_stream *strm_decompress;
 	int result;
 	int ret;
 
 	bp = bio->bio_buf;
 
 	KKASSERT(bp->b_bufsize <= HAMMER2_PBUFSIZE);
-	strm_decompress.avail_in = 0;
-	strm_decompress.next_in = Z_NULL;
-
-	ret = inflateInit(&strm_decompress);
+	scr = hammer2_comp_get();
+	compressed_buffer = scr->buf;
 
-	if (ret != Z_OK)
+	strm_decompress = hammer2_comp_inflate(scr);
+	if (strm_decompress == NULL) {
 		printf("HAMMER2 ZLIB: Fatal error in inflateInit.\n");
-
-	// XXX compressed_buffer = objcache_get(cache_buffer_read, M_INTWAIT);
-	strm_decompress.next_in = __DECONST(char *, data);
+		bzero(bp->b_data, bp->b_bufsize);
+		hammer2_comp_put(scr);
+		bp->b_resid = 0;
+		bp->b_flags |= B_AGE;
+		return;
+	}
+	strm_decompress->next_in = __DECONST(char *, data);
 
 	/* XXX supply proper size, subset of device bp */
-	strm_decompress.avail_in = bytes;
-	strm_decompress.next_out = compressed_buffer;
-	strm_decompress.avail_out = bp->b_bufsize;
+	strm_decompress->avail_in = bytes;
+	strm_decompress->next_out = compressed_buffer;
+	strm_decompress->avail_out = bp->b_bufsize;
 
-	ret = inflate(&strm_decompress, Z_FINISH);
+	ret = inflate(strm_decompress, Z_FINISH);
 	if (ret != Z_STREAM_END) {
 		printf("HAMMER2 ZLIB: Fatar error during decompression.\n");
 		bzero(compressed_buffer, bp->b_bufsize);
 	}
 	bcopy(compressed_buffer, bp->b_data, bp->b_bufsize);
-	result = bp->b_bufsize - strm_decompress.avail_out;
+	result = bp->b_bufsize - strm_decompress->avail_out;
+	if (result < bp->b_bufsize)
+		bzero(bp->b_data + result, strm_decompress->avail_out);
+	hammer2_comp_put(scr);
+
+	bp->b_resid = 0;
+	bp->b_flags |= B_AGE;
+}
+
+/*
+ * Callback used in read path in case that a block is compressed with ZSTD.
+ * The frame carries its own size, the remainder of the physical block is
+ * padding and ignored by the decoder.
+ */
+static
+void
+hammer2_decompress_ZSTD_callback(const char *data, u_int bytes, struct bioh2 *bio)
+{
+	struct buf *bp;
+	hammer2_comp_scratch_t *scr;
+	char *compressed_buffer;
+	int result;
+
+	bp = bio->bio_buf;
+
+	KKASSERT(bp->b_bufsize <= HAMMER2_PBUFSIZE);
+	scr = hammer2_comp_get();
+	compressed_buffer = scr->buf;
+
+	result = hammer2_zstd_decompress(data, bytes, compressed_buffer,
+					 bp->b_bufsize,
+					 hammer2_comp_zstd_dwrk(scr));
+	if (result < 0) {
+		printf("HAMMER2 ZSTD: Error during decompression."
+			"bio %016x/%d\n",
+			(unsigned int)bio->bio_offset, bytes);
+		/* make sure it isn't random garbage */
+		bzero(compressed_buffer, bp->b_bufsize);
+		result = 0;
+	}
+	KKASSERT(result <= bp->b_bufsize);
+	bcopy(compressed_buffer, bp->b_data, result);
 	if (result < bp->b_bufsize)
-		bzero(bp->b_data + result, strm_decompress.avail_out);
-	// XXX objcache_put(cache_buffer_read, compressed_buffer);
-	ret = inflateEnd(&strm_decompress);
+		bzero(bp->b_data + result, bp->b_bufsize - result);
+	hammer2_comp_put(scr);
 
 	bp->b_resid = 0;
 	bp->b_flags |= B_AGE;
@@ -2838,6 +2881,10 @@ hammer2_strategy_read_callback(hammer2_io_t *dio,
 			hammer2_decompress_ZLIB_callback(data, chain->bytes,
 							 bio);
 			break;
+		case HAMMER2_COMP_ZSTD:
+			hammer2_decompress_ZSTD_callback(data, chain->bytes,
+							 bio);
+			break;
 		case HAMMER2_COMP_NONE:
 			KKASSERT(chain->bytes <= bp->b_bcount);
 			bcopy(data, bp->b_data, chain->bytes);
@@ -2878,14 +2925,14 @@ hammer2_strategy_write(struct vop_strategy_args *ap)
 	pmp = ip->pmp;
 	
 	hammer2_lwinprog_ref(pmp);
-	mtx_enter((struct mutex *)&pmp->wthread_mtx);
+	mtx_enter(&pmp->wthread_mtx);
 	if (TAILQ_EMPTY(&pmp->wthread_bioq.queue)) {
 		bioq_insert_tail(&pmp->wthread_bioq, ap->a_bio);
-		mtx_leave((struct mutex *)&pmp->wthread_mtx);
+		mtx_leave(&pmp->wthread_mtx);
 		wakeup(&pmp->wthread_bioq);
 	} else {
 		bioq_insert_tail(&pmp->wthread_bioq, ap->a_bio);
-		mtx_leave((struct mutex *)&pmp->wthread_mtx);
+		mtx_leave(&pmp->wthread_mtx);
 	}
 	hammer2_lwinprog_wait(pmp);
 
@@ -0,0 +1,470 @@
+/*
+ * Copyright (c) 2014 The DragonFly Project.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ * 3. Neither the name of The DragonFly Project nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific, prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+/*
+ * xxHash - Extremely Fast Hash algorithm
+ * Copyright (C) 2012-2020 Yann Collet
+ *
+ * BSD 2-Clause License (https://www.opensource.org/licenses/bsd-license.php)
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following
+ *      disclaimer in the documentation and/or other materials provided
+ *      with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * You can contact the author at:
+ *   - xxHash homepage: https://www.xxhash.com
+ *   - xxHash source repository: https://github.com/Cyan4973/xxHash
+ */
+/*
+ * XXH3-128 (xxHash 0.8, seed 0, default secret), used by the
+ * HAMMER2_CHECK_XXH3 check method.  This is a compact scalar rendition
+ * of the xxHash reference algorithm and its default secret, sufficient
+ * to produce bit-identical hashes.
+ *
+ * Compiled into the kernel and into hammer2(8) so 'hammer2 show' can
+ * verify the same check codes.
+ */
+
+#ifdef _KERNEL
+#include <sys/param.h>
+#include <sys/systm.h>
+#include <sys/endian.h>
+#else
+#include <sys/types.h>
+#include <sys/endian.h>
+#endif
+
+void hammer2_xxh3_128(const void *buf, size_t len, uint64_t *out);
+
+#define XXH_PRIME32_1	0x9E3779B1U
+#define XXH_PRIME32_2	0x85EBCA77U
+#define XXH_PRIME32_3	0xC2B2AE3DU
+#define XXH_PRIME64_1	0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2	0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3	0x165667B19E3779F9ULL
+#define XXH_PRIME64_4	0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5	0x27D4EB2F165667C5ULL
+#define XXH_PRIME_MX1	0x165667919E3779F9ULL
+#define XXH_PRIME_MX2	0x9FB21C651E98DF25ULL
+
+#define XXH_STRIPE_LEN		64
+#define XXH_SECRET_CONSUME_RATE	8
+#define XXH_ACC_NB		8
+#define XXH_SECRET_SIZE		192
+#define XXH_SECRET_SIZE_MIN	136
+#define XXH_MIDSIZE_MAX		240
+#define XXH_MIDSIZE_STARTOFFSET	3
+#define XXH_MIDSIZE_LASTOFFSET	17
+#define XXH_SECRET_LASTACC_START 7
+#define XXH_SECRET_MERGEACCS_START 11
+
+static const uint8_t xxh3_secret[XXH_SECRET_SIZE] = {
+	0xb8, 0xfe, 0x6c, 0x39, 0x23, 0xa4, 0x4b, 0xbe,
+	0x7c, 0x01, 0x81, 0x2c, 0xf7, 0x21, 0xad, 0x1c,
+	0xde, 0xd4, 0x6d, 0xe9, 0x83, 0x90, 0x97, 0xdb,
+	0x72, 0x40, 0xa4, 0xa4, 0xb7, 0xb3, 0x67, 0x1f,
+	0xcb, 0x79, 0xe6, 0x4e, 0xcc, 0xc0, 0xe5, 0x78,
+	0x82, 0x5a, 0xd0, 0x7d, 0xcc, 0xff, 0x72, 0x21,
+	0xb8, 0x08, 0x46, 0x74, 0xf7, 0x43, 0x24, 0x8e,
+	0xe0, 0x35, 0x90, 0xe6, 0x81, 0x3a, 0x26, 0x4c,
+	0x3c, 0x28, 0x52, 0xbb, 0x91, 0xc3, 0x00, 0xcb,
+	0x88, 0xd0, 0x65, 0x8b, 0x1b, 0x53, 0x2e, 0xa3,
+	0x71, 0x64, 0x48, 0x97, 0xa2, 0x0d, 0xf9, 0x4e,
+	0x38, 0x19, 0xef, 0x46, 0xa9, 0xde, 0xac, 0xd8,
+	0xa8, 0xfa, 0x76, 0x3f, 0xe3, 0x9c, 0x34, 0x3f,
+	0xf9, 0xdc, 0xbb, 0xc7, 0xc7, 0x0b, 0x4f, 0x1d,
+	0x8a, 0x51, 0xe0, 0x4b, 0xcd, 0xb4, 0x59, 0x31,
+	0xc8, 0x9f, 0x7e, 0xc9, 0xd9, 0x78, 0x73, 0x64,
+	0xea, 0xc5, 0xac, 0x83, 0x34, 0xd3, 0xeb, 0xc3,
+	0xc5, 0x81, 0xa0, 0xff, 0xfa, 0x13, 0x63, 0xeb,
+	0x17, 0x0d, 0xdd, 0x51, 0xb7, 0xf0, 0xda, 0x49,
+	0xd3, 0x16, 0x55, 0x26, 0x29, 0xd4, 0x68, 0x9e,
+	0x2b, 0x16, 0xbe, 0x58, 0x7d, 0x47, 0xa1, 0xfc,
+	0x8f, 0xf8, 0xb8, 0xd1, 0x7a, 0xd0, 0x31, 0xce,
+	0x45, 0xcb, 0x3a, 0x8f, 0x95, 0x16, 0x04, 0x28,
+	0xaf, 0xd7, 0xfb, 0xca, 0xbb, 0x4b, 0x40, 0x7e
+};
+
+typedef struct {
+	uint64_t low64;
+	uint64_t high64;
+} xxh128_t;
+
+static __inline uint32_t
+xxh_read32(const uint8_t *p)
+{
+	uint32_t v;
+
+	__builtin_memcpy(&v, p, sizeof(v));
+	return (letoh32(v));
+}
+
+static __inline uint64_t
+xxh_read64(const uint8_t *p)
+{
+	uint64_t v;
+
+	__builtin_memcpy(&v, p, sizeof(v));
+	return (letoh64(v));
+}
+
+static __inline uint64_t
+xxh_swap64(uint64_t v)
+{
+	return (swap64(v));
+}
+
+static __inline uint32_t
+xxh_swap32(uint32_t v)
+{
+	return (swap32(v));
+}
+
+static __inline xxh128_t
+xxh_mult64to128(uint64_t lhs, uint64_t rhs)
+{
+	xxh128_t r;
+#if defined(__SIZEOF_INT128__)
+	__uint128_t product = (__uint128_t)lhs * rhs;
+
+	r.low64 = (uint64_t)product;
+	r.high64 = (uint64_t)(product >> 64);
+#else
+	uint64_t lo_lo = (lhs & 0xFFFFFFFF) * (rhs & 0xFFFFFFFF);
+	uint64_t hi_lo = (lhs >> 32) * (rhs & 0xFFFFFFFF);
+	uint64_t lo_hi = (lhs & 0xFFFFFFFF) * (rhs >> 32);
+	uint64_t hi_hi = (lhs >> 32) * (rhs >> 32);
+	uint64_t cross = (lo_lo >> 32) + (hi_lo & 0xFFFFFFFF) + lo_hi;
+
+	r.high64 = (hi_lo >> 32) + (cross >> 32) + hi_hi;
+	r.low64 = (cross << 32) | (lo_lo & 0xFFFFFFFF);
+#endif
+	return (r);
+}
+
+static __inline uint64_t
+xxh_mul128_fold64(uint64_t lhs, uint64_t rhs)
+{
+	xxh128_t product = xxh_mult64to128(lhs, rhs);
+
+	return (product.low64 ^ product.high64);
+}
+
+static __inline uint64_t
+xxh64_avalanche(uint64_t h)
+{
+	h ^= h >> 33;
+	h *= XXH_PRIME64_2;
+	h ^= h >> 29;
+	h *= XXH_PRIME64_3;
+	h ^= h >> 32;
+	return (h);
+}
+
+static __inline uint64_t
+xxh3_avalanche(uint64_t h)
+{
+	h ^= h >> 37;
+	h *= XXH_PRIME_MX1;
+	h ^= h >> 32;
+	return (h);
+}
+
+static __inline uint64_t
+xxh3_mix16b(const uint8_t *input, const uint8_t *secret)
+{
+	return (xxh_mul128_fold64(xxh_read64(input) ^ xxh_read64(secret),
+				  xxh_read64(input + 8) ^
+				  xxh_read64(secret + 8)));
+}
+
+static __inline void
+xxh128_mix32b(xxh128_t *acc, const uint8_t *input_1, const uint8_t *input_2,
+	      const uint8_t *secret)
+{
+	acc->low64 += xxh3_mix16b(input_1, secret);
+	acc->low64 ^= xxh_read64(input_2) + xxh_read64(input_2 + 8);
+	acc->high64 += xxh3_mix16b(input_2, secret + 16);
+	acc->high64 ^= xxh_read64(input_1) + xxh_read64(input_1 + 8);
+}
+
+static xxh128_t
+xxh3_len_0to16(const uint8_t *input, size_t len, const uint8_t *secret)
+{
+	xxh128_t h;
+	xxh128_t m;
+	uint64_t bitflipl;
+	uint64_t bitfliph;
+	uint64_t input_lo;
+	uint64_t input_hi;
+	uint32_t combinedl;
+	uint32_t combinedh;
+	uint32_t v;
+
+	if (len > 8) {
+		bitflipl = xxh_read64(secret + 32) ^ xxh_read64(secret + 40);
+		bitfliph = xxh_read64(secret + 48) ^ xxh_read64(secret + 56);
+		input_lo = xxh_read64(input);
+		input_hi = xxh_read64(input + len - 8);
+		m = xxh_mult64to128(input_lo ^ input_hi ^ bitflipl,
+				    XXH_PRIME64_1);
+		m.low64 += (uint64_t)(len - 1) << 54;
+		input_hi ^= bitfliph;
+		m.high64 += input_hi +
+			    (uint64_t)(uint32_t)input_hi * (XXH_PRIME32_2 - 1);
+		m.low64 ^= xxh_swap64(m.high64);
+		h = xxh_mult64to128(m.low64, XXH_PRIME64_2);
+		h.high64 += m.high64 * XXH_PRIME64_2;
+		h.low64 = xxh3_avalanche(h.low64);
+		h.high64 = xxh3_avalanche(h.high64);
+	} else if (len >= 4) {
+		input_lo = xxh_read32(input) +
+			   ((uint64_t)xxh_read32(input + len - 4) << 32);
+		bitflipl = xxh_read64(secret + 16) ^ xxh_read64(secret + 24);
+		h = xxh_mult64to128(input_lo ^ bitflipl,
+				    XXH_PRIME64_1 + (len << 2));
+		h.high64 += h.low64 << 1;
+		h.low64 ^= h.high64 >> 3;
+		h.low64 ^= h.low64 >> 35;
+		h.low64 *= XXH_PRIME_MX2;
+		h.low64 ^= h.low64 >> 28;
+		h.high64 = xxh3_avalanche(h.high64);
+	} else if (len) {
+		combinedl = ((uint32_t)input[0] << 16) |
+			    ((uint32_t)input[len >> 1] << 24) |
+			    ((uint32_t)input[len - 1]) |
+			    ((uint32_t)len << 8);
+		v = xxh_swap32(combinedl);
+		combinedh = (v << 13) | (v >> 19);
+		bitflipl = xxh_read32(secret) ^ xxh_read32(secret + 4);
+		bitfliph = xxh_read32(secret + 8) ^ xxh_read32(secret + 12);
+		h.low64 = xxh64_avalanche((uint64_t)combinedl ^ bitflipl);
+		h.high64 = xxh64_avalanche((uint64_t)combinedh ^ bitfliph);
+	} else {
+		bitflipl = xxh_read64(secret + 64) ^ xxh_read64(secret + 72);
+		bitfliph = xxh_read64(secret + 80) ^ xxh_read64(secret + 88);
+		h.low64 = xxh64_avalanche(bitflipl);
+		h.high64 = xxh64_avalanche(bitfliph);
+	}
+	return (h);
+}
+
+static xxh128_t
+xxh3_finalize_mid(xxh128_t acc, size_t len)
+{
+	xxh128_t h;
+
+	h.low64 = acc.low64 + acc.high64;
+	h.high64 = (acc.low64 * XXH_PRIME64_1) +
+		   (acc.high64 * XXH_PRIME64_4) +
+		   ((uint64_t)len * XXH_PRIME64_2);
+	h.low64 = xxh3_avalanche(h.low64);
+	h.high64 = (uint64_t)0 - xxh3_avalanche(h.high64);
+	return (h);
+}
+
+static xxh128_t
+xxh3_len_17to128(const uint8_t *input, size_t len, const uint8_t *secret)
+{
+	xxh128_t acc;
+
+	acc.low64 = len * XXH_PRIME64_1;
+	acc.high64 = 0;
+	if (len > 32) {
+		if (len > 64) {
+			if (len > 96) {
+				xxh128_mix32b(&acc, input + 48,
+					      input + len - 64, secret + 96);
+			}
+			xxh128_mix32b(&acc, input + 32, input + len - 48,
+				      secret + 64);
+		}
+		xxh128_mix32b(&acc, input + 16, input + len - 32, secret + 32);
+	}
+	xxh128_mix32b(&acc, input, input + len - 16, secret);
+	return (xxh3_finalize_mid(acc, len));
+}
+
+static xxh128_t
+xxh3_len_129to240(const uint8_t *input, size_t len, const uint8_t *secret)
+{
+	xxh128_t acc;
+	size_t i;
+
+	acc.low64 = len * XXH_PRIME64_1;
+	acc.high64 = 0;
+	for (i = 32; i < 160; i += 32) {
+		xxh128_mix32b(&acc, input + i - 32, input + i - 16,
+			      secret + i - 32);
+	}
+	acc.low64 = xxh3_avalanche(acc.low64);
+	acc.high64 = xxh3_avalanche(acc.high64);
+	for (i = 160; i <= len; i += 32) {
+		xxh128_mix32b(&acc, input + i - 32, input + i - 16,
+			      secret + XXH_MIDSIZE_STARTOFFSET + i - 160);
+	}
+	xxh128_mix32b(&acc, input + len - 16, input + len - 32,
+		      secret + XXH_SECRET_SIZE_MIN -
+		      XXH_MIDSIZE_LASTOFFSET - 16);
+	return (xxh3_finalize_mid(acc, len));
+}
+
+static __inline void
+xxh3_accumulate_512(uint64_t *acc, const uint8_t *input,
+		    const uint8_t *secret)
+{
+	uint64_t data_val;
+	uint64_t data_key;
+	int i;
+
+	for (i = 0; i < XXH_ACC_NB; ++i) {
+		data_val = xxh_read64(input + i * 8);
+		data_key = data_val ^ xxh_read64(secret + i * 8);
+		acc[i ^ 1] += data_val;
+		acc[i] += (uint64_t)(uint32_t)data_key * (data_key >> 32);
+	}
+}
+
+static __inline void
+xxh3_scramble(uint64_t *acc, const uint8_t *secret)
+{
+	uint64_t a;
+	int i;
+
+	for (i = 0; i < XXH_ACC_NB; ++i) {
+		a = acc[i];
+		a ^= a >> 47;
+		a ^= xxh_read64(secret + i * 8);
+		a *= XXH_PRIME32_1;
+		acc[i] = a;
+	}
+}
+
+static uint64_t
+xxh3_merge_accs(const uint64_t *acc, const uint8_t *secret, uint64_t start)
+{
+	uint64_t result = start;
+	int i;
+
+	for (i = 0; i < 4; ++i) {
+		result += xxh_mul128_fold64(
+				acc[2 * i] ^ xxh_read64(secret + 16 * i),
+				acc[2 * i + 1] ^ xxh_read64(secret + 16 * i + 8));
+	}
+	return (xxh3_avalanche(result));
+}
+
+static xxh128_t
+xxh3_hash_long(const uint8_t *input, size_t len, const uint8_t *secret)
+{
+	uint64_t acc[XXH_ACC_NB] = {
+		XXH_PRIME32_3, XXH_PRIME64_1, XXH_PRIME64_2, XXH_PRIME64_3,
+		XXH_PRIME64_4, XXH_PRIME32_2, XXH_PRIME64_5, XXH_PRIME32_1
+	};
+	size_t stripes_per_block;
+	size_t block_len;
+	size_t nb_blocks;
+	size_t nb_stripes;
+	size_t n;
+	size_t s;
+	xxh128_t h;
+
+	stripes_per_block = (XXH_SECRET_SIZE - XXH_STRIPE_LEN) /
+			    XXH_SECRET_CONSUME_RATE;
+	block_len = XXH_STRIPE_LEN * stripes_per_block;
+	nb_blocks = (len - 1) / block_len;
+
+	for (n = 0; n < nb_blocks; ++n) {
+		for (s = 0; s < stripes_per_block; ++s) {
+			xxh3_accumulate_512(acc,
+				input + n * block_len + s * XXH_STRIPE_LEN,
+				secret + s * XXH_SECRET_CONSUME_RATE);
+		}
+		xxh3_scramble(acc, secret + XXH_SECRET_SIZE - XXH_STRIPE_LEN);
+	}
+
+	nb_stripes = ((len - 1) - block_len * nb_blocks) / XXH_STRIPE_LEN;
+	for (s = 0; s < nb_stripes; ++s) {
+		xxh3_accumulate_512(acc,
+			input + nb_blocks * block_len + s * XXH_STRIPE_LEN,
+			secret + s * XXH_SECRET_CONSUME_RATE);
+	}
+	xxh3_accumulate_512(acc, input + len - XXH_STRIPE_LEN,
+			    secret + XXH_SECRET_SIZE - XXH_STRIPE_LEN -
+			    XXH_SECRET_LASTACC_START);
+
+	h.low64 = xxh3_merge_accs(acc, secret + XXH_SECRET_MERGEACCS_START,
+				  (uint64_t)len * XXH_PRIME64_1);
+	h.high64 = xxh3_merge_accs(acc, secret + XXH_SECRET_SIZE -
+				   sizeof(acc) - XXH_SECRET_MERGEACCS_START,
+				   ~((uint64_t)len * XXH_PRIME64_2));
+	return (h);
+}
+
+/*
+ * Calculate the 128 bit hash of buf.  out[0] receives the low 64 bits
+ * and out[1] the high 64 bits.
+ */
+void
+hammer2_xxh3_128(const void *buf, size_t len, uint64_t *out)
+{
+	const uint8_t *input = buf;
+	xxh128_t h;
+
+	if (len <= 16)
+		h = xxh3_len_0to16(input, len, xxh3_secret);
+	else if (len <= 128)
+		h = xxh3_len_17to128(input, len, xxh3_secret);
+	else if (len <= XXH_MIDSIZE_MAX)
+		h = xxh3_len_129to240(input, len, xxh3_secret);
+	else
+		h = xxh3_hash_long(input, len, xxh3_secret);
+	out[0] = h.low64;
+	out[1] = h.high64;
+}
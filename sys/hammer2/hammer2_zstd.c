@@ -0,0 +1,2484 @@
+/*
+ * Copyright (c) 2014 The DragonFly Project.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ * 3. Neither the name of The DragonFly Project nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific, prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+/*
+ * Zstandard (RFC 8878) compressor and decompressor for the
+ * HAMMER2_COMP_ZSTD compression method.
+ *
+ * Every logical block is stored as a single-segment zstd frame holding
+ * one compressed block, so the media can be inspected with stock zstd
+ * tools.  The decompressor accepts any single frame that does not need
+ * a dictionary, not only what the compressor below produces.
+ *
+ * The compressor runs a hash-chain match finder whose search depth and
+ * lazy evaluation scale with the level, Huffman codes the literals and
+ * FSE codes the sequences with per-block tables, falling back to the
+ * predefined tables when they are cheaper.
+ *
+ * Upstream libzstd wants hosted headers the kernel build does not
+ * provide, and a 64KB block needs only a small part of it.
+ */
+
+#include <sys/param.h>
+#include <sys/systm.h>
+#include <sys/endian.h>
+
+#include "hammer2_zstd.h"
+
+#define ZSTD_MAGIC		0xFD2FB528U
+#define ZSTD_BLOCKSIZE_MAX	(128 * 1024)
+
+#define ZSTD_BLOCK_RAW		0
+#define ZSTD_BLOCK_RLE		1
+#define ZSTD_BLOCK_COMP		2
+
+#define ZSTD_LIT_RAW		0
+#define ZSTD_LIT_RLE		1
+#define ZSTD_LIT_COMP		2
+#define ZSTD_LIT_TREELESS	3
+
+#define ZSTD_MODE_PREDEF	0
+#define ZSTD_MODE_RLE		1
+#define ZSTD_MODE_FSE		2
+#define ZSTD_MODE_REPEAT	3
+
+#define ZSTD_LL			0
+#define ZSTD_OF			1
+#define ZSTD_ML			2
+
+#define ZSTD_LL_MAX		35
+#define ZSTD_OF_MAX		31
+#define ZSTD_ML_MAX		52
+#define ZSTD_LL_LOG		9
+#define ZSTD_OF_LOG		8
+#define ZSTD_ML_LOG		9
+#define ZSTD_FSE_LOG_MIN	5
+
+#define ZSTD_HUF_LOG		11	/* longest code we emit */
+#define ZSTD_HUF_LOG_MAX	12	/* longest code we accept */
+#define ZSTD_HUFW_LOG		6	/* FSE accuracy for huffman weights */
+#define ZSTD_HUF_MINLITS	64
+
+#define ZSTD_MINMATCH		4
+#define ZSTD_HASH_LOG		14
+#define ZSTD_MAXSEQ		(HAMMER2_ZSTD_MAXSIZE / ZSTD_MINMATCH + 1)
+
+/*
+ * Literal length and match length codes, RFC 8878 3.1.1.3.2.1.1.
+ */
+static const uint32_t zstd_ll_base[ZSTD_LL_MAX + 1] = {
+	0, 1, 2, 3, 4, 5, 6, 7,
+	8, 9, 10, 11, 12, 13, 14, 15,
+	16, 18, 20, 22, 24, 28, 32, 40,
+	48, 64, 128, 256, 512, 1024, 2048, 4096,
+	8192, 16384, 32768, 65536
+};
+
+static const uint8_t zstd_ll_bits[ZSTD_LL_MAX + 1] = {
+	0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0,
+	1, 1, 1, 1, 2, 2, 3, 3,
+	4, 6, 7, 8, 9, 10, 11, 12,
+	13, 14, 15, 16
+};
+
+static const uint32_t zstd_ml_base[ZSTD_ML_MAX + 1] = {
+	3, 4, 5, 6, 7, 8, 9, 10,
+	11, 12, 13, 14, 15, 16, 17, 18,
+	19, 20, 21, 22, 23, 24, 25, 26,
+	27, 28, 29, 30, 31, 32, 33, 34,
+	35, 37, 39, 41, 43, 47, 51, 59,
+	67, 83, 99, 131, 259, 515, 1027, 2051,
+	4099, 8195, 16387, 32771, 65539
+};
+
+static const uint8_t zstd_ml_bits[ZSTD_ML_MAX + 1] = {
+	0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0,
+	1, 1, 1, 1, 2, 2, 3, 3,
+	4, 4, 5, 7, 8, 9, 10, 11,
+	12, 13, 14, 15, 16
+};
+
+/*
+ * Predefined distributions, RFC 8878 3.1.1.3.2.2.
+ */
+static const int16_t zstd_ll_defnorm[ZSTD_LL_MAX + 1] = {
+	4, 3, 2, 2, 2, 2, 2, 2,
+	2, 2, 2, 2, 2, 1, 1, 1,
+	2, 2, 2, 2, 2, 2, 2, 2,
+	2, 3, 2, 1, 1, 1, 1, 1,
+	-1, -1, -1, -1
+};
+
+static const int16_t zstd_ml_defnorm[ZSTD_ML_MAX + 1] = {
+	1, 4, 3, 2, 2, 2, 2, 2,
+	2, 1, 1, 1, 1, 1, 1, 1,
+	1, 1, 1, 1, 1, 1, 1, 1,
+	1, 1, 1, 1, 1, 1, 1, 1,
+	1, 1, 1, 1, 1, 1, 1, 1,
+	1, 1, 1, 1, 1, 1, -1, -1,
+	-1, -1, -1, -1, -1
+};
+
+static const int16_t zstd_of_defnorm[29] = {
+	1, 1, 1, 1, 1, 1, 2, 2,
+	2, 1, 1, 1, 1, 1, 1, 1,
+	1, 1, 1, 1, 1, 1, 1, 1,
+	-1, -1, -1, -1, -1
+};
+
+static const struct {
+	const int16_t	*norm;
+	int		maxsym;
+	int		log;
+} zstd_defaults[3] = {
+	[ZSTD_LL] = { zstd_ll_defnorm, ZSTD_LL_MAX, 6 },
+	[ZSTD_OF] = { zstd_of_defnorm, 28, 5 },
+	[ZSTD_ML] = { zstd_ml_defnorm, ZSTD_ML_MAX, 6 }
+};
+
+static const int zstd_maxsym[3] = { ZSTD_LL_MAX, ZSTD_OF_MAX, ZSTD_ML_MAX };
+static const int zstd_maxlog[3] = { ZSTD_LL_LOG, ZSTD_OF_LOG, ZSTD_ML_LOG };
+
+/*
+ * Match finder parameters per level: hash chain depth, number of lazy
+ * steps, length at which the search stops early, and how quickly a run
+ * of literals accelerates the scan (larger is slower).
+ */
+static const struct zstd_level {
+	int	depth;
+	int	lazy;
+	int	nice;
+	int	skip;
+} zstd_levels[HAMMER2_ZSTD_LEVEL_MAX + 1] = {
+	{    0, 0,     0,  0 },
+	{    2, 0,    16,  6 },
+	{    4, 0,    24,  7 },
+	{    8, 1,    32, 31 },
+	{   12, 1,    48, 31 },
+	{   16, 1,    64, 31 },
+	{   24, 2,    96, 31 },
+	{   32, 2,   128, 31 },
+	{   48, 2,   192, 31 },
+	{   64, 2,   256, 31 },
+	{   96, 2,   384, 31 },
+	{  128, 2,   512, 31 },
+	{  192, 2,  1024, 31 },
+	{  256, 2,  2048, 31 },
+	{  512, 2,  4096, 31 },
+	{ 1024, 2, 65536, 31 }
+};
+
+struct zstd_seq {
+	uint32_t	offval;		/* offset code value, 1-3 = repeat */
+	uint16_t	ll;		/* literal length */
+	uint16_t	mlb;		/* match length - 3 */
+};
+
+struct zstd_fse_ctab {
+	int		log;
+	uint16_t	state[1 << ZSTD_ML_LOG];
+	struct {
+		uint32_t	dnb;
+		int32_t		dfind;
+	} tt[ZSTD_ML_MAX + 1];
+};
+
+/*
+ * Decoding table cell.  The sequence tables also carry the baseline
+ * and extra bit count of the cell's code so the sequence loop does
+ * not have to translate codes.
+ */
+struct zstd_fse_dcell {
+	uint16_t	base;
+	uint8_t		sym;
+	uint8_t		nb;
+	uint32_t	val;
+	uint8_t		xbits;
+};
+
+struct zstd_huf_dcell {
+	uint8_t		sym;
+	uint8_t		nb;
+};
+
+/*
+ * Compressor workspace.  The chain links are 16 bit distances which
+ * covers a whole HAMMER2_ZSTD_MAXSIZE block, the heads hold pos + 1 so
+ * zero can mean empty.
+ */
+struct zstd_cwrk {
+	uint16_t	head[1 << ZSTD_HASH_LOG];
+	uint16_t	chain[HAMMER2_ZSTD_MAXSIZE];
+	uint8_t		lits[HAMMER2_ZSTD_MAXSIZE];
+	struct zstd_seq	seqs[ZSTD_MAXSEQ];
+	struct zstd_fse_ctab ctab[3];
+	struct zstd_fse_ctab wctab;
+	uint32_t	count[256];
+	uint32_t	node[512];
+	uint16_t	parent[512];
+	uint8_t		depth[512];
+	uint8_t		sorted[256];
+	uint8_t		weight[256];
+	uint8_t		huflen[256];
+	uint16_t	hufcode[256];
+	uint32_t	rep[3];
+	int		next;
+	int		nlits;
+	int		nseqs;
+	int		huflog;
+};
+
+/*
+ * Decompressor workspace.  The table state carries over between the
+ * blocks of a frame.
+ */
+struct zstd_dwrk {
+	uint8_t		lits[HAMMER2_ZSTD_MAXSIZE + 16];
+	struct zstd_huf_dcell huf[1 << ZSTD_HUF_LOG_MAX];
+	struct zstd_fse_dcell lltab[1 << ZSTD_LL_LOG];
+	struct zstd_fse_dcell oftab[1 << ZSTD_OF_LOG];
+	struct zstd_fse_dcell mltab[1 << ZSTD_ML_LOG];
+	struct zstd_fse_dcell wtab[1 << ZSTD_HUFW_LOG];
+	struct zstd_fse_dcell *tab[3];
+	int		tablog[3];
+	int		huflog;
+	uint32_t	rep[3];
+};
+
+/*
+ * Bit writer, fields are appended towards higher bit positions and
+ * read back in reverse by struct zstd_br.
+ */
+struct zstd_bw {
+	uint8_t		*p;
+	uint8_t		*end;
+	uint64_t	acc;
+	int		nb;
+	int		err;
+};
+
+/*
+ * Backward bit reader over a stream terminated by a 1 marker bit.
+ */
+struct zstd_br {
+	const uint8_t	*start;
+	const uint8_t	*ptr;
+	uint64_t	bits;
+	int		used;
+};
+
+static __inline int
+zstd_highbit(uint32_t v)
+{
+	return (31 - __builtin_clz(v));
+}
+
+static __inline uint32_t
+zstd_le16(const uint8_t *p)
+{
+	return (p[0] | (p[1] << 8));
+}
+
+static __inline uint32_t
+zstd_le24(const uint8_t *p)
+{
+	return (p[0] | (p[1] << 8) | (p[2] << 16));
+}
+
+static __inline uint32_t
+zstd_le32(const uint8_t *p)
+{
+	uint32_t v;
+
+	__builtin_memcpy(&v, p, sizeof(v));
+	return (letoh32(v));
+}
+
+static __inline uint64_t
+zstd_le64(const uint8_t *p)
+{
+	uint64_t v;
+
+	__builtin_memcpy(&v, p, sizeof(v));
+	return (letoh64(v));
+}
+
+static __inline void
+zstd_put16(uint8_t *p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+}
+
+static __inline void
+zstd_put24(uint8_t *p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+}
+
+static __inline void
+zstd_put32(uint8_t *p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+static __inline int
+zstd_ll_code(uint32_t ll)
+{
+	int c;
+
+	if (ll < 16)
+		return (ll);
+	if (ll >= 64)
+		return (zstd_highbit(ll) + 19);
+	c = 16;
+	while (zstd_ll_base[c + 1] <= ll)
+		++c;
+	return (c);
+}
+
+static __inline int
+zstd_ml_code(uint32_t mlb)
+{
+	int c;
+
+	if (mlb < 32)
+		return (mlb);
+	if (mlb >= 128)
+		return (zstd_highbit(mlb) + 36);
+	c = 32;
+	while (zstd_ml_base[c + 1] - 3 <= mlb)
+		++c;
+	return (c);
+}
+
+/*
+ * Resolve an offset code value against the repeat offset history and
+ * update the history, RFC 8878 3.1.2.5.  Shared by both directions so
+ * the compressor's view of the history cannot drift from the
+ * decompressor's.  Returns the match offset, 0 if invalid.
+ */
+static uint32_t
+zstd_rep_update(uint32_t *rep, uint32_t offval, uint32_t ll)
+{
+	uint32_t off;
+	int idx;
+
+	if (offval > 3) {
+		off = offval - 3;
+		rep[2] = rep[1];
+		rep[1] = rep[0];
+		rep[0] = off;
+		return (off);
+	}
+	idx = offval - 1 + (ll == 0);
+	if (idx == 0)
+		return (rep[0]);
+	off = (idx == 3) ? rep[0] - 1 : rep[idx];
+	if (idx != 1)
+		rep[2] = rep[1];
+	rep[1] = rep[0];
+	rep[0] = off;
+	return (off);
+}
+
+/************************************************************************
+ *				BITSTREAMS				*
+ ************************************************************************/
+
+static __inline void
+zstd_bw_init(struct zstd_bw *bw, uint8_t *p, uint8_t *end)
+{
+	bw->p = p;
+	bw->end = end;
+	bw->acc = 0;
+	bw->nb = 0;
+	bw->err = 0;
+}
+
+static __inline void
+zstd_bw_flush(struct zstd_bw *bw)
+{
+	while (bw->nb >= 8) {
+		if (bw->p < bw->end)
+			*bw->p++ = (uint8_t)bw->acc;
+		else
+			bw->err = 1;
+		bw->acc >>= 8;
+		bw->nb -= 8;
+	}
+}
+
+/*
+ * Append the low n bits of v, n <= 16.
+ */
+static __inline void
+zstd_bw_add(struct zstd_bw *bw, uint32_t v, int n)
+{
+	bw->acc |= (uint64_t)(v & ((1U << n) - 1)) << bw->nb;
+	bw->nb += n;
+	if (bw->nb >= 32)
+		zstd_bw_flush(bw);
+}
+
+/*
+ * Terminate the stream with the marker bit.  Returns the number of
+ * bytes written or 0 if the stream did not fit.
+ */
+static int
+zstd_bw_close(struct zstd_bw *bw, uint8_t *start)
+{
+	zstd_bw_add(bw, 1, 1);
+	zstd_bw_flush(bw);
+	if (bw->nb) {
+		if (bw->p < bw->end)
+			*bw->p++ = (uint8_t)bw->acc;
+		else
+			bw->err = 1;
+	}
+	if (bw->err)
+		return (0);
+	return (bw->p - start);
+}
+
+static int
+zstd_br_init(struct zstd_br *br, const uint8_t *src, int len)
+{
+	int i;
+
+	if (len < 1 || src[len - 1] == 0)
+		return (-1);
+	br->start = src;
+	br->used = 8 - zstd_highbit(src[len - 1]);
+	if (len >= 8) {
+		br->ptr = src + len - 8;
+		br->bits = zstd_le64(br->ptr);
+	} else {
+		br->ptr = src;
+		br->bits = 0;
+		for (i = 0; i < len; ++i)
+			br->bits |= (uint64_t)src[i] << (8 * i);
+		br->used += (8 - len) * 8;
+	}
+	return (0);
+}
+
+/*
+ * Refill so at least 57 bits can be consumed before the next refill,
+ * unless the beginning of the stream has been reached.
+ */
+static __inline void
+zstd_br_reload(struct zstd_br *br)
+{
+	int nbytes;
+
+	if (br->ptr - br->start >= 8) {
+		br->ptr -= br->used >> 3;
+		br->used &= 7;
+		br->bits = zstd_le64(br->ptr);
+		return;
+	}
+	if (br->used > 64)
+		return;
+	nbytes = br->used >> 3;
+	if (nbytes > br->ptr - br->start)
+		nbytes = br->ptr - br->start;
+	if (nbytes == 0)
+		return;
+	br->ptr -= nbytes;
+	br->used -= nbytes * 8;
+	br->bits = zstd_le64(br->ptr);
+}
+
+/*
+ * Return the next n bits (n <= 31) without consuming them.  Once the
+ * stream has been overrun the result is garbage (but still n bits wide),
+ * such a stream fails zstd_br_done() so it never matters.
+ */
+static __inline uint32_t
+zstd_br_peek(struct zstd_br *br, int n)
+{
+	return ((uint32_t)(((br->bits << (br->used & 63)) >> 1) >> (63 - n)));
+}
+
+/*
+ * Consume n bits, the caller is responsible for refilling.
+ */
+static __inline uint32_t
+zstd_br_get(struct zstd_br *br, int n)
+{
+	uint32_t v;
+
+	v = zstd_br_peek(br, n);
+	br->used += n;
+	return (v);
+}
+
+static __inline uint32_t
+zstd_br_read(struct zstd_br *br, int n)
+{
+	zstd_br_reload(br);
+	return (zstd_br_get(br, n));
+}
+
+static __inline int
+zstd_br_overflow(struct zstd_br *br)
+{
+	zstd_br_reload(br);
+	return (br->used > 64);
+}
+
+static __inline int
+zstd_br_done(struct zstd_br *br)
+{
+	zstd_br_reload(br);
+	return (br->ptr == br->start && br->used == 64);
+}
+
+/************************************************************************
+ *				FSE TABLES				*
+ ************************************************************************/
+
+/*
+ * Pick the table accuracy for n symbols with the largest symbol value
+ * maxsym.
+ */
+static int
+zstd_fse_log(int maxlog, int n, int maxsym)
+{
+	int log = maxlog;
+	int srcbits;
+	int minbits;
+
+	srcbits = zstd_highbit(n - 1) - 2;
+	minbits = zstd_highbit(n) + 1;
+	if (minbits > zstd_highbit(maxsym) + 2)
+		minbits = zstd_highbit(maxsym) + 2;
+	if (srcbits < log)
+		log = srcbits;
+	if (minbits > log)
+		log = minbits;
+	if (log < ZSTD_FSE_LOG_MIN)
+		log = ZSTD_FSE_LOG_MIN;
+	if (log > maxlog)
+		log = maxlog;
+	return (log);
+}
+
+/*
+ * Scale symbol counts to a distribution summing to 1 << log.  Every
+ * present symbol keeps at least one state.
+ */
+static void
+zstd_fse_normalize(int16_t *norm, const uint32_t *count, int maxsym,
+		   uint32_t total, int log)
+{
+	int scale = 1 << log;
+	int sum = 0;
+	int big = -1;
+	int s;
+	int n;
+
+	for (s = 0; s <= maxsym; ++s) {
+		if (count[s] == 0) {
+			norm[s] = 0;
+			continue;
+		}
+		n = (int)((((uint64_t)count[s] << log) + total / 2) / total);
+		if (n < 1)
+			n = 1;
+		norm[s] = n;
+		sum += n;
+		if (big < 0 || n > norm[big])
+			big = s;
+	}
+	while (sum > scale) {
+		big = 0;
+		for (s = 1; s <= maxsym; ++s) {
+			if (norm[s] > norm[big])
+				big = s;
+		}
+		n = norm[big] - 1;
+		if (n > sum - scale)
+			n = sum - scale;
+		norm[big] -= n;
+		sum -= n;
+	}
+	norm[big] += scale - sum;
+}
+
+/*
+ * Serialize a distribution, RFC 8878 4.1.1.  Returns the number of
+ * bytes written or 0 if it did not fit.
+ */
+static int
+zstd_fse_writenorm(uint8_t *dst, int dstlen, const int16_t *norm,
+		   int maxsym, int log)
+{
+	uint8_t *op = dst;
+	uint8_t *end = dst + dstlen;
+	uint64_t acc;
+	int nb;
+	int remaining = (1 << log) + 1;
+	int threshold = 1 << log;
+	int nbits = log + 1;
+	int prev0 = 0;
+	int start;
+	int count;
+	int max;
+	int s = 0;
+
+	acc = log - ZSTD_FSE_LOG_MIN;
+	nb = 4;
+	while (s <= maxsym && remaining > 1) {
+		if (prev0) {
+			start = s;
+			while (s <= maxsym && norm[s] == 0)
+				++s;
+			if (s > maxsym)
+				break;
+			while (s >= start + 24) {
+				start += 24;
+				acc |= (uint64_t)0xFFFF << nb;
+				nb += 16;
+				while (nb >= 8) {
+					if (op == end)
+						return (0);
+					*op++ = (uint8_t)acc;
+					acc >>= 8;
+					nb -= 8;
+				}
+			}
+			while (s >= start + 3) {
+				start += 3;
+				acc |= (uint64_t)3 << nb;
+				nb += 2;
+			}
+			acc |= (uint64_t)(s - start) << nb;
+			nb += 2;
+		}
+		count = norm[s++];
+		max = (2 * threshold - 1) - remaining;
+		remaining -= (count < 0) ? -count : count;
+		++count;
+		if (count >= threshold)
+			count += max;
+		acc |= (uint64_t)count << nb;
+		nb += nbits;
+		nb -= (count < max);
+		prev0 = (count == 1);
+		while (remaining < threshold) {
+			--nbits;
+			threshold >>= 1;
+		}
+		while (nb >= 8) {
+			if (op == end)
+				return (0);
+			*op++ = (uint8_t)acc;
+			acc >>= 8;
+			nb -= 8;
+		}
+	}
+	if (nb > 0) {
+		if (op == end)
+			return (0);
+		*op++ = (uint8_t)acc;
+	}
+	return (op - dst);
+}
+
+static __inline uint32_t
+zstd_fwdbits(const uint8_t *src, int len, int bitpos)
+{
+	uint64_t v = 0;
+	int b = bitpos >> 3;
+	int i;
+
+	for (i = 0; i < 5 && b + i < len; ++i)
+		v |= (uint64_t)src[b + i] << (8 * i);
+	return ((uint32_t)(v >> (bitpos & 7)));
+}
+
+/*
+ * Parse a serialized distribution.  Returns the number of bytes
+ * consumed or -1 if the description is invalid.
+ */
+static int
+zstd_fse_readnorm(int16_t *norm, int *maxsymp, int *logp, int maxsym,
+		  int maxlog, const uint8_t *src, int len)
+{
+	uint32_t bits;
+	int bitpos = 0;
+	int remaining;
+	int threshold;
+	int nbits;
+	int prev0 = 0;
+	int count;
+	int max;
+	int log;
+	int n0;
+	int s = 0;
+
+	if (len < 1)
+		return (-1);
+	log = (src[0] & 15) + ZSTD_FSE_LOG_MIN;
+	if (log > maxlog)
+		return (-1);
+	bitpos = 4;
+	remaining = (1 << log) + 1;
+	threshold = 1 << log;
+	nbits = log + 1;
+
+	while (remaining > 1) {
+		if (bitpos > len * 8)
+			return (-1);
+		if (prev0) {
+			n0 = s;
+			while ((zstd_fwdbits(src, len, bitpos) & 0xFFFF) ==
+			       0xFFFF) {
+				n0 += 24;
+				bitpos += 16;
+				if (bitpos > len * 8)
+					return (-1);
+			}
+			bits = zstd_fwdbits(src, len, bitpos);
+			while ((bits & 3) == 3) {
+				n0 += 3;
+				bits >>= 2;
+				bitpos += 2;
+			}
+			n0 += bits & 3;
+			bitpos += 2;
+			if (n0 > maxsym)
+				return (-1);
+			while (s < n0)
+				norm[s++] = 0;
+		}
+		if (s > maxsym)
+			return (-1);
+		bits = zstd_fwdbits(src, len, bitpos);
+		max = (2 * threshold - 1) - remaining;
+		if ((int)(bits & (threshold - 1)) < max) {
+			count = bits & (threshold - 1);
+			bitpos += nbits - 1;
+		} else {
+			count = bits & (2 * threshold - 1);
+			if (count >= threshold)
+				count -= max;
+			bitpos += nbits;
+		}
+		--count;
+		remaining -= (count < 0) ? -count : count;
+		if (remaining < 1)
+			return (-1);
+		norm[s++] = count;
+		prev0 = (count == 0);
+		while (remaining < threshold) {
+			--nbits;
+			threshold >>= 1;
+		}
+	}
+	if (remaining != 1 || bitpos > len * 8)
+		return (-1);
+	*maxsymp = s - 1;
+	*logp = log;
+	while (s <= maxsym)
+		norm[s++] = 0;
+	return ((bitpos + 7) >> 3);
+}
+
+/*
+ * Build a decoding table, RFC 8878 4.1.1.
+ */
+static int
+zstd_fse_dbuild(struct zstd_fse_dcell *tab, const int16_t *norm,
+		int maxsym, int log)
+{
+	uint16_t next[ZSTD_ML_MAX + 1];
+	int size = 1 << log;
+	int mask = size - 1;
+	int step = (size >> 1) + (size >> 3) + 3;
+	int high = size - 1;
+	int pos;
+	int s;
+	int i;
+	int n;
+
+	for (s = 0; s <= maxsym; ++s) {
+		if (norm[s] == -1) {
+			tab[high--].sym = s;
+			next[s] = 1;
+		} else {
+			next[s] = norm[s];
+		}
+	}
+	pos = 0;
+	for (s = 0; s <= maxsym; ++s) {
+		for (i = 0; i < norm[s]; ++i) {
+			tab[pos].sym = s;
+			pos = (pos + step) & mask;
+			while (pos > high)
+				pos = (pos + step) & mask;
+		}
+	}
+	if (pos != 0)
+		return (-1);
+	for (i = 0; i < size; ++i) {
+		n = next[tab[i].sym]++;
+		tab[i].nb = log - zstd_highbit(n);
+		tab[i].base = (n << tab[i].nb) - size;
+	}
+	return (0);
+}
+
+/*
+ * Build an encoding table for the same distribution.  The state spread
+ * must match zstd_fse_dbuild() exactly.
+ */
+static void
+zstd_fse_cbuild(struct zstd_fse_ctab *ct, const int16_t *norm,
+		int maxsym, int log)
+{
+	uint8_t tsym[1 << ZSTD_ML_LOG];
+	uint16_t cumul[ZSTD_ML_MAX + 2];
+	int size = 1 << log;
+	int mask = size - 1;
+	int step = (size >> 1) + (size >> 3) + 3;
+	int high = size - 1;
+	int total;
+	int maxout;
+	int pos;
+	int s;
+	int i;
+
+	ct->log = log;
+	cumul[0] = 0;
+	for (s = 0; s <= maxsym; ++s) {
+		if (norm[s] == -1) {
+			cumul[s + 1] = cumul[s] + 1;
+			tsym[high--] = s;
+		} else {
+			cumul[s + 1] = cumul[s] + norm[s];
+		}
+	}
+	pos = 0;
+	for (s = 0; s <= maxsym; ++s) {
+		for (i = 0; i < norm[s]; ++i) {
+			tsym[pos] = s;
+			pos = (pos + step) & mask;
+			while (pos > high)
+				pos = (pos + step) & mask;
+		}
+	}
+	for (i = 0; i < size; ++i)
+		ct->state[cumul[tsym[i]]++] = size + i;
+
+	total = 0;
+	for (s = 0; s <= maxsym; ++s) {
+		switch (norm[s]) {
+		case 0:
+			ct->tt[s].dnb = ((log + 1) << 16) - size;
+			ct->tt[s].dfind = 0;
+			break;
+		case -1:
+		case 1:
+			ct->tt[s].dnb = (log << 16) - size;
+			ct->tt[s].dfind = total - 1;
+			++total;
+			break;
+		default:
+			maxout = log - zstd_highbit(norm[s] - 1);
+			ct->tt[s].dnb = (maxout << 16) - (norm[s] << maxout);
+			ct->tt[s].dfind = total - norm[s];
+			total += norm[s];
+			break;
+		}
+	}
+}
+
+/*
+ * Encoding table for a single symbol, which costs nothing to code.
+ */
+static void
+zstd_fse_crle(struct zstd_fse_ctab *ct, int sym)
+{
+	ct->log = 0;
+	ct->state[0] = 0;
+	ct->state[1] = 0;
+	ct->tt[sym].dnb = 0;
+	ct->tt[sym].dfind = 0;
+}
+
+static __inline uint32_t
+zstd_fse_cinit(const struct zstd_fse_ctab *ct, int s)
+{
+	uint32_t nb;
+	uint32_t v;
+
+	nb = (ct->tt[s].dnb + (1 << 15)) >> 16;
+	v = (nb << 16) - ct->tt[s].dnb;
+	return (ct->state[(v >> nb) + ct->tt[s].dfind]);
+}
+
+static __inline void
+zstd_fse_encode(struct zstd_bw *bw, const struct zstd_fse_ctab *ct,
+		uint32_t *st, int s)
+{
+	uint32_t nb;
+
+	nb = (*st + ct->tt[s].dnb) >> 16;
+	zstd_bw_add(bw, *st, nb);
+	*st = ct->state[(*st >> nb) + ct->tt[s].dfind];
+}
+
+static __inline int
+zstd_fse_decode(const struct zstd_fse_dcell *tab, uint32_t *st,
+		struct zstd_br *br)
+{
+	const struct zstd_fse_dcell *cell = &tab[*st];
+
+	*st = cell->base + zstd_br_get(br, cell->nb);
+	return (cell->sym);
+}
+
+/*
+ * Approximate cost in 1/256 bits of coding a symbol with probability
+ * norm / (1 << log).
+ */
+static __inline int
+zstd_fse_cost(int norm, int log)
+{
+	int h;
+
+	if (norm < 1)
+		norm = 1;
+	h = zstd_highbit(norm);
+	return ((log << 8) - ((h << 8) + (((norm << 8) >> h) - 256)));
+}
+
+/************************************************************************
+ *				DECOMPRESSION				*
+ ************************************************************************/
+
+/*
+ * Parse a huffman tree description and build the decoding table.
+ * Returns the number of bytes consumed or -1.
+ */
+static int
+zstd_huf_read(struct zstd_dwrk *w, const uint8_t *src, int len)
+{
+	struct zstd_br br;
+	uint8_t weights[256];
+	uint32_t rankstart[ZSTD_HUF_LOG_MAX + 2];
+	uint32_t rankcount[ZSTD_HUF_LOG_MAX + 1];
+	int16_t norm[ZSTD_HUF_LOG_MAX + 1];
+	uint32_t total;
+	uint32_t rest;
+	uint32_t s1;
+	uint32_t s2;
+	int maxsym;
+	int log;
+	int hdr;
+	int nw;
+	int n;
+	int s;
+	int i;
+
+	if (len < 1)
+		return (-1);
+	hdr = src[0];
+	if (hdr >= 128) {
+		nw = hdr - 127;
+		n = 1 + (nw + 1) / 2;
+		if (n > len)
+			return (-1);
+		for (i = 0; i < nw; ++i) {
+			if (i & 1)
+				weights[i] = src[1 + i / 2] & 15;
+			else
+				weights[i] = src[1 + i / 2] >> 4;
+		}
+	} else {
+		n = 1 + hdr;
+		if (hdr == 0 || n > len)
+			return (-1);
+		i = zstd_fse_readnorm(norm, &maxsym, &log, ZSTD_HUF_LOG_MAX,
+				      ZSTD_HUFW_LOG, src + 1, hdr);
+		if (i < 0)
+			return (-1);
+		if (zstd_fse_dbuild(w->wtab, norm, maxsym, log) < 0)
+			return (-1);
+		if (zstd_br_init(&br, src + 1 + i, hdr - i) < 0)
+			return (-1);
+		s1 = zstd_br_read(&br, log);
+		s2 = zstd_br_read(&br, log);
+		nw = 0;
+		for (;;) {
+			if (nw > 253)
+				return (-1);
+			weights[nw++] = zstd_fse_decode(w->wtab, &s1, &br);
+			if (zstd_br_overflow(&br)) {
+				weights[nw++] = w->wtab[s2].sym;
+				break;
+			}
+			if (nw > 253)
+				return (-1);
+			weights[nw++] = zstd_fse_decode(w->wtab, &s2, &br);
+			if (zstd_br_overflow(&br)) {
+				weights[nw++] = w->wtab[s1].sym;
+				break;
+			}
+		}
+	}
+
+	/*
+	 * The last symbol's weight is implied by the rest.
+	 */
+	bzero(rankcount, sizeof(rankcount));
+	total = 0;
+	for (i = 0; i < nw; ++i) {
+		if (weights[i] > ZSTD_HUF_LOG_MAX)
+			return (-1);
+		++rankcount[weights[i]];
+		total += (1U << weights[i]) >> 1;
+	}
+	if (total == 0)
+		return (-1);
+	log = zstd_highbit(total) + 1;
+	if (log > ZSTD_HUF_LOG_MAX)
+		return (-1);
+	rest = (1U << log) - total;
+	if (rest & (rest - 1))
+		return (-1);
+	weights[nw] = zstd_highbit(rest) + 1;
+	++rankcount[weights[nw]];
+	++nw;
+	if (rankcount[1] < 2 || (rankcount[1] & 1))
+		return (-1);
+
+	rankstart[1] = 0;
+	for (i = 1; i <= log; ++i)
+		rankstart[i + 1] = rankstart[i] + (rankcount[i] << (i - 1));
+	for (s = 0; s < nw; ++s) {
+		if (weights[s] == 0)
+			continue;
+		rest = 1U << (weights[s] - 1);
+		for (i = 0; i < (int)rest; ++i) {
+			w->huf[rankstart[weights[s]] + i].sym = s;
+			w->huf[rankstart[weights[s]] + i].nb =
+				log + 1 - weights[s];
+		}
+		rankstart[weights[s]] += rest;
+	}
+	w->huflog = log;
+
+	return (n);
+}
+
+static __inline uint8_t
+zstd_huf_sym(const struct zstd_dwrk *w, struct zstd_br *br, int log)
+{
+	const struct zstd_huf_dcell *cell;
+
+	cell = &w->huf[zstd_br_peek(br, log)];
+	br->used += cell->nb;
+	return (cell->sym);
+}
+
+/*
+ * Decode the rest of a huffman stream one code per refill and check
+ * that it ends exactly.
+ */
+static int
+zstd_huf_finish(const struct zstd_dwrk *w, struct zstd_br *br,
+		uint8_t *out, int n)
+{
+	int i;
+
+	for (i = 0; i < n; ++i) {
+		zstd_br_reload(br);
+		out[i] = zstd_huf_sym(w, br, w->huflog);
+	}
+	if (!zstd_br_done(br))
+		return (-1);
+	return (0);
+}
+
+static int
+zstd_huf_stream(const struct zstd_dwrk *w, const uint8_t *src, int len,
+		uint8_t *out, int n)
+{
+	struct zstd_br br;
+	int log = w->huflog;
+	int i;
+
+	if (zstd_br_init(&br, src, len) < 0)
+		return (-1);
+
+	/*
+	 * Four codes of at most ZSTD_HUF_LOG_MAX bits fit one refill.
+	 */
+	for (i = 0; i + 4 <= n; i += 4) {
+		zstd_br_reload(&br);
+		out[i + 0] = zstd_huf_sym(w, &br, log);
+		out[i + 1] = zstd_huf_sym(w, &br, log);
+		out[i + 2] = zstd_huf_sym(w, &br, log);
+		out[i + 3] = zstd_huf_sym(w, &br, log);
+	}
+	return (zstd_huf_finish(w, &br, out + i, n - i));
+}
+
+/*
+ * Decode four huffman streams of seg, seg, seg and n - 3 * seg codes.
+ * The streams are independent and interleaved to overlap their table
+ * lookups.
+ */
+static int
+zstd_huf_4streams(const struct zstd_dwrk *w, const uint8_t *src,
+		  const int *len, uint8_t *out, int seg, int n)
+{
+	struct zstd_br br[4];
+	int log = w->huflog;
+	int last = n - 3 * seg;
+	int i;
+	int k;
+
+	for (k = 0; k < 4; ++k) {
+		if (zstd_br_init(&br[k], src, len[k]) < 0)
+			return (-1);
+		src += len[k];
+	}
+	for (i = 0; i + 4 <= last; i += 4) {
+		for (k = 0; k < 4; ++k)
+			zstd_br_reload(&br[k]);
+		for (k = 0; k < 4; ++k)
+			out[k * seg + i + 0] = zstd_huf_sym(w, &br[k], log);
+		for (k = 0; k < 4; ++k)
+			out[k * seg + i + 1] = zstd_huf_sym(w, &br[k], log);
+		for (k = 0; k < 4; ++k)
+			out[k * seg + i + 2] = zstd_huf_sym(w, &br[k], log);
+		for (k = 0; k < 4; ++k)
+			out[k * seg + i + 3] = zstd_huf_sym(w, &br[k], log);
+	}
+	for (k = 0; k < 3; ++k) {
+		if (zstd_huf_finish(w, &br[k], out + k * seg + i, seg - i) < 0)
+			return (-1);
+	}
+	return (zstd_huf_finish(w, &br[3], out + 3 * seg + i, last - i));
+}
+
+/*
+ * Decode a literals section.  Returns the number of bytes consumed
+ * or -1, *litp and *nlitp describe the regenerated literals.
+ */
+static int
+zstd_dec_literals(struct zstd_dwrk *w, const uint8_t *src, int len,
+		  const uint8_t **litp, int *nlitp)
+{
+	uint64_t lhc;
+	int type;
+	int sf;
+	int hsize;
+	int regen;
+	int comp;
+	int slen[4];
+	int seg;
+	int i;
+	int n;
+
+	if (len < 1)
+		return (-1);
+	type = src[0] & 3;
+	sf = (src[0] >> 2) & 3;
+
+	if (type == ZSTD_LIT_RAW || type == ZSTD_LIT_RLE) {
+		switch (sf) {
+		case 1:
+			hsize = 2;
+			break;
+		case 3:
+			hsize = 3;
+			break;
+		default:
+			hsize = 1;
+			break;
+		}
+		if (len < hsize)
+			return (-1);
+		if (hsize == 1)
+			regen = src[0] >> 3;
+		else if (hsize == 2)
+			regen = zstd_le16(src) >> 4;
+		else
+			regen = zstd_le24(src) >> 4;
+		if (regen > HAMMER2_ZSTD_MAXSIZE)
+			return (-1);
+		if (type == ZSTD_LIT_RAW) {
+			if (len - hsize < regen)
+				return (-1);
+			*litp = src + hsize;
+			*nlitp = regen;
+			return (hsize + regen);
+		}
+		if (len - hsize < 1)
+			return (-1);
+		memset(w->lits, src[hsize], regen);
+		*litp = w->lits;
+		*nlitp = regen;
+		return (hsize + 1);
+	}
+
+	hsize = (sf < 2) ? 3 : sf + 2;
+	if (len < hsize)
+		return (-1);
+	lhc = 0;
+	for (i = 0; i < hsize; ++i)
+		lhc |= (uint64_t)src[i] << (8 * i);
+	switch (sf) {
+	case 0:
+	case 1:
+		regen = (lhc >> 4) & 0x3FF;
+		comp = (lhc >> 14) & 0x3FF;
+		break;
+	case 2:
+		regen = (lhc >> 4) & 0x3FFF;
+		comp = (lhc >> 18) & 0x3FFF;
+		break;
+	default:
+		regen = (lhc >> 4) & 0x3FFFF;
+		comp = (lhc >> 22) & 0x3FFFF;
+		break;
+	}
+	if (regen > HAMMER2_ZSTD_MAXSIZE || comp > len - hsize)
+		return (-1);
+	src += hsize;
+
+	n = 0;
+	if (type == ZSTD_LIT_COMP) {
+		n = zstd_huf_read(w, src, comp);
+		if (n < 0)
+			return (-1);
+	} else if (w->huflog == 0) {
+		return (-1);
+	}
+
+	if (sf == 0) {
+		if (zstd_huf_stream(w, src + n, comp - n, w->lits, regen) < 0)
+			return (-1);
+	} else {
+		if (comp - n < 6 + 4 || regen < 6)
+			return (-1);
+		slen[0] = zstd_le16(src + n);
+		slen[1] = zstd_le16(src + n + 2);
+		slen[2] = zstd_le16(src + n + 4);
+		slen[3] = comp - n - 6 - slen[0] - slen[1] - slen[2];
+		if (slen[3] < 0)
+			return (-1);
+		seg = (regen + 3) / 4;
+		if (regen - 3 * seg < 0)
+			return (-1);
+		if (zstd_huf_4streams(w, src + n + 6, slen, w->lits,
+				      seg, regen) < 0) {
+			return (-1);
+		}
+	}
+	*litp = w->lits;
+	*nlitp = regen;
+	return (hsize + comp);
+}
+
+/*
+ * Set up the decoding table of one sequence field.  Returns the number
+ * of bytes consumed or -1.
+ */
+static int
+zstd_dec_table(struct zstd_dwrk *w, int type, int mode,
+	       const uint8_t *src, int len)
+{
+	struct zstd_fse_dcell *tab = w->tab[type];
+	int16_t norm[ZSTD_ML_MAX + 1];
+	int maxsym;
+	int log;
+	int sym;
+	int n;
+	int i;
+
+	switch (mode) {
+	case ZSTD_MODE_PREDEF:
+		log = zstd_defaults[type].log;
+		zstd_fse_dbuild(tab, zstd_defaults[type].norm,
+				zstd_defaults[type].maxsym, log);
+		n = 0;
+		break;
+	case ZSTD_MODE_RLE:
+		if (len < 1 || src[0] > zstd_maxsym[type])
+			return (-1);
+		tab[0].sym = src[0];
+		tab[0].nb = 0;
+		tab[0].base = 0;
+		log = 0;
+		n = 1;
+		break;
+	case ZSTD_MODE_FSE:
+		n = zstd_fse_readnorm(norm, &maxsym, &log, zstd_maxsym[type],
+				      zstd_maxlog[type], src, len);
+		if (n < 0)
+			return (-1);
+		if (zstd_fse_dbuild(tab, norm, maxsym, log) < 0)
+			return (-1);
+		break;
+	default:
+		if (w->tablog[type] < 0)
+			return (-1);
+		return (0);
+	}
+
+	for (i = 0; i < (1 << log); ++i) {
+		sym = tab[i].sym;
+		switch (type) {
+		case ZSTD_LL:
+			tab[i].val = zstd_ll_base[sym];
+			tab[i].xbits = zstd_ll_bits[sym];
+			break;
+		case ZSTD_OF:
+			tab[i].val = 1U << sym;
+			tab[i].xbits = sym;
+			break;
+		default:
+			tab[i].val = zstd_ml_base[sym];
+			tab[i].xbits = zstd_ml_bits[sym];
+			break;
+		}
+	}
+	w->tablog[type] = log;
+
+	return (n);
+}
+
+/*
+ * Decode the sequences section and execute it against the literals,
+ * appending to dst at *posp.  Short literal runs and matches are copied
+ * in 8 byte units when the buffers have room for the overshoot.
+ */
+static int
+zstd_dec_sequences(struct zstd_dwrk *w, const uint8_t *src, int len,
+		   const uint8_t *lit, int nlit, uint8_t *dst, int dstlen,
+		   int *posp)
+{
+	const struct zstd_fse_dcell *ofc;
+	const struct zstd_fse_dcell *mlc;
+	const struct zstd_fse_dcell *llc;
+	const uint8_t *litend;
+	struct zstd_br br;
+	uint32_t llst;
+	uint32_t ofst;
+	uint32_t mlst;
+	uint32_t offval;
+	uint32_t off;
+	uint32_t ll;
+	uint32_t ml;
+	uint8_t *op;
+	int pos = *posp;
+	int nseq;
+	int modes;
+	int type;
+	int i;
+	int n;
+
+	if (lit == w->lits)
+		litend = w->lits + sizeof(w->lits);
+	else
+		litend = lit + nlit;
+	if (len < 1)
+		return (-1);
+	if (src[0] < 128) {
+		nseq = src[0];
+		n = 1;
+	} else if (src[0] < 255) {
+		if (len < 2)
+			return (-1);
+		nseq = ((src[0] - 128) << 8) + src[1];
+		n = 2;
+	} else {
+		if (len < 3)
+			return (-1);
+		nseq = zstd_le16(src + 1) + 0x7F00;
+		n = 3;
+	}
+	src += n;
+	len -= n;
+
+	if (nseq) {
+		if (len < 1 || (src[0] & 3))
+			return (-1);
+		modes = src[0];
+		++src;
+		--len;
+		for (type = ZSTD_LL; type <= ZSTD_ML; ++type) {
+			n = zstd_dec_table(w, type,
+					   (modes >> (6 - 2 * type)) & 3,
+					   src, len);
+			if (n < 0)
+				return (-1);
+			src += n;
+			len -= n;
+		}
+		if (zstd_br_init(&br, src, len) < 0)
+			return (-1);
+		llst = zstd_br_read(&br, w->tablog[ZSTD_LL]);
+		ofst = zstd_br_read(&br, w->tablog[ZSTD_OF]);
+		mlst = zstd_br_read(&br, w->tablog[ZSTD_ML]);
+	}
+
+	/*
+	 * A refill covers at most 57 bits: the offset (up to 31), then
+	 * the lengths (up to 32), then the state updates (up to 26).
+	 */
+	for (i = 0; i < nseq; ++i) {
+		ofc = &w->oftab[ofst];
+		mlc = &w->mltab[mlst];
+		llc = &w->lltab[llst];
+		zstd_br_reload(&br);
+		offval = ofc->val + zstd_br_get(&br, ofc->xbits);
+		if (ofc->xbits > 18)
+			zstd_br_reload(&br);
+		ml = mlc->val + zstd_br_get(&br, mlc->xbits);
+		ll = llc->val + zstd_br_get(&br, llc->xbits);
+		if (i != nseq - 1) {
+			zstd_br_reload(&br);
+			zstd_fse_decode(w->lltab, &llst, &br);
+			zstd_fse_decode(w->mltab, &mlst, &br);
+			zstd_fse_decode(w->oftab, &ofst, &br);
+		}
+		off = zstd_rep_update(w->rep, offval, ll);
+
+		if (ll > (uint32_t)nlit || ll + ml > (uint32_t)(dstlen - pos))
+			return (-1);
+		if (ll <= 16 && lit + 16 <= litend && pos + 16 <= dstlen) {
+			__builtin_memcpy(dst + pos, lit, 8);
+			__builtin_memcpy(dst + pos + 8, lit + 8, 8);
+		} else {
+			bcopy(lit, dst + pos, ll);
+		}
+		lit += ll;
+		nlit -= ll;
+		pos += ll;
+		if (off == 0 || off > (uint32_t)pos)
+			return (-1);
+		op = dst + pos;
+		if (off >= 8 && ml + 8 <= (uint32_t)(dstlen - pos)) {
+			/* may overwrite up to 7 bytes past the match */
+			for (n = 0; n < (int)ml; n += 8)
+				__builtin_memcpy(op + n, op + n - off, 8);
+		} else if (off >= ml) {
+			bcopy(op - off, op, ml);
+		} else {
+			for (n = 0; n < (int)ml; ++n)
+				op[n] = op[n - (int)off];
+		}
+		pos += ml;
+	}
+	if (nseq && !zstd_br_done(&br))
+		return (-1);
+
+	if (nlit > dstlen - pos)
+		return (-1);
+	bcopy(lit, dst + pos, nlit);
+	pos += nlit;
+	*posp = pos;
+
+	return (0);
+}
+
+size_t
+hammer2_zstd_dwrksize(void)
+{
+	return (sizeof(struct zstd_dwrk));
+}
+
+/*
+ * Decompress one zstd frame into dst.  Returns the decompressed size
+ * or -1 if the frame is invalid or does not fit.  Any trailing data
+ * after the frame (block padding) is ignored.
+ */
+int
+hammer2_zstd_decompress(const void *srcv, int srclen, void *dstv,
+			int dstlen, void *wrk)
+{
+	static const int dictbytes[4] = { 0, 1, 2, 4 };
+	struct zstd_dwrk *w = wrk;
+	const uint8_t *src = srcv;
+	const uint8_t *lit;
+	uint8_t *dst = dstv;
+	uint64_t fcs;
+	uint32_t bh;
+	int havefcs;
+	int fcsbytes;
+	int nlit;
+	int fhd;
+	int pos;
+	int out;
+	int bsize;
+	int n;
+	int i;
+
+	if (srclen < 6 || zstd_le32(src) != ZSTD_MAGIC)
+		return (-1);
+	fhd = src[4];
+	if (fhd & 0x08)
+		return (-1);
+	pos = 5;
+	if ((fhd & 0x20) == 0)
+		++pos;			/* window descriptor */
+	n = dictbytes[fhd & 3];
+	if (pos + n > srclen)
+		return (-1);
+	for (i = 0; i < n; ++i) {
+		if (src[pos + i])
+			return (-1);	/* no dictionaries */
+	}
+	pos += n;
+	switch (fhd >> 6) {
+	case 0:
+		fcsbytes = (fhd & 0x20) ? 1 : 0;
+		break;
+	case 1:
+		fcsbytes = 2;
+		break;
+	case 2:
+		fcsbytes = 4;
+		break;
+	default:
+		fcsbytes = 8;
+		break;
+	}
+	if (pos + fcsbytes > srclen)
+		return (-1);
+	havefcs = (fcsbytes != 0);
+	fcs = 0;
+	for (i = 0; i < fcsbytes; ++i)
+		fcs |= (uint64_t)src[pos + i] << (8 * i);
+	if (fcsbytes == 2)
+		fcs += 256;
+	pos += fcsbytes;
+	if (havefcs && fcs > (uint64_t)dstlen)
+		return (-1);
+
+	w->tab[ZSTD_LL] = w->lltab;
+	w->tab[ZSTD_OF] = w->oftab;
+	w->tab[ZSTD_ML] = w->mltab;
+	w->tablog[ZSTD_LL] = -1;
+	w->tablog[ZSTD_OF] = -1;
+	w->tablog[ZSTD_ML] = -1;
+	w->huflog = 0;
+	w->rep[0] = 1;
+	w->rep[1] = 4;
+	w->rep[2] = 8;
+
+	out = 0;
+	for (;;) {
+		if (pos + 3 > srclen)
+			return (-1);
+		bh = zstd_le24(src + pos);
+		pos += 3;
+		bsize = bh >> 3;
+		switch ((bh >> 1) & 3) {
+		case ZSTD_BLOCK_RAW:
+			if (bsize > srclen - pos || bsize > dstlen - out)
+				return (-1);
+			bcopy(src + pos, dst + out, bsize);
+			pos += bsize;
+			out += bsize;
+			break;
+		case ZSTD_BLOCK_RLE:
+			if (pos >= srclen || bsize > dstlen - out)
+				return (-1);
+			memset(dst + out, src[pos], bsize);
+			pos += 1;
+			out += bsize;
+			break;
+		case ZSTD_BLOCK_COMP:
+			if (bsize > srclen - pos || bsize > ZSTD_BLOCKSIZE_MAX)
+				return (-1);
+			n = zstd_dec_literals(w, src + pos, bsize, &lit, &nlit);
+			if (n < 0)
+				return (-1);
+			if (zstd_dec_sequences(w, src + pos + n, bsize - n,
+					       lit, nlit, dst, dstlen,
+					       &out) < 0) {
+				return (-1);
+			}
+			pos += bsize;
+			break;
+		default:
+			return (-1);
+		}
+		if (bh & 1)
+			break;
+	}
+	if (havefcs && (uint64_t)out != fcs)
+		return (-1);
+
+	return (out);
+}
+
+/************************************************************************
+ *				COMPRESSION				*
+ ************************************************************************/
+
+static __inline uint32_t
+zstd_hash4(const uint8_t *p)
+{
+	return ((zstd_le32(p) * 2654435761U) >> (32 - ZSTD_HASH_LOG));
+}
+
+static __inline int
+zstd_count(const uint8_t *a, const uint8_t *b, const uint8_t *end)
+{
+	const uint8_t *s = a;
+	uint64_t diff;
+
+	while (a + 8 <= end) {
+		diff = zstd_le64(a) ^ zstd_le64(b);
+		if (diff)
+			return (a - s + (__builtin_ctzll(diff) >> 3));
+		a += 8;
+		b += 8;
+	}
+	while (a < end && *a == *b) {
+		++a;
+		++b;
+	}
+	return (a - s);
+}
+
+/*
+ * Offset code value for a match at distance off preceded by ll
+ * literals, preferring the repeat codes.
+ */
+static __inline uint32_t
+zstd_offval(const uint32_t *rep, uint32_t off, int ll)
+{
+	if (ll) {
+		if (off == rep[0])
+			return (1);
+		if (off == rep[1])
+			return (2);
+		if (off == rep[2])
+			return (3);
+	} else {
+		if (off == rep[1])
+			return (1);
+		if (off == rep[2])
+			return (2);
+		if (off == rep[0] - 1)
+			return (3);
+	}
+	return (off + 3);
+}
+
+/*
+ * Find the best match at ip.  Repeat offsets are tried first, then up
+ * to lv->depth hash chain candidates.  Matches are ranked by length
+ * less the cost of their offset.  Returns the match length (0 if none)
+ * with the offset in *offp and the rank in *gainp.
+ */
+static int
+zstd_find(struct zstd_cwrk *w, const uint8_t *src, int srclen, int ip,
+	  int anchor, const struct zstd_level *lv, uint32_t *offp, int *gainp)
+{
+	const uint8_t *end = src + srclen;
+	uint32_t h;
+	uint32_t off;
+	int bestlen = 0;
+	int bestgain = 0;
+	int depth;
+	int cpos;
+	int len;
+	int gain;
+	int i;
+
+	while (w->next < ip) {
+		h = zstd_hash4(src + w->next);
+		w->chain[w->next] = w->head[h] ?
+				    w->next - (w->head[h] - 1) : 0;
+		w->head[h] = w->next + 1;
+		++w->next;
+	}
+
+	for (i = 0; i < 3; ++i) {
+		off = w->rep[i];
+		if (off > (uint32_t)ip ||
+		    zstd_le32(src + ip) != zstd_le32(src + ip - off)) {
+			continue;
+		}
+		len = ZSTD_MINMATCH + zstd_count(src + ip + ZSTD_MINMATCH,
+						 src + ip - off + ZSTD_MINMATCH,
+						 end);
+		gain = len * 4 -
+		       zstd_highbit(zstd_offval(w->rep, off, ip - anchor));
+		if (gain > bestgain) {
+			bestgain = gain;
+			bestlen = len;
+			*offp = off;
+		}
+	}
+
+	h = zstd_hash4(src + ip);
+	cpos = w->head[h] - 1;
+	depth = lv->depth;
+	while (cpos >= 0 && depth-- > 0) {
+		if (bestlen >= lv->nice || ip + bestlen >= srclen)
+			break;
+		off = ip - cpos;
+		if (src[cpos + bestlen] == src[ip + bestlen] &&
+		    zstd_le32(src + cpos) == zstd_le32(src + ip)) {
+			len = ZSTD_MINMATCH +
+			      zstd_count(src + ip + ZSTD_MINMATCH,
+					 src + cpos + ZSTD_MINMATCH, end);
+			gain = len * 4 - zstd_highbit(off + 3);
+			if (gain > bestgain) {
+				bestgain = gain;
+				bestlen = len;
+				*offp = off;
+			}
+		}
+		if (w->chain[cpos] == 0)
+			break;
+		cpos -= w->chain[cpos];
+	}
+	*gainp = bestgain;
+
+	return (bestlen);
+}
+
+static void
+zstd_emit(struct zstd_cwrk *w, const uint8_t *src, int anchor, int ll,
+	  uint32_t off, int ml)
+{
+	struct zstd_seq *seq;
+	uint32_t offval;
+
+	bcopy(src + anchor, w->lits + w->nlits, ll);
+	w->nlits += ll;
+	offval = zstd_offval(w->rep, off, ll);
+	zstd_rep_update(w->rep, offval, ll);
+	seq = &w->seqs[w->nseqs++];
+	seq->offval = offval;
+	seq->ll = ll;
+	seq->mlb = ml - 3;
+}
+
+/*
+ * Split the input into sequences and literals.
+ */
+static void
+zstd_parse(struct zstd_cwrk *w, const uint8_t *src, int srclen, int level)
+{
+	const struct zstd_level *lv = &zstd_levels[level];
+	uint32_t off;
+	uint32_t off2;
+	int anchor;
+	int limit;
+	int gain;
+	int gain2;
+	int len;
+	int len2;
+	int ip;
+	int k;
+
+	bzero(w->head, sizeof(w->head));
+	w->next = 0;
+	w->nlits = 0;
+	w->nseqs = 0;
+	w->rep[0] = 1;
+	w->rep[1] = 4;
+	w->rep[2] = 8;
+
+	anchor = 0;
+	ip = 0;
+	limit = srclen - ZSTD_MINMATCH;
+	while (ip <= limit) {
+		len = zstd_find(w, src, srclen, ip, anchor, lv, &off, &gain);
+		if (len < ZSTD_MINMATCH) {
+			ip += 1 + ((ip - anchor) >> lv->skip);
+			continue;
+		}
+
+		/*
+		 * Lazy evaluation, take a later match if it is
+		 * sufficiently better than the current one.
+		 */
+		for (k = 0; k < lv->lazy && ip + 1 <= limit; ++k) {
+			len2 = zstd_find(w, src, srclen, ip + 1, anchor, lv,
+					 &off2, &gain2);
+			if (len2 < ZSTD_MINMATCH ||
+			    gain2 <= gain + (k ? 7 : 4)) {
+				break;
+			}
+			++ip;
+			len = len2;
+			off = off2;
+			gain = gain2;
+		}
+
+		while (ip > anchor && ip > (int)off &&
+		       src[ip - 1] == src[ip - off - 1]) {
+			--ip;
+			++len;
+		}
+		zstd_emit(w, src, anchor, ip - anchor, off, len);
+		ip += len;
+		anchor = ip;
+	}
+	bcopy(src + anchor, w->lits + w->nlits, srclen - anchor);
+	w->nlits += srclen - anchor;
+}
+
+/*
+ * Build length limited huffman code lengths for the literal histogram
+ * and derive the canonical codes the decoder will reconstruct from the
+ * weights.  Returns -1 if fewer than two symbols are present.
+ */
+static int
+zstd_huf_build(struct zstd_cwrk *w, int maxsym)
+{
+	uint32_t blc[ZSTD_HUF_LOG + 1];
+	uint32_t rankstart[ZSTD_HUF_LOG + 2];
+	uint32_t kraft;
+	uint32_t target;
+	int nleaf;
+	int next;
+	int li;
+	int ii;
+	int a;
+	int b;
+	int s;
+	int i;
+	int j;
+	int log;
+
+	nleaf = 0;
+	for (s = 0; s <= maxsym; ++s) {
+		if (w->count[s] == 0)
+			continue;
+		for (i = nleaf; i > 0; --i) {
+			if (w->count[w->sorted[i - 1]] <= w->count[s])
+				break;
+			w->sorted[i] = w->sorted[i - 1];
+		}
+		w->sorted[i] = s;
+		++nleaf;
+	}
+	if (nleaf < 2)
+		return (-1);
+
+	/*
+	 * Two queue construction over the sorted leaves, internal nodes
+	 * are created in non-decreasing weight order.
+	 */
+	for (i = 0; i < nleaf; ++i)
+		w->node[i] = w->count[w->sorted[i]];
+	li = 0;
+	ii = nleaf;
+	for (next = nleaf; next < 2 * nleaf - 1; ++next) {
+		if (li < nleaf && (ii >= next || w->node[li] <= w->node[ii]))
+			a = li++;
+		else
+			a = ii++;
+		if (li < nleaf && (ii >= next || w->node[li] <= w->node[ii]))
+			b = li++;
+		else
+			b = ii++;
+		w->node[next] = w->node[a] + w->node[b];
+		w->parent[a] = next;
+		w->parent[b] = next;
+	}
+	w->depth[2 * nleaf - 2] = 0;
+	for (i = 2 * nleaf - 3; i >= 0; --i)
+		w->depth[i] = w->depth[w->parent[i]] + 1;
+
+	/*
+	 * Clamp to ZSTD_HUF_LOG and restore a complete code by moving
+	 * leaves between lengths.
+	 */
+	bzero(blc, sizeof(blc));
+	for (i = 0; i < nleaf; ++i) {
+		j = w->depth[i];
+		if (j > ZSTD_HUF_LOG)
+			j = ZSTD_HUF_LOG;
+		++blc[j];
+	}
+	target = 1U << ZSTD_HUF_LOG;
+	kraft = 0;
+	for (i = 1; i <= ZSTD_HUF_LOG; ++i)
+		kraft += blc[i] << (ZSTD_HUF_LOG - i);
+	while (kraft > target) {
+		for (i = ZSTD_HUF_LOG - 1; blc[i] == 0; --i)
+			;
+		--blc[i];
+		++blc[i + 1];
+		kraft -= 1U << (ZSTD_HUF_LOG - i - 1);
+	}
+	while (kraft < target) {
+		for (i = ZSTD_HUF_LOG; i > 1; --i) {
+			if (blc[i] && (1U << (ZSTD_HUF_LOG - i)) <=
+				      target - kraft) {
+				break;
+			}
+		}
+		--blc[i];
+		++blc[i - 1];
+		kraft += 1U << (ZSTD_HUF_LOG - i);
+	}
+
+	/*
+	 * Longest codes go to the least frequent symbols.
+	 */
+	bzero(w->huflen, sizeof(w->huflen));
+	log = 0;
+	j = 0;
+	for (i = ZSTD_HUF_LOG; i >= 1; --i) {
+		if (blc[i] && log == 0)
+			log = i;
+		while (blc[i]--)
+			w->huflen[w->sorted[j++]] = i;
+	}
+
+	bzero(rankstart, sizeof(rankstart));
+	for (s = 0; s <= maxsym; ++s) {
+		w->weight[s] = w->huflen[s] ? log + 1 - w->huflen[s] : 0;
+		if (w->weight[s])
+			rankstart[w->weight[s] + 1] += 1U << (w->weight[s] - 1);
+	}
+	for (i = 2; i <= log + 1; ++i)
+		rankstart[i] += rankstart[i - 1];
+	for (s = 0; s <= maxsym; ++s) {
+		i = w->weight[s];
+		if (i == 0)
+			continue;
+		w->hufcode[s] = rankstart[i] >> (i - 1);
+		rankstart[i] += 1U << (i - 1);
+	}
+	w->huflog = log;
+
+	return (0);
+}
+
+/*
+ * FSE compress the huffman weights.  Returns the size of the tree
+ * description or 0 if it cannot be represented this way.
+ */
+static int
+zstd_huf_fseweights(struct zstd_cwrk *w, int nw, uint8_t *dst, int dstlen)
+{
+	struct zstd_bw bw;
+	uint32_t count[ZSTD_HUF_LOG + 1];
+	int16_t norm[ZSTD_HUF_LOG + 1];
+	uint32_t s1 = 0;
+	uint32_t s2 = 0;
+	int have1 = 0;
+	int have2 = 0;
+	int maxsym;
+	int log;
+	int hdr;
+	int n;
+	int i;
+
+	if (nw < 2 || dstlen < 2)
+		return (0);
+	if (dstlen > 128)
+		dstlen = 128;
+	bzero(count, sizeof(count));
+	maxsym = 0;
+	for (i = 0; i < nw; ++i) {
+		if (++count[w->weight[i]] == (uint32_t)nw)
+			return (0);
+		if (w->weight[i] > maxsym)
+			maxsym = w->weight[i];
+	}
+	log = zstd_fse_log(ZSTD_HUFW_LOG, nw, maxsym);
+	zstd_fse_normalize(norm, count, maxsym, nw, log);
+	hdr = zstd_fse_writenorm(dst + 1, dstlen - 1, norm, maxsym, log);
+	if (hdr == 0)
+		return (0);
+	zstd_fse_cbuild(&w->wctab, norm, maxsym, log);
+
+	zstd_bw_init(&bw, dst + 1 + hdr, dst + dstlen);
+	for (i = nw - 1; i >= 0; --i) {
+		if (i & 1) {
+			if (have2) {
+				zstd_fse_encode(&bw, &w->wctab, &s2,
+						w->weight[i]);
+			} else {
+				s2 = zstd_fse_cinit(&w->wctab, w->weight[i]);
+				have2 = 1;
+			}
+		} else {
+			if (have1) {
+				zstd_fse_encode(&bw, &w->wctab, &s1,
+						w->weight[i]);
+			} else {
+				s1 = zstd_fse_cinit(&w->wctab, w->weight[i]);
+				have1 = 1;
+			}
+		}
+	}
+	zstd_bw_add(&bw, s2, log);
+	zstd_bw_add(&bw, s1, log);
+	n = zstd_bw_close(&bw, dst + 1 + hdr);
+	if (n == 0 || hdr + n > 127)
+		return (0);
+	dst[0] = hdr + n;
+
+	return (1 + hdr + n);
+}
+
+/*
+ * Write the huffman tree description, the weights of all symbols but
+ * the last (maxsym).  Returns its size or 0.
+ */
+static int
+zstd_huf_tree(struct zstd_cwrk *w, int maxsym, uint8_t *dst, int dstlen)
+{
+	int direct;
+	int n;
+	int i;
+
+	n = zstd_huf_fseweights(w, maxsym, dst, dstlen);
+	direct = 1 + (maxsym + 1) / 2;
+	if (maxsym > 128 || (n && n <= direct))
+		return (n);
+	if (direct > dstlen)
+		return (0);
+	dst[0] = 127 + maxsym;
+	for (i = 0; i < maxsym; i += 2) {
+		dst[1 + i / 2] = w->weight[i] << 4;
+		if (i + 1 < maxsym)
+			dst[1 + i / 2] |= w->weight[i + 1];
+	}
+	return (direct);
+}
+
+static int
+zstd_huf_stream_enc(struct zstd_cwrk *w, const uint8_t *src, int n,
+		    uint8_t *dst, uint8_t *end)
+{
+	struct zstd_bw bw;
+	int i;
+
+	zstd_bw_init(&bw, dst, end);
+	for (i = n - 1; i >= 0; --i)
+		zstd_bw_add(&bw, w->hufcode[src[i]], w->huflen[src[i]]);
+	return (zstd_bw_close(&bw, dst));
+}
+
+static int
+zstd_lit_rawhdr(int n)
+{
+	return ((n < 32) ? 1 : (n < 4096) ? 2 : 3);
+}
+
+/*
+ * Huffman compress the literals.  Returns the size of the literals
+ * section or 0 if it does not beat storing them raw.
+ */
+static int
+zstd_enc_huf(struct zstd_cwrk *w, int maxsym, uint8_t *dst, int dstlen)
+{
+	const uint8_t *lits = w->lits;
+	uint8_t *end = dst + dstlen;
+	uint8_t *op;
+	uint8_t *jt;
+	uint64_t lhc;
+	int nlits = w->nlits;
+	int tree;
+	int comp;
+	int hsize;
+	int sf;
+	int seg;
+	int n;
+	int i;
+
+	if (dstlen < 5 + 1 + 6 + 4 || zstd_huf_build(w, maxsym) < 0)
+		return (0);
+	op = dst + 5;
+	tree = zstd_huf_tree(w, maxsym, op, end - op);
+	if (tree == 0)
+		return (0);
+	op += tree;
+
+	if (nlits < 256) {
+		n = zstd_huf_stream_enc(w, lits, nlits, op, end);
+		if (n == 0)
+			return (0);
+		op += n;
+		sf = 0;
+	} else {
+		seg = (nlits + 3) / 4;
+		if (end - op < 6)
+			return (0);
+		jt = op;
+		op += 6;
+		for (i = 0; i < 4; ++i) {
+			n = zstd_huf_stream_enc(w, lits + i * seg,
+				(i == 3) ? nlits - 3 * seg : seg, op, end);
+			if (n == 0)
+				return (0);
+			if (i < 3)
+				zstd_put16(jt + i * 2, n);
+			op += n;
+		}
+		sf = 1;
+	}
+	comp = op - (dst + 5);
+
+	if (sf == 0 || (nlits <= 1023 && comp <= 1023)) {
+		hsize = 3;
+	} else if (nlits <= 16383 && comp <= 16383) {
+		hsize = 4;
+		sf = 2;
+	} else {
+		hsize = 5;
+		sf = 3;
+	}
+	if (hsize + comp >= zstd_lit_rawhdr(nlits) + nlits)
+		return (0);
+
+	lhc = ZSTD_LIT_COMP | (sf << 2) | ((uint64_t)nlits << 4);
+	switch (hsize) {
+	case 3:
+		lhc |= (uint64_t)comp << 14;
+		break;
+	case 4:
+		lhc |= (uint64_t)comp << 18;
+		break;
+	default:
+		lhc |= (uint64_t)comp << 22;
+		break;
+	}
+	bcopy(dst + 5, dst + hsize, comp);
+	for (i = 0; i < hsize; ++i)
+		dst[i] = (uint8_t)(lhc >> (8 * i));
+
+	return (hsize + comp);
+}
+
+static int
+zstd_enc_literals(struct zstd_cwrk *w, uint8_t *dst, int dstlen)
+{
+	const uint8_t *lits = w->lits;
+	int nlits = w->nlits;
+	uint32_t maxcount;
+	int maxsym;
+	int hsize;
+	int n;
+	int i;
+
+	bzero(w->count, sizeof(w->count));
+	for (i = 0; i < nlits; ++i)
+		++w->count[lits[i]];
+	maxsym = 0;
+	maxcount = 0;
+	for (i = 0; i < 256; ++i) {
+		if (w->count[i]) {
+			maxsym = i;
+			if (w->count[i] > maxcount)
+				maxcount = w->count[i];
+		}
+	}
+
+	hsize = zstd_lit_rawhdr(nlits);
+	if (nlits > 1 && maxcount == (uint32_t)nlits) {
+		if (dstlen < hsize + 1)
+			return (0);
+		n = ZSTD_LIT_RLE;
+	} else {
+		if (nlits >= ZSTD_HUF_MINLITS) {
+			n = zstd_enc_huf(w, maxsym, dst, dstlen);
+			if (n)
+				return (n);
+		}
+		if (dstlen < hsize + nlits)
+			return (0);
+		n = ZSTD_LIT_RAW;
+	}
+	switch (hsize) {
+	case 1:
+		dst[0] = n | (nlits << 3);
+		break;
+	case 2:
+		zstd_put16(dst, n | (1 << 2) | (nlits << 4));
+		break;
+	default:
+		zstd_put24(dst, n | (3 << 2) | (nlits << 4));
+		break;
+	}
+	if (n == ZSTD_LIT_RLE) {
+		dst[hsize] = lits[0];
+		return (hsize + 1);
+	}
+	bcopy(lits, dst + hsize, nlits);
+	return (hsize + nlits);
+}
+
+static __inline int
+zstd_seq_code(const struct zstd_seq *seq, int type)
+{
+	switch (type) {
+	case ZSTD_LL:
+		return (zstd_ll_code(seq->ll));
+	case ZSTD_OF:
+		return (zstd_highbit(seq->offval));
+	default:
+		return (zstd_ml_code(seq->mlb));
+	}
+}
+
+/*
+ * Choose the cheapest table mode for one sequence field, write its
+ * description and build the encoding table.  Returns the description
+ * size or -1.
+ */
+static int
+zstd_enc_table(struct zstd_cwrk *w, int type, uint8_t *dst, int dstlen,
+	       int *modep)
+{
+	struct zstd_fse_ctab *ct = &w->ctab[type];
+	uint32_t count[ZSTD_ML_MAX + 1];
+	int16_t norm[ZSTD_ML_MAX + 1];
+	uint32_t maxcount;
+	int64_t cpredef;
+	int64_t cfse;
+	int nseqs = w->nseqs;
+	int maxsym;
+	int log;
+	int n;
+	int s;
+	int i;
+
+	bzero(count, sizeof(count));
+	for (i = 0; i < nseqs; ++i)
+		++count[zstd_seq_code(&w->seqs[i], type)];
+	maxsym = 0;
+	maxcount = 0;
+	for (s = 0; s <= zstd_maxsym[type]; ++s) {
+		if (count[s]) {
+			maxsym = s;
+			if (count[s] > maxcount)
+				maxcount = count[s];
+		}
+	}
+
+	if (maxcount == (uint32_t)nseqs) {
+		if (dstlen < 1)
+			return (-1);
+		dst[0] = maxsym;
+		zstd_fse_crle(ct, maxsym);
+		*modep = ZSTD_MODE_RLE;
+		return (1);
+	}
+
+	cpredef = -1;
+	if (maxsym <= zstd_defaults[type].maxsym) {
+		cpredef = 0;
+		for (s = 0; s <= maxsym; ++s) {
+			cpredef += (int64_t)count[s] *
+				   zstd_fse_cost(zstd_defaults[type].norm[s],
+						 zstd_defaults[type].log);
+		}
+	}
+
+	log = zstd_fse_log(zstd_maxlog[type], nseqs, maxsym);
+	zstd_fse_normalize(norm, count, maxsym, nseqs, log);
+	n = zstd_fse_writenorm(dst, dstlen, norm, maxsym, log);
+	cfse = -1;
+	if (n) {
+		cfse = (int64_t)n * 8 * 256;
+		for (s = 0; s <= maxsym; ++s) {
+			if (count[s])
+				cfse += (int64_t)count[s] *
+					zstd_fse_cost(norm[s], log);
+		}
+	}
+
+	if (cpredef >= 0 && (cfse < 0 || cpredef <= cfse)) {
+		zstd_fse_cbuild(ct, zstd_defaults[type].norm,
+				zstd_defaults[type].maxsym,
+				zstd_defaults[type].log);
+		*modep = ZSTD_MODE_PREDEF;
+		return (0);
+	}
+	if (cfse < 0)
+		return (-1);
+	zstd_fse_cbuild(ct, norm, maxsym, log);
+	*modep = ZSTD_MODE_FSE;
+
+	return (n);
+}
+
+static int
+zstd_enc_sequences(struct zstd_cwrk *w, uint8_t *dst, int dstlen)
+{
+	const struct zstd_seq *seq;
+	struct zstd_bw bw;
+	uint8_t *op = dst;
+	uint8_t *end = dst + dstlen;
+	uint8_t *modep;
+	uint32_t llst;
+	uint32_t ofst;
+	uint32_t mlst;
+	int nseqs = w->nseqs;
+	int mode;
+	int type;
+	int llc;
+	int ofc;
+	int mlc;
+	int n;
+
+	if (dstlen < 4)
+		return (0);
+	if (nseqs < 128) {
+		*op++ = nseqs;
+	} else {
+		*op++ = (nseqs >> 8) + 128;
+		*op++ = nseqs;
+	}
+	if (nseqs == 0)
+		return (op - dst);
+
+	modep = op++;
+	*modep = 0;
+	for (type = ZSTD_LL; type <= ZSTD_ML; ++type) {
+		n = zstd_enc_table(w, type, op, end - op, &mode);
+		if (n < 0)
+			return (0);
+		op += n;
+		*modep |= mode << (6 - 2 * type);
+	}
+
+	zstd_bw_init(&bw, op, end);
+	seq = &w->seqs[nseqs - 1];
+	llc = zstd_ll_code(seq->ll);
+	ofc = zstd_highbit(seq->offval);
+	mlc = zstd_ml_code(seq->mlb);
+	mlst = zstd_fse_cinit(&w->ctab[ZSTD_ML], mlc);
+	ofst = zstd_fse_cinit(&w->ctab[ZSTD_OF], ofc);
+	llst = zstd_fse_cinit(&w->ctab[ZSTD_LL], llc);
+	zstd_bw_add(&bw, seq->ll, zstd_ll_bits[llc]);
+	zstd_bw_add(&bw, seq->mlb, zstd_ml_bits[mlc]);
+	zstd_bw_add(&bw, seq->offval, ofc);
+	while (seq != w->seqs) {
+		--seq;
+		llc = zstd_ll_code(seq->ll);
+		ofc = zstd_highbit(seq->offval);
+		mlc = zstd_ml_code(seq->mlb);
+		zstd_fse_encode(&bw, &w->ctab[ZSTD_OF], &ofst, ofc);
+		zstd_fse_encode(&bw, &w->ctab[ZSTD_ML], &mlst, mlc);
+		zstd_fse_encode(&bw, &w->ctab[ZSTD_LL], &llst, llc);
+		zstd_bw_add(&bw, seq->ll, zstd_ll_bits[llc]);
+		zstd_bw_add(&bw, seq->mlb, zstd_ml_bits[mlc]);
+		zstd_bw_add(&bw, seq->offval, ofc);
+	}
+	zstd_bw_add(&bw, mlst, w->ctab[ZSTD_ML].log);
+	zstd_bw_add(&bw, ofst, w->ctab[ZSTD_OF].log);
+	zstd_bw_add(&bw, llst, w->ctab[ZSTD_LL].log);
+	n = zstd_bw_close(&bw, op);
+	if (n == 0)
+		return (0);
+
+	return (op + n - dst);
+}
+
+size_t
+hammer2_zstd_cwrksize(void)
+{
+	return (sizeof(struct zstd_cwrk));
+}
+
+/*
+ * Compress src into a single zstd frame.  Returns the frame size or 0
+ * if it would not fit in dstlen bytes.
+ */
+int
+hammer2_zstd_compress(const void *srcv, int srclen, void *dstv, int dstlen,
+		      int level, void *wrk)
+{
+	struct zstd_cwrk *w = wrk;
+	const uint8_t *src = srcv;
+	uint8_t *dst = dstv;
+	uint8_t *op;
+	int n;
+	int m;
+
+	if (srclen <= 0 || srclen > HAMMER2_ZSTD_MAXSIZE || dstlen < 12)
+		return (0);
+	if (level < HAMMER2_ZSTD_LEVEL_MIN)
+		level = HAMMER2_ZSTD_LEVEL_DEF;
+	if (level > HAMMER2_ZSTD_LEVEL_MAX)
+		level = HAMMER2_ZSTD_LEVEL_MAX;
+
+	/*
+	 * Single segment frame header with the content size, no
+	 * checksum (the blockref check code covers the data).
+	 */
+	op = dst;
+	zstd_put32(op, ZSTD_MAGIC);
+	op += 4;
+	if (srclen < 256) {
+		*op++ = 0x20;
+		*op++ = srclen;
+	} else {
+		*op++ = 0x60;
+		zstd_put16(op, srclen - 256);
+		op += 2;
+	}
+	op += 3;
+
+	zstd_parse(w, src, srclen, level);
+	n = zstd_enc_literals(w, op, dst + dstlen - op);
+	if (n == 0)
+		return (0);
+	m = zstd_enc_sequences(w, op + n, dst + dstlen - op - n);
+	if (m == 0)
+		return (0);
+	zstd_put24(op - 3, 1 | (ZSTD_BLOCK_COMP << 1) | ((n + m) << 3));
+
+	return (op + n + m - dst);
+}
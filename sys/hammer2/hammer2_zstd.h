@@ -0,0 +1,56 @@
+/*
+ * Copyright (c) 2014 The DragonFly Project.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ * 3. Neither the name of The DragonFly Project nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific, prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _HAMMER2_ZSTD_H_
+#define _HAMMER2_ZSTD_H_
+
+/*
+ * Compression levels selectable through HAMMER2_ENC_LEVEL().  Level 0
+ * in the inode selects HAMMER2_ZSTD_LEVEL_DEF.
+ */
+#define HAMMER2_ZSTD_LEVEL_MIN	1
+#define HAMMER2_ZSTD_LEVEL_DEF	3
+#define HAMMER2_ZSTD_LEVEL_MAX	15
+
+/*
+ * Largest logical block either direction handles, equal to
+ * HAMMER2_PBUFSIZE.
+ */
+#define HAMMER2_ZSTD_MAXSIZE	65536
+
+size_t hammer2_zstd_cwrksize(void);
+size_t hammer2_zstd_dwrksize(void);
+int hammer2_zstd_compress(const void *src, int srclen, void *dst, int dstlen,
+			int level, void *wrk);
+int hammer2_zstd_decompress(const void *src, int srclen, void *dst,
+			int dstlen, void *wrk);
+
+#endif /* !_HAMMER2_ZSTD_H_ */
@@ -0,0 +1,467 @@
+/*-
+ * Copyright (c) 2005-2010 Daniel Braniss <danny@cs.huji.ac.il>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+/*
+ | iSCSI
+ | $Id: isc_subr.c 560 2009-05-07 07:37:49Z danny $
+ */
+
+/*
+ * CRC32C (Castagnoli) shared by the kernel, libdmsg and the hammer2
+ * userland tools.
+ *
+ * Three implementations are provided and selected at first use:
+ *
+ *	- The SSE4.2 crc32 instruction on amd64, running three independent
+ *	  streams over large buffers to hide the instruction latency and
+ *	  combining them with precomputed zero-shift tables.
+ *	- Slicing-by-8 on little-endian machines.
+ *	- The original byte-at-a-time table.
+ *
+ * The selected implementation is checked against a known answer before
+ * it is used, falling back to the byte-at-a-time code if it fails.
+ */
+
+#ifdef _KERNEL
+#include <sys/param.h>
+#include <sys/systm.h>
+#if defined(__amd64__)
+#include <machine/cpu.h>
+#include <machine/specialreg.h>
+#endif
+#else
+#include <sys/types.h>
+#include <sys/endian.h>
+#endif
+
+#ifndef _KERNEL
+/* prototypes for the kernel are in <sys/systm.h> */
+uint32_t iscsi_crc32(const void *buf, size_t size);
+uint32_t iscsi_crc32_ext(const void *buf, size_t size, uint32_t ocrc);
+#endif
+
+#define CRC32C_POLY	0x82F63B78U	/* reflected 0x1EDC6F41 */
+#define CRC32C_CHECK	0xE3069283U	/* crc of "123456789" */
+
+#define CRC32C_LONG	8192		/* hw stream length, large bufs */
+#define CRC32C_LONGx1	"8192"
+#define CRC32C_LONGx2	"16384"
+#define CRC32C_SHORT	256		/* hw stream length, small bufs */
+#define CRC32C_SHORTx1	"256"
+#define CRC32C_SHORTx2	"512"
+
+/*****************************************************************/
+/*                                                               */
+/* CRC LOOKUP TABLE                                              */
+/* ================                                              */
+/* The following CRC lookup table was generated automagically    */
+/* by the Rocksoft^tm Model CRC Algorithm Table Generation       */
+/* Program V1.0 using the following model parameters:            */
+/*                                                               */
+/*    Width   : 4 bytes.                                         */
+/*    Poly    : 0x1EDC6F41L                                      */
+/*    Reverse : TRUE.                                            */
+/*                                                               */
+/* For more information on the Rocksoft^tm Model CRC Algorithm,  */
+/* see the document titled "A Painless Guide to CRC Error        */
+/* Detection Algorithms" by Ross Williams                        */
+/* (ross@guest.adelaide.edu.au.). This document is likely to be  */
+/* in the FTP archive "ftp.adelaide.edu.au/pub/rocksoft".        */
+/*                                                               */
+/*****************************************************************/
+
+static const uint32_t iscsiCrc32Table[256] = {
+    0x00000000L, 0xF26B8303L, 0xE13B70F7L, 0x1350F3F4L,
+    0xC79A971FL, 0x35F1141CL, 0x26A1E7E8L, 0xD4CA64EBL,
+    0x8AD958CFL, 0x78B2DBCCL, 0x6BE22838L, 0x9989AB3BL,
+    0x4D43CFD0L, 0xBF284CD3L, 0xAC78BF27L, 0x5E133C24L,
+    0x105EC76FL, 0xE235446CL, 0xF165B798L, 0x030E349BL,
+    0xD7C45070L, 0x25AFD373L, 0x36FF2087L, 0xC494A384L,
+    0x9A879FA0L, 0x68EC1CA3L, 0x7BBCEF57L, 0x89D76C54L,
+    0x5D1D08BFL, 0xAF768BBCL, 0xBC267848L, 0x4E4DFB4BL,
+    0x20BD8EDEL, 0xD2D60DDDL, 0xC186FE29L, 0x33ED7D2AL,
+    0xE72719C1L, 0x154C9AC2L, 0x061C6936L, 0xF477EA35L,
+    0xAA64D611L, 0x580F5512L, 0x4B5FA6E6L, 0xB93425E5L,
+    0x6DFE410EL, 0x9F95C20DL, 0x8CC531F9L, 0x7EAEB2FAL,
+    0x30E349B1L, 0xC288CAB2L, 0xD1D83946L, 0x23B3BA45L,
+    0xF779DEAEL, 0x05125DADL, 0x1642AE59L, 0xE4292D5AL,
+    0xBA3A117EL, 0x4851927DL, 0x5B016189L, 0xA96AE28AL,
+    0x7DA08661L, 0x8FCB0562L, 0x9C9BF696L, 0x6EF07595L,
+    0x417B1DBCL, 0xB3109EBFL, 0xA0406D4BL, 0x522BEE48L,
+    0x86E18AA3L, 0x748A09A0L, 0x67DAFA54L, 0x95B17957L,
+    0xCBA24573L, 0x39C9C670L, 0x2A993584L, 0xD8F2B687L,
+    0x0C38D26CL, 0xFE53516FL, 0xED03A29BL, 0x1F682198L,
+    0x5125DAD3L, 0xA34E59D0L, 0xB01EAA24L, 0x42752927L,
+    0x96BF4DCCL, 0x64D4CECFL, 0x77843D3BL, 0x85EFBE38L,
+    0xDBFC821CL, 0x2997011FL, 0x3AC7F2EBL, 0xC8AC71E8L,
+    0x1C661503L, 0xEE0D9600L, 0xFD5D65F4L, 0x0F36E6F7L,
+    0x61C69362L, 0x93AD1061L, 0x80FDE395L, 0x72966096L,
+    0xA65C047DL, 0x5437877EL, 0x4767748AL, 0xB50CF789L,
+    0xEB1FCBADL, 0x197448AEL, 0x0A24BB5AL, 0xF84F3859L,
+    0x2C855CB2L, 0xDEEEDFB1L, 0xCDBE2C45L, 0x3FD5AF46L,
+    0x7198540DL, 0x83F3D70EL, 0x90A324FAL, 0x62C8A7F9L,
+    0xB602C312L, 0x44694011L, 0x5739B3E5L, 0xA55230E6L,
+    0xFB410CC2L, 0x092A8FC1L, 0x1A7A7C35L, 0xE811FF36L,
+    0x3CDB9BDDL, 0xCEB018DEL, 0xDDE0EB2AL, 0x2F8B6829L,
+    0x82F63B78L, 0x709DB87BL, 0x63CD4B8FL, 0x91A6C88CL,
+    0x456CAC67L, 0xB7072F64L, 0xA457DC90L, 0x563C5F93L,
+    0x082F63B7L, 0xFA44E0B4L, 0xE9141340L, 0x1B7F9043L,
+    0xCFB5F4A8L, 0x3DDE77ABL, 0x2E8E845FL, 0xDCE5075CL,
+    0x92A8FC17L, 0x60C37F14L, 0x73938CE0L, 0x81F80FE3L,
+    0x55326B08L, 0xA759E80BL, 0xB4091BFFL, 0x466298FCL,
+    0x1871A4D8L, 0xEA1A27DBL, 0xF94AD42FL, 0x0B21572CL,
+    0xDFEB33C7L, 0x2D80B0C4L, 0x3ED04330L, 0xCCBBC033L,
+    0xA24BB5A6L, 0x502036A5L, 0x4370C551L, 0xB11B4652L,
+    0x65D122B9L, 0x97BAA1BAL, 0x84EA524EL, 0x7681D14DL,
+    0x2892ED69L, 0xDAF96E6AL, 0xC9A99D9EL, 0x3BC21E9DL,
+    0xEF087A76L, 0x1D63F975L, 0x0E330A81L, 0xFC588982L,
+    0xB21572C9L, 0x407EF1CAL, 0x532E023EL, 0xA145813DL,
+    0x758FE5D6L, 0x87E466D5L, 0x94B49521L, 0x66DF1622L,
+    0x38CC2A06L, 0xCAA7A905L, 0xD9F75AF1L, 0x2B9CD9F2L,
+    0xFF56BD19L, 0x0D3D3E1AL, 0x1E6DCDEEL, 0xEC064EEDL,
+    0xC38D26C4L, 0x31E6A5C7L, 0x22B65633L, 0xD0DDD530L,
+    0x0417B1DBL, 0xF67C32D8L, 0xE52CC12CL, 0x1747422FL,
+    0x49547E0BL, 0xBB3FFD08L, 0xA86F0EFCL, 0x5A048DFFL,
+    0x8ECEE914L, 0x7CA56A17L, 0x6FF599E3L, 0x9D9E1AE0L,
+    0xD3D3E1ABL, 0x21B862A8L, 0x32E8915CL, 0xC083125FL,
+    0x144976B4L, 0xE622F5B7L, 0xF5720643L, 0x07198540L,
+    0x590AB964L, 0xAB613A67L, 0xB831C993L, 0x4A5A4A90L,
+    0x9E902E7BL, 0x6CFBAD78L, 0x7FAB5E8CL, 0x8DC0DD8FL,
+    0xE330A81AL, 0x115B2B19L, 0x020BD8EDL, 0xF0605BEEL,
+    0x24AA3F05L, 0xD6C1BC06L, 0xC5914FF2L, 0x37FACCF1L,
+    0x69E9F0D5L, 0x9B8273D6L, 0x88D28022L, 0x7AB90321L,
+    0xAE7367CAL, 0x5C18E4C9L, 0x4F48173DL, 0xBD23943EL,
+    0xF36E6F75L, 0x0105EC76L, 0x12551F82L, 0xE03E9C81L,
+    0x34F4F86AL, 0xC69F7B69L, 0xD5CF889DL, 0x27A40B9EL,
+    0x79B737BAL, 0x8BDCB4B9L, 0x988C474DL, 0x6AE7C44EL,
+    0xBE2DA0A5L, 0x4C4623A6L, 0x5F16D052L, 0xAD7D5351L
+};
+
+static uint32_t crc32c_slice8[8][256];
+#if defined(__amd64__)
+static uint32_t crc32c_long[4][256];
+static uint32_t crc32c_short[4][256];
+#endif
+
+static uint32_t crc32c_byte(uint32_t crc, const void *buf, size_t size);
+static uint32_t (*crc32c_func)(uint32_t crc, const void *buf, size_t size);
+
+/*
+ * Original byte-at-a-time implementation, always available.
+ */
+static uint32_t
+crc32c_byte(uint32_t crc, const void *buf, size_t size)
+{
+	const uint8_t *p = buf;
+
+	crc = crc ^ 0xffffffff;
+	while (size--)
+		crc = iscsiCrc32Table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	crc = crc ^ 0xffffffff;
+	return crc;
+}
+
+#if BYTE_ORDER == LITTLE_ENDIAN
+
+/*
+ * Slicing-by-8, consumes 8 bytes per iteration with eight table lookups.
+ */
+static uint32_t
+crc32c_sw(uint32_t crc, const void *buf, size_t size)
+{
+	const uint8_t *p = buf;
+	uint64_t word;
+
+	crc = crc ^ 0xffffffff;
+	while (size && ((uintptr_t)p & 7) != 0) {
+		crc = crc32c_slice8[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+		--size;
+	}
+	while (size >= 8) {
+		word = crc ^ *(const uint64_t *)p;
+		crc = crc32c_slice8[7][word & 0xff] ^
+		      crc32c_slice8[6][(word >> 8) & 0xff] ^
+		      crc32c_slice8[5][(word >> 16) & 0xff] ^
+		      crc32c_slice8[4][(word >> 24) & 0xff] ^
+		      crc32c_slice8[3][(word >> 32) & 0xff] ^
+		      crc32c_slice8[2][(word >> 40) & 0xff] ^
+		      crc32c_slice8[1][(word >> 48) & 0xff] ^
+		      crc32c_slice8[0][word >> 56];
+		p += 8;
+		size -= 8;
+	}
+	while (size--)
+		crc = crc32c_slice8[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	crc = crc ^ 0xffffffff;
+	return crc;
+}
+
+#endif
+
+#if defined(__amd64__)
+
+/*
+ * GF(2) matrix helpers used to build the tables which shift a crc over
+ * a run of zero bytes, allowing independently computed streams to be
+ * combined.
+ */
+static uint32_t
+gf2_matrix_times(const uint32_t *mat, uint32_t vec)
+{
+	uint32_t sum = 0;
+
+	while (vec) {
+		if (vec & 1)
+			sum ^= *mat;
+		vec >>= 1;
+		++mat;
+	}
+	return sum;
+}
+
+static void
+gf2_matrix_square(uint32_t *square, const uint32_t *mat)
+{
+	int n;
+
+	for (n = 0; n < 32; ++n)
+		square[n] = gf2_matrix_times(mat, mat[n]);
+}
+
+/*
+ * Build the operator which applies len (a power of 2) zero bytes to a crc.
+ */
+static void
+crc32c_zeros_op(uint32_t *even, size_t len)
+{
+	uint32_t odd[32];
+	uint32_t row;
+	int n;
+
+	odd[0] = CRC32C_POLY;		/* operator for one zero bit */
+	row = 1;
+	for (n = 1; n < 32; ++n) {
+		odd[n] = row;
+		row <<= 1;
+	}
+	gf2_matrix_square(even, odd);	/* two zero bits */
+	gf2_matrix_square(odd, even);	/* four zero bits */
+
+	/*
+	 * First square produces one zero byte, each further square doubles.
+	 */
+	do {
+		gf2_matrix_square(even, odd);
+		len >>= 1;
+		if (len == 0)
+			return;
+		gf2_matrix_square(odd, even);
+		len >>= 1;
+	} while (len);
+
+	for (n = 0; n < 32; ++n)
+		even[n] = odd[n];
+}
+
+static void
+crc32c_zeros(uint32_t zeros[][256], size_t len)
+{
+	uint32_t op[32];
+	uint32_t n;
+
+	crc32c_zeros_op(op, len);
+	for (n = 0; n < 256; ++n) {
+		zeros[0][n] = gf2_matrix_times(op, n);
+		zeros[1][n] = gf2_matrix_times(op, n << 8);
+		zeros[2][n] = gf2_matrix_times(op, n << 16);
+		zeros[3][n] = gf2_matrix_times(op, n << 24);
+	}
+}
+
+static __inline uint32_t
+crc32c_shift(uint32_t zeros[][256], uint32_t crc)
+{
+	return (zeros[0][crc & 0xff] ^ zeros[1][(crc >> 8) & 0xff] ^
+		zeros[2][(crc >> 16) & 0xff] ^ zeros[3][crc >> 24]);
+}
+
+/*
+ * SSE4.2 implementation.  The crc32 instruction has a latency of three
+ * cycles but a throughput of one per cycle, so large buffers are split
+ * into three adjacent streams which are computed in parallel and then
+ * merged.  The instruction only uses integer registers so no FPU state
+ * needs to be saved in the kernel.
+ */
+static uint32_t
+crc32c_hw(uint32_t crc, const void *buf, size_t size)
+{
+	const uint8_t *next = buf;
+	const uint8_t *end;
+	uint64_t crc0;
+	uint64_t crc1;
+	uint64_t crc2;
+
+	crc0 = crc ^ 0xffffffff;
+
+	while (size && ((uintptr_t)next & 7) != 0) {
+		__asm __volatile("crc32b\t(%1), %0"
+				 : "=r" (crc0)
+				 : "r" (next), "0" (crc0));
+		++next;
+		--size;
+	}
+
+	while (size >= CRC32C_LONG * 3) {
+		crc1 = 0;
+		crc2 = 0;
+		end = next + CRC32C_LONG;
+		do {
+			__asm __volatile(
+				"crc32q\t(%3), %0\n\t"
+				"crc32q\t" CRC32C_LONGx1 "(%3), %1\n\t"
+				"crc32q\t" CRC32C_LONGx2 "(%3), %2"
+				: "=r" (crc0), "=r" (crc1), "=r" (crc2)
+				: "r" (next), "0" (crc0), "1" (crc1),
+				  "2" (crc2));
+			next += 8;
+		} while (next < end);
+		crc0 = crc32c_shift(crc32c_long, crc0) ^ crc1;
+		crc0 = crc32c_shift(crc32c_long, crc0) ^ crc2;
+		next += CRC32C_LONG * 2;
+		size -= CRC32C_LONG * 3;
+	}
+
+	while (size >= CRC32C_SHORT * 3) {
+		crc1 = 0;
+		crc2 = 0;
+		end = next + CRC32C_SHORT;
+		do {
+			__asm __volatile(
+				"crc32q\t(%3), %0\n\t"
+				"crc32q\t" CRC32C_SHORTx1 "(%3), %1\n\t"
+				"crc32q\t" CRC32C_SHORTx2 "(%3), %2"
+				: "=r" (crc0), "=r" (crc1), "=r" (crc2)
+				: "r" (next), "0" (crc0), "1" (crc1),
+				  "2" (crc2));
+			next += 8;
+		} while (next < end);
+		crc0 = crc32c_shift(crc32c_short, crc0) ^ crc1;
+		crc0 = crc32c_shift(crc32c_short, crc0) ^ crc2;
+		next += CRC32C_SHORT * 2;
+		size -= CRC32C_SHORT * 3;
+	}
+
+	end = next + (size - (size & 7));
+	while (next < end) {
+		__asm __volatile("crc32q\t(%1), %0"
+				 : "=r" (crc0)
+				 : "r" (next), "0" (crc0));
+		next += 8;
+	}
+	size &= 7;
+
+	while (size) {
+		__asm __volatile("crc32b\t(%1), %0"
+				 : "=r" (crc0)
+				 : "r" (next), "0" (crc0));
+		++next;
+		--size;
+	}
+	return ((uint32_t)crc0 ^ 0xffffffff);
+}
+
+static int
+crc32c_hw_present(void)
+{
+#ifdef _KERNEL
+	return ((cpu_ecxfeature & CPUIDECX_SSE42) != 0);
+#else
+	uint32_t eax, ebx, ecx, edx;
+
+	__asm __volatile("cpuid"
+			 : "=a" (eax), "=b" (ebx), "=c" (ecx), "=d" (edx)
+			 : "a" (1));
+	return ((ecx & 0x00100000) != 0);	/* CPUIDECX_SSE42 */
+#endif
+}
+
+#endif
+
+/*
+ * Build the tables and select the fastest implementation which passes
+ * the known answer test.  Multiple threads may race the first call, they
+ * all store identical values so no interlock is needed.  crc32c_func is
+ * only set after the tables it depends on are complete.
+ */
+static void
+crc32c_setup(void)
+{
+	uint32_t (*func)(uint32_t, const void *, size_t);
+	uint32_t crc;
+	int n;
+	int k;
+
+	func = crc32c_byte;
+
+	for (n = 0; n < 256; ++n) {
+		crc = iscsiCrc32Table[n];
+		crc32c_slice8[0][n] = crc;
+		for (k = 1; k < 8; ++k) {
+			crc = iscsiCrc32Table[crc & 0xff] ^ (crc >> 8);
+			crc32c_slice8[k][n] = crc;
+		}
+	}
+#if BYTE_ORDER == LITTLE_ENDIAN
+	if (crc32c_sw(0, "123456789", 9) == CRC32C_CHECK)
+		func = crc32c_sw;
+#endif
+#if defined(__amd64__)
+	if (crc32c_hw_present()) {
+		crc32c_zeros(crc32c_long, CRC32C_LONG);
+		crc32c_zeros(crc32c_short, CRC32C_SHORT);
+		if (crc32c_hw(0, "123456789", 9) == CRC32C_CHECK)
+			func = crc32c_hw;
+	}
+#endif
+	__asm __volatile("" : : : "memory");
+	crc32c_func = func;
+}
+
+uint32_t
+iscsi_crc32(const void *buf, size_t size)
+{
+	if (crc32c_func == NULL)
+		crc32c_setup();
+	return (crc32c_func(0, buf, size));
+}
+
+uint32_t
+iscsi_crc32_ext(const void *buf, size_t size, uint32_t crc)
+{
+	if (crc32c_func == NULL)
+		crc32c_setup();
+	return (crc32c_func(crc, buf, size));
+}
@@ -0,0 +1,348 @@
+/*
+ * Copyright (c) 2014 The DragonFly Project.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ * 3. Neither the name of The DragonFly Project nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific, prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * CRC64 using the ECMA-182 polynomial in its reflected form with an
+ * all-ones initial value and final xor (the CRC-64 used by xz).
+ *
+ * On amd64 with PCLMULQDQ, buffers of at least CRC64_CLMUL_MIN bytes are
+ * folded 64 bytes per iteration across four independent 128-bit lanes
+ * using carry-less multiplication.  The lanes are then folded down to a
+ * single 128-bit remainder, which is finished with the table code.
+ * Everything else uses slicing-by-8 (or a byte-at-a-time table on
+ * big-endian machines).
+ *
+ * As with icrc32.c the selected implementation must pass a known answer
+ * test before it is used.
+ */
+
+#ifdef _KERNEL
+#include <sys/param.h>
+#include <sys/systm.h>
+#if defined(__amd64__)
+#include <machine/cpu.h>
+#include <machine/fpu.h>
+#include <machine/specialreg.h>
+#endif
+#else
+#include <sys/types.h>
+#include <sys/endian.h>
+#endif
+
+#ifndef _KERNEL
+/* prototypes for the kernel are in <sys/systm.h> */
+uint64_t crc64_ecma(const void *buf, size_t size);
+uint64_t crc64_ecma_ext(const void *buf, size_t size, uint64_t ocrc);
+#endif
+
+#define CRC64_POLY	0x42F0E1EBA9EA3693ULL	/* ECMA-182 */
+#define CRC64_RPOLY	0xC96C5795D7870F42ULL	/* reflected */
+#define CRC64_CHECK	0x995DC9BBDF1939FAULL	/* crc of "123456789" */
+
+#define CRC64_CLMUL_MIN	256
+
+static uint64_t crc64_table[8][256];
+static uint64_t (*crc64_func)(uint64_t crc, const void *buf, size_t size);
+
+/*
+ * Byte-at-a-time and slicing-by-8 table code operating on the raw
+ * (uninverted) crc register.
+ */
+static uint64_t
+crc64_update(uint64_t crc, const uint8_t *p, size_t size)
+{
+#if BYTE_ORDER == LITTLE_ENDIAN
+	uint64_t word;
+
+	while (size && ((uintptr_t)p & 7) != 0) {
+		crc = crc64_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+		--size;
+	}
+	while (size >= 8) {
+		word = crc ^ *(const uint64_t *)p;
+		crc = crc64_table[7][word & 0xff] ^
+		      crc64_table[6][(word >> 8) & 0xff] ^
+		      crc64_table[5][(word >> 16) & 0xff] ^
+		      crc64_table[4][(word >> 24) & 0xff] ^
+		      crc64_table[3][(word >> 32) & 0xff] ^
+		      crc64_table[2][(word >> 40) & 0xff] ^
+		      crc64_table[1][(word >> 48) & 0xff] ^
+		      crc64_table[0][word >> 56];
+		p += 8;
+		size -= 8;
+	}
+#endif
+	while (size--)
+		crc = crc64_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	return crc;
+}
+
+static uint64_t
+crc64_sw(uint64_t crc, const void *buf, size_t size)
+{
+	return (~crc64_update(~crc, buf, size));
+}
+
+#if defined(__amd64__)
+
+/*
+ * Folding constants.  A 128-bit lane A is advanced over d bits of
+ * following data by multiplying its two halves by x^(d+63) and
+ * x^(d-1) mod P (the -1 compensates for the reflected product coming
+ * out of pclmulqdq one bit short).  The low qword of each pair
+ * multiplies the low (earlier) half of the lane.
+ */
+static uint64_t crc64_k512[2];
+static uint64_t crc64_k128[2];
+
+static uint64_t
+crc64_rev64(uint64_t v)
+{
+	uint64_t r = 0;
+	int i;
+
+	for (i = 0; i < 64; ++i) {
+		r = (r << 1) | (v & 1);
+		v >>= 1;
+	}
+	return r;
+}
+
+static uint64_t
+crc64_xpow(int n)
+{
+	uint64_t r = 1;
+
+	while (n--) {
+		if (r & 0x8000000000000000ULL)
+			r = (r << 1) ^ CRC64_POLY;
+		else
+			r <<= 1;
+	}
+	return r;
+}
+
+/*
+ * Fold size bytes (a multiple of 16, at least 64) of data into a single
+ * 128-bit remainder, which is returned in out[].  The remainder has the
+ * same crc as the data it replaces when processed with a zero register.
+ */
+static void
+crc64_clmul_fold(uint64_t crc, const uint8_t *p, size_t size, uint8_t *out)
+{
+	size_t n64 = size / 64 - 1;
+	size_t n16 = (size & 63) / 16;
+
+	__asm __volatile(
+		"movdqu	(%[p]), %%xmm0\n\t"
+		"movdqu	16(%[p]), %%xmm1\n\t"
+		"movdqu	32(%[p]), %%xmm2\n\t"
+		"movdqu	48(%[p]), %%xmm3\n\t"
+		"movq	%[crc], %%xmm4\n\t"
+		"pxor	%%xmm4, %%xmm0\n\t"
+		"add	$64, %[p]\n\t"
+		"movdqu	(%[k512]), %%xmm7\n\t"
+		"test	%[n64], %[n64]\n\t"
+		"jz	2f\n"
+		"1:\n\t"
+		"movdqa	%%xmm0, %%xmm4\n\t"
+		"movdqa	%%xmm1, %%xmm5\n\t"
+		"pclmulqdq $0x00, %%xmm7, %%xmm0\n\t"
+		"pclmulqdq $0x11, %%xmm7, %%xmm4\n\t"
+		"pclmulqdq $0x00, %%xmm7, %%xmm1\n\t"
+		"pclmulqdq $0x11, %%xmm7, %%xmm5\n\t"
+		"pxor	%%xmm4, %%xmm0\n\t"
+		"pxor	%%xmm5, %%xmm1\n\t"
+		"movdqu	(%[p]), %%xmm4\n\t"
+		"movdqu	16(%[p]), %%xmm5\n\t"
+		"pxor	%%xmm4, %%xmm0\n\t"
+		"pxor	%%xmm5, %%xmm1\n\t"
+		"movdqa	%%xmm2, %%xmm4\n\t"
+		"movdqa	%%xmm3, %%xmm5\n\t"
+		"pclmulqdq $0x00, %%xmm7, %%xmm2\n\t"
+		"pclmulqdq $0x11, %%xmm7, %%xmm4\n\t"
+		"pclmulqdq $0x00, %%xmm7, %%xmm3\n\t"
+		"pclmulqdq $0x11, %%xmm7, %%xmm5\n\t"
+		"pxor	%%xmm4, %%xmm2\n\t"
+		"pxor	%%xmm5, %%xmm3\n\t"
+		"movdqu	32(%[p]), %%xmm4\n\t"
+		"movdqu	48(%[p]), %%xmm5\n\t"
+		"pxor	%%xmm4, %%xmm2\n\t"
+		"pxor	%%xmm5, %%xmm3\n\t"
+		"add	$64, %[p]\n\t"
+		"dec	%[n64]\n\t"
+		"jnz	1b\n"
+		"2:\n\t"
+		/* fold the four lanes down into xmm3 */
+		"movdqu	(%[k128]), %%xmm7\n\t"
+		"movdqa	%%xmm0, %%xmm4\n\t"
+		"pclmulqdq $0x00, %%xmm7, %%xmm0\n\t"
+		"pclmulqdq $0x11, %%xmm7, %%xmm4\n\t"
+		"pxor	%%xmm0, %%xmm1\n\t"
+		"pxor	%%xmm4, %%xmm1\n\t"
+		"movdqa	%%xmm1, %%xmm4\n\t"
+		"pclmulqdq $0x00, %%xmm7, %%xmm1\n\t"
+		"pclmulqdq $0x11, %%xmm7, %%xmm4\n\t"
+		"pxor	%%xmm1, %%xmm2\n\t"
+		"pxor	%%xmm4, %%xmm2\n\t"
+		"movdqa	%%xmm2, %%xmm4\n\t"
+		"pclmulqdq $0x00, %%xmm7, %%xmm2\n\t"
+		"pclmulqdq $0x11, %%xmm7, %%xmm4\n\t"
+		"pxor	%%xmm2, %%xmm3\n\t"
+		"pxor	%%xmm4, %%xmm3\n\t"
+		/* fold in any remaining 16 byte blocks */
+		"test	%[n16], %[n16]\n\t"
+		"jz	4f\n"
+		"3:\n\t"
+		"movdqa	%%xmm3, %%xmm4\n\t"
+		"pclmulqdq $0x00, %%xmm7, %%xmm3\n\t"
+		"pclmulqdq $0x11, %%xmm7, %%xmm4\n\t"
+		"pxor	%%xmm4, %%xmm3\n\t"
+		"movdqu	(%[p]), %%xmm4\n\t"
+		"pxor	%%xmm4, %%xmm3\n\t"
+		"add	$16, %[p]\n\t"
+		"dec	%[n16]\n\t"
+		"jnz	3b\n"
+		"4:\n\t"
+		"movdqu	%%xmm3, (%[out])\n\t"
+		: [p] "+r" (p), [n64] "+r" (n64), [n16] "+r" (n16)
+		: [crc] "r" (crc), [k512] "r" (crc64_k512),
+		  [k128] "r" (crc64_k128), [out] "r" (out)
+		: "xmm0", "xmm1", "xmm2", "xmm3", "xmm4", "xmm5", "xmm7",
+		  "cc", "memory");
+}
+
+static uint64_t
+crc64_clmul(uint64_t crc, const void *buf, size_t size)
+{
+	const uint8_t *p = buf;
+	uint8_t rem[16];
+	size_t n;
+
+	if (size < CRC64_CLMUL_MIN)
+		return (crc64_sw(crc, buf, size));
+
+	n = size & ~(size_t)15;
+#ifdef _KERNEL
+	fpu_kernel_enter();
+#endif
+	crc64_clmul_fold(~crc, p, n, rem);
+#ifdef _KERNEL
+	fpu_kernel_exit();
+#endif
+	crc = crc64_update(0, rem, sizeof(rem));
+	crc = crc64_update(crc, p + n, size - n);
+
+	return (~crc);
+}
+
+static int
+crc64_clmul_present(void)
+{
+#ifdef _KERNEL
+	return ((cpu_ecxfeature & CPUIDECX_PCLMUL) != 0);
+#else
+	uint32_t eax, ebx, ecx, edx;
+
+	__asm __volatile("cpuid"
+			 : "=a" (eax), "=b" (ebx), "=c" (ecx), "=d" (edx)
+			 : "a" (1));
+	return ((ecx & 0x00000002) != 0);	/* CPUIDECX_PCLMUL */
+#endif
+}
+
+#endif
+
+/*
+ * Build the tables and select the fastest implementation which passes
+ * the known answer test.  Racing first callers store identical values.
+ */
+static void
+crc64_setup(void)
+{
+	uint64_t (*func)(uint64_t, const void *, size_t);
+	uint64_t crc;
+	int n;
+	int k;
+
+	for (n = 0; n < 256; ++n) {
+		crc = n;
+		for (k = 0; k < 8; ++k) {
+			if (crc & 1)
+				crc = (crc >> 1) ^ CRC64_RPOLY;
+			else
+				crc >>= 1;
+		}
+		crc64_table[0][n] = crc;
+	}
+	for (n = 0; n < 256; ++n) {
+		crc = crc64_table[0][n];
+		for (k = 1; k < 8; ++k) {
+			crc = crc64_table[0][crc & 0xff] ^ (crc >> 8);
+			crc64_table[k][n] = crc;
+		}
+	}
+	func = crc64_sw;
+
+#if defined(__amd64__)
+	if (crc64_clmul_present()) {
+		static const char kat[CRC64_CLMUL_MIN + 9] = "123456789";
+
+		crc64_k512[0] = crc64_rev64(crc64_xpow(512 + 63));
+		crc64_k512[1] = crc64_rev64(crc64_xpow(512 - 1));
+		crc64_k128[0] = crc64_rev64(crc64_xpow(128 + 63));
+		crc64_k128[1] = crc64_rev64(crc64_xpow(128 - 1));
+		if (crc64_sw(0, "123456789", 9) == CRC64_CHECK &&
+		    crc64_clmul(0, kat, sizeof(kat)) ==
+		    crc64_sw(0, kat, sizeof(kat))) {
+			func = crc64_clmul;
+		}
+	}
+#endif
+	__asm __volatile("" : : : "memory");
+	crc64_func = func;
+}
+
+uint64_t
+crc64_ecma(const void *buf, size_t size)
+{
+	if (crc64_func == NULL)
+		crc64_setup();
+	return (crc64_func(0, buf, size));
+}
+
+uint64_t
+crc64_ecma_ext(const void *buf, size_t size, uint64_t crc)
+{
+	if (crc64_func == NULL)
+		crc64_setup();
+	return (crc64_func(crc, buf, size));
+}